@@ -0,0 +1,405 @@
+//=========================================================================================================
+// bench.cpp - A microbenchmark that pushes packets through a real engine driving a mock I2C bus
+//
+// Packets are handed to the engine exactly the way the UDP server hands them over, with a window of
+// them in flight at once, and the replies come back through the real reply sender task.  Every
+// command is run twice: once with the mock bus taking as long as a real bus would, which shows the
+// throughput a client would see, and once with a bus that takes no time at all, which shows what the
+// engine itself costs per packet.
+//
+//   engine_bench [-n packets] [-w window] [-c clock_hz]
+//=========================================================================================================
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "globals.h"
+#include "host.h"
+#include "mock_i2c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+static inline uint64_t cycle_count() {return __rdtsc();}
+#else
+#define HAVE_CYCLE_COUNTER 0
+static inline uint64_t cycle_count() {return 0;}
+#endif
+
+// These are the command bytes the benchmark sends (see command_t in engine.cpp)
+#define CMD_INIT_SEQ    0
+#define CMD_WRITE_REG   3
+#define CMD_READ_REG    4
+#define CMD_GET_FWREV   5
+#define CMD_BATCH       7
+#define CMD_COALESCE    16
+#define CMD_ECHO        18
+
+// These are batch op codes (see batch_op_t in engine.cpp)
+#define OP_WRITE        1
+#define OP_WRITE_READ   3
+
+// This is the device on the mock bus that every command talks to
+#define BENCH_DEVICE    0x62
+
+
+//=========================================================================================================
+// This is a packet to benchmark, minus the transaction ID
+//=========================================================================================================
+struct bench_cmd_t
+{
+    const char* name;
+    uint8_t     body[64];   // Command byte, then its data
+    int         length;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This is the outcome of running a command over and over
+//=========================================================================================================
+struct bench_result_t
+{
+    double      seconds;
+    uint64_t    cycles;
+    uint64_t    bus_us;
+    uint32_t    errors;
+};
+//=========================================================================================================
+
+
+// This is the mock bus that Engine[0] drives
+static CMockI2C MockI2C;
+
+// These keep track of the packets that haven't been answered yet
+static std::mutex               reply_mutex;
+static std::condition_variable  reply_cv;
+static int                      in_flight;
+static uint32_t                 reply_errors;
+static uint32_t                 datagrams;
+
+// This is the transaction ID of the next packet we send
+static uint32_t next_trans_id = 1;
+
+
+//=========================================================================================================
+// on_reply() - Called by the reply sender task with every reply that the engine sends
+//=========================================================================================================
+static void on_reply(int session, const uint8_t* data, int length)
+{
+    std::lock_guard<std::mutex> lock(reply_mutex);
+    ++datagrams;
+
+    // A coalesced datagram holds several replies, each preceded by its length
+    if (length >= COALESCE_HDR_SIZE && (uint32_t)(data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]) == COALESCE_TRANS_ID)
+    {
+        const uint8_t* p = data + COALESCE_HDR_SIZE;
+        const uint8_t* end = data + length;
+        while (p + 2 <= end)
+        {
+            int reply_length = (p[0] << 8) | p[1];
+            p += 2;
+            if (reply_length < 6 || p[5] != 0) ++reply_errors;
+            p += reply_length;
+            --in_flight;
+        }
+        reply_cv.notify_one();
+        return;
+    }
+
+    // The error code follows the transaction ID and command byte
+    if (length < 6 || data[5] != 0) ++reply_errors;
+
+    --in_flight;
+    reply_cv.notify_one();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// send() - Hands the engine a packet, waiting first until fewer than 'window' packets are in flight
+//=========================================================================================================
+static void send(const uint8_t* body, int length, int window)
+{
+    {
+        std::unique_lock<std::mutex> lock(reply_mutex);
+        reply_cv.wait(lock, [window] {return in_flight < window;});
+        ++in_flight;
+    }
+
+    // Build the packet in a buffer from the pool, just as the UDP server would
+    uint8_t* buffer = PacketPool.acquire(1000);
+    if (buffer == nullptr)
+    {
+        fprintf(stderr, "The packet pool ran dry\n");
+        exit(1);
+    }
+    uint32_t trans_id = next_trans_id++;
+    buffer[0] = trans_id >> 24;
+    buffer[1] = trans_id >> 16;
+    buffer[2] = trans_id >>  8;
+    buffer[3] = trans_id;
+    memcpy(buffer + 4, body, length);
+
+    Engine[0].handle_packet(buffer, length + 4, PKT_SRC_UDP, 0);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// drain() - Waits until every packet has been answered
+//=========================================================================================================
+static void drain()
+{
+    std::unique_lock<std::mutex> lock(reply_mutex);
+    reply_cv.wait(lock, [] {return in_flight == 0;});
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// run() - Sends a command 'count' times and measures how long it took for every reply to arrive
+//=========================================================================================================
+static bench_result_t run(const bench_cmd_t& cmd, int count, int window)
+{
+    bench_result_t result;
+
+    // Warm up the engine, the caches and the pool before we start the clock
+    for (int i = 0; i < window * 4; ++i) send(cmd.body, cmd.length, window);
+    drain();
+
+    MockI2C.reset_counters();
+    reply_errors = 0;
+
+    auto     start_time  = std::chrono::steady_clock::now();
+    uint64_t start_cycle = cycle_count();
+
+    for (int i = 0; i < count; ++i) send(cmd.body, cmd.length, window);
+    drain();
+
+    result.cycles  = cycle_count() - start_cycle;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    result.bus_us  = MockI2C.bus_time_us();
+    result.errors  = reply_errors;
+    return result;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// build_commands() - Fills in the commands that get benchmarked.  Returns how many there are
+//=========================================================================================================
+static int build_commands(bench_cmd_t* cmd)
+{
+    int n = 0;
+
+    // An echo of 16 bytes never touches the bus
+    cmd[n] = {"echo"};
+    cmd[n].body[0] = CMD_ECHO;
+    cmd[n].length  = 17;
+    ++n;
+
+    // Neither does fetching the firmware revision
+    cmd[n] = {"get_fwrev"};
+    cmd[n].body[0] = CMD_GET_FWREV;
+    cmd[n].length  = 1;
+    ++n;
+
+    // Write 2 bytes to an 8-bit register
+    cmd[n] = {"write_reg"};
+    {
+        const uint8_t body[] = {CMD_WRITE_REG, 1, 0x10, 0, 2, 0x12, 0x34};
+        memcpy(cmd[n].body, body, sizeof body);
+        cmd[n].length = sizeof body;
+    }
+    ++n;
+
+    // Read 4 bytes from an 8-bit register
+    cmd[n] = {"read_reg"};
+    {
+        const uint8_t body[] = {CMD_READ_REG, 1, 0x10, 0, 4};
+        memcpy(cmd[n].body, body, sizeof body);
+        cmd[n].length = sizeof body;
+    }
+    ++n;
+
+    // A batch of a write followed by three 2-byte reads
+    cmd[n] = {"batch(1w+3r)"};
+    {
+        const uint8_t body[] =
+        {
+            CMD_BATCH,
+            OP_WRITE,      1, 0x20, 0, 1, 0x55,
+            OP_WRITE_READ, 1, 0x20, 0, 2,
+            OP_WRITE_READ, 1, 0x22, 0, 2,
+            OP_WRITE_READ, 1, 0x24, 0, 2
+        };
+        memcpy(cmd[n].body, body, sizeof body);
+        cmd[n].length = sizeof body;
+    }
+    ++n;
+
+    return n;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// check_reg_cache() - Makes sure the register cache keeps a device on bus 1 apart from a device at the
+//                     same address on bus 0.  Returns 'false' if it doesn't
+//=========================================================================================================
+static bool check_reg_cache()
+{
+    const int     key0 = CACHE_KEY(0, BENCH_DEVICE), key1 = CACHE_KEY(1, BENCH_DEVICE);
+    const uint8_t data0[2] = {0x00, 0x11}, data1[2] = {0x10, 0x22};
+    uint8_t       data[2];
+    bool          ok = true;
+
+    // Cache the same register of the same address on both buses
+    RegCache.set_range(0, key0, 0x10, 0x1F, CACHE_WRITE_THROUGH, 0);
+    RegCache.set_range(1, key1, 0x10, 0x1F, CACHE_WRITE_THROUGH, 0);
+    RegCache.store(key0, 0x10, 2, data0);
+    RegCache.store(key1, 0x10, 2, data1);
+
+    // Each bus has to get its own data back
+    ok &= RegCache.lookup(key0, 0x10, 2, data) && memcmp(data, data0, 2) == 0;
+    ok &= RegCache.lookup(key1, 0x10, 2, data) && memcmp(data, data1, 2) == 0;
+
+    // A write on bus 1 has to reach bus 1's entry, and leave bus 0's alone
+    RegCache.on_write(key1, 0x10, 2, data0);
+    ok &= RegCache.lookup(key1, 0x10, 2, data) && memcmp(data, data0, 2) == 0;
+    RegCache.on_write(key1, 0x10, 2, nullptr);
+    ok &= !RegCache.lookup(key1, 0x10, 2, data);
+    ok &= RegCache.lookup(key0, 0x10, 2, data) && memcmp(data, data0, 2) == 0;
+
+    // So does invalidating bus 1's device
+    RegCache.store(key1, 0x10, 2, data1);
+    RegCache.invalidate(key1);
+    ok &= !RegCache.lookup(key1, 0x10, 2, data);
+    ok &= RegCache.lookup(key0, 0x10, 2, data);
+
+    // Leave the cache the way we found it, so the benchmarks always go to the bus
+    RegCache.set_range(0, 0, 0, 0, CACHE_NONE, 0);
+    RegCache.set_range(1, 0, 0, 0, CACHE_NONE, 0);
+    RegCache.reset_stats();
+    return ok;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// check_coalescing() - Makes sure that with reply coalescing on and no time limit, replies to packets
+//                      that pile up while the bus is busy share datagrams.  Returns 'false' if they don't
+//=========================================================================================================
+static bool check_coalescing(int window)
+{
+    const uint8_t on[]  = {CMD_COALESCE, 1, 1400 >> 8, 1400 & 0xFF, 0, 0, 0, 0};
+    const uint8_t off[] = {CMD_COALESCE, 0};
+    const uint8_t read_reg[] = {CMD_READ_REG, 1, 0x10, 0, 4};
+    const int     count = window * 4;
+
+    send(on, sizeof on, 1);
+    drain();
+
+    // The bus takes as long as it would on the wire, so packets queue up behind every read
+    MockI2C.set_timing(MOCK_OVERHEAD_US, true);
+    datagrams = 0;
+    for (int i = 0; i < count; ++i) send(read_reg, sizeof read_reg, window);
+    drain();
+    uint32_t sent = datagrams;
+
+    send(off, sizeof off, 1);
+    drain();
+    return sent < (uint32_t)count;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// main() - Sets up the engine on the mock bus, and benchmarks every command
+//=========================================================================================================
+int main(int argc, char** argv)
+{
+    int      count    = 20000;
+    int      window   = 8;
+    uint32_t clock_hz = I2C_CLOCK_FAST;
+    int      opt;
+
+    while ((opt = getopt(argc, argv, "n:w:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count    = atoi(optarg); break;
+            case 'w': window   = atoi(optarg); break;
+            case 'c': clock_hz = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n packets] [-w window] [-c clock_hz]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // The packet pool has to hold every packet in flight plus the ones the engine is working on
+    if (window < 1 || window > PACKET_POOL_SIZE / 2) window = PACKET_POOL_SIZE / 2;
+
+    // Put a device on the mock bus
+    MockI2C.init(clock_hz);
+    MockI2C.add_device(BENCH_DEVICE);
+
+    // Start everything the way main.cpp does, with Engine[0] driving the mock bus
+    PacketPool.begin();
+    RegCache.begin();
+    Macros.begin();
+    Stats[0].begin();
+    Engine[0].begin(0, &MockI2C);
+    host_reply_hook = on_reply;
+    UDPServer.begin();
+
+    // Before timing anything, make sure the cache tells the buses apart
+    if (!check_reg_cache())
+    {
+        fprintf(stderr, "The register cache confuses devices on different buses\n");
+        return 1;
+    }
+
+    // The client starts over, the way every client does
+    const uint8_t init_seq[] = {CMD_INIT_SEQ};
+    send(init_seq, sizeof init_seq, 1);
+    drain();
+
+    // And that coalesced replies really are coalesced
+    if (!check_coalescing(window))
+    {
+        fprintf(stderr, "Coalesced replies went out one per datagram\n");
+        return 1;
+    }
+
+    bench_cmd_t cmd[8];
+    int cmd_count = build_commands(cmd);
+
+    printf("%i packets per command, %i in flight, %u Hz bus clock\n\n", count, window, clock_hz);
+    printf("%-14s %12s %12s %12s %12s %10s\n", "command", "pkts/s", "pkts/s", "ns/pkt", "cycles/pkt", "bus us/pkt");
+    printf("%-14s %12s %12s %12s %12s %10s\n", "", "(bus timed)", "(no bus)", "(no bus)", "(no bus)", "");
+
+    for (int i = 0; i < cmd_count; ++i)
+    {
+        // Once with the bus taking as long as it would on the wire, and once with it taking no time
+        MockI2C.set_timing(MOCK_OVERHEAD_US, true);
+        bench_result_t timed = run(cmd[i], count, window);
+        MockI2C.set_timing(MOCK_OVERHEAD_US, false);
+        bench_result_t raw   = run(cmd[i], count, window);
+
+        char cycles[16] = "n/a";
+        if (HAVE_CYCLE_COUNTER) sprintf(cycles, "%.0f", (double)raw.cycles / count);
+
+        printf("%-14s %12.0f %12.0f %12.0f %12s %10.1f%s\n", cmd[i].name,
+               count / timed.seconds, count / raw.seconds, raw.seconds * 1e9 / count, cycles,
+               (double)raw.bus_us / count, (timed.errors || raw.errors) ? "  (replies with errors!)" : "");
+    }
+
+    return 0;
+}
+//=========================================================================================================
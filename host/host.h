@@ -0,0 +1,12 @@
+//=========================================================================================================
+// host.h - Defines what the host build adds to the firmware's objects
+//
+// The host build runs the real engine, packet pool, register cache, macros, stats and trace against a
+// mock I2C bus.  Everything else the engine talks to (Wi-Fi, flash, streams, triggers) is a stand-in in
+// host_stubs.cpp, and the UDP server hands replies to a function instead of a socket
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+
+// If this is set, CUDPServer::reply() hands every reply to it
+extern void (*host_reply_hook)(int session, const uint8_t* data, int length);
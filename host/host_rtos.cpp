@@ -0,0 +1,349 @@
+//=========================================================================================================
+// host_rtos.cpp - Implements just enough of FreeRTOS and esp_timer on top of the C++ standard library
+//                 for the engine to run on a host computer
+//
+// A task is a detached std::thread with a notification counter.  Priorities and core affinity are
+// remembered but not enforced: the host scheduler decides who runs
+//=========================================================================================================
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+
+//=========================================================================================================
+// These are the objects that the RTOS handles point to
+//=========================================================================================================
+struct host_task_t
+{
+    std::mutex              mutex;
+    std::condition_variable cv;
+    uint32_t                notify = 0;
+    UBaseType_t             priority = 0;
+    BaseType_t              core = tskNO_AFFINITY;
+    std::string             name;
+};
+
+struct host_queue_t
+{
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> items;
+    size_t                  item_size;
+    size_t                  capacity;
+};
+
+struct host_sem_t
+{
+    std::mutex              mutex;
+    std::condition_variable cv;
+    int                     count;
+    int                     max_count;
+};
+
+struct host_timer_t
+{
+    esp_timer_cb_t          callback;
+    void*                   arg;
+    std::mutex              mutex;
+    uint64_t                generation = 0;     // Bumped every time the timer is started or stopped
+};
+//=========================================================================================================
+
+
+// This is the task that the calling thread is.  Threads we didn't create get one the first time they ask
+static thread_local host_task_t* this_task = nullptr;
+
+// This is the one lock behind every critical section
+static std::recursive_mutex critical_mutex;
+
+// This is when the program started.  It's "boot time" for esp_timer_get_time()
+static const auto boot_time = std::chrono::steady_clock::now();
+
+
+//=========================================================================================================
+// wait_until() - Waits on a condition variable for a predicate, for a number of RTOS ticks
+//
+// Returns: The final value of the predicate
+//=========================================================================================================
+template <class LOCK, class PRED>
+static bool wait_until(std::condition_variable& cv, LOCK& lock, TickType_t ticks, PRED pred)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cv.wait(lock, pred);
+        return true;
+    }
+    return cv.wait_for(lock, milliseconds((uint64_t)ticks * portTICK_PERIOD_MS), pred);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Tasks
+//=========================================================================================================
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack_depth, void* param,
+                                   UBaseType_t priority, TaskHandle_t* p_handle, BaseType_t core)
+{
+    host_task_t* task = new host_task_t;
+    task->priority = priority;
+    task->core     = core;
+    task->name     = name;
+
+    // The caller's handle has to be filled in before the task can possibly use it
+    if (p_handle) *p_handle = task;
+
+    std::thread([=]() {this_task = task; code(param);}).detach();
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    if (this_task == nullptr) this_task = new host_task_t;
+    return this_task;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // A host task can only end itself, by returning from its thread
+    if (task == nullptr) while (true) std::this_thread::sleep_for(std::chrono::hours(1));
+}
+
+void vTaskDelay(TickType_t ticks)                 {std::this_thread::sleep_for(milliseconds((uint64_t)ticks * portTICK_PERIOD_MS));}
+TickType_t xTaskGetTickCount()                    {return esp_timer_get_time() / 1000 / portTICK_PERIOD_MS;}
+void taskYIELD()                                  {std::this_thread::yield();}
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority) {((host_task_t*)(task ? task : xTaskGetCurrentTaskHandle()))->priority = priority;}
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)  {return ((host_task_t*)(task ? task : xTaskGetCurrentTaskHandle()))->priority;}
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {return 0;}
+BaseType_t xTaskGetAffinity(TaskHandle_t task)    {return ((host_task_t*)task)->core;}
+const char* pcTaskGetName(TaskHandle_t task)      {return ((host_task_t*)(task ? task : xTaskGetCurrentTaskHandle()))->name.c_str();}
+int xPortGetCoreID()                              {return 0;}
+size_t xPortGetFreeHeapSize()                     {return 0;}
+void portENTER_CRITICAL(portMUX_TYPE* mux)        {critical_mutex.lock();}
+void portEXIT_CRITICAL(portMUX_TYPE* mux)         {critical_mutex.unlock();}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Task notifications
+//=========================================================================================================
+BaseType_t xTaskNotifyGive(TaskHandle_t handle)
+{
+    host_task_t* task = (host_task_t*)handle;
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        ++task->notify;
+    }
+    task->cv.notify_one();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t handle, BaseType_t* p_woken)
+{
+    xTaskNotifyGive(handle);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    host_task_t* task = (host_task_t*)xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->mutex);
+
+    // Wait for a notification, and take one (or all of them)
+    if (!wait_until(task->cv, lock, ticks_to_wait, [task] {return task->notify != 0;})) return 0;
+    uint32_t value = task->notify;
+    task->notify = clear_on_exit ? 0 : value - 1;
+    return value;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Queues
+//=========================================================================================================
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    host_queue_t* queue = new host_queue_t;
+    queue->capacity  = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t ticks_to_wait)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    std::unique_lock<std::mutex> lock(queue->mutex);
+
+    // Wait for room, then add the item
+    if (!wait_until(queue->cv, lock, ticks_to_wait, [queue] {return queue->items.size() < queue->capacity;}))
+        return pdFALSE;
+    const uint8_t* bytes = (const uint8_t*)item;
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t handle, const void* item, BaseType_t* p_woken)
+{
+    return xQueueSend(handle, item, 0);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t handle, const void* item)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    const uint8_t* bytes = (const uint8_t*)item;
+    queue->items.clear();
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void* item, TickType_t ticks_to_wait)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    std::unique_lock<std::mutex> lock(queue->mutex);
+
+    // Wait for an item, then take it
+    if (!wait_until(queue->cv, lock, ticks_to_wait, [queue] {return !queue->items.empty();})) return pdFALSE;
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t handle)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->items.clear();
+    queue->cv.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    if (queue == nullptr) return 0;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t handle)
+{
+    host_queue_t* queue = (host_queue_t*)handle;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->capacity - queue->items.size();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Semaphores.  A mutex is a binary semaphore that starts out given
+//=========================================================================================================
+static SemaphoreHandle_t create_semaphore(int count, int max_count)
+{
+    host_sem_t* sem = new host_sem_t;
+    sem->count     = count;
+    sem->max_count = max_count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()          {return create_semaphore(1, 1);}
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {return create_semaphore(1, 1);}
+SemaphoreHandle_t xSemaphoreCreateBinary()         {return create_semaphore(0, 1);}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks_to_wait)
+{
+    host_sem_t* sem = (host_sem_t*)handle;
+    std::unique_lock<std::mutex> lock(sem->mutex);
+    if (!wait_until(sem->cv, lock, ticks_to_wait, [sem] {return sem->count > 0;})) return pdFALSE;
+    --sem->count;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    host_sem_t* sem = (host_sem_t*)handle;
+    {
+        std::lock_guard<std::mutex> lock(sem->mutex);
+        if (sem->count == sem->max_count) return pdFALSE;
+        ++sem->count;
+    }
+    sem->cv.notify_one();
+    return pdTRUE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// esp_timer.  Every start of a timer gets a thread of its own that fires the callback unless the timer
+// has been started or stopped again in the meantime
+//=========================================================================================================
+int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - boot_time).count();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* p_handle)
+{
+    host_timer_t* timer = new host_timer_t;
+    timer->callback = args->callback;
+    timer->arg      = args->arg;
+    *p_handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t start_timer(esp_timer_handle_t handle, uint64_t period_us, bool periodic)
+{
+    host_timer_t* timer = (host_timer_t*)handle;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        generation = ++timer->generation;
+    }
+
+    std::thread([=]()
+    {
+        do
+        {
+            std::this_thread::sleep_for(microseconds(period_us));
+            {
+                std::lock_guard<std::mutex> lock(timer->mutex);
+                if (timer->generation != generation) return;
+            }
+            timer->callback(timer->arg);
+        } while (periodic);
+    }).detach();
+
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)    {return start_timer(timer, timeout_us, false);}
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {return start_timer(timer, period_us, true);}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t handle)
+{
+    host_timer_t* timer = (host_timer_t*)handle;
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    ++timer->generation;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t handle)
+{
+    // A timer thread may still be looking at the timer, so it's stopped rather than freed
+    return esp_timer_stop(handle);
+}
+//=========================================================================================================
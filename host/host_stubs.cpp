@@ -0,0 +1,150 @@
+//=========================================================================================================
+// host_stubs.cpp - Defines the firmware's global objects for the host build, along with stand-ins for
+//                  the parts of the firmware that need the ESP32 (see host.h)
+//=========================================================================================================
+#include <chrono>
+#include <thread>
+#include "globals.h"
+#include "host.h"
+
+CSystem      System;
+CFlashIO     FlashIO;
+CI2C         I2C[I2C_BUS_COUNT];
+CUDPServer   UDPServer;
+CBinServer   BinServer(1182);
+CEngine      Engine[I2C_BUS_COUNT];
+CPacketPool  PacketPool;
+CTrace       Trace;
+CStreamer    Streamer;
+CTrigger     Trigger[MAX_TRIGGERS];
+CRegCache    RegCache;
+CStats       Stats[I2C_BUS_COUNT];
+CMacros      Macros;
+CPerfProfile PerfProfile;
+CTelemetry   Telemetry;
+
+void (*host_reply_hook)(int session, const uint8_t* data, int length) = nullptr;
+
+
+//=========================================================================================================
+// crc32() - Computes the same CRC-32 as the firmware does, a bit at a time instead of from a table
+//=========================================================================================================
+uint32_t crc32(void *buf, size_t len)
+{
+    const uint8_t* input = (const uint8_t*)buf;
+    uint32_t crc = ~0u;
+    while (len--)
+    {
+        crc ^= *input++;
+        for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// usdelay() - Spins through short delays and sleeps through long ones, the way the firmware does
+//=========================================================================================================
+void usdelay(uint32_t microseconds)
+{
+    if (microseconds >= portTICK_PERIOD_MS * 1000)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+        return;
+    }
+    int64_t start_time = esp_timer_get_time();
+    while (esp_timer_get_time() - start_time < microseconds);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CUDPServer - There's no socket.  The reply sender task is real, and replies go to host_reply_hook
+//=========================================================================================================
+static void launch_sender(void *pvParameters)
+{
+    ((CUDPServer*) pvParameters)->sender_task();
+}
+
+void CUDPServer::begin()
+{
+    if (m_is_running) return;
+    m_is_running = true;
+    xTaskCreatePinnedToCore(launch_sender, "udp_sender", 4096, this, TASK_PRIO_REPLY, &m_sender_handle, NET_CPU);
+}
+
+void CUDPServer::sender_task()
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) Engine[bus].send_queued_replies();
+    }
+}
+
+void CUDPServer::reply(int session, void* data, int length)
+{
+    if (host_reply_hook) host_reply_hook(session, (const uint8_t*)data, length);
+}
+
+void CUDPServer::set_client_port(int session, int port) {}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CI2C - There's no I2C hardware on the host.  Engines are handed a CMockI2C instead (see mock_i2c.h)
+//=========================================================================================================
+bool CI2C::set_clock(uint32_t clock_hz)                                            {return false;}
+bool CI2C::set_device_clock(int i2c_address, uint32_t clock_hz)                    {return false;}
+bool CI2C::set_device_timeout(int i2c_address, int timeout_ms, int stretch_us)     {return false;}
+void CI2C::lock(int bus_class, int64_t deadline_us)                                {}
+void CI2C::unlock()                                                                {}
+bool CI2C::read(int i2c_address, void* vp_data, int length)                        {return false;}
+bool CI2C::write(int i2c_address, int val1, int len1, int val2, int len2)          {return false;}
+bool CI2C::write(int i2c_address, int reg, int reg_width, const void* data, int data_length) {return false;}
+bool CI2C::write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length)     {return false;}
+bool CI2C::probe(int i2c_address)                                                  {return false;}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CFlashIO - There's no flash.  Nothing is ever found there, and writes are thrown away
+//=========================================================================================================
+void CFlashIO::read(const char* nvs_key, char* buffer)                 {}
+void CFlashIO::write(const char* nvs_key, char* buffer, size_t length) {}
+void CFlashIO::erase(const char* nvs_key)                              {}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CStreamer and CTrigger - Streams and triggers need their own tasks and GPIOs, and can't be started
+//=========================================================================================================
+bool CStreamer::start(int job, const stream_cfg_t& cfg)             {return false;}
+void CStreamer::stop(int job)                                       {}
+void CStreamer::stop_all()                                          {}
+void CStreamer::get_status(int job, stream_status_t* p_status)      {memset(p_status, 0, sizeof *p_status);}
+bool CTrigger::configure(const trigger_cfg_t& cfg)                  {return false;}
+void CTrigger::disable()                                            {}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CBinServer - There's no TCP client.  Replies to one are thrown away
+//=========================================================================================================
+CTCPServerBase::CTCPServerBase(int port, const char* task_name, int priority, int cpu) {}
+void CTCPServerBase::execute()                                      {}
+void CBinServer::execute()                                          {}
+void CBinServer::send_frame(const uint8_t* data, int length)        {}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Everything else the engine asks about
+//=========================================================================================================
+int  CSystem::rssi()                                                {return 0;}
+int  CPerfProfile::priority(int normal)                             {return normal;}
+bool CTelemetry::has_cpu_load()                                     {return false;}
+void CTelemetry::heap(heap_telemetry_t* p_heap)                     {memset(p_heap, 0, sizeof *p_heap);}
+int  CTelemetry::tasks(task_telemetry_t* out, int max_tasks)        {return 0;}
+//=========================================================================================================
@@ -0,0 +1,193 @@
+//=========================================================================================================
+// mock_i2c.cpp - Implements a RAM-based I2C bus for running an engine on a host computer
+//=========================================================================================================
+#include "esp_timer.h"
+#include "mock_i2c.h"
+
+
+//=========================================================================================================
+// init() - Call this once before the bus is used
+//=========================================================================================================
+void CMockI2C::init(uint32_t clock_hz)
+{
+    // There are no devices on the bus yet, and every register file is zeros
+    memset(m_reg,          0, sizeof m_reg);
+    memset(m_reg_ptr,      0, sizeof m_reg_ptr);
+    memset(m_present,      0, sizeof m_present);
+    memset(m_device_clock, 0, sizeof m_device_clock);
+
+    // Every device runs at the default clock, and transactions take as long as they would on the wire
+    m_default_clock = clock_hz;
+    m_overhead_us   = MOCK_OVERHEAD_US;
+    m_simulate      = true;
+    reset_counters();
+
+    // The scheduler works exactly as it does on the real bus
+    m_scheduler.init();
+    m_installed = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add_device() - Puts a device on the bus
+//=========================================================================================================
+void CMockI2C::add_device(int i2c_address)
+{
+    m_present[i2c_address & 0x7F] = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_clock() - Changes the default bus clock
+//=========================================================================================================
+bool CMockI2C::set_clock(uint32_t clock_hz)
+{
+    if (clock_hz < I2C_CLOCK_MIN || clock_hz > I2C_CLOCK_FAST_PLUS) return false;
+    m_default_clock = clock_hz;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_device_clock() - Gives a device its own bus clock.  0 means "use the default"
+//=========================================================================================================
+bool CMockI2C::set_device_clock(int i2c_address, uint32_t clock_hz)
+{
+    if (clock_hz && (clock_hz < I2C_CLOCK_MIN || clock_hz > I2C_CLOCK_FAST_PLUS)) return false;
+    m_device_clock[i2c_address & 0x7F] = clock_hz;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// lock()/unlock() - Obtain and release exclusive access to the bus
+//=========================================================================================================
+void CMockI2C::lock(int bus_class, int64_t deadline_us) {m_scheduler.acquire(bus_class, deadline_us);}
+void CMockI2C::unlock()                                 {m_scheduler.release();}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// bus_cycle() - Accounts for a transaction that moved 'length' bytes after the address byte, and if
+//               we're simulating bus timing, spins until the transaction would have finished
+//=========================================================================================================
+void CMockI2C::bus_cycle(int i2c_address, int length)
+{
+    int64_t start_time = esp_timer_get_time();
+
+    // Find out what clock this device runs at
+    uint32_t clock_hz = m_device_clock[i2c_address & 0x7F];
+    if (clock_hz == 0) clock_hz = m_default_clock;
+
+    // Every byte, the address byte included, is 9 bit-times on the wire
+    uint32_t duration_us = m_overhead_us + (uint32_t)((uint64_t)(length + 1) * 9 * 1000000 / clock_hz);
+
+    // Keep track of what the bus has done
+    ++m_transactions;
+    m_bytes       += length;
+    m_bus_time_us += duration_us;
+
+    // If we're simulating the bus, the caller waits as long as the transaction would take
+    if (m_simulate) while (esp_timer_get_time() - start_time < duration_us);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// store() - Stores bytes into a device starting at its register pointer, advancing the pointer
+//=========================================================================================================
+void CMockI2C::store(int i2c_address, const uint8_t* data, int length)
+{
+    int     addr = i2c_address & 0x7F;
+    uint8_t& ptr = m_reg_ptr[addr];
+    while (length--) m_reg[addr][ptr++] = *data++;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// fetch() - Fetches bytes from a device starting at its register pointer, advancing the pointer
+//=========================================================================================================
+void CMockI2C::fetch(int i2c_address, uint8_t* data, int length)
+{
+    int     addr = i2c_address & 0x7F;
+    uint8_t& ptr = m_reg_ptr[addr];
+    while (length--) *data++ = m_reg[addr][ptr++];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read() - Reads bytes from a device, starting at its register pointer
+//=========================================================================================================
+bool CMockI2C::read(int i2c_address, void* vp_data, int length)
+{
+    bus_cycle(i2c_address, length);
+    if (!m_present[i2c_address & 0x7F]) return false;
+    fetch(i2c_address, (uint8_t*)vp_data, length);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write() - Writes a register number and then an integer value to a device
+//=========================================================================================================
+bool CMockI2C::write(int i2c_address, int val1, int len1, int val2, int len2)
+{
+    uint8_t data[4];
+
+    // The second value goes out MSB first
+    for (int i = 0; i < len2; ++i) data[i] = val2 >> (8 * (len2 - 1 - i));
+
+    // The first value is the register number
+    return write(i2c_address, val1, len1, data, len2);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write() - Writes a register number followed by a buffer full of data to a device
+//=========================================================================================================
+bool CMockI2C::write(int i2c_address, int reg, int reg_width, const void* data, int data_length)
+{
+    bus_cycle(i2c_address, reg_width + data_length);
+    if (!m_present[i2c_address & 0x7F]) return false;
+
+    // A register number sets the register pointer, and the data is stored from there on
+    if (reg_width) m_reg_ptr[i2c_address & 0x7F] = reg & 0xFF;
+    store(i2c_address, (const uint8_t*)data, data_length);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write_read() - Writes a register number then, after a repeated START, reads data back
+//=========================================================================================================
+bool CMockI2C::write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length)
+{
+    // The repeated START costs a second address byte
+    bus_cycle(i2c_address, reg_width + 1 + length);
+    if (!m_present[i2c_address & 0x7F]) return false;
+
+    if (reg_width) m_reg_ptr[i2c_address & 0x7F] = reg & 0xFF;
+    fetch(i2c_address, (uint8_t*)vp_data, length);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// probe() - Returns true if there's a device at the specified address
+//=========================================================================================================
+bool CMockI2C::probe(int i2c_address)
+{
+    bus_cycle(i2c_address, 0);
+    return m_present[i2c_address & 0x7F];
+}
+//=========================================================================================================
@@ -0,0 +1,101 @@
+//=========================================================================================================
+// mock_i2c.h - Defines a RAM-based I2C bus for running an engine on a host computer
+//
+// Every device on the mock bus has 256 1-byte registers and a register pointer that auto-increments,
+// the way most register-mapped I2C parts behave.  A write sets the pointer from the first byte of the
+// register number and stores the rest of the data from there on; a read starts at the pointer.  With
+// a register width of 2, the low byte of the register number is the one that's used.
+//
+// Each transaction costs a fixed overhead plus 9 bit-times (8 data bits and an ACK) per byte, including
+// the address byte, at the bus clock in use.  That time is always added up, and when timing is
+// simulated the calling task spins for that long too, so that a benchmark sees the bus the way the
+// engine would on the real hardware
+//=========================================================================================================
+#pragma once
+#include <atomic>
+#include "i2c_interface.h"
+#include "i2c_bus.h"
+
+// This is the default cost of a transaction that isn't bit-times: START, STOP, and driver overhead
+#define MOCK_OVERHEAD_US    20
+
+class CMockI2C : public CI2CInterface
+{
+public:
+
+    // Constructor
+    CMockI2C() {m_installed = false;}
+
+    // Call this once before the bus is used
+    void    init(uint32_t clock_hz = I2C_CLOCK_STANDARD);
+
+    // Puts a device on the bus at the specified address.  Its registers start out as 0
+    void    add_device(int i2c_address);
+
+    // Direct access to a device's registers, bypassing the bus
+    uint8_t* registers(int i2c_address) {return m_reg[i2c_address & 0x7F];}
+
+    // Sets the fixed cost of a transaction, and whether callers spin for the simulated time
+    void    set_timing(uint32_t overhead_us, bool simulate) {m_overhead_us = overhead_us; m_simulate = simulate;}
+
+    // Returns the number of transactions, the number of bytes moved, and the simulated bus time
+    uint64_t transactions() {return m_transactions;}
+    uint64_t bytes()        {return m_bytes;}
+    uint64_t bus_time_us()  {return m_bus_time_us;}
+
+    // Zeros the counters above
+    void    reset_counters() {m_transactions = 0; m_bytes = 0; m_bus_time_us = 0;}
+
+public:
+
+    // These are the CI2CInterface methods
+    bool    is_installed() override {return m_installed;}
+    uint32_t clock() override {return m_default_clock;}
+    bool    set_clock(uint32_t clock_hz) override;
+    bool    set_device_clock(int i2c_address, uint32_t clock_hz) override;
+    bool    set_device_timeout(int i2c_address, int timeout_ms, int stretch_us) override {return true;}
+    bool    timed_out() override {return false;}
+    uint32_t timeouts() override {return 0;}
+    uint32_t recoveries() override {return 0;}
+    void    lock(int bus_class = BUS_CLASS_INTERACTIVE, int64_t deadline_us = 0) override;
+    void    unlock() override;
+    CBusScheduler& scheduler() override {return m_scheduler;}
+    bool    read(int i2c_address, void* vp_data, int length) override;
+    bool    write(int i2c_address, int val1, int len1, int val2=0, int len2=0) override;
+    bool    write(int i2c_address, int reg, int reg_width, const void* data, int data_length) override;
+    bool    write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length) override;
+    bool    probe(int i2c_address) override;
+
+protected:
+
+    // Accounts for (and if we're simulating, waits out) a transaction that moved 'length' bytes
+    void    bus_cycle(int i2c_address, int length);
+
+    // Stores bytes into a device starting at its register pointer
+    void    store(int i2c_address, const uint8_t* data, int length);
+
+    // Fetches bytes from a device starting at its register pointer
+    void    fetch(int i2c_address, uint8_t* data, int length);
+
+    // Every address has a register file and a pointer into it, but only some have a device
+    uint8_t     m_reg[128][256];
+    uint8_t     m_reg_ptr[128];
+    bool        m_present[128];
+
+    // This is the bus clock, and the clock each device has been given (0 = use the default)
+    uint32_t    m_default_clock;
+    uint32_t    m_device_clock[128];
+
+    // This is how the time a transaction takes is simulated
+    uint32_t    m_overhead_us;
+    bool        m_simulate;
+
+    // These count what's been done on the bus
+    std::atomic<uint64_t> m_transactions, m_bytes, m_bus_time_us;
+
+    // This decides which task gets the bus next, exactly as it does on the real bus
+    CBusScheduler m_scheduler;
+
+    // This is true once init() has been called
+    bool        m_installed;
+};
@@ -0,0 +1,20 @@
+//=========================================================================================================
+// driver/gpio.h - Host stand-in for the ESP-IDF GPIO driver types
+//=========================================================================================================
+#pragma once
+#include "esp_err.h"
+
+typedef enum
+{
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_0  = 0,  GPIO_NUM_2  = 2,  GPIO_NUM_4  = 4,  GPIO_NUM_5  = 5,  GPIO_NUM_15 = 15,
+    GPIO_NUM_16 = 16, GPIO_NUM_17 = 17, GPIO_NUM_18 = 18, GPIO_NUM_19 = 19, GPIO_NUM_21 = 21,
+    GPIO_NUM_22 = 22, GPIO_NUM_MAX = 40
+} gpio_num_t;
+
+typedef enum {GPIO_INTR_DISABLE, GPIO_INTR_POSEDGE, GPIO_INTR_NEGEDGE, GPIO_INTR_ANYEDGE} gpio_int_type_t;
+typedef enum {GPIO_MODE_INPUT, GPIO_MODE_OUTPUT, GPIO_MODE_INPUT_OUTPUT_OD, GPIO_MODE_OUTPUT_OD} gpio_mode_t;
+typedef void (*gpio_isr_t)(void* arg);
+
+#define GPIO_IS_VALID_GPIO(n)         ((n) >= 0 && (n) < 40)
+#define GPIO_IS_VALID_OUTPUT_GPIO(n)  ((n) >= 0 && (n) < 34)
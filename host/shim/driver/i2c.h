@@ -0,0 +1,24 @@
+//=========================================================================================================
+// driver/i2c.h - Host stand-in for the ESP-IDF I2C driver types.  Nothing on the host drives a real bus
+//=========================================================================================================
+#pragma once
+#include "gpio.h"
+
+typedef int   i2c_port_t;
+typedef void* i2c_cmd_handle_t;
+#define I2C_NUM_0   0
+#define I2C_NUM_1   1
+#define I2C_NUM_MAX 2
+
+typedef enum {I2C_MODE_SLAVE, I2C_MODE_MASTER} i2c_mode_t;
+
+typedef struct
+{
+    i2c_mode_t  mode;
+    int         sda_io_num;
+    int         scl_io_num;
+    bool        sda_pullup_en;
+    bool        scl_pullup_en;
+    struct {uint32_t clk_speed;} master;
+    uint32_t    clk_flags;
+} i2c_config_t;
@@ -0,0 +1,4 @@
+//=========================================================================================================
+// driver/uart.h - Host stand-in.  Nothing that's built for the host uses it
+//=========================================================================================================
+#pragma once
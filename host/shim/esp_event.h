@@ -0,0 +1,6 @@
+//=========================================================================================================
+// esp_event.h - Host stand-in for the ESP-IDF event loop types
+//=========================================================================================================
+#pragma once
+#include "esp_err.h"
+typedef const char* esp_event_base_t;
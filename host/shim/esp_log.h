@@ -0,0 +1,8 @@
+//=========================================================================================================
+// esp_log.h - Host stand-in for the ESP-IDF logging macros.  Everything goes to stdout
+//=========================================================================================================
+#pragma once
+#include <stdio.h>
+#define ESP_LOGE(tag, ...) printf(__VA_ARGS__)
+#define ESP_LOGW(tag, ...) printf(__VA_ARGS__)
+#define ESP_LOGI(tag, ...) printf(__VA_ARGS__)
@@ -0,0 +1,6 @@
+//=========================================================================================================
+// esp_pm.h - Host stand-in for the ESP-IDF power management types
+//=========================================================================================================
+#pragma once
+#include "esp_err.h"
+typedef void* esp_pm_lock_handle_t;
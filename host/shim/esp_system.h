@@ -0,0 +1,6 @@
+//=========================================================================================================
+// esp_system.h - Host stand-in for the ESP-IDF system API
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
@@ -0,0 +1,7 @@
+//=========================================================================================================
+// esp_wifi.h - Host stand-in for the ESP-IDF Wi-Fi types
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+typedef enum {WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM} wifi_ps_type_t;
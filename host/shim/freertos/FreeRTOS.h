@@ -0,0 +1,47 @@
+//=========================================================================================================
+// freertos/FreeRTOS.h - Host stand-in for the FreeRTOS types and port macros (see host_rtos.cpp)
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint32_t TickType_t;
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+
+// Every kind of RTOS object is an opaque pointer to something in host_rtos.cpp
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* xQueueHandle;
+typedef void* SemaphoreHandle_t;
+
+// The firmware runs with CONFIG_FREERTOS_HZ=100, and so do we
+#define configTICK_RATE_HZ      100
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define portMAX_DELAY           0xFFFFFFFFu
+#define configMAX_PRIORITIES    25
+#define configMAX_TASK_NAME_LEN 16
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define pdFAIL  0
+
+// There's no IRAM or RTC memory on the host
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define portYIELD_FROM_ISR()
+
+// A critical section is one process-wide lock
+typedef struct {int unused;} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+void portENTER_CRITICAL(portMUX_TYPE* mux);
+void portEXIT_CRITICAL(portMUX_TYPE* mux);
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)  portEXIT_CRITICAL(mux)
+
+size_t xPortGetFreeHeapSize();
+int    xPortGetCoreID();
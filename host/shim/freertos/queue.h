@@ -0,0 +1,14 @@
+//=========================================================================================================
+// freertos/queue.h - Host stand-in for the FreeRTOS queue API
+//=========================================================================================================
+#pragma once
+#include "FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t    xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait);
+BaseType_t    xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t* p_woken);
+BaseType_t    xQueueOverwrite(QueueHandle_t queue, const void* item);
+BaseType_t    xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks_to_wait);
+BaseType_t    xQueueReset(QueueHandle_t queue);
+UBaseType_t   uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t   uxQueueSpacesAvailable(QueueHandle_t queue);
@@ -0,0 +1,13 @@
+//=========================================================================================================
+// freertos/semphr.h - Host stand-in for the FreeRTOS semaphore API
+//=========================================================================================================
+#pragma once
+#include "FreeRTOS.h"
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+BaseType_t        xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait);
+BaseType_t        xSemaphoreGive(SemaphoreHandle_t sem);
+#define xSemaphoreTakeRecursive(sem, ticks) xSemaphoreTake(sem, ticks)
+#define xSemaphoreGiveRecursive(sem)        xSemaphoreGive(sem)
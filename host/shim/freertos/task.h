@@ -0,0 +1,26 @@
+//=========================================================================================================
+// freertos/task.h - Host stand-in for the FreeRTOS task API.  Tasks are std::threads
+//=========================================================================================================
+#pragma once
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void*);
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+BaseType_t   xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack_depth, void* param,
+                                     UBaseType_t priority, TaskHandle_t* p_handle, BaseType_t core);
+void         vTaskDelete(TaskHandle_t task);
+void         vTaskDelay(TickType_t ticks);
+TickType_t   xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+void         vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority);
+UBaseType_t  uxTaskPriorityGet(TaskHandle_t task);
+UBaseType_t  uxTaskGetStackHighWaterMark(TaskHandle_t task);
+BaseType_t   xTaskGetAffinity(TaskHandle_t task);
+const char*  pcTaskGetName(TaskHandle_t task);
+void         taskYIELD();
+
+// Only the counting form of task notifications is used by the code that's built for the host
+BaseType_t   xTaskNotifyGive(TaskHandle_t task);
+void         vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* p_woken);
+uint32_t     ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
@@ -0,0 +1,4 @@
+//=========================================================================================================
+// lwip/sys.h - Host stand-in.  Nothing that's built for the host uses it
+//=========================================================================================================
+#pragma once
@@ -0,0 +1,4 @@
+//=========================================================================================================
+// soc/adc_channel.h - Host stand-in.  Nothing that's built for the host uses it
+//=========================================================================================================
+#pragma once
@@ -0,0 +1,119 @@
+//=========================================================================================================
+// bin_server.cpp - Implements a TCP server that carries the same binary command set as the UDP server
+//=========================================================================================================
+#include <lwip/err.h>
+#include <lwip/sockets.h>
+#include <lwip/sys.h>
+#include <lwip/netdb.h>
+#include "bin_server.h"
+#include "globals.h"
+
+// This is how long we wait for a free packet buffer before we check again
+#define POOL_WAIT_MS 100
+
+// The reply sender builds each outgoing frame in here
+static uint8_t tx_frame[BIN_FRAME_HDR_SIZE + MAX_REPLY_LENGTH];
+
+
+//=========================================================================================================
+// recv_all() - Receives exactly the specified number of bytes from the client
+//
+// Passed: buffer = Where to store the incoming bytes
+//         length = The number of bytes to receive
+//
+// Returns: 'true' if all of the bytes arrived, 'false' if the connection closed first
+//=========================================================================================================
+bool CBinServer::recv_all(void* buffer, int length)
+{
+    uint8_t* out = (uint8_t*)buffer;
+
+    // Keep receiving until we have everything the caller asked for
+    while (length)
+    {
+        int count = recv(client_socket(), out, length, 0);
+        if (count < 1) return false;
+        out    += count;
+        length -= count;
+    }
+
+    // If we get here, we have every byte
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// execute() - Fetches frames from the client and hands each message to the engine for the I2C bus it's
+//             aimed at, until the client disconnects or breaks the framing rules
+//=========================================================================================================
+void CBinServer::execute()
+{
+    uint8_t header[BIN_FRAME_HDR_SIZE];
+    uint8_t* buffer;
+    int     value = 1;
+
+    // Our replies are already whole messages, so send each one without waiting for more to be written
+    setsockopt(client_socket(), IPPROTO_TCP, TCP_NODELAY, &value, sizeof value);
+
+    while (true)
+    {
+        // Fetch the frame header
+        if (!recv_all(header, sizeof header)) return;
+
+        // Find out how long the message is and whether the client wants a reply if it succeeds
+        int length = (header[0] << 8) | header[1];
+        bool quiet = (length & BIN_FLAG_QUIET) != 0;
+        length &= ~BIN_FLAG_QUIET;
+
+        // If the message can't fit in a packet buffer, we've lost track of the framing and can't go on
+        if (length > PACKET_BUFFER_SIZE)
+        {
+            Trace.log(TRC_BIN_BAD_FRAME, length);
+            return;
+        }
+
+        // Wait for a free packet buffer.  While we wait, the client's data backs up in the TCP window,
+        // which is how we tell the client to slow down
+        while ((buffer = PacketPool.acquire(POOL_WAIT_MS)) == nullptr);
+
+        // Fetch the message
+        if (!recv_all(buffer, length))
+        {
+            PacketPool.release(buffer);
+            return;
+        }
+
+        // Tell the network that there is activity on this socket
+        Network.register_activity();
+
+        // And hand the message to the engine for the I2C bus it's aimed at.  From here on, the engine
+        // owns the buffer
+        CEngine::dispatch(buffer, length, quiet ? PKT_SRC_TCP_QUIET : PKT_SRC_TCP);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// send_frame() - Sends a reply to the client as a frame.  This runs in the reply sender task
+//
+// Passed: data   = The reply (transaction ID, command, error code, and data)
+//         length = The length of the reply
+//=========================================================================================================
+void CBinServer::send_frame(const uint8_t* data, int length)
+{
+    // If the client has gone away, there's no one to send the reply to
+    if (!has_client()) return;
+
+    // Never overflow the frame buffer
+    if (length > (int)sizeof(tx_frame) - BIN_FRAME_HDR_SIZE) length = sizeof(tx_frame) - BIN_FRAME_HDR_SIZE;
+
+    // Build the frame header, followed by the reply
+    tx_frame[0] = length >> 8;
+    tx_frame[1] = length;
+    memcpy(tx_frame + BIN_FRAME_HDR_SIZE, data, length);
+
+    // And send the frame
+    if (::send(client_socket(), tx_frame, BIN_FRAME_HDR_SIZE + length, 0) < 0) Trace.log(TRC_BIN_TX_FAIL, length, errno);
+}
+//=========================================================================================================
@@ -0,0 +1,42 @@
+//=========================================================================================================
+// bin_server.h - Defines a TCP server that carries the same binary command set as the UDP server
+//
+// Every message in either direction is a frame:
+//   2 Bytes of frame length (the length of what follows, not counting these two bytes)
+//   n Bytes of message, exactly as it would appear in a UDP datagram
+//
+// In a frame from the client, bit 15 of the frame length (BIN_FLAG_QUIET) means "only reply to this
+// message if it fails".  TCP doesn't lose or duplicate messages, so a client can stream quiet messages
+// back-to-back and let the kernel's windowing do the flow control.   Messages that arrive over TCP
+// don't take part in the UDP transaction-ID window or the reply cache, and their replies are never
+// coalesced.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "tcp_server_base.h"
+
+// This bit in the length of a frame from the client means "don't reply unless the message fails"
+#define BIN_FLAG_QUIET      0x8000
+
+// This is the size of the frame header
+#define BIN_FRAME_HDR_SIZE  2
+
+class CBinServer : public CTCPServerBase
+{
+public:
+
+    // Constructor - The binary server lives in the network core, next to the UDP server
+    CBinServer(int port) : CTCPServerBase(port, "bin_server", TASK_PRIO_UDP, NET_CPU) {}
+
+    // The reply sender task calls this to send a reply to the client
+    void    send_frame(const uint8_t* data, int length);
+
+protected:
+
+    // Fetches frames from the client and hands them to the engines until the connection closes
+    void    execute();
+
+    // Receives exactly 'length' bytes from the client.  Returns 'false' if the connection closed
+    bool    recv_all(void* buffer, int length);
+};
+//=========================================================================================================
@@ -0,0 +1,177 @@
+//=========================================================================================================
+// bus_scheduler.cpp - Implements the arbiter that decides which task gets an I2C bus next
+//=========================================================================================================
+#include "esp_timer.h"
+#include "bus_scheduler.h"
+
+
+//=========================================================================================================
+// init() - Call this once before the bus is used
+//=========================================================================================================
+void CBusScheduler::init()
+{
+    // Every slot in the waiter table is free, and each has a semaphore its task can block on
+    for (int i=0; i<BUS_MAX_WAITERS; ++i)
+    {
+        m_waiter[i].state = SLOT_FREE;
+        m_waiter[i].grant = xSemaphoreCreateBinary();
+    }
+
+    // Nobody has waited for the bus yet
+    reset_stats();
+
+    // Create the mutex that protects the waiter table
+    m_mutex = xSemaphoreCreateMutex();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// acquire() - Waits until the calling task owns the bus
+//
+// Passed: bus_class   = A bus_class_t that says how urgent this task's work is
+//         deadline_us = The esp_timer_get_time() by which the work should be finished, or 0 for none
+//=========================================================================================================
+void CBusScheduler::acquire(int bus_class, int64_t deadline_us)
+{
+    TaskHandle_t this_task = xTaskGetCurrentTaskHandle();
+
+    // If we already own the bus, we just own it one more level deep.  Nobody but us can change
+    // m_owner while we own the bus, so it's safe to look at it without the mutex
+    if (m_owner == this_task)
+    {
+        ++m_depth;
+        return;
+    }
+
+    // Keep track of when we started waiting
+    int64_t start_time = esp_timer_get_time();
+
+    while (true)
+    {
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        // If nobody owns the bus, nobody is waiting for it either, and it's ours
+        if (m_owner == nullptr)
+        {
+            m_owner = this_task;
+            m_depth = 1;
+            xSemaphoreGive(m_mutex);
+            return;
+        }
+
+        // Find a free slot in the waiter table
+        int slot;
+        for (slot = 0; slot < BUS_MAX_WAITERS; ++slot) if (m_waiter[slot].state == SLOT_FREE) break;
+
+        // If the table is full, wait a moment for someone to get the bus and try again
+        if (slot == BUS_MAX_WAITERS)
+        {
+            xSemaphoreGive(m_mutex);
+            vTaskDelay(1);
+            continue;
+        }
+
+        // Get in line
+        waiter_t& waiter   = m_waiter[slot];
+        waiter.state       = SLOT_WAITING;
+        waiter.bus_class   = bus_class;
+        waiter.deadline_us = deadline_us;
+        waiter.since_us    = start_time;
+        waiter.task        = this_task;
+        xSemaphoreGive(m_mutex);
+
+        // Wait for release() to hand us the bus
+        xSemaphoreTake(waiter.grant, portMAX_DELAY);
+
+        // We own the bus now.  Give our slot back, and keep track of how long we waited
+        uint32_t waited = esp_timer_get_time() - start_time;
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        waiter.state = SLOT_FREE;
+        if (waited > m_max_wait_us[bus_class]) m_max_wait_us[bus_class] = waited;
+        xSemaphoreGive(m_mutex);
+        return;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// release() - Gives up one level of ownership of the bus.  On the last one, the bus is handed to
+//             whichever waiting task should get it next
+//=========================================================================================================
+void CBusScheduler::release()
+{
+    SemaphoreHandle_t grant = nullptr;
+
+    // If we still own the bus at an outer level, there's nothing else to do
+    if (--m_depth) return;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Find out who goes next
+    int next = pick_next(esp_timer_get_time());
+
+    // If nobody is waiting, the bus is free.  Otherwise, it belongs to the next task in line
+    if (next < 0)
+        m_owner = nullptr;
+    else
+    {
+        waiter_t& waiter = m_waiter[next];
+        waiter.state = SLOT_GRANTED;
+        m_owner      = waiter.task;
+        m_depth      = 1;
+        grant        = waiter.grant;
+    }
+
+    xSemaphoreGive(m_mutex);
+
+    // Wake up the task we just handed the bus to
+    if (grant) xSemaphoreGive(grant);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// pick_next() - Returns the index of the waiter who should get the bus next, or -1 if nobody is waiting
+//
+// Note: The caller must be holding m_mutex
+//=========================================================================================================
+int CBusScheduler::pick_next(int64_t now)
+{
+    int     best = -1, best_class = 0;
+    int64_t best_deadline = 0;
+
+    for (int i=0; i<BUS_MAX_WAITERS; ++i)
+    {
+        const waiter_t& waiter = m_waiter[i];
+        if (waiter.state != SLOT_WAITING) continue;
+
+        // A task moves up one class for every BUS_AGING_US it has been waiting
+        int bus_class = waiter.bus_class - (int)((now - waiter.since_us) / BUS_AGING_US);
+        if (bus_class < 0) bus_class = 0;
+
+        // A task with no deadline sorts after every task that has one
+        int64_t deadline = waiter.deadline_us ? waiter.deadline_us : INT64_MAX;
+
+        // The most urgent class wins, then the earliest deadline, then the longest wait
+        if (best >= 0)
+        {
+            if (bus_class > best_class) continue;
+            if (bus_class == best_class)
+            {
+                if (deadline > best_deadline) continue;
+                if (deadline == best_deadline && waiter.since_us >= m_waiter[best].since_us) continue;
+            }
+        }
+
+        // This is the best candidate so far
+        best          = i;
+        best_class    = bus_class;
+        best_deadline = deadline;
+    }
+
+    // Hand the caller the index of the task that gets the bus next
+    return best;
+}
+//=========================================================================================================
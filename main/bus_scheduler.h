@@ -0,0 +1,91 @@
+//=========================================================================================================
+// bus_scheduler.h - Defines the arbiter that decides which task gets an I2C bus next
+//
+// Every task that wants the bus says what class of work it's doing.  When the bus comes free, it's
+// handed straight to the waiting task with the most urgent class.  Among tasks of the same class, the
+// one with the earliest deadline goes first, and among those, the one that has waited longest.
+//
+// So that a steady stream of urgent work can't lock the rest out forever, a waiting task is promoted
+// one class for every BUS_AGING_US it has waited.
+//
+// Ownership is recursive: a task that owns the bus can acquire it again, and it only comes free when
+// every acquire has been matched by a release.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// These are the classes of bus work, most urgent first
+enum bus_class_t
+{
+    BUS_CLASS_REALTIME    = 0,      // Trigger inputs reacting to a hardware edge
+    BUS_CLASS_SAMPLING    = 1,      // Periodic samples for stream jobs
+    BUS_CLASS_INTERACTIVE = 2,      // Commands from a client
+    BUS_CLASS_BULK        = 3,      // Large transfers and bus scans that can afford to wait
+    BUS_CLASS_COUNT       = 4
+};
+
+// This is the most tasks that can be waiting for the bus at once
+#define BUS_MAX_WAITERS     8
+
+// A waiting task is promoted one class for every this many microseconds it waits
+#define BUS_AGING_US        5000
+
+// Bulk transfers are broken into transactions no longer than this, so that they give up the bus
+// often.   At 400 KHz this is about 3 milliseconds on the bus
+#define BUS_BULK_SLICE      128
+
+class CBusScheduler
+{
+public:
+
+    // Constructor
+    CBusScheduler() {m_mutex = nullptr; m_owner = nullptr; m_depth = 0;}
+
+    // Call this once before the bus is used
+    void    init();
+
+    // Waits until the calling task owns the bus.  'deadline_us' is the esp_timer_get_time() by which
+    // the work should finish, or 0 if there's no deadline
+    void    acquire(int bus_class, int64_t deadline_us = 0);
+
+    // Gives up one level of ownership.  On the last one, the bus goes to the next task in line
+    void    release();
+
+    // Returns the longest any task of this class has waited for the bus, in microseconds
+    uint32_t max_wait_us(int bus_class) {return m_max_wait_us[bus_class];}
+
+    // Resets the wait-time counters
+    void    reset_stats() {memset(m_max_wait_us, 0, sizeof m_max_wait_us);}
+
+protected:
+
+    // These are the states of a slot in the waiter table
+    enum {SLOT_FREE = 0, SLOT_WAITING = 1, SLOT_GRANTED = 2};
+
+    // This is a task that's waiting for the bus
+    struct waiter_t
+    {
+        int                 state;
+        int                 bus_class;
+        int64_t             deadline_us;
+        int64_t             since_us;
+        TaskHandle_t        task;
+        SemaphoreHandle_t   grant;
+    };
+
+    // Returns the index of the waiter who should get the bus next, or -1 if nobody is waiting
+    int     pick_next(int64_t now);
+
+    // This protects the owner and the waiter table
+    SemaphoreHandle_t   m_mutex;
+
+    // This is the task that owns the bus (or nullptr), and how many times it has acquired it
+    TaskHandle_t        m_owner;
+    int                 m_depth;
+
+    // These are the tasks waiting for the bus
+    waiter_t            m_waiter[BUS_MAX_WAITERS];
+
+    // This is the longest a task of each class has waited
+    uint32_t            m_max_wait_us[BUS_CLASS_COUNT];
+};
@@ -11,8 +11,30 @@
 #define DEFAULT_TASK_PRI  5
 #define TASK_PRIO_TCP     6
 #define TASK_PRIO_UDP     6
+#define TASK_PRIO_TRIGGER 7
+#define TASK_PRIO_STREAM  7
 #define TASK_PRIO_FLASH   9  // This has to be higher priority than all other tasks
 
+// The UDP receiver and the reply sender run in the PRO core next to lwIP (see the TCPIP task affinity
+// in sdkconfig), and the engines that drive the I2C buses run in the APP core, where nothing but the
+// flash task can preempt them.  Any of these can be overridden from the build (e.g. -DENGINE_CPU=0)
+#ifndef NET_CPU
+#define NET_CPU           0
+#endif
+#ifndef ENGINE_CPU
+#define ENGINE_CPU        1
+#endif
+#ifndef TASK_PRIO_ENGINE
+#define TASK_PRIO_ENGINE  7
+#endif
+#ifndef TASK_PRIO_REPLY
+#define TASK_PRIO_REPLY   7
+#endif
+
+// In the low-latency performance profile (see perf_profile.h), the engines and the UDP tasks run at
+// this priority instead, above everything but the flash task
+#define TASK_PRIO_LOW_LATENCY 8
+
 // This is a macro that can be used to check the size of structures at compile time
 #define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
 
@@ -48,6 +70,15 @@
 #define PIN_PROV_BUTTON GPIO_NUM_5
 #define PIN_I2C_SDA     GPIO_NUM_4
 #define PIN_I2C_SCL     GPIO_NUM_15
+
+// The pins of the second I2C bus come from NVS.  This pin number means "the bus isn't used"
+#define PIN_UNUSED      -1
+//=========================================================================================================
+
+//=========================================================================================================
+// This is how many I2C buses we drive.   Bus 0 is on I2C_NUM_0, bus 1 is on I2C_NUM_1
+//=========================================================================================================
+#define I2C_BUS_COUNT   2
 //=========================================================================================================
 
 
@@ -81,7 +112,12 @@ struct nvsdata_t
     uint8_t   network_ssid[32];
     char      network_pw[NET_PW_ENC_LEN];
     char      network_user[64];
-    char      unused[788];
+    uint32_t  i2c_clock_hz;
+    uint32_t  i2c1_clock_hz;
+    int8_t    i2c1_sda_pin;
+    int8_t    i2c1_scl_pin;
+    uint8_t   perf_profile;
+    char      unused[777];
 };
 //=========================================================================================================
 
@@ -12,7 +12,25 @@ enum command_t
     CMD_WRITE_REG   = 3,
     CMD_READ_REG    = 4,
     CMD_GET_FWREV   = 5,
-    CMD_GET_RSSI    = 6
+    CMD_GET_RSSI    = 6,
+    CMD_BATCH       = 7,
+    CMD_BUS_CLOCK   = 8,
+    CMD_DEVICE_CTX  = 9,
+    CMD_STREAM_START= 10,
+    CMD_STREAM_STOP = 11,
+    CMD_STREAM_QUERY= 12,
+    CMD_STREAM_DATA = STREAM_DATA_CMD,  // Never received.  This is the command byte of a stream packet
+    CMD_TRIGGER     = 14,
+    CMD_CACHE       = 15,
+    CMD_COALESCE    = 16,
+    CMD_GET_STATS   = 17,
+    CMD_ECHO        = 18,
+    CMD_CHUNKED     = 19,
+    CMD_SCAN        = 20,
+    CMD_MACRO       = 21,
+    CMD_DISCOVER    = DISCOVER_CMD,     // Never received.  The UDP server answers these itself
+    CMD_POLL_UNTIL  = 23,
+    CMD_RMW         = 24
 };
 
 enum error_code_t
@@ -21,11 +39,152 @@ enum error_code_t
     ERR_NOT_ENUF_DATA = 1,
     ERR_I2C_WRITE     = 2,
     ERR_I2C_READ      = 3,
+    ERR_BAD_OP        = 4,
+    ERR_TOO_LONG      = 5,
+    ERR_BAD_PARAM     = 6,
+    ERR_BAD_SLOT      = 7,
+    ERR_NO_BUS        = 8,
+    ERR_NO_DEVICE     = 9,
+    ERR_BUS_TIMEOUT   = 10,
+    ERR_NO_MACRO      = 11,
+    ERR_POLL_TIMEOUT  = 12,
+    ERR_VERIFY        = 13,
+    ERR_REPLY_EXPIRED = 14,
     ERR_UNSUPPORTED   = 255
 };
 
-// Our virtual device has 256 1 byte registers
-unsigned char virtual_device[256];
+// These are the operations that can appear in a CMD_BATCH op-list
+enum batch_op_t
+{
+    OP_WRITE        = 1,
+    OP_READ         = 2,
+    OP_WRITE_READ   = 3,
+    OP_DELAY_US     = 4,
+    OP_SET_ADDR     = 5,
+    OP_POLL_UNTIL   = 6,
+    OP_RMW          = 7
+};
+
+// In the reply to a CMD_BATCH, this "failing op index" means that every op succeeded
+#define NO_FAILED_OP 0xFFFF
+
+// In a target byte, this bit means "the low bits are a device slot", otherwise it's an I2C address
+#define TARGET_SLOT     0x80
+
+
+//=========================================================================================================
+// fetch() - Fetches a big-endian integer from a buffer and advances the buffer pointer past it
+//
+// Passed: p_data      = Pointer to the caller's buffer pointer
+//         p_remaining = Pointer to the number of bytes remaining in the buffer
+//         width       = How many bytes wide the integer is
+//         p_value     = Where to store the value
+//
+// Returns: 'false' if there weren't enough bytes remaining in the buffer
+//=========================================================================================================
+static bool fetch(const uint8_t** p_data, int* p_remaining, int width, int* p_value)
+{
+    // If there aren't enough bytes left in the buffer, tell the caller
+    if (*p_remaining < width) return false;
+
+    // Build the value, MSB first
+    int value = 0;
+    for (int i=0; i<width; ++i) value = (value << 8) | *(*p_data)++;
+
+    // The buffer now has fewer bytes remaining
+    *p_remaining -= width;
+
+    // Hand the value to the caller
+    *p_value = value;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// store() - Stores a big-endian integer into a buffer and advances the buffer pointer past it
+//
+// Passed: p_out = Pointer to the caller's buffer pointer
+//         value = The value to store
+//         width = How many bytes wide the integer is
+//=========================================================================================================
+static void store(uint8_t** p_out, uint64_t value, int width)
+{
+    // Store the value, MSB first
+    while (width--) *(*p_out)++ = value >> (8 * width);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// parse_reg_spec() - Parses the register-width byte, the optional target byte, and the register number
+//                    that appear at the start of every register read or write
+//
+// Passed: p_data      = Pointer to the caller's buffer pointer
+//         p_remaining = Pointer to the number of bytes remaining in the buffer
+//         p_spec      = Filled in with the I2C address, register number, width, and flags
+//
+// Returns: An error code, ERR_NONE if all is well
+//=========================================================================================================
+int CEngine::parse_reg_spec(const uint8_t** p_data, int* p_remaining, reg_spec_t* p_spec)
+{
+    int target;
+
+    // Fetch the width of the register number, along with the option flags
+    if (!fetch(p_data, p_remaining, 1, &p_spec->flags)) return ERR_NOT_ENUF_DATA;
+    p_spec->width = p_spec->flags & REG_WIDTH_MASK;
+
+    // Unless told otherwise, we're talking to the device at the current I2C address
+    p_spec->address = m_i2c_address;
+
+    // If there is a target byte, it's either an I2C address or a device slot
+    if (p_spec->flags & RWF_TARGET)
+    {
+        if (!fetch(p_data, p_remaining, 1, &target)) return ERR_NOT_ENUF_DATA;
+        if (!resolve_target(target, &p_spec->address, &p_spec->width)) return ERR_BAD_SLOT;
+    }
+
+    // Fetch the register number
+    if (!fetch(p_data, p_remaining, p_spec->width, &p_spec->reg)) return ERR_NOT_ENUF_DATA;
+
+    // Tell the caller that all is well
+    return ERR_NONE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// resolve_target() - Translates a target byte into an I2C address and register width
+//
+// Passed: target  = Either a 7-bit I2C address, or TARGET_SLOT plus a device-slot number
+//         p_addr  = Filled in with the I2C address of the device
+//         p_width = If this is zero and the target is a device slot, filled in with the register width
+//
+// Returns: 'false' if the target names a device slot that isn't in use
+//=========================================================================================================
+bool CEngine::resolve_target(int target, int* p_addr, int* p_width)
+{
+    // If this is an inline I2C address, we're done
+    if ((target & TARGET_SLOT) == 0)
+    {
+        *p_addr = target;
+        return true;
+    }
+
+    // Find out which device slot is being referred to
+    int slot = target & ~TARGET_SLOT;
+
+    // If that's not a valid, in-use slot, tell the caller
+    if (slot >= MAX_DEVICE_SLOTS || !m_device[slot].in_use) return false;
+
+    // Fill in the address, and if the caller didn't specify a register width, use the slot's
+    *p_addr = m_device[slot].address;
+    if (p_width && *p_width == 0) *p_width = m_device[slot].reg_width;
+
+    // Tell the caller that all is well
+    return true;
+}
+//=========================================================================================================
 
 //=========================================================================================================
 // launch_task() - Calls the "task()" routine in the specified object
@@ -44,34 +203,202 @@ static void launch_task(void *pvParameters)
 
 
 //=========================================================================================================
-// start() - Starts the UDP server task
+// begin() - Starts the engine task for an I2C bus
+//
+// Passed: bus   = The index of the I2C bus (in the I2C[] array) that this engine drives
+//         p_i2c = The bus to drive instead of I2C[bus], or nullptr
 //=========================================================================================================
-void CEngine::begin()
+void CEngine::begin(int bus, CI2CInterface* p_i2c)
 {
-    // We don't have a most recent message ID
-    m_have_most_recent_trans_id = false;
+    char task_name[16];
+
+    // Keep track of which bus we drive
+    m_bus   = bus;
+    m_i2c   = p_i2c ? p_i2c : &I2C[bus];
+    m_stats = &Stats[bus];
+
+    // The ring that packets arrive on has to be able to hold every buffer in the packet pool
+    BUILD_BUG_ON(ENGINE_RING_SIZE < PACKET_POOL_SIZE + 4);
 
-    // Create the queue that other threads will post messages to
-    m_event_queue = xQueueCreate(50, sizeof(packet_t));
+    // We haven't seen any transaction IDs from any client, have no cached replies, none of our reply
+    // buffers are waiting to be sent, and replies are sent one per datagram until a client asks for
+    // something else
+    for (cached_reply_t& entry : m_reply_cache)
+    {
+        entry.valid   = false;
+        entry.pending = 0;
+    }
+    m_next_cache_entry = 0;
+    for (client_state_t& client : m_client)
+    {
+        reset_trans_window(client);
+        client.coalesce = false;
+    }
+    m_coalesce_pending[0] = 0;
+    m_coalesce_pending[1] = 0;
+    m_flush_due = false;
+    for (int i = 0; i < CHUNK_BUFFER_COUNT; ++i) m_chunk_pending[i] = 0;
+    m_next_chunk_buffer = 0;
+    m_next_ring = 0;
+    m_source    = PKT_SRC_UDP;
+    m_session   = 0;
+
+    // Create the timer that tells us when to send coalesced replies
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof timer_args);
+    timer_args.callback        = on_coalesce_timer;
+    timer_args.arg             = this;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name            = "coalesce";
+    esp_timer_create(&timer_args, &m_coalesce_timer);
+
+    // Create the timer that tells us when to re-scan the bus
+    timer_args.callback        = on_scan_timer;
+    timer_args.name            = "bus_scan";
+    esp_timer_create(&timer_args, &m_scan_timer);
+
+    // We haven't scanned the bus yet, and we don't check addresses until the client asks us to
+    m_scan_valid    = false;
+    m_scan_validate = false;
+    m_scan_due      = false;
+
+    // We aren't holding any coalesced replies
+    m_coalesce_index   = 0;
+    m_coalesce_length  = COALESCE_HDR_SIZE;
+    m_coalesce_session = 0;
 
     // A default address for a device on the I2C bus that we'll be talking to
     m_i2c_address = 0x62;
 
+    // None of our device slots are in use
+    memset(m_device, 0, sizeof m_device);
+
+    // Unless the client set up a session before a soft reboot, in which case we carry on with it
+    restore_session();
+
+    // Our virtual device starts out full of zeros
+    memset(m_virtual_device, 0, sizeof m_virtual_device);
+    m_virtual_reg_ptr = 0;
+
     // And start the task
-    xTaskCreatePinnedToCore(launch_task, "i2c_engine", 4096, this, DEFAULT_TASK_PRI, &m_task_handle, TASK_CPU);
+    sprintf(task_name, "i2c_engine%i", bus);
+    xTaskCreatePinnedToCore(launch_task, task_name, 4096, this, PerfProfile.priority(TASK_PRIO_ENGINE), &m_task_handle,
+                            ENGINE_CPU);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// dispatch() - Hands an incoming packet to the engine for the I2C bus that it's aimed at
+//
+// Passed: buffer = A buffer from PacketPool.  The engine gives it back to the pool
+//         length = The length of the packet in the buffer
+//         source  = Where the packet came from (a packet_source_t)
+//         session = If it came over UDP, the session slot of the client that sent it
+//=========================================================================================================
+void CEngine::dispatch(uint8_t* buffer, int length, int source, int session)
+{
+    // If the packet is too short to have a command byte, let bus 0's engine throw it away
+    if (length < 5)
+    {
+        Engine[0].handle_packet(buffer, length, source, session);
+        return;
+    }
+
+    // Find out which bus this command is aimed at
+    int command = buffer[4];
+    int bus = (command & CMD_BUS_FLAG) && I2C_BUS_COUNT > 1 ? 1 : 0;
+    command &= ~CMD_BUS_FLAG;
+
+    // When a UDP client starts over, every engine has to forget that client's old transaction IDs,
+    // not just the engine that the init-sequence message is aimed at
+    if (source == PKT_SRC_UDP && (command == CMD_INIT_SEQ || command == CMD_CLIENT_PORT))
+    {
+        for (int i=0; i<I2C_BUS_COUNT; ++i) if (i != bus) Engine[i].post_message(ENGINE_MSG_RESET, session);
+    }
+
+    // And hand the packet to the engine for that bus
+    Engine[bus].handle_packet(buffer, length, source, session);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// ring_index() - Returns the index of the packet ring that packets from the specified source (and UDP
+//                session) arrive on
+//=========================================================================================================
+static int ring_index(int source, int session)
+{
+    return source == PKT_SRC_UDP ? session : TCP_CLIENT;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// post_message() - Posts a message (an engine_msg_t) about a UDP session to the engine task
+//
+// The message goes through the session's packet ring, so the engine sees it in order with that
+// client's packets.  A packet ring has a single producer, so only the UDP task may call this
+//=========================================================================================================
+void CEngine::post_message(int message, int session)
+{
+    packet_t packet = {nullptr, (uint16_t)message, PKT_SRC_UDP, (uint8_t)session, 0};
+    if (m_rx_ring[ring_index(PKT_SRC_UDP, session)].push(packet)) xTaskNotifyGive(m_task_handle);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_packet() - Hands a packet to the engine task.  For any one source, only one task may call this
+//=========================================================================================================
+void CEngine::handle_packet(uint8_t* buffer, int length, int source, int session)
+{
+    packet_t message = {buffer, (uint16_t)length, (uint8_t)source, (uint8_t)session, esp_timer_get_time()};
+
+    // Put the packet into the ring for its source and wake up the engine task
+    if (m_rx_ring[ring_index(source, session)].push(message))
+    {
+        xTaskNotifyGive(m_task_handle);
+        return;
+    }
+
+    // If we get here, the ring was full.  Give the buffer back and count the dropped packet
+    PacketPool.release(buffer);
+    PacketPool.count_queue_drop();
+    Trace.log(TRC_QUEUE_DROP, length);
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
-// handle_packet() - Sends a notification of a packet to be handled
+// next_packet() - Fetches the next packet to handle.  The packet rings take turns, so that a busy
+//                 client can't lock out the other UDP clients or a client on TCP
+//
+// Returns: 'true' if a packet was fetched, 'false' if every ring is empty
 //=========================================================================================================
-void CEngine::handle_packet(uint8_t* buffer, int length)
+bool CEngine::next_packet(packet_t* p_packet)
 {
-    packet_t message = {buffer, (uint16_t)length};
+    for (int i = 0; i < PKT_RING_COUNT; ++i)
+    {
+        int ring = m_next_ring;
+        m_next_ring = (m_next_ring + 1) % PKT_RING_COUNT;
+        if (m_rx_ring[ring].pop(p_packet)) return true;
+    }
+
+    // If we get here, there are no packets waiting
+    return false;
+}
+//=========================================================================================================
 
-    // Stuff this event into the event queue
-    xQueueSend(m_event_queue, &message, 0);
+
+//=========================================================================================================
+// packets_waiting() - Returns the number of packets waiting in all of our packet rings
+//=========================================================================================================
+int CEngine::packets_waiting()
+{
+    int count = 0;
+    for (int i = 0; i < PKT_RING_COUNT; ++i) count += m_rx_ring[i].count();
+    return count;
 }
 //=========================================================================================================
 
@@ -83,78 +410,252 @@ void CEngine::task()
 {
     packet_t    packet;
     
-    // Loop forever, waiting for packets to arrive
-    while (xQueueReceive(m_event_queue, &packet, portMAX_DELAY))
+    // Loop forever, waiting for the network tasks or the coalesce timer to wake us up
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // If the coalesced replies have been held as long as the client allows, send them
+        if (m_flush_due.exchange(false)) flush_replies();
+
+        // If it's time to re-scan the bus, do so
+        if (m_scan_due.exchange(false) && m_i2c->is_installed()) scan_bus();
+
+        // Handle every packet in the rings
+        while (next_packet(&packet))
+        {
+            // A packet with no buffer is a message to us rather than a packet from the client
+            if (packet.buffer == nullptr)
+            {
+                if (packet.length == ENGINE_MSG_RESET)
+                {
+                    client_state_t& client = m_client[packet.session];
+                    reset_trans_window(client);
+                    set_coalescing(client, false);
+                }
+                continue;
+            }
+
+            // Keep track of how far behind we've fallen.  The packet we just took counts
+            m_stats->note_queue_depth(packets_waiting() + 1);
+
+            // Handle the packet
+            m_rx_time = packet.rx_time;
+            m_source  = packet.source;
+            m_session = packet.session;
+            process_packet(packet.buffer, packet.length);
+
+            // And give the packet buffer back to the pool
+            PacketPool.release(packet.buffer);
+
+            // If we're not holding any coalesced replies, we're done with this packet
+            if (m_coalesce_length == COALESCE_HDR_SIZE) continue;
+
+            // If there are no more packets waiting and the client wants replies as soon as the rings are
+            // empty, or if the coalesced replies are overdue, send them
+            uint32_t delay_us = m_client[m_coalesce_session].coalesce_delay_us;
+            if ((packets_waiting() == 0 && delay_us == 0) || esp_timer_get_time() >= m_coalesce_deadline)
+            {
+                flush_replies();
+            }
+        }
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// uses_bus() - Returns 'true' if the specified command uses the I2C bus
+//=========================================================================================================
+static bool uses_bus(int command)
+{
+    switch (command)
     {
-        // If there's not a transaction ID and command in the packet, ignore it
-        if (packet.length < 5) return;
+        case CMD_INIT_SEQ:
+        case CMD_CLIENT_PORT:
+        case CMD_GET_FWREV:
+        case CMD_GET_RSSI:
+        case CMD_COALESCE:
+        case CMD_GET_STATS:
+        case CMD_ECHO:
+            return false;
+    }
 
-        // Point to the incoming packet buffer
-        unsigned char* in = packet.buffer;
+    // Everything else does
+    return true;
+}
+//=========================================================================================================
 
-        // Fetch transaction ID from this message
-        uint32_t trans_id = 0;
-        trans_id = (trans_id << 8) | *in++;
-        trans_id = (trans_id << 8) | *in++;
-        trans_id = (trans_id << 8) | *in++;
-        trans_id = (trans_id << 8) | *in++;
 
-        // If this is a init-sequence message, forget that we have a most recent message ID
-        if (*in == CMD_INIT_SEQ || *in == CMD_CLIENT_PORT) m_have_most_recent_trans_id = false;
+//=========================================================================================================
+// process_packet() - Handles a single incoming packet
+//
+// Passed: in     = Pointer to the packet
+//         length = The length of the packet, in bytes
+//=========================================================================================================
+void CEngine::process_packet(const uint8_t* in, int length)
+{
+    // If there's not a transaction ID and command in the packet, ignore it
+    if (length < 5) return;
+
+    // Fetch transaction ID from this message
+    uint32_t trans_id = 0;
+    trans_id = (trans_id << 8) | *in++;
+    trans_id = (trans_id << 8) | *in++;
+    trans_id = (trans_id << 8) | *in++;
+    trans_id = (trans_id << 8) | *in++;
+
+    // Messages over TCP are never lost or duplicated, so they don't take part in any UDP client's
+    // transaction-ID window
+    bool is_udp = (m_source == PKT_SRC_UDP);
+
+    // If this is a init-sequence message, the client is starting over with new transaction IDs, and
+    // might be an older client that doesn't understand coalesced replies
+    int command = *in & ~CMD_BUS_FLAG;
+    if (is_udp && (command == CMD_INIT_SEQ || command == CMD_CLIENT_PORT))
+    {
+        reset_trans_window(client());
+        set_coalescing(client(), false);
+    }
 
-        // If the message we just received as the same transaction ID as the previous one, ignore it
-        if (m_have_most_recent_trans_id && trans_id == m_most_recent_trans_id) continue;
+    // If we've already handled this transaction, re-send the reply and move on
+    if (is_udp && !accept_trans_id(trans_id))
+    {
+        m_stats->count_duplicate();
+        if (resend_cached_reply(trans_id)) return;
 
-        // This is now our most recent transactionge ID
+        // The reply has aged out of the cache.  The request can't be run again (it may have been a
+        // write), but the client needs to hear that, rather than retrying until it gives up
         m_most_recent_trans_id = trans_id;
+        m_request_length       = length;
+        m_bus_us               = 0;
+        m_bus_timeout          = false;
+        m_command              = *in;
+        reply(ERR_REPLY_EXPIRED);
+        return;
+    }
+
+    // This is the transaction we're about to handle
+    m_most_recent_trans_id = trans_id;
+
+    // This command hasn't spent any time on the bus yet
+    m_request_length = length;
+    m_bus_us         = 0;
+    m_bus_timeout    = false;
+
+    // Fetch the command byte.  The reply echoes it back, bus flag and all
+    m_command = *in++;
+
+    // The transaction ID and command took up 5 bytes.  This is how much is left
+    int data_length = length - 5;
+
+    // If our I2C bus was never set up, we can only handle the commands that don't use it
+    if (!m_i2c->is_installed() && uses_bus(command))
+    {
+        reply(ERR_NO_BUS);
+        return;
+    }
+
+    // Handle each type of command we know about
+    switch(command)
+    {
+        case CMD_INIT_SEQ:
+            reply(ERR_NONE);
+            break;
         
-        // Keep track of the fact that we have a transaction ID
-        m_have_most_recent_trans_id = true;
+        case CMD_WRITE_REG:
+            handle_cmd_write_reg(in, data_length);
+            break;
 
-        // Fetch the command byte
-        m_command = *in++;
+        case CMD_READ_REG:
+            handle_cmd_read_reg(in, data_length);
+            break;
 
-        // The transaction ID and command took up 5 bytes.  This is how much is left
-        int data_length = packet.length - 5;
+        case CMD_BATCH:
+            handle_cmd_batch(in, data_length);
+            break;
 
-        // Handle each type of command we know about
-        switch(m_command)
-        {
-            case CMD_INIT_SEQ:
-                reply(ERR_NONE);
-                break;
-            
-            case CMD_WRITE_REG:
-                handle_cmd_write_reg(in, data_length);
-                break;
+        case CMD_BUS_CLOCK:
+            handle_cmd_bus_clock(in, data_length);
+            break;
 
-            case CMD_READ_REG:
-                handle_cmd_read_reg(in, data_length);
-                break;
+        case CMD_DEVICE_CTX:
+            handle_cmd_device_ctx(in, data_length);
+            break;
 
-            case CMD_CLIENT_PORT:
-                handle_cmd_client_port(in, data_length);
-                break;
+        case CMD_STREAM_START:
+            handle_cmd_stream_start(in, data_length);
+            break;
 
-            case CMD_I2C_ADDR:
-                handle_cmd_i2c_addr(in, data_length);
-                break;
-            
-            case CMD_GET_FWREV:
-                reply(ERR_NONE, atoi(FW_VERSION));
-                break;
-            
-            case CMD_GET_RSSI:
-                reply(ERR_NONE, System.rssi());
-                break;
-            
-            default:
-                reply(ERR_UNSUPPORTED);
-                break;
+        case CMD_STREAM_STOP:
+            handle_cmd_stream_stop(in, data_length);
+            break;
 
-        }
-    }
+        case CMD_STREAM_QUERY:
+            handle_cmd_stream_query(in, data_length);
+            break;
+
+        case CMD_TRIGGER:
+            handle_cmd_trigger(in, data_length);
+            break;
+
+        case CMD_CACHE:
+            handle_cmd_cache(in, data_length);
+            break;
+
+        case CMD_COALESCE:
+            handle_cmd_coalesce(in, data_length);
+            break;
+
+        case CMD_GET_STATS:
+            handle_cmd_get_stats(in, data_length);
+            break;
+
+        case CMD_ECHO:
+            handle_cmd_echo(in, data_length);
+            break;
+
+        case CMD_CHUNKED:
+            handle_cmd_chunked(in, data_length);
+            break;
+
+        case CMD_SCAN:
+            handle_cmd_scan(in, data_length);
+            break;
 
+        case CMD_MACRO:
+            handle_cmd_macro(in, data_length);
+            break;
+
+        case CMD_POLL_UNTIL:
+            handle_cmd_poll_until(in, data_length);
+            break;
+
+        case CMD_RMW:
+            handle_cmd_rmw(in, data_length);
+            break;
+
+        case CMD_CLIENT_PORT:
+            handle_cmd_client_port(in, data_length);
+            break;
+
+        case CMD_I2C_ADDR:
+            handle_cmd_i2c_addr(in, data_length);
+            break;
+        
+        case CMD_GET_FWREV:
+            reply(ERR_NONE, atoi(FW_VERSION));
+            break;
+        
+        case CMD_GET_RSSI:
+            reply(ERR_NONE, System.rssi());
+            break;
+        
+        default:
+            reply(ERR_UNSUPPORTED);
+            break;
+
+    }
 }
 //=========================================================================================================
 
@@ -169,11 +670,13 @@ void CEngine::task()
 //=========================================================================================================
 void CEngine::handle_cmd_write_reg(const uint8_t* data, int data_length)
 {
-    int reg, write_length;
+    reg_spec_t  spec;
+    int         write_length;
 
     //---------------------------------------------------------------
     // Format of a "write_register" command
     // 1 Byte that defines how many bytes wide a register number is
+    // 1 Byte of target (only if RWF_TARGET is set in the width byte)
     // n Bytes of a register number
     // 2 Bytes that define how much data to write
     // n Bytes of data
@@ -182,36 +685,33 @@ void CEngine::handle_cmd_write_reg(const uint8_t* data, int data_length)
 
     while (data_length > 0)
     {
-        reg = write_length = 0;
-
-        // Fetch the register width 
-        // (Removes 1 byte from the buffer)
-        int reg_width = *data++;
-        
-        // Fetch the register number we're writing to
-        // (Removes reg_width bytes from the buffer)
-        int w = reg_width; while (w--) reg = (reg << 8) | *data++;
+        // Fetch the target device, register width, and register number we're writing to
+        int error = parse_reg_spec(&data, &data_length, &spec);
+        if (error)
+        {
+            reply(error);
+            return;
+        }
 
         // Fetch the length of the data we're going to write to the register
-        // (Removes two bytes from the buffer)
-        write_length = (write_length << 8) | *data++;
-        write_length = (write_length << 8) | *data++;
-
-        // We have now have fewer bytes of data in the buffer
-        data_length = data_length - reg_width - 3;
+        if (!fetch(&data, &data_length, 2, &write_length))
+        {
+            reply(ERR_NOT_ENUF_DATA, spec.reg);
+            return;
+        }
 
         // If there isn't enough data in the buffer to satisfy the register length, something is awry
         if (data_length < write_length)
         {
-            printf("Register 0x%02X needs %i bytes.  Not enough data!\n", reg, data_length);
-            reply(ERR_NOT_ENUF_DATA);
+            Trace.log(TRC_NOT_ENUF_DATA, spec.reg, write_length, data_length);
+            reply(ERR_NOT_ENUF_DATA, spec.reg);
             return;
         }
 
         // If we can't write to the I2C, it's an error
-        if (!i2c_write(reg, reg_width, data, write_length))
+        if (!i2c_write(spec.address, spec.reg, spec.width, data, write_length))
         {
-            reply(ERR_I2C_WRITE, reg);
+            reply(ERR_I2C_WRITE, spec.reg);
             return;
         }
         
@@ -232,141 +732,1810 @@ void CEngine::handle_cmd_write_reg(const uint8_t* data, int data_length)
 // handle_cmd_read_reg() - Reads data from one or more registers on the I2C device
 //
 // Passed:  data        = Pointer to buffer that says how many bytes to read
-//          data_length = Length of that buffer (we don't need it)
+//          data_length = Length of that buffer
 //=========================================================================================================
-unsigned char read_buffer[1024];
 void CEngine::handle_cmd_read_reg(const uint8_t* data, int data_length)
 {
+    reg_spec_t  spec;
+    int         read_length;
 
     //---------------------------------------------------------------
     // Format of a "read_register" command
     // 1 Byte that defines how many bytes wide a register number is
+    //        (bit 7 of this byte set = STOP between register write and read)
+    //        (bit 5 of this byte set = bypass the register cache)
+    // 1 Byte of target (only if RWF_TARGET is set in the width byte)
     // n Bytes of a register number
     // 2 Bytes that define how much data to read
     //---------------------------------------------------------------
 
-    int reg = 0;
-    int read_length = 0;
-
-    // Fetch the width of the register in bytes
-    int reg_width = *data++;
-
-    // Fetch the register number we're reading from
-    int w = reg_width; while (w--) reg = (reg << 8) | *data++;
+    // Fetch the target device, register width, and register number we're reading from
+    int error = parse_reg_spec(&data, &data_length, &spec);
+    if (error)
+    {
+        reply(error);
+        return;
+    }
 
     // Fetch the length of the data we're going to read from the register
-    read_length = (read_length << 8) | *data++;
-    read_length = (read_length << 8) | *data++;
+    if (!fetch(&data, &data_length, 2, &read_length))
+    {
+        reply(ERR_NOT_ENUF_DATA, spec.reg);
+        return;
+    }
+
+    // Anything longer than our read buffer has to be done as a chunked read
+    if (read_length > (int)sizeof(m_read_buffer))
+    {
+        reply(ERR_TOO_LONG, spec.reg);
+        return;
+    }
 
     // If we can't read from the I2C, it's an error
-    if (!i2c_read(reg, reg_width, read_buffer, read_length))
+    if (!i2c_read(spec.address, spec.reg, spec.width, m_read_buffer, read_length, spec.flags))
     {
-        reply(ERR_I2C_READ, reg);
+        reply(ERR_I2C_READ, spec.reg);
         return;
     }
 
     // Tell the client that everything worked
-    reply(ERR_NONE, read_buffer, read_length);
+    reply(ERR_NONE, m_read_buffer, read_length);
 }
 //=========================================================================================================
 
 
+
 //=========================================================================================================
-// reply() - Replies with a single integer data value
+// handle_cmd_batch() - Executes an ordered list of read, write, and delay operations and replies with
+//                      all of the data that was read
+//
+// Passed:  data        = Pointer to the list of operations
+//          data_length = The number of bytes in the data buffer
 //=========================================================================================================
-void CEngine::reply(int error_code, int32_t value, int width)
+void CEngine::handle_cmd_batch(const uint8_t* data, int data_length)
 {
-    unsigned char bytes[4], *out = bytes;
-
-    // Stuff the value into the "bytes" buffer, MSB first    
-    if (width >= 4) *out++ = (value >> 24);
-    if (width >= 3) *out++ = (value >> 16);
-    if (width >= 2) *out++ = (value >>  8);
-    if (width >= 1) *out++ = (value >>  0);
-
-    // Tell the client that everything worked
-    reply(error_code, bytes, (out - bytes));
-}
-//=========================================================================================================
+    //---------------------------------------------------------------
+    // Format of a "batch" command is a list of ops.  Each op is
+    // 1 Byte of op code, followed by:
+    //
+    // OP_WRITE      : reg-width byte, [target], register number, 2 byte length, data
+    // OP_READ       : 2 byte length (read without a register number)
+    // OP_WRITE_READ : reg-width byte, [target], register number, 2 byte length
+    // OP_DELAY_US   : 4 byte delay in microseconds, no more than
+    //                 BATCH_MAX_DELAY_US (otherwise ERR_BAD_PARAM)
+    // OP_SET_ADDR   : 1 byte target (for the rest of this batch)
+    // OP_POLL_UNTIL : the same fields as a CMD_POLL_UNTIL.  Its outcome
+    //                 and the value it read go into the reply data like
+    //                 a read, and if the condition isn't met, the batch
+    //                 stops with ERR_POLL_TIMEOUT
+    // OP_RMW        : the same fields as a CMD_RMW.  The old and new
+    //                 values go into the reply data like a read
+    //
+    // The reply contains:
+    // 2 Bytes of "failing op index" (0xFFFF if every op succeeded)
+    // n Bytes of all of the data read by the read ops, in order
+    //---------------------------------------------------------------
 
+    int fail_index, out_length;
 
+    // The first two bytes of the output are the index of the failing op
+    uint8_t* out = m_read_buffer + 2;
 
+    // Run the op list, collecting the data we read as we go
+    int error = run_ops(m_i2c_address, data, data_length, out, sizeof(m_read_buffer) - 2, &out_length, &fail_index);
 
-//=========================================================================================================
-// handle_cmd_client_port() - Sets the UDP port for replying to the client
-//=========================================================================================================
-void CEngine::handle_cmd_client_port(const uint8_t* data, int data_length)
-{
-    // Fetch the port number
-    int udp_port = (data[0] << 8) | data[1];
+    // If every op succeeded, there's no failing op index to report
+    if (error == ERR_NONE) fail_index = NO_FAILED_OP;
 
-    // Tell the server what client port to send responses to
-    UDPServer.set_client_port(udp_port);
+    // Fill in the failing op index
+    m_read_buffer[0] = fail_index >> 8;
+    m_read_buffer[1] = fail_index;
 
-    // Tell the client that everything worked
-    reply(ERR_NONE);
+    // Tell the client how it went, along with whatever data we read
+    reply(error, m_read_buffer, out_length + 2);
 }
 //=========================================================================================================
 
 
 
 //=========================================================================================================
-// i2c_addr() - Declares the I2C address of the device we want to talk to
+// run_ops() - Executes an ordered list of read, write, and delay operations
+//
+// Passed:  address      = The I2C address to start with
+//          ops          = Pointer to the list of operations
+//          ops_length   = The number of bytes in the list of operations
+//          out          = Where to store the data read by read operations
+//          out_max      = The number of bytes the output buffer can hold
+//          p_out_length = Filled in with the number of bytes stored in the output buffer
+//          p_fail_index = Filled in with the index of the op that failed
+//
+// Returns: An error code, ERR_NONE if every op succeeded
 //=========================================================================================================
-void CEngine::handle_cmd_i2c_addr(const uint8_t* data, int data_length)
+int CEngine::run_ops(int address, const uint8_t* ops, int ops_length, uint8_t* out, int out_max,
+                     int* p_out_length, int* p_fail_index)
 {
-    // Set our internal I2C address
-    m_i2c_address = *data;
-
-    // Tell the client that everything worked
-    reply(ERR_NONE);
-}
-//=========================================================================================================
+    reg_spec_t  spec;
+    int op, length = 0, delay, target;
 
+    // We haven't read any data yet
+    *p_out_length = 0;
 
+    // Loop through each op in the list
+    for (int index = 0; ops_length > 0; ++index)
+    {
+        // If this op fails, this is the index we'll report
+        *p_fail_index = index;
 
+        // Fetch the op code
+        fetch(&ops, &ops_length, 1, &op);
 
+        // If this is an op with a register number, fetch the target, register width and register number
+        if (op == OP_WRITE || op == OP_WRITE_READ)
+        {
+            int error = parse_reg_spec(&ops, &ops_length, &spec);
+            if (error) return error;
 
-//=========================================================================================================
-// i2c_read() - Reads data from a device register via I2C
-//
-// Passed: reg    = The register number
-//         width  = Width, in bytes, of the register number
-//         data   = Pointer to where the data we read should be stored
-//         length = How many bytes of the data to read
-//=========================================================================================================
-bool CEngine::i2c_read(int reg, int width, uint8_t* data, int length)
-{
-    bool status;
+            // Without a target byte, the op is aimed at the batch's current I2C address
+            if ((spec.flags & RWF_TARGET) == 0) spec.address = address;
+        }
 
-    // If we're reading from our virtual device
-    if (m_i2c_address == 0)
-    {
-        for (int i = 0; i<length; ++i)
+        // If this is an op with a length, fetch the length
+        if (op == OP_WRITE || op == OP_WRITE_READ || op == OP_READ)
         {
-            int index = (reg + i) & 0xFF;
-            data[i] = virtual_device[index];
-        }        
-        return true;        
+            if (!fetch(&ops, &ops_length, 2, &length)) return ERR_NOT_ENUF_DATA;
+        }
+
+        // If this is a read, make sure there's room in the output buffer for the data
+        if (op == OP_WRITE_READ || op == OP_READ)
+        {
+            if (*p_out_length + length > out_max) return ERR_TOO_LONG;
+        }
+
+        // Perform the operation
+        switch (op)
+        {
+            case OP_WRITE:
+                if (ops_length < length) return ERR_NOT_ENUF_DATA;
+                if (!i2c_write(spec.address, spec.reg, spec.width, ops, length)) return ERR_I2C_WRITE;
+                ops        += length;
+                ops_length -= length;
+                break;
+
+            case OP_READ:
+                if (!i2c_read_raw(address, out + *p_out_length, length)) return ERR_I2C_READ;
+                *p_out_length += length;
+                break;
+
+            case OP_WRITE_READ:
+                if (!i2c_read(spec.address, spec.reg, spec.width, out + *p_out_length, length, spec.flags))
+                    return ERR_I2C_READ;
+                *p_out_length += length;
+                break;
+
+            case OP_DELAY_US:
+                if (!fetch(&ops, &ops_length, 4, &delay)) return ERR_NOT_ENUF_DATA;
+                if (delay < 0 || delay > BATCH_MAX_DELAY_US) return ERR_BAD_PARAM;
+                usdelay(delay);
+                break;
+
+            case OP_SET_ADDR:
+                if (!fetch(&ops, &ops_length, 1, &target)) return ERR_NOT_ENUF_DATA;
+                if (!resolve_target(target, &address)) return ERR_BAD_SLOT;
+                if (!device_present(address)) return ERR_NO_DEVICE;
+                break;
+
+            case OP_POLL_UNTIL:
+            {
+                poll_spec_t poll;
+                int error = parse_poll_spec(&ops, &ops_length, &poll);
+                if (error) return error;
+                if ((poll.spec.flags & RWF_TARGET) == 0) poll.spec.address = address;
+                if (*p_out_length + POLL_RESULT_LENGTH + poll.length > out_max) return ERR_TOO_LONG;
+                error = poll_until(poll, out + *p_out_length);
+                if (error != ERR_NONE && error != ERR_POLL_TIMEOUT) return error;
+                *p_out_length += POLL_RESULT_LENGTH + poll.length;
+                if (error) return error;
+                break;
+            }
+
+            case OP_RMW:
+            {
+                rmw_spec_t rmw;
+                int error = parse_rmw_spec(&ops, &ops_length, &rmw);
+                if (error) return error;
+                if ((rmw.spec.flags & RWF_TARGET) == 0) rmw.spec.address = address;
+                if (*p_out_length + 2 * rmw.length > out_max) return ERR_TOO_LONG;
+                error = read_modify_write(rmw, out + *p_out_length);
+                if (error != ERR_NONE && error != ERR_VERIFY) return error;
+                *p_out_length += 2 * rmw.length;
+                if (error) return error;
+                break;
+            }
+
+            default:
+                return ERR_BAD_OP;
+        }
+    }
+
+    // If we get here, every op succeeded
+    return ERR_NONE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_poll_until() - Reads a register over and over until (value & mask) == expected, so that
+//                           waiting for a device to be ready doesn't take a network round trip per read
+//=========================================================================================================
+void CEngine::handle_cmd_poll_until(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "poll_until" command
+    // 1 Byte that defines how many bytes wide a register number is
+    //        (the RWF_SPLIT_READ and RWF_TARGET flags work as they do
+    //        for a register read.  The cache is never consulted)
+    // 1 Byte of target (only if RWF_TARGET is set in the width byte)
+    // n Bytes of a register number
+    // 1 Byte of value length (1 thru 4)
+    // 4 Bytes of mask
+    // 4 Bytes of expected value
+    // 4 Bytes of interval between reads in microseconds
+    // 4 Bytes of timeout in microseconds (1 thru POLL_MAX_TIMEOUT_US)
+    // 2 Bytes of iteration cap (0 = only the timeout applies)
+    //
+    // The reply contains:
+    // 1 Byte of poll_status_t
+    // 2 Bytes of the number of reads performed
+    // 4 Bytes of time elapsed in microseconds
+    // n Bytes of the last value read
+    //---------------------------------------------------------------
+
+    poll_spec_t poll;
+
+    // Find out what we're polling for
+    int error = parse_poll_spec(&data, &data_length, &poll);
+    if (error) {reply(error); return;}
+
+    // Poll the register.  A condition that isn't met isn't an error here: the status says so
+    error = poll_until(poll, m_read_buffer);
+    if (error == ERR_POLL_TIMEOUT) error = ERR_NONE;
+
+    // Tell the client how it went
+    if (error)
+        reply(error, poll.spec.reg);
+    else
+        reply(ERR_NONE, m_read_buffer, POLL_RESULT_LENGTH + poll.length);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// parse_poll_spec() - Parses the description of a register to poll
+//
+// Returns: An error code, ERR_NONE if the description is sensible
+//=========================================================================================================
+int CEngine::parse_poll_spec(const uint8_t** p_data, int* p_remaining, poll_spec_t* p_poll)
+{
+    int mask, expected, interval_us, timeout_us;
+
+    // Fetch the target device, register width, and register number we're polling
+    int error = parse_reg_spec(p_data, p_remaining, &p_poll->spec);
+    if (error) return error;
+
+    // Fetch the rest of the fields
+    if (!fetch(p_data, p_remaining, 1, &p_poll->length))    return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &mask))              return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &expected))          return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &interval_us))       return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &timeout_us))        return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 2, &p_poll->max_polls)) return ERR_NOT_ENUF_DATA;
+    p_poll->mask        = mask;
+    p_poll->expected    = expected;
+    p_poll->interval_us = interval_us;
+    p_poll->timeout_us  = timeout_us;
+
+    // The value has to fit in 32 bits, and we won't keep the engine tied up for too long
+    if (p_poll->length < 1 || p_poll->length > POLL_MAX_WIDTH) return ERR_BAD_PARAM;
+    if (p_poll->timeout_us < 1 || p_poll->timeout_us > POLL_MAX_TIMEOUT_US) return ERR_BAD_PARAM;
+    if (p_poll->interval_us > p_poll->timeout_us) return ERR_BAD_PARAM;
+
+    // A register that's being polled is changed by the device, so a cached copy is no use
+    p_poll->spec.flags |= RWF_NO_CACHE;
+    return ERR_NONE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// poll_until() - Reads a register over and over until (value & mask) == expected, or until the timeout
+//                or the iteration cap is reached
+//
+// Passed: poll = What to read, and what we're waiting for
+//         out  = Where to store the outcome (POLL_RESULT_LENGTH bytes) and the last value read
+//
+// Returns: ERR_NONE if the condition was met, ERR_POLL_TIMEOUT if it wasn't, or the error from a read
+//=========================================================================================================
+int CEngine::poll_until(const poll_spec_t& poll, uint8_t* out)
+{
+    uint8_t* value = out + POLL_RESULT_LENGTH;
+    int      status, polls = 0;
+    int64_t  start_time = esp_timer_get_time(), elapsed;
+
+    while (true)
+    {
+        // Read the register
+        if (!i2c_read(poll.spec.address, poll.spec.reg, poll.spec.width, value, poll.length, poll.spec.flags))
+            return ERR_I2C_READ;
+        ++polls;
+        elapsed = esp_timer_get_time() - start_time;
+
+        // Find out whether the condition is met
+        uint32_t v = 0;
+        for (int i = 0; i < poll.length; ++i) v = (v << 8) | value[i];
+        if ((v & poll.mask) == poll.expected) {status = POLL_MET; break;}
+
+        // If we've run out of time or reads, give up
+        if (poll.max_polls && polls >= poll.max_polls)                  {status = POLL_MAX_POLLS; break;}
+        if (elapsed + poll.interval_us >= (int64_t)poll.timeout_us)     {status = POLL_TIMED_OUT; break;}
+
+        // Give the device a moment before we read it again
+        usdelay(poll.interval_us);
+    }
+
+    // Fill in the outcome in front of the value
+    out[0] = status;
+    out[1] = polls >> 8;
+    out[2] = polls;
+    out[3] = elapsed >> 24;
+    out[4] = elapsed >> 16;
+    out[5] = elapsed >>  8;
+    out[6] = elapsed;
+
+    // Tell the caller whether the condition was met
+    return (status == POLL_MET) ? ERR_NONE : ERR_POLL_TIMEOUT;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_rmw() - Changes some of the bits of a register without disturbing the others, in a single
+//                    round trip, and without any other task getting the bus in between
+//=========================================================================================================
+void CEngine::handle_cmd_rmw(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "read-modify-write" command
+    // 1 Byte that defines how many bytes wide a register number is
+    //        (the RWF_SPLIT_READ and RWF_TARGET flags work as they do
+    //        for a register read.  The cache is never consulted)
+    // 1 Byte of target (only if RWF_TARGET is set in the width byte)
+    // n Bytes of a register number
+    // 1 Byte of value length (1 thru 4)
+    // 4 Bytes of mask: the bits that are changed
+    // 4 Bytes of value: what those bits are changed to
+    // 1 Byte of RMW_xxx flags
+    //
+    // The reply contains:
+    // n Bytes of the value the register had before
+    // n Bytes of the value it has now (read back, with RMW_VERIFY)
+    //---------------------------------------------------------------
+
+    rmw_spec_t rmw;
+
+    // Find out what we're changing
+    int error = parse_rmw_spec(&data, &data_length, &rmw);
+    if (error) {reply(error); return;}
+
+    // Change it
+    error = read_modify_write(rmw, m_read_buffer);
+
+    // Tell the client how it went
+    if (error)
+        reply(error, rmw.spec.reg);
+    else
+        reply(ERR_NONE, m_read_buffer, 2 * rmw.length);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// parse_rmw_spec() - Parses the description of a read-modify-write
+//
+// Returns: An error code, ERR_NONE if the description is sensible
+//=========================================================================================================
+int CEngine::parse_rmw_spec(const uint8_t** p_data, int* p_remaining, rmw_spec_t* p_rmw)
+{
+    int mask, value;
+
+    // Fetch the target device, register width, and register number we're changing
+    int error = parse_reg_spec(p_data, p_remaining, &p_rmw->spec);
+    if (error) return error;
+
+    // Fetch the rest of the fields
+    if (!fetch(p_data, p_remaining, 1, &p_rmw->length)) return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &mask))          return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 4, &value))         return ERR_NOT_ENUF_DATA;
+    if (!fetch(p_data, p_remaining, 1, &p_rmw->flags))  return ERR_NOT_ENUF_DATA;
+    p_rmw->mask  = mask;
+    p_rmw->value = value;
+
+    // The value has to fit in 32 bits
+    if (p_rmw->length < 1 || p_rmw->length > RMW_MAX_WIDTH) return ERR_BAD_PARAM;
+
+    // The whole point is to change what's in the device right now, not what the cache thinks is there
+    p_rmw->spec.flags |= RWF_NO_CACHE;
+    return ERR_NONE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read_modify_write() - Reads a register, changes the bits in the mask, and writes it back, all while
+//                       we own the bus, so no other client, stream or trigger can get in between
+//
+// Passed: rmw = What to change
+//         out = Where to store the old value followed by the new one (2 * rmw.length bytes)
+//
+// Returns: ERR_NONE, ERR_VERIFY if the value read back isn't the one we wrote, or the error from a
+//          read or a write
+//=========================================================================================================
+int CEngine::read_modify_write(const rmw_spec_t& rmw, uint8_t* out)
+{
+    const reg_spec_t& spec = rmw.spec;
+    uint8_t *old_value = out, *new_value = out + rmw.length;
+    uint32_t v = 0;
+    int      error = ERR_NONE;
+
+    // Nobody else gets the bus until we're done.  The reads and writes below lock it too, but since
+    // we already own it, they just own it one level deeper
+    m_i2c->lock();
+
+    // Read the register
+    if (!i2c_read(spec.address, spec.reg, spec.width, old_value, rmw.length, spec.flags))
+    {
+        m_i2c->unlock();
+        return ERR_I2C_READ;
+    }
+
+    // Change the bits in the mask
+    for (int i = 0; i < rmw.length; ++i) v = (v << 8) | old_value[i];
+    v = (v & ~rmw.mask) | (rmw.value & rmw.mask);
+    for (int i = rmw.length - 1; i >= 0; --i, v >>= 8) new_value[i] = v;
+
+    // Write it back
+    if (!i2c_write(spec.address, spec.reg, spec.width, new_value, rmw.length)) error = ERR_I2C_WRITE;
+
+    // If the client wants to be sure the write took, read the register back
+    else if (rmw.flags & RMW_VERIFY)
+    {
+        uint8_t readback[RMW_MAX_WIDTH];
+        if (!i2c_read(spec.address, spec.reg, spec.width, readback, rmw.length, spec.flags))
+            error = ERR_I2C_READ;
+        else
+        {
+            if (memcmp(readback, new_value, rmw.length) != 0) error = ERR_VERIFY;
+            memcpy(new_value, readback, rmw.length);
+        }
+    }
+
+    // Other tasks can now use the bus again
+    m_i2c->unlock();
+    return error;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reply() - Replies with a single integer data value
+//=========================================================================================================
+void CEngine::reply(int error_code, int32_t value, int width)
+{
+    unsigned char bytes[4], *out = bytes;
+
+    // Stuff the value into the "bytes" buffer, MSB first    
+    if (width >= 4) *out++ = (value >> 24);
+    if (width >= 3) *out++ = (value >> 16);
+    if (width >= 2) *out++ = (value >>  8);
+    if (width >= 1) *out++ = (value >>  0);
+
+    // Tell the client that everything worked
+    reply(error_code, bytes, (out - bytes));
+}
+//=========================================================================================================
+
+
+
+
+//=========================================================================================================
+// handle_cmd_client_port() - Sets the UDP port for replying to the client that sent the command
+//=========================================================================================================
+void CEngine::handle_cmd_client_port(const uint8_t* data, int data_length)
+{
+    // Fetch the port number
+    int udp_port = (data[0] << 8) | data[1];
+
+    // Tell the server what port to send this client's responses to.  The server remembers it in
+    // case we reboot.  A client on TCP doesn't have a reply port
+    if (m_source == PKT_SRC_UDP) UDPServer.set_client_port(m_session, udp_port);
+
+    // Tell the client that everything worked
+    reply(ERR_NONE);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_bus_clock() - Reports or sets the I2C bus clock, either the default or for one device
+//=========================================================================================================
+void CEngine::handle_cmd_bus_clock(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "bus_clock" command
+    // 4 Bytes of bus clock in Hz (optional)
+    // 1 Byte of I2C address (optional)
+    //
+    // With no clock, the reply is the current default bus clock
+    // With an I2C address, the clock applies only to that device, 
+    // with a clock of 0 meaning "use the default clock"
+    //---------------------------------------------------------------
+
+    int clock_hz, address;
+
+    // If there is no bus clock in the command, report the current default clock
+    if (!fetch(&data, &data_length, 4, &clock_hz))
+    {
+        reply(ERR_NONE, m_i2c->clock());
+        return;
+    }
+
+    // If there is no I2C address, this is the new default bus clock
+    if (!fetch(&data, &data_length, 1, &address))
+    {
+        reply(m_i2c->set_clock(clock_hz) ? ERR_NONE : ERR_BAD_PARAM);
+        return;
+    }
+
+    // Otherwise, this is the bus clock for one specific device
+    reply(m_i2c->set_device_clock(address, clock_hz) ? ERR_NONE : ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_device_ctx() - Reports or configures a device slot
+//=========================================================================================================
+void CEngine::handle_cmd_device_ctx(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "device_context" command
+    // 1 Byte of slot number
+    // 1 Byte of I2C address (0xFF = free the slot)
+    // 1 Byte of register width
+    // 4 Bytes of bus clock in Hz (0 = default bus clock)
+    // 2 Bytes of timeout in milliseconds (0 = default)
+    // 2 Bytes of clock-stretch limit in microseconds (optional, 0 = default)
+    //
+    // If only the slot number is present, the reply contains the
+    // slot's address, register width, bus clock, timeout and
+    // clock-stretch limit
+    //---------------------------------------------------------------
+
+    int slot, address, reg_width, clock_hz, timeout_ms, stretch_us = 0;
+    uint8_t out[10];
+
+    // Fetch the slot number and make sure it's valid
+    if (!fetch(&data, &data_length, 1, &slot)) {reply(ERR_NOT_ENUF_DATA); return;}
+    if (slot >= MAX_DEVICE_SLOTS) {reply(ERR_BAD_SLOT); return;}
+
+    // Get a handy reference to the slot
+    device_ctx_t& device = m_device[slot];
+
+    // If there's nothing but a slot number, the client is asking what's in the slot
+    if (data_length == 0)
+    {
+        if (!device.in_use) {reply(ERR_BAD_SLOT); return;}
+        out[0] = device.address;
+        out[1] = device.reg_width;
+        out[2] = device.clock_hz >> 24;
+        out[3] = device.clock_hz >> 16;
+        out[4] = device.clock_hz >>  8;
+        out[5] = device.clock_hz;
+        out[6] = device.timeout_ms >> 8;
+        out[7] = device.timeout_ms;
+        out[8] = device.stretch_us >> 8;
+        out[9] = device.stretch_us;
+        reply(ERR_NONE, out, sizeof out);
+        return;
+    }
+
+    // Fetch the I2C address
+    fetch(&data, &data_length, 1, &address);
+
+    // An address of 0xFF means "free this slot"
+    if (address == 0xFF)
+    {
+        if (device.in_use) forget_device(device);
+        device.in_use = false;
+        save_session();
+        reply(ERR_NONE);
+        return;
+    }
+
+    // Fetch the rest of the fields
+    if (!fetch(&data, &data_length, 1, &reg_width ) ||
+        !fetch(&data, &data_length, 4, &clock_hz  ) ||
+        !fetch(&data, &data_length, 2, &timeout_ms))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // The clock-stretch limit is optional
+    if (data_length) fetch(&data, &data_length, 2, &stretch_us);
+
+    // Make sure the address, register width and clock-stretch limit are sensible
+    if (address > 0x7F || reg_width > 4 || stretch_us > I2C_STRETCH_MAX_US) {reply(ERR_BAD_PARAM); return;}
+
+    // If we're checking addresses against the last bus scan, make sure the device is there
+    if (!device_present(address)) {reply(ERR_NO_DEVICE); return;}
+
+    // If the slot previously had a device with its own bus clock or timeouts, that device gets the
+    // defaults back
+    if (device.in_use) forget_device(device);
+
+    // If the device has its own bus clock or timeouts, tell the I2C bus about them
+    if ((clock_hz && !m_i2c->set_device_clock(address, clock_hz)) ||
+        ((timeout_ms || stretch_us) && !m_i2c->set_device_timeout(address, timeout_ms, stretch_us)))
+    {
+        m_i2c->set_device_clock(address, 0);
+        device.in_use = false;
+        save_session();
+        reply(ERR_BAD_PARAM);
+        return;
+    }
+
+    // Fill in the slot
+    device.address    = address;
+    device.reg_width  = reg_width;
+    device.clock_hz   = clock_hz;
+    device.timeout_ms = timeout_ms;
+    device.stretch_us = stretch_us;
+    device.in_use     = true;
+    save_session();
+
+    // Tell the client that everything worked
+    reply(ERR_NONE);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// forget_device() - Gives the device in a slot the default bus clock and timeouts back
+//=========================================================================================================
+void CEngine::forget_device(const device_ctx_t& device)
+{
+    if (device.clock_hz) m_i2c->set_device_clock(device.address, 0);
+    if (device.timeout_ms || device.stretch_us) m_i2c->set_device_timeout(device.address, 0, 0);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// save_session() - Copies the I2C address and device slots to NVRAM, so they survive a soft reboot
+//=========================================================================================================
+void CEngine::save_session()
+{
+    engine_session_t& session = NVRAM.engine[m_bus];
+
+    session.i2c_address = m_i2c_address;
+    memcpy(session.device, m_device, sizeof m_device);
+    NVRAM.seal(&session, sizeof session);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// restore_session() - After a soft reboot, picks up the I2C address and device slots that the client
+//                     set up before it
+//=========================================================================================================
+void CEngine::restore_session()
+{
+    const engine_session_t& session = NVRAM.engine[m_bus];
+
+    // If there's no intact session in NVRAM, or we have no bus to talk to the devices on, we start fresh
+    if (!NVRAM.is_sealed(&session, sizeof session) || !m_i2c->is_installed()) return;
+
+    // Carry on talking to the same devices
+    m_i2c_address = session.i2c_address;
+    memcpy(m_device, session.device, sizeof m_device);
+
+    // The bus forgot the clocks and timeouts of the devices when we rebooted, so tell it again
+    for (int slot = 0; slot < MAX_DEVICE_SLOTS; ++slot)
+    {
+        device_ctx_t& device = m_device[slot];
+        if (!device.in_use) continue;
+        if (device.clock_hz) m_i2c->set_device_clock(device.address, device.clock_hz);
+        if (device.timeout_ms || device.stretch_us)
+            m_i2c->set_device_timeout(device.address, device.timeout_ms, device.stretch_us);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_stream_start() - Starts a job that periodically samples a list of registers and streams
+//                             the samples to the client
+//=========================================================================================================
+void CEngine::handle_cmd_stream_start(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "stream_start" command
+    // 1 Byte of job number
+    // 1 Byte of target (I2C address, or TARGET_SLOT + slot number)
+    // 1 Byte of register width (0 = the device slot's register width)
+    // 4 Bytes of sampling period in microseconds
+    // 1 Byte of samples per packet
+    // 1 Byte of register count
+    // For each register:
+    //    n Bytes of register number
+    //    1 Byte of length
+    //---------------------------------------------------------------
+
+    int job, target, period_us;
+    stream_cfg_t cfg;
+
+    // Fetch the fixed-size fields
+    if (!fetch(&data, &data_length, 1, &job                   ) ||
+        !fetch(&data, &data_length, 1, &target                ) ||
+        !fetch(&data, &data_length, 1, &cfg.reg_width         ) ||
+        !fetch(&data, &data_length, 4, &period_us             ) ||
+        !fetch(&data, &data_length, 1, &cfg.samples_per_packet) ||
+        !fetch(&data, &data_length, 1, &cfg.reg_count         ))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // Find out which device we're sampling
+    if (!resolve_target(target, &cfg.address, &cfg.reg_width)) {reply(ERR_BAD_SLOT); return;}
+
+    // Make sure the register width and register count are sensible
+    if (cfg.reg_width > 4 || cfg.reg_count > MAX_STREAM_REGS) {reply(ERR_BAD_PARAM); return;}
+
+    // Fetch the register list
+    for (int i = 0; i < cfg.reg_count; ++i)
+    {
+        if (!fetch(&data, &data_length, cfg.reg_width, &cfg.regs[i].reg   ) ||
+            !fetch(&data, &data_length, 1,             &cfg.regs[i].length))
+        {
+            reply(ERR_NOT_ENUF_DATA);
+            return;
+        }
+    }
+
+    // Start the job.  Its samples go to the client that asked for them, or if that client is on TCP,
+    // to whichever UDP client we heard from last
+    cfg.period_us = period_us;
+    cfg.bus       = m_bus;
+    cfg.session   = (m_source == PKT_SRC_UDP) ? m_session : LATEST_SESSION;
+    reply(Streamer.start(job, cfg) ? ERR_NONE : ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_stream_stop() - Stops a stream job
+//=========================================================================================================
+void CEngine::handle_cmd_stream_stop(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "stream_stop" command
+    // 1 Byte of job number (0xFF = stop every job)
+    //---------------------------------------------------------------
+
+    int job;
+
+    // Fetch the job number
+    if (!fetch(&data, &data_length, 1, &job)) {reply(ERR_NOT_ENUF_DATA); return;}
+
+    // Stop the job (or all of them)
+    if (job == 0xFF)
+        Streamer.stop_all();
+    else
+        Streamer.stop(job);
+
+    // Tell the client that everything worked
+    reply(ERR_NONE);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_stream_query() - Reports the status of a stream job
+//=========================================================================================================
+void CEngine::handle_cmd_stream_query(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "stream_query" command
+    // 1 Byte of job number
+    //
+    // The reply contains:
+    // 1 Byte  of "is running" flag
+    // 4 Bytes of sampling period in microseconds
+    // 4 Bytes of sequence number of the next packet
+    // 4 Bytes of samples taken
+    // 4 Bytes of samples skipped because the previous one wasn't done
+    // 4 Bytes of samples where an I2C read failed
+    //---------------------------------------------------------------
+
+    int job;
+    stream_status_t status;
+    uint8_t out[21], *p = out;
+
+    // Fetch the job number
+    if (!fetch(&data, &data_length, 1, &job)) {reply(ERR_NOT_ENUF_DATA); return;}
+    if (job >= MAX_STREAM_JOBS) {reply(ERR_BAD_PARAM); return;}
+
+    // Fetch the status of the job
+    Streamer.get_status(job, &status);
+
+    // Build the reply
+    *p++ = status.running;
+    const uint32_t fields[] = {status.period_us, status.seq, status.samples, status.overruns, status.errors};
+    for (uint32_t value : fields)
+    {
+        *p++ = value >> 24;
+        *p++ = value >> 16;
+        *p++ = value >>  8;
+        *p++ = value;
+    }
+
+    // And send it
+    reply(ERR_NONE, out, sizeof out);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// check_trigger_ops() - Makes sure that an op list is fit to run from a trigger
+//
+// A trigger runs its op list from its own task while it holds the bus at BUS_CLASS_REALTIME, so the list
+// can't wait (OP_DELAY_US and OP_POLL_UNTIL can each take seconds, and would starve every other client),
+// and can't touch the virtual device at address 0 (its register pointer belongs to the engine task)
+//
+// Passed: address    = The I2C address the op list starts with
+//         ops        = The op list, in CMD_BATCH format
+//         ops_length = The length of the op list
+//
+// Returns: ERR_BAD_OP for an op a trigger can't run, ERR_BAD_PARAM for the virtual device, or the error
+//          from parsing the op list
+//=========================================================================================================
+int CEngine::check_trigger_ops(int address, const uint8_t* ops, int ops_length)
+{
+    reg_spec_t spec;
+    rmw_spec_t rmw;
+    int op, length, target, error;
+
+    // The device the op list starts with
+    if (address == 0) return ERR_BAD_PARAM;
+
+    // Walk the op list without performing it
+    while (ops_length > 0)
+    {
+        fetch(&ops, &ops_length, 1, &op);
+        switch (op)
+        {
+            case OP_WRITE:
+            case OP_WRITE_READ:
+                if ((error = parse_reg_spec(&ops, &ops_length, &spec)) != ERR_NONE) return error;
+                if ((spec.flags & RWF_TARGET) && spec.address == 0) return ERR_BAD_PARAM;
+                if (!fetch(&ops, &ops_length, 2, &length)) return ERR_NOT_ENUF_DATA;
+                if (op == OP_WRITE)
+                {
+                    if (ops_length < length) return ERR_NOT_ENUF_DATA;
+                    ops        += length;
+                    ops_length -= length;
+                }
+                break;
+
+            case OP_READ:
+                if (!fetch(&ops, &ops_length, 2, &length)) return ERR_NOT_ENUF_DATA;
+                break;
+
+            case OP_SET_ADDR:
+                if (!fetch(&ops, &ops_length, 1, &target)) return ERR_NOT_ENUF_DATA;
+                if (!resolve_target(target, &address)) return ERR_BAD_SLOT;
+                if (address == 0) return ERR_BAD_PARAM;
+                break;
+
+            case OP_RMW:
+                if ((error = parse_rmw_spec(&ops, &ops_length, &rmw)) != ERR_NONE) return error;
+                if ((rmw.spec.flags & RWF_TARGET) && rmw.spec.address == 0) return ERR_BAD_PARAM;
+                break;
+
+            default:
+                return ERR_BAD_OP;
+        }
+    }
+
+    // If we get here, a trigger can run this op list
+    return ERR_NONE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_trigger() - Configures or disables a trigger input
+//=========================================================================================================
+void CEngine::handle_cmd_trigger(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "trigger" command
+    // 1 Byte  of trigger number
+    // 1 Byte  of GPIO pin number (0xFF = disable the trigger)
+    // 1 Byte  of edge (0 = rising, 1 = falling, 2 = either)
+    // 1 Byte  of stream job number the captured data goes to
+    // 1 Byte  of target (I2C address, or TARGET_SLOT + slot number)
+    // 1 Byte  of samples per packet
+    // 2 Bytes of capture length (the number of bytes the op list reads)
+    // n Bytes of op list, in the same format as CMD_BATCH, with no
+    //         OP_DELAY_US or OP_POLL_UNTIL, and never address 0
+    //         (see check_trigger_ops)
+    //---------------------------------------------------------------
+
+    int trigger, pin, target;
+    trigger_cfg_t cfg;
+
+    // Fetch the trigger number and pin number
+    if (!fetch(&data, &data_length, 1, &trigger) || !fetch(&data, &data_length, 1, &pin))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // Make sure the trigger number is valid
+    if (trigger >= MAX_TRIGGERS) {reply(ERR_BAD_PARAM); return;}
+
+    // A pin number of 0xFF means "disable this trigger"
+    if (pin == 0xFF)
+    {
+        Trigger[trigger].disable();
+        reply(ERR_NONE);
+        return;
+    }
+
+    // Fetch the rest of the fixed-size fields
+    if (!fetch(&data, &data_length, 1, &cfg.edge              ) ||
+        !fetch(&data, &data_length, 1, &cfg.job               ) ||
+        !fetch(&data, &data_length, 1, &target                ) ||
+        !fetch(&data, &data_length, 1, &cfg.samples_per_packet) ||
+        !fetch(&data, &data_length, 2, &cfg.capture_length    ))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // Find out which device the op list starts out talking to
+    if (!resolve_target(target, &cfg.address)) {reply(ERR_BAD_SLOT); return;}
+
+    // The rest of the message is the op list, and it has to be one a trigger can run
+    if (data_length > MAX_TRIGGER_OPS) {reply(ERR_TOO_LONG); return;}
+    int error = check_trigger_ops(cfg.address, data, data_length);
+    if (error) {reply(error); return;}
+    memcpy(cfg.ops, data, data_length);
+    cfg.ops_length = data_length;
+    cfg.pin = pin;
+    cfg.bus = m_bus;
+    cfg.session = (m_source == PKT_SRC_UDP) ? m_session : LATEST_SESSION;
+
+    // Configure the trigger
+    reply(Trigger[trigger].configure(cfg) ? ERR_NONE : ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_cache() - Configures, invalidates, or reports on the register cache
+//=========================================================================================================
+void CEngine::handle_cmd_cache(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "cache" command
+    // 1 Byte of sub-command, followed by:
+    //
+    // CACHE_SET_RANGE  : 1 byte range index, 1 byte target, 4 bytes first register,
+    //                    4 bytes last register, 1 byte policy, 4 bytes TTL in milliseconds
+    // CACHE_INVALIDATE : 1 byte target (0xFF = every device)
+    // CACHE_QUERY      : nothing.  The reply is 4 bytes each of hits, misses, and
+    //                    invalidations, and 1 byte of entries in use
+    //---------------------------------------------------------------
+
+    enum {CACHE_SET_RANGE = 0, CACHE_INVALIDATE = 1, CACHE_QUERY = 2};
+
+    int subcmd, index, target, address, first_reg, last_reg, policy, ttl_ms;
+    uint8_t out[13], *p = out;
+
+    // Fetch the sub-command
+    if (!fetch(&data, &data_length, 1, &subcmd)) {reply(ERR_NOT_ENUF_DATA); return;}
+
+    switch (subcmd)
+    {
+        case CACHE_SET_RANGE:
+            if (!fetch(&data, &data_length, 1, &index    ) ||
+                !fetch(&data, &data_length, 1, &target   ) ||
+                !fetch(&data, &data_length, 4, &first_reg) ||
+                !fetch(&data, &data_length, 4, &last_reg ) ||
+                !fetch(&data, &data_length, 1, &policy   ) ||
+                !fetch(&data, &data_length, 4, &ttl_ms   ))
+            {
+                reply(ERR_NOT_ENUF_DATA);
+                return;
+            }
+            if (!resolve_target(target, &address)) {reply(ERR_BAD_SLOT); return;}
+            reply(RegCache.set_range(index, cache_key(address), first_reg, last_reg, policy, ttl_ms) ? ERR_NONE : ERR_BAD_PARAM);
+            return;
+
+        case CACHE_INVALIDATE:
+            if (!fetch(&data, &data_length, 1, &target)) {reply(ERR_NOT_ENUF_DATA); return;}
+            if (target == 0xFF)
+                address = -1;
+            else if (!resolve_target(target, &address))
+            {
+                reply(ERR_BAD_SLOT);
+                return;
+            }
+            RegCache.invalidate(address < 0 ? address : cache_key(address));
+            reply(ERR_NONE);
+            return;
+
+        case CACHE_QUERY:
+        {
+            reg_cache_stats_t stats = RegCache.stats();
+            const uint32_t fields[] = {stats.hits, stats.misses, stats.invalidations};
+            for (uint32_t value : fields)
+            {
+                *p++ = value >> 24;
+                *p++ = value >> 16;
+                *p++ = value >>  8;
+                *p++ = value;
+            }
+            *p++ = RegCache.entries_in_use();
+            reply(ERR_NONE, out, sizeof out);
+            return;
+        }
+    }
+
+    // If we get here, we don't know this sub-command
+    reply(ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_coalesce() - Turns reply coalescing on or off
+//=========================================================================================================
+void CEngine::handle_cmd_coalesce(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "coalesce" command
+    // 1 Byte  of enable flag (0 = one reply per datagram)
+    // 2 Bytes of maximum coalesced datagram size
+    // 4 Bytes of maximum time a reply may be held, in microseconds
+    //         (0 = send as soon as there are no more packets waiting)
+    //
+    // The reply to this command is always sent on its own, and
+    // coalescing (if enabled) begins with the next reply
+    //---------------------------------------------------------------
+    
+    int enable, max_bytes = 0, max_delay_us = 0;
+
+    // Fetch the enable flag
+    if (!fetch(&data, &data_length, 1, &enable)) {reply(ERR_NOT_ENUF_DATA); return;}
+
+    // If we're turning coalescing on, fetch the size and time limits
+    if (enable)
+    {
+        if (!fetch(&data, &data_length, 2, &max_bytes) || !fetch(&data, &data_length, 4, &max_delay_us))
+        {
+            reply(ERR_NOT_ENUF_DATA);
+            return;
+        }
+    }
+
+    // Send out any replies we're holding, and turn coalescing off so that this reply goes out on its own
+    set_coalescing(client(), false);
+    reply(ERR_NONE);
+
+    // And now switch to the mode the client asked for
+    if (enable) set_coalescing(client(), true, max_bytes, max_delay_us);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_get_stats() - Reports or resets the performance counters
+//=========================================================================================================
+void CEngine::handle_cmd_get_stats(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "get_stats" command
+    // 1 Byte of sub-command, followed by:
+    //
+    // STATS_SUMMARY : nothing.  The reply is 4 bytes each of duplicate
+    //                 transaction IDs, packets dropped for lack of a
+    //                 buffer, packets dropped because the event queue
+    //                 was full, event queue high-water mark, a bitmap
+    //                 of the commands that have been handled, bus
+    //                 timeouts and bus recoveries, then 1 byte of the
+    //                 performance profile that's in effect
+    // STATS_COMMAND : 1 byte command number.  The reply is 4 bytes of
+    //                 count, 4 bytes of errors, 8 bytes of bus time in
+    //                 microseconds, 4 bytes each of bytes in and bytes
+    //                 out, 1 byte of histogram bucket count, then 4
+    //                 bytes for each latency histogram bucket
+    // STATS_RESET   : nothing.  Resets these counters and the packet
+    //                 pool counters
+    // STATS_SYSTEM  : nothing.  The reply is 4 bytes each of free heap,
+    //                 minimum-ever free heap and largest free block,
+    //                 1 byte of engine count, then 2 bytes of queue
+    //                 depth for each engine, 2 bytes
+    //                 of flash queue depth, 1 byte that is non-zero if
+    //                 CPU load is available, 1 byte of task count, then
+    //                 for each task: 16 bytes of nul-padded name, 1 byte
+    //                 of core (0xFF = either), 1 byte of priority, 4
+    //                 bytes of stack high-water mark (bytes free) and 2
+    //                 bytes of CPU load in tenths of a percent of a core
+    //---------------------------------------------------------------
+
+    enum {STATS_SUMMARY = 0, STATS_COMMAND = 1, STATS_RESET = 2, STATS_SYSTEM = 3};
+
+    int subcmd, command;
+    uint8_t out[25 + 4 * LATENCY_BUCKETS], *p = out;
+
+    // Fetch the sub-command
+    if (!fetch(&data, &data_length, 1, &subcmd)) {reply(ERR_NOT_ENUF_DATA); return;}
+
+    switch (subcmd)
+    {
+        case STATS_SUMMARY:
+        {
+            const engine_stats_t&      stats = m_stats->engine();
+            const packet_pool_stats_t& pool  = PacketPool.stats();
+
+            // Build a bitmap of the commands that have been handled
+            uint32_t bitmap = 0;
+            for (int i=0; i<STATS_MAX_COMMANDS; ++i) if (m_stats->command(i)->count) bitmap |= (1 << i);
+
+            store(&p, stats.duplicates,       4);
+            store(&p, pool.rx_drops,          4);
+            store(&p, pool.queue_drops,       4);
+            store(&p, stats.queue_high_water, 4);
+            store(&p, bitmap,                 4);
+            store(&p, m_i2c->timeouts(),      4);
+            store(&p, m_i2c->recoveries(),    4);
+            store(&p, PerfProfile.current(),  1);
+            reply(ERR_NONE, out, p - out);
+            return;
+        }
+
+        case STATS_COMMAND:
+        {
+            if (!fetch(&data, &data_length, 1, &command)) {reply(ERR_NOT_ENUF_DATA); return;}
+            const cmd_stats_t* p_stats = m_stats->command(command);
+            if (p_stats == nullptr) {reply(ERR_BAD_PARAM); return;}
+
+            store(&p, p_stats->count,     4);
+            store(&p, p_stats->errors,    4);
+            store(&p, p_stats->bus_us,    8);
+            store(&p, p_stats->bytes_in,  4);
+            store(&p, p_stats->bytes_out, 4);
+            store(&p, LATENCY_BUCKETS,    1);
+            for (int i=0; i<LATENCY_BUCKETS; ++i) store(&p, p_stats->latency[i], 4);
+            reply(ERR_NONE, out, p - out);
+            return;
+        }
+
+        case STATS_RESET:
+            m_stats->reset();
+            PacketPool.reset_stats();
+            m_i2c->scheduler().reset_stats();
+            reply(ERR_NONE);
+            return;
+
+        case STATS_SYSTEM:
+        {
+            heap_telemetry_t heap;
+            task_telemetry_t* task = m_task_telemetry;
+
+            // Fetch the state of the heap and the latest snapshot of the tasks
+            CTelemetry::heap(&heap);
+            int task_count = Telemetry.tasks(task, TELEMETRY_MAX_TASKS);
+
+            // This reply is too big for 'out', so it gets built in our read buffer
+            p = m_read_buffer;
+            store(&p, heap.free,                   4);
+            store(&p, heap.min_free,               4);
+            store(&p, heap.largest_block,          4);
+            store(&p, I2C_BUS_COUNT,               1);
+            for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) store(&p, Engine[bus].queue_depth(), 2);
+            store(&p, FlashIO.queue_depth(),       2);
+            store(&p, CTelemetry::has_cpu_load(),  1);
+            store(&p, task_count,                  1);
+
+            for (int i = 0; i < task_count; ++i)
+            {
+                size_t n = strnlen(task[i].name, TELEMETRY_NAME_LENGTH);
+                memcpy(p, task[i].name, n);
+                memset(p + n, 0, TELEMETRY_NAME_LENGTH - n);
+                p += TELEMETRY_NAME_LENGTH;
+                store(&p, task[i].core,            1);
+                store(&p, task[i].priority,        1);
+                store(&p, task[i].stack_free,      4);
+                store(&p, task[i].cpu_permille,    2);
+            }
+
+            reply(ERR_NONE, m_read_buffer, p - m_read_buffer);
+            return;
+        }
+    }
+
+    // If we get here, we don't know this sub-command
+    reply(ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_echo() - Sends the data in the message straight back to the client without touching the
+//                     I2C bus.  This lets a client measure what the network and the engine cost by
+//                     themselves
+//=========================================================================================================
+void CEngine::handle_cmd_echo(const uint8_t* data, int data_length)
+{
+    reply(ERR_NONE, data, data_length);
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_chunked() - Reads a block of data that is too big for a single reply, and sends it to the
+//                        client as a series of fragments
+//
+// Each fragment is read from the device straight into the datagram it's sent in, so a read of any
+// length only needs a few fragments' worth of RAM.  Since nothing is kept once the fragments have been
+// sent, a fragment that goes missing is re-read from the device when the client asks for it again.
+// Don't use this on registers where reading has side effects (a FIFO, for instance)
+//=========================================================================================================
+void CEngine::handle_cmd_chunked(const uint8_t* data, int data_length)
+{
+    int         sub_command, total_length, chunk_size, seq;
+    reg_spec_t  spec;
+
+    //---------------------------------------------------------------
+    // Format of a "chunked" command
+    // 1 Byte of sub-command: CHUNK_READ or CHUNK_RESEND
+    // 1 Byte that defines how many bytes wide a register number is
+    // 1 Byte of target (only if RWF_TARGET is set in the width byte)
+    // n Bytes of a register number
+    // 4 Bytes of total length to read
+    // 2 Bytes of chunk size (0 = the largest that fits in a datagram)
+    // For CHUNK_RESEND:
+    //    Any number of 2-byte sequence numbers of the fragments to send again
+    //
+    // The reply contains:
+    // 2 Bytes of the number of fragments in the whole read
+    // 2 Bytes of the chunk size
+    //
+    // The data address of fragment 'n' is (register + n * chunk_size)
+    //---------------------------------------------------------------
+
+    enum {CHUNK_READ = 0, CHUNK_RESEND = 1};
+
+    // Fetch the sub-command
+    if (!fetch(&data, &data_length, 1, &sub_command))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // Fetch the target device, register width, and register number we're reading from
+    int error = parse_reg_spec(&data, &data_length, &spec);
+    if (error)
+    {
+        reply(error);
+        return;
+    }
+
+    // Fetch the length of the read and the size of each chunk
+    if (!fetch(&data, &data_length, 4, &total_length) || !fetch(&data, &data_length, 2, &chunk_size))
+    {
+        reply(ERR_NOT_ENUF_DATA, spec.reg);
+        return;
+    }
+
+    // A chunk size of 0 means "as big as will fit", and no chunk can be bigger than that
+    if (chunk_size == 0 || chunk_size > CHUNK_MAX_DATA) chunk_size = CHUNK_MAX_DATA;
+
+    // Sequence numbers are 16 bits, which limits how long a read can be.  This is checked before we
+    // divide, so that a huge length can't overflow the arithmetic
+    if (total_length < 1 || total_length > 0xFFFF * chunk_size)
+    {
+        reply(ERR_TOO_LONG, spec.reg);
+        return;
+    }
+
+    // Figure out how many fragments the read needs
+    int chunk_count = (total_length + chunk_size - 1) / chunk_size;
+
+    // This is what the reply to the request says, once the fragments are on their way
+    uint8_t  summary[4];
+    uint8_t* out = summary;
+    store(&out, chunk_count, 2);
+    store(&out, chunk_size,  2);
+
+    // If this is a new read, send every fragment
+    if (sub_command == CHUNK_READ)
+    {
+        for (seq = 0; seq < chunk_count; ++seq)
+        {
+            if (!send_chunk(spec, seq, chunk_size, total_length))
+            {
+                reply(ERR_I2C_READ, seq);
+                return;
+            }
+        }
+        reply(ERR_NONE, summary, sizeof summary);
+        return;
+    }
+
+    // If the client is missing some fragments, send them again
+    if (sub_command == CHUNK_RESEND)
+    {
+        while (fetch(&data, &data_length, 2, &seq))
+        {
+            if (seq >= chunk_count)
+            {
+                reply(ERR_BAD_PARAM, seq);
+                return;
+            }
+            if (!send_chunk(spec, seq, chunk_size, total_length))
+            {
+                reply(ERR_I2C_READ, seq);
+                return;
+            }
+        }
+        reply(ERR_NONE, summary, sizeof summary);
+        return;
+    }
+
+    // If we get here, we don't know this sub-command
+    reply(ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// send_chunk() - Reads one chunk of a chunked read and sends it to the client as a fragment
+//
+// Passed: spec         = The device and register that the chunked read starts at
+//         seq          = The sequence number of the fragment
+//         chunk_size   = The number of bytes in every fragment but the last one
+//         total_length = The number of bytes in the whole read
+//
+// Returns: 'true' if the chunk was read from the device
+//=========================================================================================================
+bool CEngine::send_chunk(const reg_spec_t& spec, int seq, int chunk_size, int total_length)
+{
+    // Figure out where in the read this fragment is, and how long it is
+    int offset = seq * chunk_size;
+    int length = total_length - offset;
+    if (length > chunk_size) length = chunk_size;
+
+    // Use the next fragment buffer, once the reply sender is done with what's in it
+    int index = m_next_chunk_buffer;
+    m_next_chunk_buffer = (m_next_chunk_buffer + 1) % CHUNK_BUFFER_COUNT;
+    wait_for_sender(m_chunk_pending[index]);
+    uint8_t* buffer = m_chunk_buffer[index];
+
+    // Read the data straight into the fragment.  This is bulk work, so it's read in slices, and each
+    // slice waits for the bus behind anything more urgent
+    for (int done = 0; done < length; done += BUS_BULK_SLICE)
+    {
+        int slice = (length - done < BUS_BULK_SLICE) ? length - done : BUS_BULK_SLICE;
+        m_i2c->lock(BUS_CLASS_BULK);
+        bool status = i2c_read(spec.address, spec.reg + offset + done, spec.width, buffer + CHUNK_HDR_SIZE + done, slice, spec.flags);
+        m_i2c->unlock();
+        if (!status) return false;
+    }
+
+    // Fill in the fragment header
+    uint8_t* out = buffer;
+    store(&out, CHUNK_TRANS_ID, 4);
+    *out++ = m_command;
+    *out++ = ERR_NONE;
+    store(&out, m_most_recent_trans_id, 4);
+    store(&out, seq, 2);
+    store(&out, offset, 4);
+
+    // And send it.  Fragments are already as big as a datagram, so they're never coalesced
+    queue_reply(buffer, CHUNK_HDR_SIZE + length, m_source, m_session, &m_chunk_pending[index]);
+    return true;
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// handle_cmd_scan() - Scans the bus for devices, reports the last scan, or configures scanning
+//=========================================================================================================
+void CEngine::handle_cmd_scan(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "scan" command
+    // 1 Byte of sub-command:
+    //
+    // SCAN_NOW       : (nothing else)
+    // SCAN_CACHED    : (nothing else)
+    // SCAN_CONFIGURE : 4 bytes of re-scan period in ms (0 = never),
+    //                  1 byte of "validate" flag
+    //
+    // The reply to SCAN_NOW and SCAN_CACHED contains:
+    // 16 Bytes of bitmap.  Bit (address & 7) of byte (address >> 3)
+    //          is set if a device answered at that address
+    //  4 Bytes of how many milliseconds ago the scan was done
+    //
+    // When the "validate" flag is on, OP_SET_ADDR in a batch and
+    // CMD_DEVICE_CTX fail with ERR_NO_DEVICE if the last scan
+    // didn't find a device at the address
+    //---------------------------------------------------------------
+
+    enum {SCAN_NOW = 0, SCAN_CACHED = 1, SCAN_CONFIGURE = 2};
+
+    int sub_command, period_ms, validate;
+    uint8_t out[sizeof m_scan_bitmap + 4];
+
+    // Fetch the sub-command
+    if (!fetch(&data, &data_length, 1, &sub_command))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // If the client wants to change how we scan, make it so
+    if (sub_command == SCAN_CONFIGURE)
+    {
+        if (!fetch(&data, &data_length, 4, &period_ms) || !fetch(&data, &data_length, 1, &validate))
+        {
+            reply(ERR_NOT_ENUF_DATA);
+            return;
+        }
+
+        // Start (or stop) re-scanning the bus periodically
+        esp_timer_stop(m_scan_timer);
+        if (period_ms) esp_timer_start_periodic(m_scan_timer, (uint64_t)period_ms * 1000);
+
+        // If we're going to be checking addresses, we need a scan to check them against
+        m_scan_validate = (validate != 0);
+        if (m_scan_validate && !m_scan_valid) scan_bus();
+        reply(ERR_NONE);
+        return;
+    }
+
+    // If the client wants a new scan (or wants the last scan and there never was one), do one now
+    if (sub_command == SCAN_NOW || (sub_command == SCAN_CACHED && !m_scan_valid)) scan_bus();
+
+    // If we don't know this sub-command, complain
+    else if (sub_command != SCAN_CACHED)
+    {
+        reply(ERR_BAD_PARAM);
+        return;
+    }
+
+    // Report the bitmap and how old it is
+    uint8_t* p = out;
+    memcpy(p, m_scan_bitmap, sizeof m_scan_bitmap);
+    p += sizeof m_scan_bitmap;
+    store(&p, (esp_timer_get_time() - m_scan_time) / 1000, 4);
+    reply(ERR_NONE, out, sizeof out);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// handle_cmd_macro() - Defines, runs, deletes, or reports on a stored macro
+//=========================================================================================================
+void CEngine::handle_cmd_macro(const uint8_t* data, int data_length)
+{
+    //---------------------------------------------------------------
+    // Format of a "macro" command
+    // 1 Byte of sub-command, 1 byte of macro number, followed by:
+    //
+    // MACRO_DEFINE : 1 byte of flags (bit 0 = persist in flash),
+    //                1 byte of parameter count, and for each parameter
+    //                2 bytes of offset into the op list and 1 byte of
+    //                width, then the op list, in CMD_BATCH format
+    // MACRO_RUN    : the value of each parameter, in order, each as
+    //                wide as the parameter.  The reply is exactly the
+    //                reply to a CMD_BATCH of the op list
+    // MACRO_DELETE : (nothing else)
+    // MACRO_QUERY  : (nothing else).  The reply is 2 bytes of op list
+    //                length, 1 byte of flags, 1 byte of parameter count,
+    //                3 bytes for each parameter, then the op list
+    //---------------------------------------------------------------
+
+    enum {MACRO_DEFINE = 0, MACRO_RUN = 1, MACRO_DELETE = 2, MACRO_QUERY = 3};
+
+    int sub_command, index, flags, param_count, offset, width, ops_length;
+    macro_param_t param[MAX_MACRO_PARAMS];
+
+    // Fetch the sub-command and the macro number
+    if (!fetch(&data, &data_length, 1, &sub_command) || !fetch(&data, &data_length, 1, &index))
+    {
+        reply(ERR_NOT_ENUF_DATA);
+        return;
+    }
+
+    // Make sure the macro number is valid
+    if (index >= MAX_MACROS) {reply(ERR_BAD_PARAM); return;}
+
+    switch (sub_command)
+    {
+        case MACRO_RUN:
+
+            // Fill in the parameters and run the op list, just as if it had arrived in a CMD_BATCH
+            switch (Macros.expand(index, data, data_length, m_macro.ops, &ops_length))
+            {
+                case MACRO_OK:
+                    handle_cmd_batch(m_macro.ops, ops_length);
+                    break;
+                case MACRO_UNDEFINED:
+                    reply(ERR_NO_MACRO);
+                    break;
+                default:
+                    reply(ERR_BAD_PARAM);
+            }
+            return;
+
+        case MACRO_DEFINE:
+
+            // Fetch the flags and the parameter count
+            if (!fetch(&data, &data_length, 1, &flags) || !fetch(&data, &data_length, 1, &param_count))
+            {
+                reply(ERR_NOT_ENUF_DATA);
+                return;
+            }
+            if (param_count > MAX_MACRO_PARAMS) {reply(ERR_BAD_PARAM); return;}
+
+            // Fetch where each parameter goes
+            for (int i = 0; i < param_count; ++i)
+            {
+                if (!fetch(&data, &data_length, 2, &offset) || !fetch(&data, &data_length, 1, &width))
+                {
+                    reply(ERR_NOT_ENUF_DATA);
+                    return;
+                }
+                param[i].offset   = offset;
+                param[i].width    = width;
+                param[i].reserved = 0;
+            }
+
+            // The rest of the message is the op list
+            if (data_length > MAX_MACRO_OPS) {reply(ERR_TOO_LONG); return;}
+            reply(Macros.define(index, param, param_count, data, data_length, flags) ? ERR_NONE : ERR_BAD_PARAM);
+            return;
+
+        case MACRO_DELETE:
+            reply(Macros.remove(index) ? ERR_NONE : ERR_NO_MACRO);
+            return;
+
+        case MACRO_QUERY:
+        {
+            if (!Macros.fetch(index, &m_macro)) {reply(ERR_NO_MACRO); return;}
+
+            // Describe the macro, and follow that with the op list
+            uint8_t* p = m_read_buffer;
+            store(&p, m_macro.ops_length,  2);
+            store(&p, m_macro.flags,       1);
+            store(&p, m_macro.param_count, 1);
+            for (int i = 0; i < m_macro.param_count; ++i)
+            {
+                store(&p, m_macro.param[i].offset, 2);
+                store(&p, m_macro.param[i].width,  1);
+            }
+            memcpy(p, m_macro.ops, m_macro.ops_length);
+            p += m_macro.ops_length;
+            reply(ERR_NONE, m_read_buffer, p - m_read_buffer);
+            return;
+        }
+    }
+
+    // If we get here, we don't know this sub-command
+    reply(ERR_BAD_PARAM);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// scan_bus() - Probes every address on the bus and records which ones answered in m_scan_bitmap
+//=========================================================================================================
+void CEngine::scan_bus()
+{
+    uint8_t bitmap[sizeof m_scan_bitmap];
+    memset(bitmap, 0, sizeof bitmap);
+
+    // Probe each address.  A probe is nothing but the address byte, so it's over quickly.  A scan 
+    // can afford to wait, so each probe lets anything more urgent have the bus first
+    for (int address = SCAN_FIRST_ADDR; address <= SCAN_LAST_ADDR; ++address)
+    {
+        int64_t start_time = esp_timer_get_time();
+        m_i2c->lock(BUS_CLASS_BULK);
+        bool found = m_i2c->probe(address);
+        m_i2c->unlock();
+        note_bus_time(start_time);
+        if (found) bitmap[address >> 3] |= (1 << (address & 7));
+    }
+
+    // And save the results
+    memcpy(m_scan_bitmap, bitmap, sizeof bitmap);
+    m_scan_time  = esp_timer_get_time();
+    m_scan_valid = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// device_present() - Checks an address against the last bus scan
+//
+// Returns: 'false' if we're checking addresses and the last scan found no device there
+//=========================================================================================================
+bool CEngine::device_present(int address)
+{
+    // If we're not checking, or have nothing to check against, assume the device is there
+    if (!m_scan_validate || !m_scan_valid) return true;
+
+    // Our virtual device is always there
+    if (address == 0) return true;
+
+    // Otherwise, ask the bitmap
+    return (m_scan_bitmap[(address >> 3) & 0x0F] & (1 << (address & 7))) != 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_scan_timer() - Called by esp_timer when it's time to re-scan the bus
+//=========================================================================================================
+void CEngine::on_scan_timer(void* p_engine)
+{
+    CEngine& engine = *(CEngine*)p_engine;
+
+    // Tell the engine task to re-scan the bus
+    engine.m_scan_due = true;
+    xTaskNotifyGive(engine.m_task_handle);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// i2c_addr() - Declares the I2C address of the device we want to talk to
+//=========================================================================================================
+void CEngine::handle_cmd_i2c_addr(const uint8_t* data, int data_length)
+{
+    // Set our internal I2C address
+    m_i2c_address = *data;
+    save_session();
+
+    // Tell the client that everything worked
+    reply(ERR_NONE);
+}
+//=========================================================================================================
+
+
+
+
+
+//=========================================================================================================
+// i2c_read() - Reads data from a device register via I2C
+//
+// Passed: address = The I2C address of the device
+//         reg     = The register number
+//         width   = Width, in bytes, of the register number
+//         data    = Pointer to where the data we read should be stored
+//         length  = How many bytes of the data to read
+//         flags   = RWF_SPLIT_READ to write the register number and read the data as two separate
+//                   transactions, RWF_NO_CACHE to bypass the register cache
+//=========================================================================================================
+bool CEngine::i2c_read(int address, int reg, int width, uint8_t* data, int length, int flags)
+{
+    // If we're reading from our virtual device, the register number is where the read starts
+    if (address == 0)
+    {
+        m_virtual_reg_ptr = reg;
+        return i2c_read_raw(address, data, length);
+    }
+
+    // Find out if the client wants us to use the register cache
+    bool use_cache = (flags & RWF_NO_CACHE) == 0;
+
+    // If the register cache can answer this read, we don't have to touch the bus
+    if (use_cache && RegCache.lookup(cache_key(address), reg, length, data)) return true;
+
+    // Read the register from the device
+    if (!bus_read(address, reg, width, data, length, (flags & RWF_SPLIT_READ) != 0)) return false;
+
+    // If this register is in a cached range, the cache gets a copy
+    if (use_cache) RegCache.store(cache_key(address), reg, length, data);
+    
+    // Tell the caller all is well
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// bus_read() - Reads data from a device register via I2C, without consulting the register cache
+//
+// Passed: address = The I2C address of the device
+//         reg     = The register number
+//         width   = Width, in bytes, of the register number
+//         data    = Pointer to where the data we read should be stored
+//         length  = How many bytes of the data to read
+//         split   = true to write the register number and read the data as two separate transactions
+//=========================================================================================================
+bool CEngine::bus_read(int address, int reg, int width, uint8_t* data, int length, bool split)
+{
+    bool status;
+
+    // Keep track of how long we spend on the bus
+    int64_t start_time = esp_timer_get_time();
+
+    // Unless the caller asked for the old two-transaction behavior, write the register number and
+    // read the data back in a single transaction with a repeated START between them
+    if (!split)
+    {
+        status = m_i2c->write_read(address, reg, width, data, length);
+        note_bus_time(start_time);
+
+        // If that fails, complain
+        if (!status)
+        {
+            Trace.log(TRC_I2C_READ_FAIL, address, reg);
+            return false;
+        }
+
+        // Tell the caller all is well
+        return true;
     }
 
     // Write the address of the byte that we wish to read
-    status = I2C.write(m_i2c_address, reg, width);
+    status = m_i2c->write(address, reg, width);
+    note_bus_time(start_time);
 
     // If that fails, complain
     if (!status) 
     {
-        printf("I2C write failed on register 0x%02X for I2C device 0x%02X\n", reg, m_i2c_address);
+        Trace.log(TRC_I2C_WRITE_FAIL, address, reg);
         return false;
     }
 
     // And read the result
-    status = I2C.read(m_i2c_address, data, length);
+    start_time = esp_timer_get_time();
+    status = m_i2c->read(address, data, length);
+    note_bus_time(start_time);
 
     // If that fails, complain
     if (!status) 
     {
-        printf("I2C read failed on register 0x%02X for I2C device 0x%02X\n", reg, m_i2c_address);
+        Trace.log(TRC_I2C_READ_FAIL, address, reg);
         return false;
     }
 
@@ -377,32 +2546,72 @@ bool CEngine::i2c_read(int reg, int width, uint8_t* data, int length)
 
 
 
+//=========================================================================================================
+// i2c_read_raw() - Reads data from a device via I2C without writing a register number first
+//
+// Passed: address = The I2C address of the device
+//         data    = Pointer to where the data we read should be stored
+//         length  = How many bytes of the data to read
+//=========================================================================================================
+bool CEngine::i2c_read_raw(int address, uint8_t* data, int length)
+{
+    // If we're reading from our virtual device, start at the current virtual register pointer
+    if (address == 0)
+    {
+        for (int i = 0; i<length; ++i)
+        {
+            m_virtual_reg_ptr &= 0xFF;
+            data[i] = m_virtual_device[m_virtual_reg_ptr++];
+        }
+        return true;
+    }
+
+    // Read the data from the device
+    int64_t start_time = esp_timer_get_time();
+    bool status = m_i2c->read(address, data, length);
+    note_bus_time(start_time);
+
+    // If that fails, complain
+    if (!status) Trace.log(TRC_I2C_RAW_FAIL, address);
+
+    // Tell the caller the status
+    return status;
+}
+//=========================================================================================================
+
+
+
 
 //=========================================================================================================
 // i2c_write() - Writes data to a device register via I2C
 //=========================================================================================================
-bool CEngine::i2c_write(int reg, int width, const uint8_t* data, int length)
+bool CEngine::i2c_write(int address, int reg, int width, const uint8_t* data, int length)
 {
     // If we're writing to our virtual device
-    if (m_i2c_address == 0)
+    if (address == 0)
     {
         for (int i = 0; i<length; ++i)
         {
             int index = (reg + i) & 0xFF;
-            virtual_device[index] = data[i];
-        }        
+            m_virtual_device[index] = data[i];
+        }
+
+        // A subsequent read without a register number will start immediately after this write
+        m_virtual_reg_ptr = reg + length;
         return true;        
     }
 
 
     // Write to the I2C device
-    bool status = I2C.write(m_i2c_address, reg, width, data, length);
+    int64_t start_time = esp_timer_get_time();
+    bool status = m_i2c->write(address, reg, width, data, length);
+    note_bus_time(start_time);
 
     // If that fails, complain
-    if (!status) 
-    {
-        printf("I2C write failed on register 0x%02X for I2C device 0x%02X\n", reg, m_i2c_address);
-    }
+    if (!status) Trace.log(TRC_I2C_WRITE_FAIL, address, reg);
+
+    // Keep the register cache up to date.  If the write failed, we don't know what's in the registers
+    RegCache.on_write(cache_key(address), reg, length, status ? data : nullptr);
 
     // Tell the caller the status
     return status;
@@ -411,13 +2620,130 @@ bool CEngine::i2c_write(int reg, int width, const uint8_t* data, int length)
 
 
 //=========================================================================================================
-// reply() - Sends a reply to the host
+// note_bus_time() - Adds the time since 'start_time' to the bus time of the command being handled,
+//                   and notes whether the transaction timed out.  Bus time spent by other tasks (the
+//                   streamer, triggers) isn't charged to a command
+//=========================================================================================================
+void CEngine::note_bus_time(int64_t start_time)
+{
+    if (xTaskGetCurrentTaskHandle() != m_task_handle) return;
+    m_bus_us += esp_timer_get_time() - start_time;
+
+    // If that transaction hung the bus, the command's reply will say so
+    if (m_i2c->timed_out()) m_bus_timeout = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reset_trans_window() - Forgets every transaction ID we've seen from a client and every reply we've
+//                        cached for it
+//=========================================================================================================
+void CEngine::reset_trans_window(client_state_t& client)
+{
+    // We haven't seen any transaction IDs
+    client.window_valid = false;
+
+    // Invalidate every entry in the reply cache that belongs to this client
+    int index = &client - m_client;
+    for (cached_reply_t& entry : m_reply_cache) if (entry.client == index) entry.valid = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// accept_trans_id() - Decides whether a transaction ID is one we haven't seen before.  Clients may have
+//                     several transactions in flight, so the IDs can arrive out of order.   We accept any
+//                     ID we haven't seen that's no more than TRANS_WINDOW_SIZE-1 behind the newest one.
+//                     Every client has a window of its own
+//
+// Passed: trans_id = The transaction ID of an incoming packet
+//
+// Returns: 'true' if this is a new transaction (it's now marked as seen), 'false' if it's a duplicate
+//          or is too old to tell
+//=========================================================================================================
+bool CEngine::accept_trans_id(uint32_t trans_id)
+{
+    client_state_t& client = this->client();
+
+    // If this is the first transaction ID we've seen, it's new
+    if (!client.window_valid)
+    {
+        client.window_valid = true;
+        client.window_top   = trans_id;
+        client.window_bits  = 1;
+        return true;
+    }
+
+    // How far ahead of the newest ID we've seen is this one?  (Negative means "behind")
+    int32_t ahead = (int32_t)(trans_id - client.window_top);
+
+    // If this ID is newer than any we've seen, slide the window forward
+    if (ahead > 0)
+    {
+        client.window_bits = (ahead >= TRANS_WINDOW_SIZE) ? 1 : (client.window_bits << ahead) | 1;
+        client.window_top  = trans_id;
+        return true;
+    }
+
+    // If this ID is too far behind the window, we can't tell if we've seen it, so treat it as a duplicate
+    int behind = -ahead;
+    if (behind >= TRANS_WINDOW_SIZE) return false;
+
+    // If we've already seen this ID, it's a duplicate
+    uint64_t bit = (uint64_t)1 << behind;
+    if (client.window_bits & bit) return false;
+
+    // Otherwise it's new.  Mark it as seen
+    client.window_bits |= bit;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// resend_cached_reply() - If we have a cached reply for a transaction ID, sends it again
+//
+// Passed: trans_id = The transaction ID of a duplicate packet
+//
+// Returns: 'true' if the reply was still in the cache and was re-sent
+//=========================================================================================================
+bool CEngine::resend_cached_reply(uint32_t trans_id)
+{
+    // Look through the cache for this client's reply to this transaction, and if we find it, send it again
+    int index = &client() - m_client;
+    for (cached_reply_t& entry : m_reply_cache)
+    {
+        if (entry.valid && entry.client == index && entry.trans_id == trans_id)
+        {
+            send_reply(entry.data, entry.length, &entry.pending);
+            return true;
+        }
+    }
+
+    // If we get here, that reply has aged out of the cache
+    return false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reply() - Sends a reply to the host.  The reply is built directly in the reply cache so that we can
+//           re-send it if the client retransmits the request
 //=========================================================================================================
-unsigned char reply_buffer[1024];
 void CEngine::reply(int error_code, const uint8_t* data, int data_len)
 {
+    // This is the cache entry we're going to build this reply in
+    cached_reply_t& entry = m_reply_cache[m_next_cache_entry];
+
+    // If the reply sender still hasn't transmitted what's in this entry, wait for it
+    wait_for_sender(entry.pending);
+
+    // The next reply will go into the next cache entry
+    m_next_cache_entry = (m_next_cache_entry + 1) % REPLY_CACHE_SIZE;
+
     // Point to the reply buffer
-    unsigned char* out = reply_buffer;
+    unsigned char* out = entry.data;
 
     // Output the message ID
     *out++ = (m_most_recent_trans_id >> 24);
@@ -428,9 +2754,18 @@ void CEngine::reply(int error_code, const uint8_t* data, int data_len)
     // Output the command we are responding to
     *out++ = m_command;
 
+    // If the bus operation failed because a transaction hung, the client gets a distinct error
+    if (m_bus_timeout && (error_code == ERR_I2C_READ || error_code == ERR_I2C_WRITE))
+    {
+        error_code = ERR_BUS_TIMEOUT;
+    }
+
     // Output the error_code  
     *out++ = error_code;
 
+    // Never overflow the reply buffer
+    if (data_len > REPLY_BUFFER_SIZE) data_len = REPLY_BUFFER_SIZE;
+
     // If there's reply data, stuff it into the buffer
     if (data && data_len)
     {
@@ -442,14 +2777,228 @@ void CEngine::reply(int error_code, const uint8_t* data, int data_len)
     }
 
     // Figure out how long the reply message is
-    int length = out - reply_buffer;
+    int length = out - entry.data;
+
+    // This cache entry now holds the reply to this transaction.  A reply over TCP never needs re-sending
+    entry.client   = &client() - m_client;
+    entry.trans_id = m_most_recent_trans_id;
+    entry.length   = length;
+    entry.valid    = (m_source == PKT_SRC_UDP);
+
+    // Count this command in the performance counters
+    m_stats->record(m_command & ~CMD_BUS_FLAG, error_code, m_bus_us, m_request_length, length, esp_timer_get_time() - m_rx_time);
+
+    // If the client only wants to hear about failures and this isn't one, we're done
+    if (m_source == PKT_SRC_TCP_QUIET && error_code == ERR_NONE) return;
 
     // Send the reply to the client
-    UDPServer.reply(reply_buffer, length);
+    send_reply(entry.data, length, &entry.pending);
+}
+//=========================================================================================================
+
+
+
+
+
+
+
+//=========================================================================================================
+// set_coalescing() - Turns reply coalescing on or off for a client
+//
+// Passed: client       = The client whose replies we're changing the handling of
+//         enable       = 'true' to gather replies into coalesced datagrams
+//         max_bytes    = The largest coalesced datagram to send
+//         max_delay_us = The longest a reply may be held before it's sent, 0 = until the queue is empty
+//=========================================================================================================
+void CEngine::set_coalescing(client_state_t& client, bool enable, int max_bytes, uint32_t max_delay_us)
+{
+    // Send out whatever replies we're holding
+    flush_replies();
+
+    // Keep the size limit within reason
+    if (max_bytes > COALESCE_BUFFER_SIZE) max_bytes = COALESCE_BUFFER_SIZE;
+    if (max_bytes < COALESCE_MIN_SIZE   ) max_bytes = COALESCE_MIN_SIZE;
+
+    // And save the new settings
+    client.coalesce          = enable;
+    client.coalesce_max      = max_bytes;
+    client.coalesce_delay_us = max_delay_us;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_coalesce_timer() - Called by esp_timer when coalesced replies have been held as long as allowed
+//=========================================================================================================
+void CEngine::on_coalesce_timer(void* p_engine)
+{
+    CEngine& engine = *(CEngine*)p_engine;
+
+    // Tell the engine task to send its coalesced replies.  This doesn't go through the packet ring,
+    // because the UDP task is the only task allowed to put things into it
+    engine.m_flush_due = true;
+    xTaskNotifyGive(engine.m_task_handle);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// send_reply() - Sends a fully built reply.  If coalescing is on, the reply is added to the datagram
+//                we're building, otherwise it is sent immediately
+//
+// Passed: data      = Pointer to the reply (transaction ID, command, error code, and data)
+//         length    = The length of the reply
+//         p_pending = The pending-count of the buffer that 'data' lives in
+//=========================================================================================================
+void CEngine::send_reply(const uint8_t* data, int length, std::atomic<int>* p_pending)
+{
+    const client_state_t& client = this->client();
+
+    // If we're not coalescing this client's replies (or this is a reply over TCP), send this one
+    // right away
+    if (!client.coalesce || m_source != PKT_SRC_UDP)
+    {
+        queue_reply(data, length, m_source, m_session, p_pending);
+        return;
+    }
+
+    // If the datagram we're building is for some other client, or this reply won't fit in it, send
+    // what we have first
+    if (m_coalesce_session != m_session || m_coalesce_length + 2 + length > client.coalesce_max) flush_replies();
+
+    // If this reply won't fit in a coalesced datagram at all, send it on its own
+    if (COALESCE_HDR_SIZE + 2 + length > client.coalesce_max)
+    {
+        queue_reply(data, length, PKT_SRC_UDP, m_session, p_pending);
+        return;
+    }
+
+    // If this is the first reply in the datagram, make sure the reply sender is done with the
+    // buffer, and start the clock on how long we can hold it.  With no time limit, the datagram has
+    // no deadline: it goes out when the rings are empty
+    if (m_coalesce_length == COALESCE_HDR_SIZE)
+    {
+        wait_for_sender(m_coalesce_pending[m_coalesce_index]);
+        m_coalesce_session  = m_session;
+        m_coalesce_deadline = INT64_MAX;
+        if (client.coalesce_delay_us)
+        {
+            m_coalesce_deadline = esp_timer_get_time() + client.coalesce_delay_us;
+            esp_timer_start_once(m_coalesce_timer, client.coalesce_delay_us);
+        }
+    }
+
+    // Append the length of the reply, and the reply itself
+    uint8_t* out = m_coalesce_buffer[m_coalesce_index] + m_coalesce_length;
+    *out++ = length >> 8;
+    *out++ = length;
+    memcpy(out, data, length);
+    m_coalesce_length += 2 + length;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// flush_replies() - Sends the coalesced replies we're holding, if there are any
+//=========================================================================================================
+void CEngine::flush_replies()
+{
+    // If we're not holding any replies, there's nothing to do
+    if (m_coalesce_length == COALESCE_HDR_SIZE) return;
+
+    // We don't need the timer to remind us anymore
+    esp_timer_stop(m_coalesce_timer);
+
+    // Fill in the header of the datagram
+    uint32_t trans_id = COALESCE_TRANS_ID;
+    uint8_t* buffer = m_coalesce_buffer[m_coalesce_index];
+    uint8_t* out = buffer;
+    *out++ = trans_id >> 24;
+    *out++ = trans_id >> 16;
+    *out++ = trans_id >>  8;
+    *out++ = trans_id;
+    *out++ = CMD_COALESCE;
+    *out++ = ERR_NONE;
+
+    // Send the datagram
+    queue_reply(buffer, m_coalesce_length, PKT_SRC_UDP, m_coalesce_session, &m_coalesce_pending[m_coalesce_index]);
+
+    // And the next datagram starts out empty, in the other buffer
+    m_coalesce_index  = 1 - m_coalesce_index;
+    m_coalesce_length = COALESCE_HDR_SIZE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// queue_reply() - Hands a reply to the reply sender task, which transmits it from the network core
+//
+// Passed: data      = Pointer to the reply.  It must stay put until the reply has been sent
+//         length    = The length of the reply
+//         source    = Where the packet we're replying to came from (a packet_source_t)
+//         session   = If it came over UDP, the session slot of the client that sent it
+//         p_pending = The pending-count of the buffer that 'data' lives in
+//=========================================================================================================
+void CEngine::queue_reply(const uint8_t* data, int length, int source, int session, std::atomic<int>* p_pending)
+{
+    queued_reply_t reply = {data, (uint16_t)length, (uint8_t)source, (uint8_t)session, p_pending};
+
+    // The buffer is now waiting to be sent
+    ++*p_pending;
+
+    // If the reply ring is full, the reply sender has fallen behind.  Wait for the oldest reply in
+    // the ring to go out
+    while (!m_tx_ring.push(reply))
+    {
+        UDPServer.wake_sender();
+        vTaskDelay(1);
+    }
+
+    // And tell the reply sender there's something to send
+    UDPServer.wake_sender();
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// wait_for_sender() - Waits until the reply sender has transmitted everything in a reply buffer
+//
+// Passed: pending = The pending-count of the reply buffer
+//=========================================================================================================
+void CEngine::wait_for_sender(std::atomic<int>& pending)
+{
+    // If the buffer isn't waiting to be sent, we don't need to wait
+    if (pending.load() == 0) return;
+
+    // Make sure the reply sender is awake
+    UDPServer.wake_sender();
+
+    // Sending a datagram only takes the reply sender a few dozen microseconds, so spin for a bit...
+    int64_t give_up_time = esp_timer_get_time() + SENDER_SPIN_US;
+    while (pending.load() && esp_timer_get_time() < give_up_time) taskYIELD();
+
+    // ...and if it still isn't done, the network is backed up.  Let the other tasks in our core run
+    while (pending.load()) vTaskDelay(1);
+}
+//=========================================================================================================
 
 
+//=========================================================================================================
+// send_queued_replies() - Transmits every reply in the reply ring.  This runs in the reply sender task
+//=========================================================================================================
+void CEngine::send_queued_replies()
+{
+    queued_reply_t* p_reply;
 
+    // Send each reply, then tell the engine it may re-use the buffer the reply lives in
+    while ((p_reply = m_tx_ring.peek()) != nullptr)
+    {
+        if (p_reply->source == PKT_SRC_UDP)
+            UDPServer.reply(p_reply->session, (void*)p_reply->data, p_reply->length);
+        else
+            BinServer.send_frame(p_reply->data, p_reply->length);
+        --*p_reply->p_pending;
+        m_tx_ring.pop();
+    }
+}
+//=========================================================================================================
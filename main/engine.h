@@ -3,6 +3,15 @@
 //=========================================================================================================
 #pragma once
 #include "common.h"
+#include <atomic>
+#include "esp_timer.h"
+#include "i2c_interface.h"
+#include "stats.h"
+#include "reg_cache.h"
+#include "spsc_ring.h"
+#include "macros.h"
+#include "telemetry.h"
+#include "udp_server.h"
 
 /*
 Packet formats:
@@ -12,8 +21,38 @@ All packets begin with
 4 bytes of transaction ID
 1 byte  of command ID
 
+If bit 7 of the command ID (CMD_BUS_FLAG) is set, the command is aimed at the second I2C bus.  Each
+bus has its own engine task, so commands for different buses are handled concurrently.
+
+The same packets can also arrive over TCP, wrapped in frames (see bin_server.h)
+
 */
 
+// This bit in the command byte means "this command is for I2C bus 1"
+#define CMD_BUS_FLAG 0x80
+
+// The upper bits of a "register width" byte are option flags.  CEngine::i2c_read() takes them too
+#define REG_WIDTH_MASK  0x0F
+#define RWF_SPLIT_READ  0x80    // Do a register read as a write, STOP, and a separate read
+#define RWF_TARGET      0x40    // A target byte follows the register-width byte
+#define RWF_NO_CACHE    0x20    // Read from the bus even if the register is in a cached range
+
+
+//=========================================================================================================
+// These are the places a packet can come from.  Every UDP session has its own packet ring in every
+// engine, so that the engine can take turns between clients, and the binary TCP server has one too
+// because a ring can only have one producer
+//=========================================================================================================
+enum packet_source_t
+{
+    PKT_SRC_UDP       = 0,  // The UDP server
+    PKT_SRC_TCP       = 1,  // The binary TCP server
+    PKT_SRC_TCP_QUIET = 2,  // The binary TCP server, and the client only wants a reply if it fails
+};
+#define PKT_RING_COUNT (MAX_UDP_SESSIONS + 1)
+//=========================================================================================================
+
+
 //=========================================================================================================
 // This is the data descriptor that describes an incoming packet
 //=========================================================================================================
@@ -21,6 +60,222 @@ struct packet_t
 {
     uint8_t*    buffer;
     uint16_t    length;    
+    uint8_t     source;     // A packet_source_t
+    uint8_t     session;    // The UDP session slot of the client that sent it
+    int64_t     rx_time;    // When the packet arrived, from esp_timer_get_time()
+};
+
+// A packet_t with no buffer is a message to the engine task, and its "length" is one of these
+enum engine_msg_t
+{
+    ENGINE_MSG_RESET = 1    // The client in the "session" slot started over.  Forget its transaction IDs
+};
+
+// Packets are handed to an engine through rings this big.  Each can hold every buffer in the packet
+// pool plus a few engine messages, so it should never be full
+#define ENGINE_RING_SIZE 32
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes a reply that the engine has built and the reply sender task is to transmit.  The
+// sender decrements *p_pending once the reply has been sent, and until then the engine won't touch
+// the buffer the reply lives in
+//=========================================================================================================
+struct queued_reply_t
+{
+    const uint8_t*      data;
+    uint16_t            length;
+    uint8_t             source;     // The packet_source_t of the packet we're replying to
+    uint8_t             session;    // The UDP session slot of the client we're replying to
+    std::atomic<int>*   p_pending;
+};
+
+// This is how many replies an engine can have waiting for the reply sender
+#define REPLY_RING_SIZE 16
+
+// When a reply buffer is still waiting to be sent, this is how long the engine spins waiting for it
+// before it starts sleeping instead
+#define SENDER_SPIN_US  500
+//=========================================================================================================
+
+
+//=========================================================================================================
+// A reply cache entry holds a reply we've already sent, in case the client asks for it again.  The
+// clients of an engine share its reply cache, and each entry remembers which client it belongs to.  A
+// retransmit whose reply is no longer cached is answered with ERR_REPLY_EXPIRED, so clients shouldn't
+// have more than REPLY_CACHE_SIZE requests in flight at once
+//=========================================================================================================
+#define REPLY_HDR_SIZE     6
+#define REPLY_BUFFER_SIZE  1024
+#define REPLY_CACHE_SIZE   8
+struct cached_reply_t
+{
+    bool        valid;
+    uint8_t     client;         // The index in m_client of the client we replied to
+    uint32_t    trans_id;
+    uint16_t    length;
+    std::atomic<int> pending;   // How many times this reply is waiting in the reply ring
+    uint8_t     data[REPLY_HDR_SIZE + REPLY_BUFFER_SIZE];
+};
+//=========================================================================================================
+
+// This is how many transaction IDs behind the newest one we'll still accept as "new"
+#define TRANS_WINDOW_SIZE 64
+
+
+//=========================================================================================================
+// This is what an engine keeps track of for each client: one per UDP session, plus one (TCP_CLIENT)
+// for the binary TCP server
+//=========================================================================================================
+#define CLIENT_COUNT    (MAX_UDP_SESSIONS + 1)
+#define TCP_CLIENT      MAX_UDP_SESSIONS
+struct client_state_t
+{
+    // If this is true, window_top and window_bits describe the transaction IDs we've seen
+    bool            window_valid;
+
+    // This is the highest transaction ID we've seen
+    uint32_t        window_top;
+
+    // Bit 'n' is set if we've seen transaction ID (window_top - n)
+    uint64_t        window_bits;
+
+    // When this is true, this client's replies are gathered into coalesced datagrams.  A datagram is
+    // sent when it would exceed coalesce_max bytes, or when its oldest reply has been waiting
+    // coalesce_delay_us, or when there are no more packets to handle (if coalesce_delay_us is 0)
+    bool            coalesce;
+    int             coalesce_max;
+    uint32_t        coalesce_delay_us;
+};
+//=========================================================================================================
+
+//=========================================================================================================
+// When reply coalescing is turned on, replies are gathered into a datagram that looks like this:
+//   4 Bytes of transaction ID (always COALESCE_TRANS_ID)
+//   1 Byte  of command        (always CMD_COALESCE)
+//   1 Byte  of error code     (always 0)
+//   For each reply:
+//      2 Bytes of reply length
+//      n Bytes of reply, exactly as it would have been sent on its own
+//=========================================================================================================
+#define COALESCE_TRANS_ID    0xFFFFFFFE
+#define COALESCE_HDR_SIZE    6
+#define COALESCE_BUFFER_SIZE 1400
+#define COALESCE_MIN_SIZE    64
+
+
+//=========================================================================================================
+// A chunked read (CMD_CHUNKED) is answered with a series of fragments, each in its own datagram:
+//   4 Bytes of transaction ID (always CHUNK_TRANS_ID)
+//   1 Byte  of command        (CMD_CHUNKED, with the bus flag if the request had it)
+//   1 Byte  of error code     (always 0)
+//   4 Bytes of the transaction ID of the request
+//   2 Bytes of sequence number
+//   4 Bytes of offset from the start of the read
+//   n Bytes of data, read from the device straight into the fragment
+//
+// After the fragments comes the ordinary reply to the request
+//=========================================================================================================
+#define CHUNK_TRANS_ID      0xFFFFFFFD
+#define CHUNK_HDR_SIZE      16
+#define CHUNK_BUFFER_SIZE   1400
+#define CHUNK_MAX_DATA      (CHUNK_BUFFER_SIZE - CHUNK_HDR_SIZE)
+#define CHUNK_BUFFER_COUNT  4
+
+// This is the longest reply of any kind that an engine sends
+#define MAX_REPLY_LENGTH    CHUNK_BUFFER_SIZE
+
+// A bus scan probes these addresses.  The rest of the 7-bit range is reserved
+#define SCAN_FIRST_ADDR     0x08
+#define SCAN_LAST_ADDR      0x77
+
+
+//=========================================================================================================
+// A device slot describes a device on the I2C bus that the client can refer to by slot number
+//=========================================================================================================
+#define MAX_DEVICE_SLOTS 16
+struct device_ctx_t
+{
+    bool        in_use;
+    uint8_t     address;
+    uint8_t     reg_width;
+    uint16_t    timeout_ms;
+    uint16_t    stretch_us;
+    uint32_t    clock_hz;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This is the part of the client's session that belongs to an engine.  A copy is kept in NVRAM, so that
+// the I2C address and device slots the client set up survive a soft reboot
+//=========================================================================================================
+struct engine_session_t
+{
+    uint32_t        crc;            // See CNVRAM::seal()
+    int             i2c_address;
+    device_ctx_t    device[MAX_DEVICE_SLOTS];
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes the device and register that a register read or write is aimed at
+//=========================================================================================================
+struct reg_spec_t
+{
+    int     address;
+    int     reg;
+    int     width;
+    int     flags;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes a register that's read over and over until (value & mask) == expected
+//=========================================================================================================
+#define POLL_MAX_WIDTH      4           // A polled value is 1 thru 4 bytes, big-endian
+#define POLL_MAX_TIMEOUT_US 3000000     // The engine can't serve other requests while it polls
+#define POLL_RESULT_LENGTH  7           // Status, iterations, elapsed time.  The value follows these
+
+// A batch op can't delay for longer than a poll can wait, for the same reason
+#define BATCH_MAX_DELAY_US  POLL_MAX_TIMEOUT_US
+
+enum poll_status_t
+{
+    POLL_MET        = 0,    // The condition was met
+    POLL_TIMED_OUT  = 1,    // The timeout went by first
+    POLL_MAX_POLLS  = 2     // The iteration cap was reached first
+};
+
+struct poll_spec_t
+{
+    reg_spec_t  spec;
+    int         length;         // How many bytes of the register make up the value
+    uint32_t    mask;
+    uint32_t    expected;
+    uint32_t    interval_us;    // How long to wait between reads
+    uint32_t    timeout_us;     // How long to keep trying
+    int         max_polls;      // The most reads to perform, or 0 for no limit
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes a read-modify-write of a register: new = (old & ~mask) | (value & mask)
+//=========================================================================================================
+#define RMW_MAX_WIDTH   4           // A register value is 1 thru 4 bytes, big-endian
+#define RMW_VERIFY      0x01        // Read the register back afterwards and make sure it took
+
+struct rmw_spec_t
+{
+    reg_spec_t  spec;
+    int         length;         // How many bytes of the register make up the value
+    uint32_t    mask;
+    uint32_t    value;
+    int         flags;          // RMW_xxx flags
 };
 //=========================================================================================================
 
@@ -29,55 +284,279 @@ class CEngine
 {
 public:
 
-    // Called once at program startup to start the thread
-    void    begin();
+    // Called once at program startup to start the thread for the specified I2C bus.  The engine drives
+    // I2C[bus] unless it's handed some other implementation of the bus
+    void    begin(int bus, CI2CInterface* p_i2c = nullptr);
+
+    // Call this to handle an incoming packet.  The buffer must come from PacketPool, and the engine
+    // gives it back to the pool once the packet has been handled.  Only one task may hand the engine
+    // packets from any one source.  'session' is the UDP session slot of the client that sent it
+    void    handle_packet(uint8_t* buffer, int length, int source = PKT_SRC_UDP, int session = 0);
+
+    // Hands an incoming packet to the engine for the I2C bus the packet is aimed at
+    static void dispatch(uint8_t* buffer, int length, int source = PKT_SRC_UDP, int session = 0);
+
+    // Posts a message (an engine_msg_t) about a UDP session to the engine task.  Only the UDP task may
+    // call this
+    void    post_message(int message, int session);
+
+    // Returns the I2C bus this engine drives
+    int     bus() {return m_bus;}
+
+    // Changes the priority of the engine task
+    void    set_priority(int priority) {vTaskPrioritySet(m_task_handle, priority);}
+
+    // Returns the number of packets waiting for this engine to handle them
+    int     queue_depth() {return packets_waiting();}
 
-    // Call this to handle an incoming packet
-    void    handle_packet(uint8_t* buffer, int length);
+    // Called by the reply sender task to transmit every reply this engine has queued up
+    void    send_queued_replies();
 
 public:
 
     // This is the code that executes in it's own thread
     void    task();
 
+    // The I2C read/write routines are safe to call from other tasks.  Address 0 is the virtual device
+
+    // Call this to write to a device register via I2C
+    bool        i2c_write(int address, int reg, int reg_width, const uint8_t* data, int length);
+
+    // Call this to read a device register via I2C.  'flags' are the option bits of a register-width byte
+    bool        i2c_read(int address, int reg, int reg_width, uint8_t* data, int length, int flags = 0);
+
+    // Call this to read from a device via I2C without sending a register number first
+    bool        i2c_read_raw(int address, uint8_t* data, int length);
+
+    // Executes a list of batch operations, storing the data that was read in "out"
+    int         run_ops(int address, const uint8_t* ops, int ops_length, uint8_t* out, int out_max,
+                        int* p_out_length, int* p_fail_index);
+
 protected:
 
+    // Handles a single incoming packet
+    void        process_packet(const uint8_t* in, int length);
+
     // Sends a reply to the most recently received message
     void        reply(int error_code, const uint8_t* data = nullptr, int data_length = 0);
     void        reply(int error_code, int32_t value, int width = 4);
 
+    // Sends a fully built reply, either on its own or as part of a coalesced datagram
+    void        send_reply(const uint8_t* data, int length, std::atomic<int>* p_pending);
+
+    // Hands a reply to the reply sender task
+    void        queue_reply(const uint8_t* data, int length, int source, int session,
+                            std::atomic<int>* p_pending);
+
+    // Fetches the next packet to handle, taking turns between the packet rings
+    bool        next_packet(packet_t* p_packet);
+
+    // Returns the number of packets waiting in all of our packet rings
+    int         packets_waiting();
+
+    // Waits until a buffer is no longer waiting to be sent by the reply sender task
+    void        wait_for_sender(std::atomic<int>& pending);
+
+    // Sends the coalesced replies we're holding (if any)
+    void        flush_replies();
+
+    // Turns reply coalescing on or off for a client
+    void        set_coalescing(client_state_t& client, bool enable, int max_bytes = 0, uint32_t max_delay_us = 0);
+
+    // Returns the state we keep for the client that sent the packet we're handling
+    client_state_t& client() {return m_client[m_source == PKT_SRC_UDP ? m_session : TCP_CLIENT];}
+
+    // The esp_timer callback that tells the engine task it's time to flush coalesced replies
+    static void on_coalesce_timer(void* p_engine);
+
     // Command handlers
     void        handle_cmd_write_reg  (const uint8_t* data, int data_length);    /* CMD_WRITE       */
     void        handle_cmd_read_reg   (const uint8_t* data, int data_length);    /* CMD_READ        */
     void        handle_cmd_client_port(const uint8_t* data, int data_length);    /* CMD_CLIENT_PORT */
     void        handle_cmd_i2c_addr   (const uint8_t* data, int data_length);    /* CMD_I2C_ADDR    */
     void        handle_cmd_get_fwrev  (const uint8_t* data, int data_length);    /* CMD_GET_FWREV   */
-    
+    void        handle_cmd_batch      (const uint8_t* data, int data_length);    /* CMD_BATCH       */
+    void        handle_cmd_bus_clock  (const uint8_t* data, int data_length);    /* CMD_BUS_CLOCK   */
+    void        handle_cmd_device_ctx (const uint8_t* data, int data_length);    /* CMD_DEVICE_CTX  */
+    void        handle_cmd_stream_start(const uint8_t* data, int data_length);   /* CMD_STREAM_START*/
+    void        handle_cmd_stream_stop (const uint8_t* data, int data_length);   /* CMD_STREAM_STOP */
+    void        handle_cmd_stream_query(const uint8_t* data, int data_length);   /* CMD_STREAM_QUERY*/
+    void        handle_cmd_trigger    (const uint8_t* data, int data_length);    /* CMD_TRIGGER     */
+    void        handle_cmd_cache      (const uint8_t* data, int data_length);    /* CMD_CACHE       */
+    void        handle_cmd_coalesce   (const uint8_t* data, int data_length);    /* CMD_COALESCE    */
+    void        handle_cmd_get_stats  (const uint8_t* data, int data_length);    /* CMD_GET_STATS   */
+    void        handle_cmd_echo       (const uint8_t* data, int data_length);    /* CMD_ECHO        */
+    void        handle_cmd_chunked    (const uint8_t* data, int data_length);    /* CMD_CHUNKED     */
+    void        handle_cmd_scan       (const uint8_t* data, int data_length);    /* CMD_SCAN        */
+    void        handle_cmd_macro      (const uint8_t* data, int data_length);    /* CMD_MACRO       */
+    void        handle_cmd_poll_until (const uint8_t* data, int data_length);    /* CMD_POLL_UNTIL  */
+    void        handle_cmd_rmw        (const uint8_t* data, int data_length);    /* CMD_RMW         */
 
-    // Call this to write to a device register via I2C
-    bool        i2c_write(int reg, int reg_width, const uint8_t* data, int length);
+    // Probes every address on the bus and records which ones answered
+    void        scan_bus();
+
+    // Returns 'false' if the last bus scan says there's no device at this address (and we're checking)
+    bool        device_present(int address);
+
+    // Copies the I2C address and device slots to NVRAM, or back from NVRAM after a reboot
+    void        save_session();
+    void        restore_session();
+
+    // Gives the device in a slot the default bus clock and timeouts back
+    void        forget_device(const device_ctx_t& device);
+
+    // The esp_timer callback that tells the engine task it's time to re-scan the bus
+    static void on_scan_timer(void* p_engine);
+
+    // Reads one chunk of a chunked read from the device and sends it as a fragment
+    bool        send_chunk(const reg_spec_t& spec, int seq, int chunk_size, int total_length);
+
+    // Returns the key that the register cache knows a device on our bus by
+    int         cache_key(int address) {return CACHE_KEY(m_bus, address);}
+
+    // Adds the time since 'start_time' to the bus time of the current command (if we're the engine task)
+    void        note_bus_time(int64_t start_time);
+
+    // Reads a device register via I2C without consulting the register cache
+    bool        bus_read(int address, int reg, int reg_width, uint8_t* data, int length, bool split);
+
+    // Parses the register-width byte, optional target byte, and register number of a read or write
+    int         parse_reg_spec(const uint8_t** p_data, int* p_remaining, reg_spec_t* p_spec);
+
+    // Parses the description of a register to poll (everything after the op code of an OP_POLL_UNTIL)
+    int         parse_poll_spec(const uint8_t** p_data, int* p_remaining, poll_spec_t* p_poll);
+
+    // Reads a register until a condition is met, and stores the outcome (POLL_RESULT_LENGTH bytes)
+    // followed by the last value read in 'out'
+    int         poll_until(const poll_spec_t& poll, uint8_t* out);
+
+    // Makes sure an op list is fit to run from a trigger: no waiting, and no virtual device
+    int         check_trigger_ops(int address, const uint8_t* ops, int ops_length);
+
+    // Parses the description of a read-modify-write (everything after the op code of an OP_RMW)
+    int         parse_rmw_spec(const uint8_t** p_data, int* p_remaining, rmw_spec_t* p_rmw);
+
+    // Performs a read-modify-write as one exclusive use of the bus, and stores the old value followed
+    // by the new value in 'out'
+    int         read_modify_write(const rmw_spec_t& rmw, uint8_t* out);
+
+    // Translates a target byte into an I2C address (and optionally a register width)
+    bool        resolve_target(int target, int* p_addr, int* p_width = nullptr);
+    
 
-    // Call this to read a device register via I2C
-    bool        i2c_read(int reg, int reg_width, uint8_t* data, int length);
 
     // Sends out a reply with the specified integer value
     bool        reply_with_value(int32_t value, int width);
-        
-    // If this is true, we have a most recent transaction ID
-    bool        m_have_most_recent_trans_id;
+
+    // Forgets every transaction ID we've seen from a client and every reply we've cached for it
+    void        reset_trans_window(client_state_t& client);
+
+    // Returns 'true' if this transaction ID hasn't been seen before, and marks it as seen
+    bool        accept_trans_id(uint32_t trans_id);
+
+    // If we have a cached reply for this transaction ID, re-sends it and returns 'true'
+    bool        resend_cached_reply(uint32_t trans_id);
+
+    // This is the transaction-ID window and coalescing setting of each client
+    client_state_t m_client[CLIENT_COUNT];
+
+    // These are the most recent replies we've sent to any client, and the index of the one to overwrite
+    // next.  A single cache is much smaller than one per client, and only busy clients ever fill it
+    cached_reply_t m_reply_cache[REPLY_CACHE_SIZE];
+    int            m_next_cache_entry;
+
+    // This is the time (from esp_timer_get_time) that the coalesced replies must be sent by
+    int64_t     m_coalesce_deadline;
+
+    // We gather replies into one of these datagrams while the reply sender is transmitting the other.
+    // m_coalesce_length is the length of the one we're gathering into, and a datagram only ever holds
+    // replies to the client in session slot m_coalesce_session
+    uint8_t     m_coalesce_buffer[2][COALESCE_BUFFER_SIZE];
+    std::atomic<int> m_coalesce_pending[2];
+    int         m_coalesce_index;
+    int         m_coalesce_length;
+    int         m_coalesce_session;
+
+    // The coalesce timer sets this when it's time to send the coalesced replies
+    std::atomic<bool> m_flush_due;
+
+    // The fragments of a chunked read are built in these, taking turns
+    uint8_t     m_chunk_buffer[CHUNK_BUFFER_COUNT][CHUNK_BUFFER_SIZE];
+    std::atomic<int> m_chunk_pending[CHUNK_BUFFER_COUNT];
+    int         m_next_chunk_buffer;
+
+    // Register reads and batches read their data into here
+    uint8_t     m_read_buffer[REPLY_BUFFER_SIZE];
+
+    // The system statistics fetch the snapshot of every task into here.  It's too big for our stack
+    task_telemetry_t m_task_telemetry[TELEMETRY_MAX_TASKS];
+
+    // A macro's op list is expanded into here before it's run, and a macro is copied into here to
+    // describe it to the client
+    macro_t     m_macro;
+
+    // Bit (address & 7) of byte (address >> 3) is set if that device answered the last bus scan.
+    // m_scan_time is when that scan was done
+    uint8_t     m_scan_bitmap[16];
+    bool        m_scan_valid;
+    int64_t     m_scan_time;
+
+    // When this is true, batches and device slots are checked against the last bus scan
+    bool        m_scan_validate;
+
+    // This timer periodically sets m_scan_due, to tell the engine task it's time to re-scan the bus
+    esp_timer_handle_t m_scan_timer;
+    std::atomic<bool>  m_scan_due;
+
+    // This timer goes off when it's time to send the coalesced replies
+    esp_timer_handle_t m_coalesce_timer;
+
+    // This is the I2C bus we drive, along with its performance counters
+    int         m_bus;
+    CI2CInterface* m_i2c;
+    CStats*     m_stats;
 
     // The I2C address of the device we want to talk to
     int         m_i2c_address;
 
-    // This is the most recent message we've received
+    // Our virtual device (I2C address 0) has 256 1-byte registers.  A read without a register number
+    // starts at m_virtual_reg_ptr
+    uint8_t     m_virtual_device[256];
+    int         m_virtual_reg_ptr;
+
+    // These are the devices that the client can refer to by slot number
+    device_ctx_t m_device[MAX_DEVICE_SLOTS];
+
+    // This is the transaction ID of the message we're currently handling
     uint32_t    m_most_recent_trans_id;
 
+    // This is where the message we're currently handling came from (a packet_source_t), and if it came
+    // over UDP, the session slot of the client that sent it
+    int         m_source;
+    int         m_session;
+
     // The command that is currently being handled 
     uint8_t     m_command;
+
+    // This is when the current command's packet arrived, and how long that packet was
+    int64_t     m_rx_time;
+    int         m_request_length;
+
+    // This is how many microseconds the current command has spent on the I2C bus
+    uint32_t    m_bus_us;
+
+    // This is true if one of the current command's bus transactions timed out
+    bool        m_bus_timeout;
     
     // This is the handle of the currently running server task
     TaskHandle_t m_task_handle;
 
-    // This is the queue that other threads will publish notifications to
-    xQueueHandle m_event_queue;
+    // The UDP task hands us packets through a ring for each session, the binary TCP server through a
+    // ring of its own, and they wake us with a task notification.  m_next_ring is the ring that
+    // next_packet() looks in first
+    CSpscRing<packet_t, ENGINE_RING_SIZE> m_rx_ring[PKT_RING_COUNT];
+    int         m_next_ring;
+
+    // We hand replies to the reply sender task through this ring
+    CSpscRing<queued_reply_t, REPLY_RING_SIZE> m_tx_ring;
 };
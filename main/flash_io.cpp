@@ -6,6 +6,7 @@
 
 #define FLASH_READ  0
 #define FLASH_WRITE 1
+#define FLASH_ERASE 2
 
 // This is the namespace that NVS stores our data structure under
 static const char* NAMESPACE = "storage";
@@ -41,6 +42,30 @@ static void write_flash(const char* nvs_key, char* buffer, size_t length)
 
 
 
+//=========================================================================================================
+// erase_flash() - Removes a named region of flash memory
+//=========================================================================================================
+static void erase_flash(const char* nvs_key)
+{
+    nvs_handle  handle;
+
+    // Open a handle to non-volatile storage
+    nvs_open(NAMESPACE, NVS_READWRITE, &handle);
+
+    // Erase the key.  If it doesn't exist, there's nothing to do
+    nvs_erase_key(handle, nvs_key);
+
+    // Commit those flash changes (i.e., make them permanent)
+    nvs_commit(handle);
+
+    // We're done with NVS storage for the moment
+    nvs_close(handle);
+}
+//=========================================================================================================
+
+
+
+
 //=========================================================================================================
 // read_flash() - Reads a blob of data from named region of flash memory
 //=========================================================================================================
@@ -120,6 +145,7 @@ void CFlashIO::task()
         // Perform the requested operation
         if (cmd == FLASH_WRITE) write_flash(m_nvs_key, m_rw_buffer, m_rw_length);
         if (cmd == FLASH_READ ) read_flash(m_nvs_key, m_rw_buffer);
+        if (cmd == FLASH_ERASE) erase_flash(m_nvs_key);
 
         // Tell the requesting task that the operation is complete
         xQueueSend(m_done_qh, &cmd, portMAX_DELAY);
@@ -183,3 +209,27 @@ void CFlashIO::write(const char* nvs_key, char* buffer, size_t length)
 //=========================================================================================================
 
 
+
+//=========================================================================================================
+// erase() - Erases an object from flash memory with a very high priorty task that blocks other tasks
+//=========================================================================================================
+void CFlashIO::erase(const char* nvs_key)
+{
+    char cmd = FLASH_ERASE;
+
+    // Only one thread a time is allowed to read/write flash memory
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Fill in the paramater required to erase an object from flash
+    m_nvs_key = nvs_key;
+
+    // Tell the read/write task to commence the operation
+    xQueueSend(m_start_qh, &cmd, portMAX_DELAY);
+
+    // Wait for the operation to complete
+    xQueueReceive(m_done_qh, &cmd, portMAX_DELAY);
+
+    // Allow other threads to read/write flash memory
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
@@ -21,6 +21,12 @@ public:
     // Call this to write an object to flash memory
     void    write(const char* nvs_key, char* buffer, size_t length);
 
+    // Call this to erase an object from flash memory
+    void    erase(const char* nvs_key);
+
+    // Returns the number of requests waiting for the flash task
+    int     queue_depth() {return uxQueueMessagesWaiting(m_start_qh);}
+
 protected:
 
     // Other tasks write to this queue to signal the start of a flash read/write
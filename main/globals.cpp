@@ -1,6 +1,7 @@
 //=========================================================================================================
 // globals.cpp - Defined globally accessable variables and objects
 //=========================================================================================================
+#include "esp_rom_sys.h"
 #include "globals.h"
 #include "common.h"
 
@@ -25,14 +26,44 @@ CStackTrack StackMgr;
 // The provisioning button
 CProvButton ProvButton;
 
-// An I2C bus for controlling external peripherals
-CI2C I2C;
+// The I2C buses for controlling external peripherals
+CI2C I2C[I2C_BUS_COUNT];
 
 // The UDP server
 CUDPServer  UDPServer;
 
-// The engine that handles incoming packets and drives our FPGA
-CEngine  Engine;
+// The TCP server that speaks the same binary protocol as the UDP server
+CBinServer  BinServer(1182);
+
+// The engines that handle incoming packets, one for each I2C bus
+CEngine  Engine[I2C_BUS_COUNT];
+
+// The pool of buffers that incoming UDP packets are received into
+CPacketPool PacketPool;
+
+// The ring of diagnostic trace events
+CTrace      Trace;
+
+// Samples device registers periodically and streams the samples to the client
+CStreamer   Streamer;
+
+// The trigger inputs that capture device registers when a GPIO edge occurs
+CTrigger    Trigger[MAX_TRIGGERS];
+
+// The shadow cache of device registers
+CRegCache   RegCache;
+
+// The performance counters of each engine
+CStats      Stats[I2C_BUS_COUNT];
+
+// The op lists that the client has stored for running by number
+CMacros     Macros;
+
+// The setting that trades latency for power
+CPerfProfile PerfProfile;
+
+// CPU load, stack, heap and queue figures for the whole system
+CTelemetry  Telemetry;
 
 //========================================================================================================= 
 // msdelay() - Do nothing for the specified number of milliseconds
@@ -44,6 +75,29 @@ void msdelay(uint32_t milliseconds)
 //========================================================================================================= 
 
 
+//========================================================================================================= 
+// usdelay() - Do nothing for the specified number of microseconds
+//
+// Delays shorter than an RTOS tick are a busy-wait.  Longer delays sleep so that other tasks can run
+//========================================================================================================= 
+void usdelay(uint32_t microseconds)
+{
+    // This is how many microseconds are in one RTOS tick
+    const uint32_t us_per_tick = portTICK_PERIOD_MS * 1000;
+
+    // Short delays are a busy-wait
+    if (microseconds < us_per_tick)
+    {
+        esp_rom_delay_us(microseconds);
+        return;
+    }
+
+    // vTaskDelay() can return up to one tick early, so sleep for an extra tick
+    vTaskDelay(microseconds / us_per_tick + 1);
+}
+//========================================================================================================= 
+
+
 //========================================================================================================= 
 // safe_strcpy() - A version of strcpy gauranteed to not overflow the destination buffer
 //========================================================================================================= 
@@ -12,7 +12,17 @@
 #include "buttons.h"
 #include "i2c_bus.h"
 #include "udp_server.h"
+#include "bin_server.h"
 #include "engine.h"
+#include "packet_pool.h"
+#include "trace.h"
+#include "streamer.h"
+#include "trigger.h"
+#include "reg_cache.h"
+#include "stats.h"
+#include "macros.h"
+#include "perf_profile.h"
+#include "telemetry.h"
 
 extern CSystem     System;
 extern CNVS        NVS;
@@ -22,14 +32,25 @@ extern CNVRAM      NVRAM;
 extern CStackTrack StackMgr;
 extern CTCPServer  TCPServer;
 extern CProvButton ProvButton;
-extern CI2C        I2C;
+extern CI2C        I2C[I2C_BUS_COUNT];
 extern CUDPServer  UDPServer;
-extern CEngine     Engine;
+extern CBinServer  BinServer;
+extern CEngine     Engine[I2C_BUS_COUNT];
+extern CPacketPool PacketPool;
+extern CTrace     Trace;
+extern CStreamer  Streamer;
+extern CTrigger   Trigger[MAX_TRIGGERS];
+extern CRegCache  RegCache;
+extern CStats     Stats[I2C_BUS_COUNT];
+extern CMacros    Macros;
+extern CPerfProfile PerfProfile;
+extern CTelemetry  Telemetry;
 
 
 
 uint32_t crc32(void *buf, size_t len);
 void     msdelay(uint32_t milliseconds);
+void     usdelay(uint32_t microseconds);
 bool     parse_utc_string(const char* input, hms_t* p_hms);
 
 #define safe_copy(d,s) safe_strcpy((char*)(d), (char*)(s), sizeof(d))
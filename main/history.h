@@ -7,12 +7,40 @@
 // Vers   When      Who  What
 //---------------------------------------------------------------------------------------------------------
 // 1000  12-Dec-21  DWW  Initial creation
+// 1001  14-Oct-26       CMD_READ_REG now uses a single write/repeated-START/read transaction
+// 1002  14-Oct-26       Added CMD_BATCH
+// 1003  14-Oct-26       CI2C uses a pool of static command-links and bulk reads/writes
+// 1004  14-Oct-26       Added CMD_BUS_CLOCK, per-device bus clocks, and NVS default bus clock
+// 1005  14-Oct-26       Added device slots (CMD_DEVICE_CTX) and per-operation targets
+// 1006  14-Oct-26       Added a reply cache and a sliding window of transaction IDs
+// 1007  14-Oct-26       UDP packets are received into a pool of buffers that the engine gives back
+// 1008  14-Oct-26       Hot-path printf replaced by a binary trace ring (TCP "trace" command)
+// 1009  14-Oct-26       Added periodic register streaming (CMD_STREAM_START/STOP/QUERY)
+// 1010  14-Oct-26       Added GPIO trigger inputs that capture registers into a stream (CMD_TRIGGER)
+// 1011  14-Oct-26       Added a register shadow cache with per-range policies (CMD_CACHE)
+// 1012  14-Oct-26       Added negotiated reply coalescing (CMD_COALESCE)
+// 1013  14-Oct-26       Added engine performance counters (CMD_GET_STATS, TCP "stats" command)
+// 1014  14-Oct-26       Added CMD_ECHO for measuring network-only cost
+// 1015  14-Oct-26       Added a second I2C bus (I2C_NUM_1) with its own engine task, selected by CMD_BUS_FLAG
+// 1016  14-Oct-26       Engines run on the APP core, networking on the PRO core, with lock-free rings between them
+// 1017  14-Oct-26       Added the binary TCP server on port 1182
+// 1018  14-Oct-26       TCP server receives in blocks and buffers replies, added i2c read/write/dump/scan
+// 1019  14-Oct-26       Added CMD_CHUNKED for reads of any length, read_reg checks its length
+// 1020  14-Oct-26       Added CMD_SCAN with a cached bus topology
+// 1021  14-Oct-26       Added per-device I2C timeouts and automatic bus recovery
+// 1022  14-Oct-26       Added a bus scheduler with priority classes
+// 1023  14-Oct-26       Added stored macros (CMD_MACRO), optionally persisted in flash
+// 1024  14-Oct-26       Added discovery (mDNS and CMD_DISCOVER) and session resume across soft reboots
+// 1025  14-Oct-26       Added performance profiles (TCP "profile" command), reported by CMD_GET_STATS
+// 1026  14-Oct-26       Added CMD_POLL_UNTIL and the OP_POLL_UNTIL batch op
+// 1027  14-Oct-26       Added CMD_RMW and the OP_RMW batch op
+// 1028  14-Oct-26       Added system telemetry (TCP "perf" command, STATS_SYSTEM)
+// 1029  14-Oct-26       Per-client UDP sessions (TCP "sessions" command)
+// 1030  14-Oct-26       Engines drive CI2CInterface, added a host build with a mock I2C bus and a benchmark (host/)
 //=========================================================================================================
-#define FW_VERSION "1000" 
+#define FW_VERSION "1030" 
 
 /*
 
 Add debug
-Add discovery feature?
-Add some sort of status counts that can be queried
 */
\ No newline at end of file
@@ -1,23 +1,47 @@
 //=========================================================================================================
 // i2c_bus.cpp - Implements the interfaces to an I2C multi-drop serial bus
 //=========================================================================================================
+#include "esp_rom_sys.h"
 #include "globals.h"
 
+// This is how many statically allocated command-links we keep in our pool
+#define CMD_LINK_POOL_SIZE 4
+
+// Each command-link is large enough for a write, a repeated START, and a read
+#define CMD_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(3)
+
+// These are the buffers for the command-links, and the handle of each one that is in use
+static uint8_t          cmd_pool_buffer[CMD_LINK_POOL_SIZE][CMD_LINK_SIZE];
+static i2c_cmd_handle_t cmd_pool_handle[CMD_LINK_POOL_SIZE];
+
+// This protects the command-link pool from simultaneous access by multiple tasks
+static portMUX_TYPE cmd_pool_spinlock = portMUX_INITIALIZER_UNLOCKED;
 
 //=========================================================================================================
 // init() - Call this once at bootup to initialize this I2C bus
 //
-// Passed: port    = I2C_NUM_0 or I2C_NUM_1
-//         sda_pin = The name of the GPIO that will be the I2C data (SDA) pin.
-//         scl_pin = The name of the GPIO that will be the I2C clock (SCL) pin 
+// Passed: port     = I2C_NUM_0 or I2C_NUM_1
+//         sda_pin  = The name of the GPIO that will be the I2C data (SDA) pin.
+//         scl_pin  = The name of the GPIO that will be the I2C clock (SCL) pin 
+//         clock_hz = The default I2C bus clock, in Hz
 //=========================================================================================================
-void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin)
+void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin, uint32_t clock_hz)
 {
-    i2c_config_t conf;
+    i2c_config_t& conf = m_conf;
     
     // Save the port number for future use
     m_port = port;
 
+    // If we were handed a nonsensical bus clock, use the standard-mode clock
+    if (!is_valid_clock(clock_hz)) clock_hz = I2C_CLOCK_STANDARD;
+
+    // We don't have any device that has its own bus clock or timeouts
+    memset(m_device_override, 0, sizeof m_device_override);
+
+    // Nothing has timed out yet
+    m_timed_out_task = nullptr;
+    m_timeouts = m_recoveries = 0;
+
     // Initialize the I2C configuration structure to known values
     memset(&conf, 0, sizeof conf);
 
@@ -32,28 +56,237 @@ void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin)
     conf.sda_pullup_en = GPIO_PULLUP_ENABLE;
     conf.scl_pullup_en = GPIO_PULLUP_ENABLE;
 
-    // Set the I2C bus clock to 100 kilohertz
-    conf.master.clk_speed = 100000;
+    // Set the I2C bus clock
+    conf.master.clk_speed = clock_hz;
+    m_default_clock = clock_hz;
 
-    // Configure this I2C serial bus
-    i2c_param_config(port, &conf);
-
-    // And install the I2C bus driver
-    i2c_driver_install(port, conf.mode, 0, 0, 0);
+    // Configure this I2C serial bus and install the I2C bus driver
+    install_driver();
     
-    // Create the mutex that we will use to ensure thread-safe access to the I2C bus
-    m_mutex = xSemaphoreCreateMutex();
+    // Set up the scheduler that we will use to ensure thread-safe access to the I2C bus.  Ownership
+    // is recursive so that a task holding the lock can still call the methods that lock the bus themselves
+    m_scheduler.init();
+
+    // The bus is ready for use
+    m_installed = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_clock() - Changes the default I2C bus clock, re-installing the I2C driver
+//
+// Returns: 'false' if the requested clock speed is out of range
+//=========================================================================================================
+bool CI2C::set_clock(uint32_t clock_hz)
+{
+    // Make sure the caller gave us a sensible clock speed
+    if (!is_valid_clock(clock_hz)) return false;
+
+    // Nobody else gets to use the bus while we re-install the driver
+    lock();
+
+    // Reconfigure the bus with the new clock
+    i2c_driver_delete(m_port);
+    m_conf.master.clk_speed = clock_hz;
+    install_driver();
+
+    // This is the new default bus clock, and the bus is running at that speed
+    m_default_clock = clock_hz;
+
+    // Other tasks can now use the bus again
+    unlock();
+
+    // Tell the caller that all is well
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_device_clock() - Specifies a bus clock for a single device that overrides the default clock
+//
+// Passed: i2c_address = The I2C address of the device
+//         clock_hz    = The bus clock to use for that device, or 0 to use the default clock
+//
+// Returns: 'false' if the clock speed is out of range, or if there are too many overrides
+//=========================================================================================================
+bool CI2C::set_device_clock(int i2c_address, uint32_t clock_hz)
+{
+    // Make sure the caller gave us a sensible clock speed
+    if (clock_hz && !is_valid_clock(clock_hz)) return false;
+
+    // We're going to be modifying the override table
+    lock();
+
+    // Find this device's override slot.  We only need a new one if we're not removing the override
+    device_override_t* p_override = find_override(i2c_address, clock_hz != 0);
+
+    // Store the bus clock for this device.  A clock of 0 removes the override
+    if (p_override) p_override->clock_hz = clock_hz;
+
+    // Other tasks can now use the bus again
+    unlock();
+
+    // If we're not removing an override, we need to have found a slot for it
+    return (p_override || clock_hz == 0);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_device_timeout() - Specifies a transaction timeout and a clock-stretch limit for a single device
+//                        that override the defaults
+//
+// Passed: i2c_address = The I2C address of the device
+//         timeout_ms  = The longest a transaction with this device may take, or 0 for the default
+//         stretch_us  = The longest this device may stretch the clock, or 0 for the default
+//
+// Returns: 'false' if a value is out of range, or if there are too many overrides
+//=========================================================================================================
+bool CI2C::set_device_timeout(int i2c_address, int timeout_ms, int stretch_us)
+{
+    // Make sure the caller gave us sensible values
+    if (timeout_ms < 0 || timeout_ms > 0xFFFF || stretch_us < 0 || stretch_us > I2C_STRETCH_MAX_US) return false;
+
+    // We're going to be modifying the override table
+    lock();
+
+    // Find this device's override slot.  We only need a new one if we're not removing the override
+    device_override_t* p_override = find_override(i2c_address, timeout_ms || stretch_us);
+
+    // Store the timeouts for this device
+    if (p_override)
+    {
+        p_override->timeout_ms = timeout_ms;
+        p_override->stretch_us = stretch_us;
+    }
+
+    // Other tasks can now use the bus again
+    unlock();
+
+    // If we're not removing an override, we need to have found a slot for it
+    return (p_override || (timeout_ms == 0 && stretch_us == 0));
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find_override() - Finds the override slot for a device
+//
+// Passed: i2c_address = The I2C address of the device
+//         create      = true if a free slot should be handed out when the device doesn't have one
+//
+// Returns: A pointer to the slot, or nullptr
+//
+// Note: The caller must be holding the lock if 'create' is true
+//=========================================================================================================
+CI2C::device_override_t* CI2C::find_override(int i2c_address, bool create)
+{
+    device_override_t* p_free = nullptr;
+
+    // Look for an existing override for this device, and keep track of the first empty slot
+    for (int i=0; i<MAX_DEVICE_OVERRIDES; ++i)
+    {
+        device_override_t& slot = m_device_override[i];
+        bool in_use = slot.clock_hz || slot.timeout_ms || slot.stretch_us;
+        if (in_use && slot.address == i2c_address) return &slot;
+        if (!in_use && p_free == nullptr) p_free = &slot;
+    }
+
+    // If we get here, the device doesn't have a slot.  Hand it the empty one if the caller wants it
+    if (!create || p_free == nullptr) return nullptr;
+    p_free->address = i2c_address;
+    return p_free;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// device_clock() - Returns the bus clock that will be used to talk to a specific device
+//=========================================================================================================
+uint32_t CI2C::device_clock(int i2c_address)
+{
+    device_override_t* p_override = find_override(i2c_address);
+
+    // If the device has its own bus clock, that's the one we use, otherwise it gets the default clock
+    return (p_override && p_override->clock_hz) ? p_override->clock_hz : m_default_clock;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// is_valid_clock() - Returns 'true' if the specified bus clock is one that we support
+//=========================================================================================================
+bool CI2C::is_valid_clock(uint32_t clock_hz)
+{
+    return clock_hz >= I2C_CLOCK_MIN && clock_hz <= I2C_CLOCK_FAST_PLUS;
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
 // perform() - Performs an I2C read or write transaction
+//
+// Passed: cmd         = The I2C command-link to execute
+//         i2c_address = The I2C address of the device (determines the bus clock), or -1 for the default
 //=========================================================================================================
-bool CI2C::perform(i2c_cmd_handle_t cmd)
+bool CI2C::perform(i2c_cmd_handle_t cmd, int i2c_address, int timeout_ms)
 {
-    // Perform the read or write transaction
-    esp_err_t status = i2c_master_cmd_begin(m_port, cmd, 0);
+    int stretch_us = 0;
+
+    // Nobody else gets to use the bus while this transaction is in progress
+    lock();
+
+    // Find out what bus clock this transaction should run at
+    uint32_t clock_hz = (i2c_address < 0) ? m_default_clock : device_clock(i2c_address);
+
+    // If the device has its own timeouts, find out what they are
+    device_override_t* p_override = (i2c_address < 0) ? nullptr : find_override(i2c_address);
+    if (p_override)
+    {
+        if (timeout_ms == 0) timeout_ms = p_override->timeout_ms;
+        stretch_us = p_override->stretch_us;
+    }
+
+    // If neither the caller nor the device has a timeout in mind, use the default
+    if (timeout_ms == 0) timeout_ms = I2C_TIMEOUT_DEFAULT_MS;
+
+    // If the bus isn't running at the right speed, reconfigure it
+    if (clock_hz != m_current_clock)
+    {
+        m_conf.master.clk_speed = clock_hz;
+        i2c_param_config(m_port, &m_conf);
+        m_current_clock = clock_hz;
+        m_current_stretch_us = 0;
+    }
+
+    // If the hardware isn't set up for this device's clock-stretch limit, set it up.  The hardware
+    // counts 80 MHz APB clock cycles, and a device without a limit of its own gets the default back
+    if (stretch_us != m_current_stretch_us)
+    {
+        i2c_set_timeout(m_port, stretch_us ? stretch_us * 80 : m_default_stretch_cycles);
+        m_current_stretch_us = stretch_us;
+    }
+
+    // Perform the read or write transaction.  We wait at least one tick more than the timeout, since
+    // a single tick may be almost over by the time we start waiting
+    esp_err_t status = i2c_master_cmd_begin(m_port, cmd, pdMS_TO_TICKS(timeout_ms) + 1);
+
+    // Keep track of whether this task's most recent transaction timed out
+    TaskHandle_t this_task = xTaskGetCurrentTaskHandle();
+    if (status != ESP_ERR_TIMEOUT && m_timed_out_task == this_task) m_timed_out_task = nullptr;
+
+    // If the transaction hung, a device is probably holding the bus.  Get it to let go
+    if (status == ESP_ERR_TIMEOUT)
+    {
+        m_timed_out_task = this_task;
+        ++m_timeouts;
+        recover();
+    }
+
+    // Other tasks can now use the bus
+    unlock();
 
     // Tell the caller whether or not this read or write operation was successful
     return status == ESP_OK;
@@ -61,6 +294,156 @@ bool CI2C::perform(i2c_cmd_handle_t cmd)
 //=========================================================================================================
 
 
+//=========================================================================================================
+// recover() - Frees a bus that a device is holding hostage, and re-installs the I2C driver
+//
+// A device that lost track of where it was in a transaction may be holding SDA low, waiting for 
+// clocks that will never come.   We take the pins away from the I2C hardware and clock SCL by hand
+// until the device lets go of SDA, then send a STOP so every device on the bus is back to idle.
+//=========================================================================================================
+void CI2C::recover()
+{
+    gpio_num_t sda = (gpio_num_t)m_conf.sda_io_num;
+    gpio_num_t scl = (gpio_num_t)m_conf.scl_io_num;
+
+    // Nobody else gets to use the bus while we recover it
+    lock();
+
+    // We're going to drive the pins ourselves
+    i2c_driver_delete(m_port);
+
+    // Both pins become open-drain outputs with pullups, idling high
+    gpio_config_t pins;
+    memset(&pins, 0, sizeof pins);
+    pins.pin_bit_mask = (1ULL << sda) | (1ULL << scl);
+    pins.mode         = GPIO_MODE_INPUT_OUTPUT_OD;
+    pins.pull_up_en   = GPIO_PULLUP_ENABLE;
+    gpio_config(&pins);
+    gpio_set_level(sda, 1);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(5);
+
+    // Clock SCL at roughly 100 KHz until the device releases SDA
+    for (int i=0; i<I2C_RECOVERY_CLOCKS && gpio_get_level(sda) == 0; ++i)
+    {
+        gpio_set_level(scl, 0);
+        esp_rom_delay_us(5);
+        gpio_set_level(scl, 1);
+        esp_rom_delay_us(5);
+    }
+
+    // Send a STOP: SDA goes from low to high while SCL is high
+    gpio_set_level(scl, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(sda, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(5);
+    gpio_set_level(sda, 1);
+    esp_rom_delay_us(5);
+
+    // Hand the pins back to a freshly installed I2C driver
+    install_driver();
+
+    // Keep track of how often this happens
+    ++m_recoveries;
+    Trace.log(TRC_I2C_RECOVERY, m_port, gpio_get_level(sda), gpio_get_level(scl));
+
+    // Other tasks can now use the bus again
+    unlock();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// install_driver() - Configures the I2C hardware with m_conf and installs the I2C driver
+//=========================================================================================================
+void CI2C::install_driver()
+{
+    // Configure this I2C serial bus.  This also routes the pins back to the I2C hardware
+    i2c_param_config(m_port, &m_conf);
+
+    // And install the I2C bus driver
+    i2c_driver_install(m_port, m_conf.mode, 0, 0, 0);
+
+    // The bus runs at the clock in m_conf, and the hardware has its default clock-stretch limit.  We
+    // remember what that is, so we can put it back after a device with a limit of its own
+    m_current_clock      = m_conf.master.clk_speed;
+    m_current_stretch_us = 0;
+    i2c_get_timeout(m_port, &m_default_stretch_cycles);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// alloc_cmd_link() - Fetches a statically allocated I2C command-link from the pool
+//
+// If every command-link in the pool is in use, one is allocated from the heap
+//=========================================================================================================
+i2c_cmd_handle_t CI2C::alloc_cmd_link()
+{
+    i2c_cmd_handle_t cmd = nullptr;
+
+    // Look for a command-link buffer that isn't in use
+    portENTER_CRITICAL(&cmd_pool_spinlock);
+    for (int i=0; i<CMD_LINK_POOL_SIZE; ++i) if (cmd_pool_handle[i] == nullptr)
+    {
+        cmd = i2c_cmd_link_create_static(cmd_pool_buffer[i], CMD_LINK_SIZE);
+        cmd_pool_handle[i] = cmd;
+        break;
+    }
+    portEXIT_CRITICAL(&cmd_pool_spinlock);
+
+    // If every buffer in the pool was in use, fall back to allocating from the heap
+    if (cmd == nullptr) cmd = i2c_cmd_link_create();
+
+    // Hand the caller his command-link
+    return cmd;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// free_cmd_link() - Returns a command-link that was obtained from alloc_cmd_link()
+//=========================================================================================================
+void CI2C::free_cmd_link(i2c_cmd_handle_t cmd)
+{
+    // If this command-link came from our pool, return it to the pool
+    portENTER_CRITICAL(&cmd_pool_spinlock);
+    for (int i=0; i<CMD_LINK_POOL_SIZE; ++i) if (cmd_pool_handle[i] == cmd)
+    {
+        i2c_cmd_link_delete_static(cmd);
+        cmd_pool_handle[i] = nullptr;
+        portEXIT_CRITICAL(&cmd_pool_spinlock);
+        return;
+    }
+    portEXIT_CRITICAL(&cmd_pool_spinlock);
+
+    // If we get here, this command-link was allocated from the heap
+    i2c_cmd_link_delete(cmd);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// pack() - Stores an integer value of the specified width into a buffer, MSB first
+//
+// Returns: the number of bytes stored
+//=========================================================================================================
+static int pack(uint8_t* out, int value, int width)
+{
+    // Integers are never more than 4 bytes wide
+    if (width > 4) width = 4;
+
+    // Store the bytes of the value, MSB first
+    for (int i=width-1; i>=0; --i) *out++ = value >> (8 * i);
+
+    // Tell the caller how many bytes we stored
+    return width;
+}
+//=========================================================================================================
+
+
 //=========================================================================================================
 // read() - A convenience method that reads data from an I2C device
 //=========================================================================================================
@@ -72,21 +455,21 @@ bool  CI2C::read(int i2c_address, void* vp_data, int length)
     // Turn the output-buffer void* into a U8*
     U8* p_data = (U8*) vp_data;
 
-    // Allocate an I2C command buffers
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    // Fetch an I2C command buffer
+    i2c_cmd_handle_t cmd = alloc_cmd_link();
  
-    // Initialize the command buffer that will perform the I2C read operation
+    // Initialize the command buffer that will perform the I2C read operation.  I2C_MASTER_LAST_NACK
+    // ACKs every byte but the last one, so the entire read is a single command
     i2c_master_start(cmd);
     i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_READ, true);
-    if (length > 1) i2c_master_read(cmd, p_data, length-1, I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, p_data + length - 1, I2C_MASTER_NACK);
+    i2c_master_read(cmd, p_data, length, I2C_MASTER_LAST_NACK);
     i2c_master_stop(cmd);
  
     // Perform the I2C read operation
-    bool status = I2C.perform(cmd);
+    bool status = perform(cmd, i2c_address);
  
     // Free the resources we allocated earlier
-    i2c_cmd_link_delete(cmd);
+    free_cmd_link(cmd);
  
     // Tell the caller whether or not this read operation was successful
     return status;
@@ -95,6 +478,35 @@ bool  CI2C::read(int i2c_address, void* vp_data, int length)
 
 
 
+//=========================================================================================================
+// probe() - Finds out whether there is a device at the specified address
+//
+// Returns: 'true' if a device acknowledged a write to that address
+//=========================================================================================================
+bool  CI2C::probe(int i2c_address)
+{
+    // Fetch an I2C command buffer
+    i2c_cmd_handle_t cmd = alloc_cmd_link();
+
+    // The transaction is nothing but the address, followed by a STOP
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_WRITE, true);
+    i2c_master_stop(cmd);
+
+    // Perform the transaction.  It only succeeds if a device ACKs the address.  A lone address byte
+    // takes microseconds, so there's no reason to wait long for it
+    bool status = perform(cmd, i2c_address, I2C_TIMEOUT_PROBE_MS);
+
+    // Free the resources we allocated earlier
+    free_cmd_link(cmd);
+
+    // Tell the caller whether anybody answered
+    return status;
+}
+//=========================================================================================================
+
+
+
 //=========================================================================================================
 // write() - A conveience method that writes a stream of data to a register
 //           an I2C device
@@ -109,35 +521,32 @@ bool  CI2C::read(int i2c_address, void* vp_data, int length)
 //=========================================================================================================
 bool  CI2C::write(int i2c_address, int reg, int reg_width, const void* data, int data_length)
 {
-    // Get our data pointer as a unsigned char*    
-    const uint8_t* to_send = (const uint8_t*) data;
-    
-    // Allocate an I2C command buffer for the write operation
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    uint8_t header[5];
+
+    // The header is the device address followed by the register number
+    header[0] = i2c_address << 1 | I2C_MASTER_WRITE;
+    int header_length = 1 + pack(header + 1, reg, reg_width);
+
+    // Fetch an I2C command buffer for the write operation
+    i2c_cmd_handle_t cmd = alloc_cmd_link();
 
     // Initialize the write-operation buffer
     i2c_master_start(cmd);
 
-    // Tell the I2C bus that this is going to be a write operation to the specified device
-    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_WRITE, true);
-
-    // Buffer up the register number
-    if (reg_width >= 4) i2c_master_write_byte(cmd, reg >> 24, true);
-    if (reg_width >= 3) i2c_master_write_byte(cmd, reg >> 16, true);
-    if (reg_width >= 2) i2c_master_write_byte(cmd, reg >>  8, true);
-    if (reg_width >= 1) i2c_master_write_byte(cmd, reg      , true);
+    // Buffer up the device address and register number
+    i2c_master_write(cmd, header, header_length, true);
 
     // Buffer up the data we want to send
-    while (data_length--) i2c_master_write_byte(cmd, *to_send++ , true);
+    if (data_length > 0) i2c_master_write(cmd, (const uint8_t*) data, data_length, true);
 
     // Finalize the command buffer
     i2c_master_stop(cmd);
  
     // Perform the I2C write commands
-    bool status = I2C.perform(cmd);
+    bool status = perform(cmd, i2c_address);
 
     // Free up the resources we allocated earlier
-    i2c_cmd_link_delete(cmd);
+    free_cmd_link(cmd);
  
     // Tell the caller whether this I2C write operation worked
     return status;
@@ -146,6 +555,56 @@ bool  CI2C::write(int i2c_address, int reg, int reg_width, const void* data, int
 
 
 
+//=========================================================================================================
+// write_read() - Writes a register number to an I2C device, then issues a repeated START and reads
+//                data back from the device.  The whole thing is performed as a single transaction,
+//                so there is no STOP condition between the register-pointer write and the read.
+//
+// Passed: i2c_address = The I2C address of the device
+//         reg         = The register number we want to read from
+//         reg_width   = The width of that register number in bytes
+//         vp_data     = Where the data we read should be stored
+//         length      = How many bytes of data to read
+//
+// Returns: 'true' if the I2C transaction was successful, otherwise 'false'
+//=========================================================================================================
+bool CI2C::write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length)
+{
+    uint8_t header[5];
+
+    // If there's nothing to read, this is just a write of the register number
+    if (length < 1) return write(i2c_address, reg, reg_width);
+
+    // The header is the device address followed by the register number
+    header[0] = i2c_address << 1 | I2C_MASTER_WRITE;
+    int header_length = 1 + pack(header + 1, reg, reg_width);
+
+    // Fetch an I2C command buffer
+    i2c_cmd_handle_t cmd = alloc_cmd_link();
+
+    // Tell the I2C bus that this starts with a write of the register number to the specified device
+    i2c_master_start(cmd);
+    i2c_master_write(cmd, header, header_length, true);
+
+    // Issue a repeated START and turn the bus around for the read
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_READ, true);
+    i2c_master_read(cmd, (U8*) vp_data, length, I2C_MASTER_LAST_NACK);
+    i2c_master_stop(cmd);
+
+    // Perform the I2C transaction
+    bool status = perform(cmd, i2c_address);
+
+    // Free the resources we allocated earlier
+    free_cmd_link(cmd);
+
+    // Tell the caller whether or not this transaction was successful
+    return status;
+}
+//=========================================================================================================
+
+
+
 
 //=========================================================================================================
 // write() - A conveience method that writes one or two integer values of arbitrary length to the 
@@ -161,35 +620,30 @@ bool  CI2C::write(int i2c_address, int reg, int reg_width, const void* data, int
 //=========================================================================================================
 bool  CI2C::write(int i2c_address, int val1, int len1, int val2, int len2)
 {
-    // Allocate an I2C command buffer for the write operation
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    uint8_t buffer[9], *out = buffer;
 
-    // Initialize the write-operation buffer
-    i2c_master_start(cmd);
+    // Build the device address, followed by the two values we're going to write
+    *out++ = i2c_address << 1 | I2C_MASTER_WRITE;
+    out += pack(out, val1, len1);
+    out += pack(out, val2, len2);
 
-    // Tell the I2C bus that this is going to be a write operation to the specified device
-    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_WRITE, true);
+    // Fetch an I2C command buffer for the write operation
+    i2c_cmd_handle_t cmd = alloc_cmd_link();
 
-    // Buffer up the first value to be written
-    if (len1 >= 4) i2c_master_write_byte(cmd, val1 >> 24, true);
-    if (len1 >= 3) i2c_master_write_byte(cmd, val1 >> 16, true);
-    if (len1 >= 2) i2c_master_write_byte(cmd, val1 >>  8, true);
-    if (len1 >= 1) i2c_master_write_byte(cmd, val1      , true);
+    // Initialize the write-operation buffer
+    i2c_master_start(cmd);
 
-    // Buffer up the second value to be written
-    if (len2 >= 4) i2c_master_write_byte(cmd, val2 >> 24, true);
-    if (len2 >= 3) i2c_master_write_byte(cmd, val2 >> 16, true);
-    if (len2 >= 2) i2c_master_write_byte(cmd, val2 >>  8, true);
-    if (len2 >= 1) i2c_master_write_byte(cmd, val2      , true);
+    // Buffer up the device address and the values to be written
+    i2c_master_write(cmd, buffer, out - buffer, true);
 
     // Finalize the command buffer
     i2c_master_stop(cmd);
  
     // Perform the I2C write commands
-    bool status = I2C.perform(cmd);
+    bool status = perform(cmd, i2c_address);
 
     // Free up the resources we allocated earlier
-    i2c_cmd_link_delete(cmd);
+    free_cmd_link(cmd);
  
     // Tell the caller whether this I2C write operation worked
     return status;
@@ -200,6 +654,6 @@ bool  CI2C::write(int i2c_address, int val1, int len1, int val2, int len2)
 //=========================================================================================================
 // lock() / unlock() - These are used to manage thread-safe exclusive access to the I2C bus.
 //=========================================================================================================
-void CI2C::lock()   {xSemaphoreTake(m_mutex, portMAX_DELAY);}
-void CI2C::unlock() {xSemaphoreGive(m_mutex);}
+void CI2C::lock(int bus_class, int64_t deadline_us) {m_scheduler.acquire(bus_class, deadline_us);}
+void CI2C::unlock()                                 {m_scheduler.release();}
 //=========================================================================================================
@@ -3,38 +3,161 @@
 //=========================================================================================================
 #pragma once
 #include "common.h"
+#include "i2c_interface.h"
 
+// These are the standard I2C bus clocks, and the slowest clock we'll allow
+#define I2C_CLOCK_STANDARD     100000
+#define I2C_CLOCK_FAST         400000
+#define I2C_CLOCK_FAST_PLUS   1000000
+#define I2C_CLOCK_MIN           10000
 
-class CI2C
+// This is the maximum number of devices that can have their own bus clock or timeouts
+#define MAX_DEVICE_OVERRIDES 8
+
+// This is how long a transaction may take before we give up on it and recover the bus
+#define I2C_TIMEOUT_DEFAULT_MS  20
+
+// Probes are only ever an address byte, so they get a much shorter timeout
+#define I2C_TIMEOUT_PROBE_MS     2
+
+// This is the longest a device may stretch the clock.  The hardware counts APB cycles in a 20-bit
+// register, which tops out at about 13 milliseconds.   0 means "leave the hardware's default alone"
+#define I2C_STRETCH_MAX_US   13000
+
+// This is how many clock pulses it takes to get a device that's holding SDA low to let go of it
+#define I2C_RECOVERY_CLOCKS      9
+
+class CI2C : public CI2CInterface
 {
 public:
 
+    // Constructor
+    CI2C() {m_installed = false;}
+
     // Call this once at bootup to initialize this I2C bus
-    void    init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin);
+    void    init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin, uint32_t clock_hz = I2C_CLOCK_STANDARD);
+
+    // Returns true if init() has been called, and the bus is ready for use
+    bool    is_installed() override {return m_installed;}
+
+    // Returns true if the specified GPIO is one of this bus's pins
+    bool    uses_pin(int pin) {return m_installed && (pin == m_conf.sda_io_num || pin == m_conf.scl_io_num);}
+
+    // Call this to change the default bus clock.  Returns false if the clock is out of range
+    bool    set_clock(uint32_t clock_hz) override;
+
+    // Call this to give a specific device its own bus clock.  A clock of 0 means "use the default"
+    bool    set_device_clock(int i2c_address, uint32_t clock_hz) override;
+
+    // Returns the default bus clock
+    uint32_t clock() override {return m_default_clock;}
+
+    // Returns the bus clock that will be used for a specific device
+    uint32_t device_clock(int i2c_address);
+
+    // Call this to give a specific device its own transaction timeout and clock-stretch limit.  
+    // 0 means "use the default" for either one
+    bool    set_device_timeout(int i2c_address, int timeout_ms, int stretch_us) override;
+
+    // Returns true if the calling task's most recent transaction timed out
+    bool    timed_out() override {return m_timed_out_task == xTaskGetCurrentTaskHandle();}
+
+    // Returns the number of transactions that have timed out, and the number of times we've had to
+    // recover a hung bus
+    uint32_t timeouts()   override {return m_timeouts;}
+    uint32_t recoveries() override {return m_recoveries;}
+
+    // Frees a bus that a device is holding hostage, and re-installs the I2C driver
+    void    recover();
+
+    // Returns true if the specified bus clock is one that we support
+    static bool is_valid_clock(uint32_t clock_hz);
 
     // These should be called before and after a set of "perform" and/or "read" operations to 
-    // obtain thread-safe exclusive access to the bus.
-    void    lock();
-    void    unlock();
+    // obtain thread-safe exclusive access to the bus.  When several tasks want the bus, it goes to the
+    // one with the most urgent bus_class_t first, then to the one with the earliest deadline
+    void    lock(int bus_class = BUS_CLASS_INTERACTIVE, int64_t deadline_us = 0) override;
+    void    unlock() override;
+
+    // Returns the scheduler that decides which task gets the bus next
+    CBusScheduler& scheduler() override {return m_scheduler;}
 
     // This is a convenience method that calls "perform" to do an I2C read for a specified number of bytes
-    bool    read(int i2c_address, void* vp_data, int length);
+    bool    read(int i2c_address, void* vp_data, int length) override;
 
     // This is a convenience method that calls "perform" to write one or two integer values to an I2C device
-    bool    write(int i2c_address, int val1, int len1, int val2=0, int len2=0);
+    bool    write(int i2c_address, int val1, int len1, int val2=0, int len2=0) override;
 
     // This is a convenience method that calls "perform" to write a buffer full of data to an I2C device
-    bool    write(int i2c_address, int reg, int reg_width, const void* data, int data_length);
+    bool    write(int i2c_address, int reg, int reg_width, const void* data, int data_length) override;
+
+    // Writes a register number then, after a repeated START, reads data back.  All in one transaction
+    bool    write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length) override;
+
+    // Returns true if a device at the specified address acknowledges its address
+    bool    probe(int i2c_address) override;
 
-    // Call this to perform an arbitrary set of I2C read/write commands
-    bool    perform(i2c_cmd_handle_t cmd);
+    // Call this to perform an arbitrary set of I2C read/write commands.  A timeout of 0 means "use the
+    // device's timeout"
+    bool    perform(i2c_cmd_handle_t cmd, int i2c_address = -1, int timeout_ms = 0);
 
 protected:
 
+    // This is the per-device configuration that overrides the bus defaults.  A field of 0 means
+    // "use the default", and a slot where every field is 0 is free
+    struct device_override_t
+    {
+        int         address;
+        uint32_t    clock_hz;
+        uint16_t    timeout_ms;
+        uint16_t    stretch_us;
+    };
+
+    // Returns the override slot for a device, or nullptr if it doesn't have one.  With 'create' = true,
+    // a free slot is handed out (if there is one) when the device doesn't already have a slot
+    device_override_t* find_override(int i2c_address, bool create = false);
+
+    // Installs the I2C driver with the configuration in m_conf
+    void    install_driver();
+
+    // Fetches an I2C command-link from a pool of statically allocated buffers
+    i2c_cmd_handle_t alloc_cmd_link();
+
+    // Returns a command-link that was fetched via alloc_cmd_link()
+    void    free_cmd_link(i2c_cmd_handle_t cmd);
+
     // This is the I2C port number of this I2C bus
     i2c_port_t          m_port;
+
+    // This is the configuration that the I2C driver was installed with
+    i2c_config_t        m_conf;
+
+    // This is the bus clock that devices without an override use
+    uint32_t            m_default_clock;
+
+    // This is the bus clock that the I2C hardware is currently configured for
+    uint32_t            m_current_clock;
+
+    // This is the clock-stretch limit that the I2C hardware is currently configured for (0 = its default)
+    int                 m_current_stretch_us;
+
+    // This is the hardware's default clock-stretch limit, in APB clock cycles
+    int                 m_default_stretch_cycles;
+
+    // These are devices that have their own bus clock or timeouts
+    device_override_t   m_device_override[MAX_DEVICE_OVERRIDES];
+
+    // This is the task whose most recent transaction timed out, or nullptr
+    TaskHandle_t        m_timed_out_task;
+
+    // These count transactions that timed out, and the times we've recovered the bus
+    uint32_t            m_timeouts;
+    uint32_t            m_recoveries;
         
-    // This is the handle to the mutex that ensures thread-safe access to the I2C bus
-    SemaphoreHandle_t   m_mutex;
+    // This decides which task gets exclusive access to the I2C bus next
+    CBusScheduler       m_scheduler;
+
+    // This is true once the driver for this bus has been installed
+    bool                m_installed;
 
 };
\ No newline at end of file
@@ -0,0 +1,61 @@
+//=========================================================================================================
+// i2c_interface.h - Defines the interface that an engine drives an I2C bus through
+//
+// CI2C (i2c_bus.h) is the real bus.   A build for a host computer (see host/) gives an engine a RAM-based
+// bus with simulated timing instead, so that the engine itself can be measured without an ESP32
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "bus_scheduler.h"
+
+class CI2CInterface
+{
+public:
+
+    // Returns true if the bus is ready for use
+    virtual bool    is_installed() = 0;
+
+    // Returns the default bus clock
+    virtual uint32_t clock() = 0;
+
+    // Call this to change the default bus clock.  Returns false if the clock is out of range
+    virtual bool    set_clock(uint32_t clock_hz) = 0;
+
+    // Call this to give a specific device its own bus clock.  A clock of 0 means "use the default"
+    virtual bool    set_device_clock(int i2c_address, uint32_t clock_hz) = 0;
+
+    // Call this to give a specific device its own transaction timeout and clock-stretch limit.
+    // 0 means "use the default" for either one
+    virtual bool    set_device_timeout(int i2c_address, int timeout_ms, int stretch_us) = 0;
+
+    // Returns true if the calling task's most recent transaction timed out
+    virtual bool    timed_out() = 0;
+
+    // Returns the number of transactions that have timed out, and the number of times we've had to
+    // recover a hung bus
+    virtual uint32_t timeouts() = 0;
+    virtual uint32_t recoveries() = 0;
+
+    // These should be called before and after a set of reads and/or writes to obtain exclusive access
+    // to the bus (see CBusScheduler)
+    virtual void    lock(int bus_class = BUS_CLASS_INTERACTIVE, int64_t deadline_us = 0) = 0;
+    virtual void    unlock() = 0;
+
+    // Returns the scheduler that decides which task gets the bus next
+    virtual CBusScheduler& scheduler() = 0;
+
+    // Reads a specified number of bytes from a device
+    virtual bool    read(int i2c_address, void* vp_data, int length) = 0;
+
+    // Writes one or two integer values to a device
+    virtual bool    write(int i2c_address, int val1, int len1, int val2=0, int len2=0) = 0;
+
+    // Writes a register number followed by a buffer full of data to a device
+    virtual bool    write(int i2c_address, int reg, int reg_width, const void* data, int data_length) = 0;
+
+    // Writes a register number then, after a repeated START, reads data back.  All in one transaction
+    virtual bool    write_read(int i2c_address, int reg, int reg_width, void* vp_data, int length) = 0;
+
+    // Returns true if a device at the specified address acknowledges its address
+    virtual bool    probe(int i2c_address) = 0;
+};
@@ -0,0 +1,243 @@
+//=========================================================================================================
+// macros.cpp - Implements the store of macros that the client runs by number
+//=========================================================================================================
+#include <stddef.h>
+#include <stdio.h>
+#include "globals.h"
+
+// If this value is in the "present_flag" field, the macro is defined
+const uint32_t MACRO_PRESENT_MARKER = 0x4D41434F;
+
+
+//=========================================================================================================
+// begin() - Called once at startup to create the mutex and reload the macros persisted in flash
+//=========================================================================================================
+void CMacros::begin()
+{
+    char key[16];
+
+    // Create the mutex that keeps the engines from tripping over each other
+    m_mutex = xSemaphoreCreateMutex();
+
+    // No macros are defined until we find them in flash
+    memset(m_macro, 0, sizeof m_macro);
+
+    for (int index = 0; index < MAX_MACROS; ++index)
+    {
+        macro_t& macro = m_macro[index];
+
+        // Read this macro from flash.  If it was never stored, the present-flag will be 0
+        make_key(index, key);
+        FlashIO.read(key, (char*)&macro);
+        if (macro.present_flag != MACRO_PRESENT_MARKER) continue;
+
+        // Make sure what we read is sensible and intact
+        bool valid = macro.ops_length <= MAX_MACRO_OPS && macro.param_count <= MAX_MACRO_PARAMS;
+        if (valid)
+        {
+            uint32_t crc = macro.crc;
+            macro.crc = 0;
+            valid = (crc32(&macro, stored_length(macro)) == crc);
+            macro.crc = crc;
+        }
+
+        // If it isn't, throw it away
+        if (!valid) memset(&macro, 0, sizeof macro);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// define() - Defines (or re-defines) a macro
+//
+// Passed: index       = Which macro (0 thru MAX_MACROS-1)
+//         params      = Where in the op list each parameter goes, and how wide it is
+//         param_count = The number of parameters
+//         ops         = The op list, in CMD_BATCH format
+//         ops_length  = The length of the op list
+//         flags       = MACRO_xxx flags
+//
+// Returns: 'false' if the parameters don't make sense
+//=========================================================================================================
+bool CMacros::define(int index, const macro_param_t* params, int param_count, const uint8_t* ops,
+                     int ops_length, int flags)
+{
+    // Make sure the parameters are sensible
+    if (index < 0 || index >= MAX_MACROS) return false;
+    if (ops_length < 1 || ops_length > MAX_MACRO_OPS) return false;
+    if (param_count < 0 || param_count > MAX_MACRO_PARAMS) return false;
+
+    // Every parameter has to fit inside the op list
+    for (int i = 0; i < param_count; ++i)
+    {
+        int width = params[i].width;
+        if (width < 1 || width > MAX_MACRO_PARAM_WIDTH) return false;
+        if (params[i].offset + width > ops_length) return false;
+    }
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    macro_t& macro = m_macro[index];
+
+    // If the old version of this macro was in flash, the new one has to replace it there
+    bool was_persisted = (macro.present_flag == MACRO_PRESENT_MARKER) && (macro.flags & MACRO_PERSIST);
+
+    // Fill in the macro
+    memset(&macro, 0, sizeof macro);
+    macro.present_flag = MACRO_PRESENT_MARKER;
+    macro.ops_length   = ops_length;
+    macro.flags        = flags;
+    macro.param_count  = param_count;
+    memcpy(macro.param, params, param_count * sizeof(macro_param_t));
+    memcpy(macro.ops, ops, ops_length);
+
+    // Compute the CRC that tells us, at boot, that the stored macro is intact
+    macro.crc = crc32(&macro, stored_length(macro));
+
+    // Write it to flash (or erase the old version from flash) if we need to
+    if (was_persisted || (flags & MACRO_PERSIST)) persist(index);
+
+    xSemaphoreGive(m_mutex);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// remove() - Deletes a macro
+//
+// Returns: 'false' if the macro wasn't defined
+//=========================================================================================================
+bool CMacros::remove(int index)
+{
+    if (index < 0 || index >= MAX_MACROS) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    macro_t& macro = m_macro[index];
+
+    // Find out whether the macro is defined, and whether there's a copy in flash
+    bool was_defined   = (macro.present_flag == MACRO_PRESENT_MARKER);
+    bool was_persisted = was_defined && (macro.flags & MACRO_PERSIST);
+
+    // Forget the macro, and if it was in flash, erase it from there too
+    memset(&macro, 0, sizeof macro);
+    if (was_persisted) persist(index);
+
+    xSemaphoreGive(m_mutex);
+    return was_defined;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// expand() - Copies a macro's op list into a buffer, with the parameter values substituted in
+//
+// Passed: index        = Which macro
+//         args         = The parameter values, one after another, each as wide as its parameter
+//         args_length  = The number of bytes in 'args'
+//         ops          = The buffer (MAX_MACRO_OPS bytes) to copy the op list into
+//         p_ops_length = Filled in with the length of the op list
+//
+// Returns: A macro_result_t
+//=========================================================================================================
+int CMacros::expand(int index, const uint8_t* args, int args_length, uint8_t* ops, int* p_ops_length)
+{
+    int result = MACRO_OK;
+
+    if (index < 0 || index >= MAX_MACROS) return MACRO_UNDEFINED;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    const macro_t& macro = m_macro[index];
+
+    // If the macro isn't defined, there's nothing to run
+    if (macro.present_flag != MACRO_PRESENT_MARKER)
+        result = MACRO_UNDEFINED;
+
+    else
+    {
+        // The parameter values have to be exactly as long as the parameters
+        int needed = 0;
+        for (int i = 0; i < macro.param_count; ++i) needed += macro.param[i].width;
+
+        if (args_length != needed)
+            result = MACRO_BAD_ARGS;
+
+        else
+        {
+            // Copy the op list, and overwrite each parameter with its value
+            memcpy(ops, macro.ops, macro.ops_length);
+            for (int i = 0; i < macro.param_count; ++i)
+            {
+                memcpy(ops + macro.param[i].offset, args, macro.param[i].width);
+                args += macro.param[i].width;
+            }
+            *p_ops_length = macro.ops_length;
+        }
+    }
+
+    xSemaphoreGive(m_mutex);
+    return result;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// fetch() - Copies a macro into a caller-supplied structure
+//
+// Returns: 'false' if the macro isn't defined
+//=========================================================================================================
+bool CMacros::fetch(int index, macro_t* p_macro)
+{
+    if (index < 0 || index >= MAX_MACROS) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    *p_macro = m_macro[index];
+    xSemaphoreGive(m_mutex);
+
+    return p_macro->present_flag == MACRO_PRESENT_MARKER;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stored_length() - Returns the number of bytes of a macro that are stored in flash: everything but
+//                   the unused part of the op list
+//=========================================================================================================
+int CMacros::stored_length(const macro_t& macro)
+{
+    return offsetof(macro_t, ops) + macro.ops_length;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// persist() - Writes a macro to flash, or erases it from flash if it's no longer defined or persisted
+//
+// Note: The caller must be holding m_mutex
+//=========================================================================================================
+void CMacros::persist(int index)
+{
+    char key[16];
+    const macro_t& macro = m_macro[index];
+
+    make_key(index, key);
+
+    if (macro.present_flag == MACRO_PRESENT_MARKER && (macro.flags & MACRO_PERSIST))
+        FlashIO.write(key, (char*)&macro, stored_length(macro));
+    else
+        FlashIO.erase(key);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// make_key() - Builds the NVS key that a macro is stored under
+//=========================================================================================================
+void CMacros::make_key(int index, char* key)
+{
+    sprintf(key, "macro%02i", index);
+}
+//=========================================================================================================
@@ -0,0 +1,103 @@
+//=========================================================================================================
+// macros.h - Defines the store of macros: op lists (in CMD_BATCH format) that the client uploads once
+//            and then runs by number with a tiny packet
+//
+// A macro can have parameters.  Each parameter is a field of the op list (a register number, a value
+// to write, a delay) that is overwritten with a value from the "run" packet before the op list is
+// executed, so the same macro can be aimed at different registers or write different values.
+//
+// A macro can also be persisted, in which case it's written to NVS (via FlashIO) and reloaded at boot.
+// Macros aren't specific to an I2C bus: a macro runs on whichever bus the "run" packet is aimed at
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is how many macros there can be
+#define MAX_MACROS          16
+
+// This is the longest op list a macro can store
+#define MAX_MACRO_OPS       512
+
+// This is the most parameters a macro can have, and the widest a parameter can be
+#define MAX_MACRO_PARAMS    8
+#define MAX_MACRO_PARAM_WIDTH 4
+
+// These are the flags that describe a macro
+#define MACRO_PERSIST       0x01    // The macro is stored in flash and survives a reboot
+
+// These are the results of expand()
+enum macro_result_t
+{
+    MACRO_OK        = 0,
+    MACRO_UNDEFINED = 1,    // There is no macro with that number
+    MACRO_BAD_ARGS  = 2     // The parameter values aren't the length the macro expects
+};
+
+
+//=========================================================================================================
+// This describes one parameter of a macro
+//=========================================================================================================
+struct macro_param_t
+{
+    uint16_t    offset;     // Where in the op list the parameter goes
+    uint8_t     width;      // How many bytes wide the parameter is
+    uint8_t     reserved;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This is a macro, exactly as it's stored in flash.   Only the first 'ops_length' bytes of the op list
+// are written to flash
+//=========================================================================================================
+struct macro_t
+{
+    uint32_t        present_flag;           // MACRO_PRESENT_MARKER if this macro is defined
+    uint32_t        crc;                    // The CRC of the stored part of the macro, with this field 0
+    uint16_t        ops_length;
+    uint8_t         flags;                  // MACRO_xxx flags
+    uint8_t         param_count;
+    macro_param_t   param[MAX_MACRO_PARAMS];
+    uint8_t         ops[MAX_MACRO_OPS];
+};
+//=========================================================================================================
+
+
+class CMacros
+{
+public:
+
+    // Called once at startup, after FlashIO is running.  Reloads the persisted macros
+    void    begin();
+
+    // Defines (or re-defines) a macro.  Returns 'false' if the parameters don't make sense
+    bool    define(int index, const macro_param_t* params, int param_count, const uint8_t* ops,
+                   int ops_length, int flags);
+
+    // Deletes a macro, from flash too if it was persisted.  Returns 'false' if it wasn't defined
+    bool    remove(int index);
+
+    // Copies a macro's op list into 'ops' (which must hold MAX_MACRO_OPS bytes), with the parameter
+    // values in 'args' substituted in.  Returns a macro_result_t
+    int     expand(int index, const uint8_t* args, int args_length, uint8_t* ops, int* p_ops_length);
+
+    // Copies a macro into 'p_macro'.  Returns 'false' if it isn't defined
+    bool    fetch(int index, macro_t* p_macro);
+
+protected:
+
+    // Returns the number of bytes of a macro that are stored in flash
+    static int  stored_length(const macro_t& macro);
+
+    // Writes a macro to flash, or erases it from flash if it isn't defined or persisted
+    void    persist(int index);
+
+    // Builds the NVS key that a macro is stored under
+    static void make_key(int index, char* key);
+
+    // These are the macros
+    macro_t     m_macro[MAX_MACROS];
+
+    // Engines for both buses can define and run macros at the same time
+    SemaphoreHandle_t m_mutex;
+};
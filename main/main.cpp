@@ -50,10 +50,40 @@ void cpp_main()
     ProvButton.init(PIN_PROV_BUTTON);
 
     // Configure the I2C bus.   This must be done before initializing I2C peripherals
-    I2C.init(I2C_NUM_0, PIN_I2C_SDA, PIN_I2C_SCL);
+    I2C[0].init(I2C_NUM_0, PIN_I2C_SDA, PIN_I2C_SCL, NVS.data.i2c_clock_hz);
 
-    // Start up command handling engine
-    Engine.begin();
+    // If the second I2C bus has been given pins, configure it too
+    if (NVS.data.i2c1_sda_pin != PIN_UNUSED && NVS.data.i2c1_scl_pin != PIN_UNUSED)
+    {
+        gpio_num_t sda = (gpio_num_t)NVS.data.i2c1_sda_pin;
+        gpio_num_t scl = (gpio_num_t)NVS.data.i2c1_scl_pin;
+        I2C[1].init(I2C_NUM_1, sda, scl, NVS.data.i2c1_clock_hz);
+    }
+
+    // Apply the performance profile.  This sets the I2C bus clocks, so it comes after the buses
+    PerfProfile.begin();
+
+    // Get ready to collect CPU load and stack figures for every task
+    Telemetry.begin();
+
+    // Create the pool of buffers that incoming packets are received into
+    PacketPool.begin();
+
+    // Initialize the shadow cache of device registers
+    RegCache.begin();
+
+    // Reload the macros that the client stored in flash
+    Macros.begin();
+
+    // Start up a command handling engine for each I2C bus, with its performance counters zeroed
+    for (int bus = 0; bus < I2C_BUS_COUNT; ++bus)
+    {
+        Stats[bus].begin();
+        Engine[bus].begin(bus);
+    }
+
+    // Start the task that streams periodic register samples to the client
+    Streamer.begin();
 
     // Find out if we should start the Wi-Fi in "Access-Point" mode
     bool start_as_ap = ProvButton.is_pressed()       ||
@@ -128,6 +158,9 @@ void periodic_task(void* arg)
 //=========================================================================================================
 void do_periodic()
 {
+    // Take this second's snapshot of how much CPU and stack every task is using
+    Telemetry.sample();
+
     // If the provisioning button has been down for more than 4 seconds and our network is 
     // in STA mode, re-start the network in wireless-access-point mode
     if (ProvButton.is_pressed_at_least(4000) && Network.wifi_status() != WIFI_AP_MODE)
@@ -15,6 +15,7 @@
 #include "lwip/apps/sntp.h"
 #include "globals.h"
 #include "mdns.h"
+#include "history.h"
 
 
 // These are the three kinds of ways we can start the WiFi
@@ -75,8 +76,9 @@ void safe_wifi_start()
 //=========================================================================================================
 void safe_wifi_stop()
 {
-    // Make sure that the TCPServer is stopped
+    // Make sure that the TCP servers are stopped
     TCPServer.stop();
+    BinServer.stop();
 
     // If we have Wi-Fi running, stop it
     if (is_wifi_started)
@@ -138,8 +140,24 @@ void get_time_via_ntp()
 //=========================================================================================================
 static void setup_mdns()
 {  
-   mdns_init();
-   mdns_hostname_set(System.ssid);
+    static bool is_started = false;
+
+    // mDNS keeps running across Wi-Fi reconnects, so it only needs to be set up once
+    if (is_started) return;
+    is_started = true;
+
+    // Set up our host name
+    mdns_init();
+    mdns_hostname_set(System.ssid);
+    mdns_instance_name_set(System.ssid);
+
+    // Every service we advertise tells the client which firmware we're running
+    mdns_txt_item_t txt[] = {{"fw", FW_VERSION}};
+
+    // Advertise the UDP server and the binary TCP server, so clients can find us without knowing
+    // our IP address
+    mdns_service_add(nullptr, "_wifi-i2c", "_udp", UDPServer.port(), txt, 1);
+    mdns_service_add(nullptr, "_wifi-i2c", "_tcp", BinServer.port(), txt, 1);
 }
 //=========================================================================================================
 
@@ -219,6 +237,9 @@ void CNetwork::event_handler(esp_event_base_t event_base, int32_t event_id, void
         // Initialize mDNS and broadcast our dns-name
         setup_mdns();
 
+        // Set the Wi-Fi power-save mode of our performance profile
+        PerfProfile.apply_wifi();
+
         // Fetch the current time via an NTP server on the internet. 
         #if 0
         printf("$$$>>>NTP\n");
@@ -227,6 +248,7 @@ void CNetwork::event_handler(esp_event_base_t event_base, int32_t event_id, void
 
         // Start the servers
         TCPServer.start();
+        BinServer.start();
         UDPServer.begin();
 
         // Output the specially formatted message that software can use to determine our IP address
@@ -253,6 +275,7 @@ void CNetwork::event_handler(esp_event_base_t event_base, int32_t event_id, void
 
         // Stop the servers
         TCPServer.stop();
+        BinServer.stop();
 
         // If we're still in STA mode, go ahead and try to reconnect to the access point
         if (m_wifi_status != WIFI_AP_MODE && m_wifi_status != WIFI_STOPPED)
@@ -633,8 +656,15 @@ void CNetwork::start_as_ap(ap_mode_t reason)
     ble_server_begin();
     #endif
 
+    // Advertise ourselves to mDNS clients on our network
+    setup_mdns();
+
+    // Set the Wi-Fi power-save mode of our performance profile
+    PerfProfile.apply_wifi();
+
     // And start the servers
     TCPServer.start();
+    BinServer.start();
     UDPServer.begin();
 
     // Keep track of what time (in microseconds since boot) that we launched AP mode
@@ -16,11 +16,14 @@ const U32 DATA_PRESENT_MARKER = 0xDEEDBAAF;
 //=========================================================================================================
 // This should be incremented any time a field gets added to the nvsdata_t structure
 //=========================================================================================================
-const int CURRENT_STRUCT_VERSION = 1;
+const int CURRENT_STRUCT_VERSION = 4;
 //--------------------------------------------------------------------------------------------------------
 // Ver  FW_REV  Description
 //--------------------------------------------------------------------------------------------------------
 //   1   1000   Initial creation
+//   2   1004   Added i2c_clock_hz
+//   3   1015   Added i2c1_clock_hz, i2c1_sda_pin, i2c1_scl_pin
+//   4   1025   Added perf_profile
 //--------------------------------------------------------------------------------------------------------
 //=========================================================================================================
 
@@ -81,7 +84,7 @@ void CNVS::init_default_data()
 
 
     //------------------------------------------------------------------------------------------------
-    // TODO: As the data structure grows due to new fields being added, there should be a series of
+    // As the data structure grows due to new fields being added, there should be a series of
     // initializers here that look like:
     //
     //    if (data.struct_version < SOME_CONSTANT)
@@ -91,6 +94,26 @@ void CNVS::init_default_data()
     //
     //-----------------------------------------------------------------------------------------------
 
+    // Fields that were added in version 2
+    if (data.struct_version < 2)
+    {
+        data.i2c_clock_hz = I2C_CLOCK_STANDARD;
+    }
+
+    // Fields that were added in version 3.  The second I2C bus is unused until it's given pins
+    if (data.struct_version < 3)
+    {
+        data.i2c1_clock_hz = I2C_CLOCK_STANDARD;
+        data.i2c1_sda_pin  = PIN_UNUSED;
+        data.i2c1_scl_pin  = PIN_UNUSED;
+    }
+
+    // Fields that were added in version 4
+    if (data.struct_version < 4)
+    {
+        data.perf_profile = PROFILE_BALANCED;
+    }
+
     // Indicate that the data structure is of the most recent format
     data.struct_version = CURRENT_STRUCT_VERSION;
 }
@@ -4,6 +4,7 @@
 #include "nvram.h"
 #include <string.h>
 #include "common.h"
+#include "globals.h"
 
 // We will look for this string in NVRAM to determine whether we have data there
 #define MAGIC_KEY "**nvram**"
@@ -21,6 +22,40 @@ CNVRAM::CNVRAM()
 
     // We aren't going to force Wi-Fi to start in access-point mode
     start_wifi_ap = false;
+
+    // There's no client session to resume.  A part that's all zeros never has a matching CRC
+    memset(&client, 0, sizeof client);
+    memset(engine,  0, sizeof engine);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// part_crc() - Computes the CRC of a session part, not counting the CRC field in its first 4 bytes
+//=========================================================================================================
+static uint32_t part_crc(const void* part, size_t size)
+{
+    return crc32((uint8_t*)part + sizeof(uint32_t), size - sizeof(uint32_t));
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// seal() - Stores the CRC of a session part in its first 4 bytes
+//=========================================================================================================
+void CNVRAM::seal(void* part, size_t size)
+{
+    *(uint32_t*)part = part_crc(part, size);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// is_sealed() - Returns 'true' if the CRC of a session part matches its contents
+//=========================================================================================================
+bool CNVRAM::is_sealed(const void* part, size_t size)
+{
+    return *(const uint32_t*)part == part_crc(part, size);
 }
 //=========================================================================================================
 
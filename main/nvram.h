@@ -2,6 +2,18 @@
 // nvram.h - Defines a structure in RAM that survives reboots
 //=========================================================================================================
 #pragma once
+#include "engine.h"
+
+
+//=========================================================================================================
+// This is the part of the UDP clients' sessions that isn't specific to an I2C bus
+//=========================================================================================================
+struct client_session_t
+{
+    uint32_t        crc;                        // See CNVRAM::seal()
+    udp_session_t   session[MAX_UDP_SESSIONS];  // Each client, and the port it wants its replies on
+};
+//=========================================================================================================
 
 
 class CNVRAM
@@ -14,6 +26,19 @@ public:
     // This will be true if Wi-Fi should start in access-point mode
     bool    start_wifi_ap;
 
+    // This is the clients' session state, so that a soft reboot doesn't end it.  Each part has a writer
+    // of its own (the UDP server for the client part, the engine for that bus for the engine parts), and
+    // each part carries its own CRC, so that if we rebooted in the middle of writing a part, only that
+    // part is lost
+    client_session_t    client;
+    engine_session_t    engine[I2C_BUS_COUNT];
+
+    // Stores the CRC of a session part in its first 4 bytes, after the part has been changed
+    void    seal(void* part, size_t size);
+
+    // Returns 'true' if the CRC of a session part matches its contents
+    bool    is_sealed(const void* part, size_t size);
+
 protected:
 
     // This will contain a "magic string" if this object has already been initialized
@@ -21,5 +46,3 @@ protected:
 };
 
 extern CNVRAM NVRAM;
-
-
@@ -0,0 +1,83 @@
+//=========================================================================================================
+// packet_pool.cpp - Implements a fixed pool of buffers for incoming packets
+//=========================================================================================================
+#include "globals.h"
+
+// This is the memory for all of the packet buffers
+static uint8_t pool_memory[PACKET_POOL_SIZE][PACKET_BUFFER_SIZE];
+
+
+//=========================================================================================================
+// begin() - Creates the queue of free buffers and fills it with every buffer in the pool
+//=========================================================================================================
+void CPacketPool::begin()
+{
+    // Create a queue big enough to hold a pointer to every buffer in the pool
+    m_free_qh = xQueueCreate(PACKET_POOL_SIZE, sizeof(uint8_t*));
+
+    // Every buffer starts out free
+    for (int i = 0; i < PACKET_POOL_SIZE; ++i)
+    {
+        uint8_t* buffer = pool_memory[i];
+        xQueueSend(m_free_qh, &buffer, 0);
+    }
+
+    // Start the counters from zero
+    reset_stats();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// acquire() - Fetches a free buffer from the pool
+//
+// Passed:  wait_ms = The maximum number of milliseconds to wait for a buffer to come free
+//
+// Returns: A pointer to a PACKET_BUFFER_SIZE buffer, or nullptr if none came free in time
+//=========================================================================================================
+uint8_t* CPacketPool::acquire(uint32_t wait_ms)
+{
+    uint8_t* buffer;
+
+    // If there's a free buffer right now, we don't have to wait
+    if (!xQueueReceive(m_free_qh, &buffer, 0))
+    {
+        // Keep track of the fact that the pool ran dry
+        ++m_stats.waits;
+
+        // Wait for the engine to give back a buffer, and if it doesn't, tell the caller
+        if (!xQueueReceive(m_free_qh, &buffer, pdMS_TO_TICKS(wait_ms))) return nullptr;
+    }
+
+    // Keep track of how many buffers we've handed out
+    ++m_stats.acquired;
+
+    // Keep track of the fewest free buffers there have ever been
+    uint32_t free_now = free_count();
+    if (free_now < m_stats.low_water) m_stats.low_water = free_now;
+
+    // Hand the caller his buffer
+    return buffer;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// release() - Gives a buffer back to the pool
+//=========================================================================================================
+void CPacketPool::release(uint8_t* buffer)
+{
+    xQueueSend(m_free_qh, &buffer, 0);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reset_stats() - Resets the counters that describe how the pool has been used
+//=========================================================================================================
+void CPacketPool::reset_stats()
+{
+    memset(&m_stats, 0, sizeof m_stats);
+    m_stats.low_water = free_count();
+}
+//=========================================================================================================
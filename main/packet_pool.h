@@ -0,0 +1,63 @@
+//=========================================================================================================
+// packet_pool.h - Defines a fixed pool of buffers for incoming packets
+//
+// The UDP server takes a buffer from the pool, receives a packet into it, and hands it to the engine.
+// The engine gives the buffer back to the pool when it's done with the packet.   A buffer is never
+// re-used while the engine still owns it.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is how many packet buffers there are, and how big each one is
+#define PACKET_POOL_SIZE    16
+#define PACKET_BUFFER_SIZE  1024
+
+
+//=========================================================================================================
+// These are the counters that tell us how well the pool is keeping up with incoming traffic
+//=========================================================================================================
+struct packet_pool_stats_t
+{
+    uint32_t    acquired;       // Number of buffers handed out
+    uint32_t    waits;          // Number of times a caller had to wait for a free buffer
+    uint32_t    rx_drops;       // Number of packets thrown away because no buffer came free in time
+    uint32_t    queue_drops;    // Number of packets thrown away because the engine's queue was full
+    uint32_t    low_water;      // The fewest free buffers there have ever been
+};
+//=========================================================================================================
+
+
+class CPacketPool
+{
+public:
+
+    // Call this once at startup, before anything calls acquire()
+    void        begin();
+
+    // Fetches a free buffer, waiting up to "wait_ms" for one.   Returns nullptr if none came free
+    uint8_t*    acquire(uint32_t wait_ms);
+
+    // Gives a buffer back to the pool
+    void        release(uint8_t* buffer);
+
+    // Call these to record a packet that had to be thrown away
+    void        count_rx_drop()    {++m_stats.rx_drops;   }
+    void        count_queue_drop() {++m_stats.queue_drops;}
+
+    // Returns the number of buffers that are currently free
+    int         free_count() {return uxQueueMessagesWaiting(m_free_qh);}
+
+    // Returns the counters
+    const packet_pool_stats_t& stats() {return m_stats;}
+
+    // Resets the counters
+    void        reset_stats();
+
+protected:
+
+    // This is a queue of pointers to the buffers that are free
+    QueueHandle_t   m_free_qh;
+
+    // These are the counters that describe how the pool has been used
+    packet_pool_stats_t m_stats;
+};
@@ -0,0 +1,194 @@
+//=========================================================================================================
+// perf_profile.cpp - Implements the performance profile
+//=========================================================================================================
+#include <strings.h>
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "globals.h"
+
+// An identifier that is used by the logging facility
+static const char *TAG = "perf_profile";
+
+// These are the names of the profiles, in the order of perf_profile_t
+static const char* profile_name[PROFILE_COUNT] = {"balanced", "lowlatency", "lowpower"};
+
+
+//=========================================================================================================
+// begin() - Called once at startup to apply the profile that's stored in NVS
+//=========================================================================================================
+void CPerfProfile::begin()
+{
+    // If NVS holds a profile we don't know about, use the default
+    m_profile = NVS.data.perf_profile;
+    if (m_profile >= PROFILE_COUNT) m_profile = PROFILE_BALANCED;
+
+    #if CONFIG_PM_ENABLE
+    // Create the locks that hold the CPU clock up and keep us out of light sleep
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX,   0, "perf_cpu",   &m_cpu_lock);
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "perf_awake", &m_no_sleep_lock);
+    m_has_cpu_lock = m_has_no_sleep_lock = false;
+    #endif
+
+    // Wi-Fi isn't started yet, so the network code applies that part of the profile later.  The engines
+    // aren't started yet either, and pick up their priority from us when they are
+    apply();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set() - Switches to a different profile, and stores it in NVS
+//
+// Returns: 'false' if there's no such profile
+//=========================================================================================================
+bool CPerfProfile::set(int profile)
+{
+    // Make sure this is a profile we know about
+    if (profile < 0 || profile >= PROFILE_COUNT) return false;
+
+    // Switch to the new profile
+    m_profile = profile;
+    apply();
+    apply_wifi();
+
+    // The tasks that are already running get their new priorities
+    for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) Engine[bus].set_priority(priority(TASK_PRIO_ENGINE));
+    UDPServer.set_priority(priority(TASK_PRIO_UDP), priority(TASK_PRIO_REPLY));
+
+    // And the new profile is in effect from now on, even after a reboot
+    NVS.data.perf_profile = profile;
+    NVS.write_to_flash();
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// name() - Returns the name of a profile
+//=========================================================================================================
+const char* CPerfProfile::name(int profile)
+{
+    if (profile < 0 || profile >= PROFILE_COUNT) return "unknown";
+    return profile_name[profile];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// from_name() - Returns the profile with the specified name, or -1 if there isn't one
+//=========================================================================================================
+int CPerfProfile::from_name(const char* name)
+{
+    for (int profile = 0; profile < PROFILE_COUNT; ++profile)
+    {
+        if (strcasecmp(name, profile_name[profile]) == 0) return profile;
+    }
+
+    // If we get here, there's no profile by that name
+    return -1;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// priority() - Returns the priority that a task which would normally run at 'normal' priority runs at
+//              in the current profile
+//=========================================================================================================
+int CPerfProfile::priority(int normal)
+{
+    // In the low-latency profile, the tasks that carry a request from the network to the bus and back
+    // run above everything but the flash task
+    if (m_profile == PROFILE_LOW_LATENCY) return TASK_PRIO_LOW_LATENCY;
+
+    // Otherwise they run at the priority they were built with
+    return normal;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// apply() - Applies the parts of the current profile that don't depend on Wi-Fi or on running tasks
+//=========================================================================================================
+void CPerfProfile::apply()
+{
+    #if CONFIG_PM_ENABLE
+    // The balanced profile runs the CPU at the clock it booted with, just as it would without power
+    // management.  The low-latency profile may run it at 240 MHz, and the low-power profile lets it
+    // drop to 80 MHz (the slowest the APB allows) when nothing needs it faster
+    esp_pm_config_esp32_t config;
+    config.max_freq_mhz = (m_profile == PROFILE_LOW_LATENCY) ? 240 : CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    config.min_freq_mhz = (m_profile == PROFILE_LOW_POWER)   ? 80  : CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    #if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    config.light_sleep_enable = true;
+    #else
+    config.light_sleep_enable = false;
+    #endif
+    esp_err_t rc = esp_pm_configure(&config);
+    if (rc) ESP_LOGE(TAG, "esp_pm_configure() returned %s", esp_err_to_name(rc));
+
+    // The low-latency profile holds the CPU at its fastest, and nothing but the low-power profile lets
+    // us go into light sleep (which would add its wake-up time to every request)
+    bool want_cpu_lock      = (m_profile == PROFILE_LOW_LATENCY);
+    bool want_no_sleep_lock = (m_profile != PROFILE_LOW_POWER);
+
+    if (want_cpu_lock != m_has_cpu_lock)
+    {
+        if (want_cpu_lock) esp_pm_lock_acquire(m_cpu_lock); else esp_pm_lock_release(m_cpu_lock);
+        m_has_cpu_lock = want_cpu_lock;
+    }
+
+    if (want_no_sleep_lock != m_has_no_sleep_lock)
+    {
+        if (want_no_sleep_lock) esp_pm_lock_acquire(m_no_sleep_lock); else esp_pm_lock_release(m_no_sleep_lock);
+        m_has_no_sleep_lock = want_no_sleep_lock;
+    }
+    #endif
+
+    // Set the default clock of the I2C buses
+    apply_i2c();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// apply_i2c() - Sets the default clock of each I2C bus that's installed.  The low-latency profile runs
+//               every bus at least at 400 kHz, the others run it at the clock stored in NVS.  The
+//               bus clocks of individual devices aren't changed
+//=========================================================================================================
+void CPerfProfile::apply_i2c()
+{
+    uint32_t nvs_clock[I2C_BUS_COUNT] = {NVS.data.i2c_clock_hz, NVS.data.i2c1_clock_hz};
+
+    for (int bus = 0; bus < I2C_BUS_COUNT; ++bus)
+    {
+        // A bus that has no pins has no clock
+        if (!I2C[bus].is_installed()) continue;
+
+        // Find the clock this bus should run at in this profile
+        uint32_t clock_hz = nvs_clock[bus];
+        if (m_profile == PROFILE_LOW_LATENCY && clock_hz < I2C_CLOCK_FAST) clock_hz = I2C_CLOCK_FAST;
+
+        // Re-installing the driver takes a moment, so don't do it if the clock is already right
+        if (I2C[bus].clock() != clock_hz) I2C[bus].set_clock(clock_hz);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// apply_wifi() - Sets the Wi-Fi power-save mode of the current profile
+//
+// In modem power save, the radio sleeps between beacons, and a request that arrives while it's asleep
+// waits for the next DTIM beacon to be received.  That's where the latency spikes come from
+//=========================================================================================================
+void CPerfProfile::apply_wifi()
+{
+    wifi_ps_type_t mode = WIFI_PS_MIN_MODEM;
+
+    if (m_profile == PROFILE_LOW_LATENCY) mode = WIFI_PS_NONE;
+    if (m_profile == PROFILE_LOW_POWER)   mode = WIFI_PS_MAX_MODEM;
+
+    // If Wi-Fi hasn't been started yet, this fails harmlessly and the network code calls us again later
+    esp_wifi_set_ps(mode);
+}
+//=========================================================================================================
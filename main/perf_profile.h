@@ -0,0 +1,74 @@
+//=========================================================================================================
+// perf_profile.h - Defines the performance profile: a single setting that trades latency for power
+//
+// A profile decides the Wi-Fi power-save mode, whether the CPU is held at its maximum frequency, the
+// priorities of the engines and the UDP tasks, and the default I2C bus clock.   The profile is stored
+// in NVS, applied at boot, and can be switched at any time from the TCP server ("profile" command)
+//
+// The CPU frequency is managed with power management (CONFIG_PM_ENABLE, which sdkconfig turns on).  The
+// balanced profile keeps the CPU at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ, the low-latency profile holds it
+// at 240 MHz, and the low-power profile lets it drop to 80 MHz.  In a build without power management, the
+// CPU always runs at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ and every other part of a profile still applies
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+// These are the performance profiles
+enum perf_profile_t
+{
+    PROFILE_BALANCED    = 0,    // The IDF defaults: modem power save, compile-time task priorities
+                                // and CPU clock
+    PROFILE_LOW_LATENCY = 1,    // No power save, 240 MHz CPU clock, engines and UDP tasks preempt
+                                // everything but flash, and at least a 400 kHz I2C bus
+    PROFILE_LOW_POWER   = 2,    // Maximum modem power save, and the CPU and APB clocks may drop
+    PROFILE_COUNT       = 3
+};
+
+
+class CPerfProfile
+{
+public:
+
+    // Called once at startup, after NVS and the I2C buses are initialized, and before the engines are
+    // started.  Applies the profile that's stored in NVS
+    void    begin();
+
+    // Switches to a profile and stores it in NVS.  Returns 'false' if there's no such profile
+    bool    set(int profile);
+
+    // Returns the profile that's in effect
+    int     current() {return m_profile;}
+
+    // Returns the name of a profile, or converts a name to a profile (-1 if there's no such profile)
+    static const char* name(int profile);
+    static int  from_name(const char* name);
+
+    // Called by the network code every time Wi-Fi has started, to set its power-save mode
+    void    apply_wifi();
+
+    // Returns the priority that a task which would normally run at 'normal' priority runs at in the
+    // current profile.  Only the engines and the UDP tasks are affected
+    int     priority(int normal);
+
+protected:
+
+    // Applies every part of the current profile
+    void    apply();
+
+    // Sets the default clock of each I2C bus that's installed
+    void    apply_i2c();
+
+    // This is the profile that's in effect
+    int     m_profile;
+
+    #if CONFIG_PM_ENABLE
+    // These hold the CPU at its maximum frequency, and keep it out of light sleep
+    esp_pm_lock_handle_t m_cpu_lock, m_no_sleep_lock;
+
+    // These are true while we're holding the locks
+    bool    m_has_cpu_lock, m_has_no_sleep_lock;
+    #endif
+};
@@ -0,0 +1,268 @@
+//=========================================================================================================
+// reg_cache.cpp - Implements a shadow cache of device registers
+//=========================================================================================================
+#include "esp_timer.h"
+#include "globals.h"
+
+
+//=========================================================================================================
+// begin() - Called once at startup to create the mutex, and mark every range and entry as unused
+//=========================================================================================================
+void CRegCache::begin()
+{
+    // Create the mutex that keeps tasks from tripping over each other
+    m_mutex = xSemaphoreCreateMutex();
+
+    // No range has a caching policy, and no entries hold data
+    memset(m_range, 0, sizeof m_range);
+    memset(m_entry, 0, sizeof m_entry);
+    m_next_entry = 0;
+
+    // Start the counters from zero
+    reset_stats();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_range() - Declares the caching policy of a range of registers
+//
+// Passed: index      = Which range (0 thru MAX_CACHE_RANGES-1)
+//         address    = The CACHE_KEY() of the device
+//         first_reg  = The first register in the range
+//         last_reg   = The last register in the range
+//         policy     = A cache_policy_t.  CACHE_NONE frees the range
+//         ttl_ms     = For CACHE_TTL, how long cached data remains valid
+//
+// Returns: 'false' if the parameters don't make sense
+//=========================================================================================================
+bool CRegCache::set_range(int index, int address, uint32_t first_reg, uint32_t last_reg, int policy, uint32_t ttl_ms)
+{
+    // Make sure the parameters are sensible
+    if (index < 0 || index >= MAX_CACHE_RANGES) return false;
+    if (policy < CACHE_NONE || policy > CACHE_TTL) return false;
+    if (policy != CACHE_NONE && ((address & 0xFF) < 1 || (address & 0xFF) > 0x7F || last_reg < first_reg)) return false;
+    if (policy == CACHE_TTL && ttl_ms == 0) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Fill in the range
+    range_t& range  = m_range[index];
+    range.policy    = policy;
+    range.address   = address;
+    range.first_reg = first_reg;
+    range.last_reg  = last_reg;
+    range.ttl_us    = (int64_t)ttl_ms * 1000;
+
+    xSemaphoreGive(m_mutex);
+
+    // Whatever was cached under the old policy is suspect
+    invalidate();
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find_range() - Returns the range that a register belongs to, or nullptr if it isn't in a cached range.
+//                The caller must own m_mutex
+//=========================================================================================================
+CRegCache::range_t* CRegCache::find_range(int address, uint32_t reg)
+{
+    for (int i = 0; i < MAX_CACHE_RANGES; ++i)
+    {
+        range_t& range = m_range[i];
+        if (range.policy == CACHE_NONE || range.address != address) continue;
+        if (reg >= range.first_reg && reg <= range.last_reg) return &range;
+    }
+
+    // If we get here, this register isn't cached
+    return nullptr;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find_entry() - Returns the entry holding a cached read, or nullptr if there isn't one.
+//                The caller must own m_mutex
+//=========================================================================================================
+CRegCache::entry_t* CRegCache::find_entry(int address, uint32_t reg, int length)
+{
+    for (int i = 0; i < MAX_CACHE_ENTRIES; ++i)
+    {
+        entry_t& entry = m_entry[i];
+        if (entry.valid && entry.address == address && entry.reg == reg && entry.length == length) return &entry;
+    }
+
+    // If we get here, this read isn't cached
+    return nullptr;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// fill() - Fills in a cache entry with data and an expiration time.  The caller must own m_mutex
+//=========================================================================================================
+void CRegCache::fill(entry_t* p_entry, range_t* p_range, const uint8_t* data)
+{
+    memcpy(p_entry->data, data, p_entry->length);
+    p_entry->expires = (p_range->policy == CACHE_TTL) ? esp_timer_get_time() + p_range->ttl_us : 0;
+    p_entry->valid   = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// lookup() - Looks for a read in the cache
+//
+// Passed: address = The CACHE_KEY() of the device
+//         reg     = The register number
+//         length  = The number of bytes being read
+//         data    = Where to store the data if it's in the cache
+//
+// Returns: 'true' if the read was answered from the cache
+//=========================================================================================================
+bool CRegCache::lookup(int address, int reg, int length, uint8_t* data)
+{
+    bool hit = false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If this register is in a cached range...
+    if (find_range(address, reg))
+    {
+        // Find out if we have this read cached
+        entry_t* p_entry = find_entry(address, reg, length);
+
+        // If the cached data has expired, throw it away
+        if (p_entry && p_entry->expires && esp_timer_get_time() >= p_entry->expires)
+        {
+            p_entry->valid = false;
+            p_entry = nullptr;
+        }
+
+        // If we have good data, hand it to the caller
+        if (p_entry)
+        {
+            memcpy(data, p_entry->data, length);
+            hit = true;
+        }
+
+        // Keep track of how well the cache is working
+        if (hit) ++m_stats.hits; else ++m_stats.misses;
+    }
+
+    xSemaphoreGive(m_mutex);
+    return hit;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// store() - Called after a successful bus read.   If the register is in a cached range, caches the data
+//=========================================================================================================
+void CRegCache::store(int address, int reg, int length, const uint8_t* data)
+{
+    // If this read is too long to cache, don't bother
+    if (length < 1 || length > MAX_CACHE_DATA) return;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If this register is in a cached range...
+    range_t* p_range = find_range(address, reg);
+    if (p_range)
+    {
+        // If we don't already have an entry for this read, re-use the oldest one
+        entry_t* p_entry = find_entry(address, reg, length);
+        if (p_entry == nullptr)
+        {
+            p_entry = &m_entry[m_next_entry];
+            m_next_entry = (m_next_entry + 1) % MAX_CACHE_ENTRIES;
+            p_entry->address = address;
+            p_entry->reg     = reg;
+            p_entry->length  = length;
+        }
+
+        // And cache the data
+        fill(p_entry, p_range, data);
+    }
+
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_write() - Called after a bus write.   A cached read of exactly the registers that were written gets
+//              the new data.  Any other cached read that overlaps the written registers is thrown away
+//
+// Passed: address = The CACHE_KEY() of the device
+//         reg     = The first register written
+//         length  = The number of bytes written
+//         data    = The data that was written, or nullptr if the write failed
+//=========================================================================================================
+void CRegCache::on_write(int address, int reg, int length, const uint8_t* data)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // These are the registers that were written
+    uint32_t first = reg, last = reg + (length ? length - 1 : 0);
+
+    // Look at every cached read for this device
+    for (int i = 0; i < MAX_CACHE_ENTRIES; ++i)
+    {
+        entry_t& entry = m_entry[i];
+        if (!entry.valid || entry.address != address) continue;
+
+        // If this cached read doesn't overlap the registers that were written, it's still good
+        if (entry.reg + entry.length - 1 < first || entry.reg > last) continue;
+
+        // If the write succeeded and exactly matches this cached read, the cache gets the new data
+        range_t* p_range = find_range(address, reg);
+        if (data && entry.reg == first && entry.length == length && p_range)
+        {
+            fill(&entry, p_range, data);
+            continue;
+        }
+
+        // Otherwise, we no longer know what's in those registers
+        entry.valid = false;
+        ++m_stats.invalidations;
+    }
+
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// invalidate() - Throws away the cached data for one device, or for every device if address is -1
+//=========================================================================================================
+void CRegCache::invalidate(int address)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < MAX_CACHE_ENTRIES; ++i)
+    {
+        entry_t& entry = m_entry[i];
+        if (!entry.valid) continue;
+        if (address >= 0 && entry.address != address) continue;
+        entry.valid = false;
+        ++m_stats.invalidations;
+    }
+
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// entries_in_use() - Returns the number of cache entries that hold data
+//=========================================================================================================
+int CRegCache::entries_in_use()
+{
+    int count = 0;
+    for (int i = 0; i < MAX_CACHE_ENTRIES; ++i) if (m_entry[i].valid) ++count;
+    return count;
+}
+//=========================================================================================================
@@ -0,0 +1,121 @@
+//=========================================================================================================
+// reg_cache.h - Defines a shadow cache of device registers
+//
+// The client declares ranges of registers on a device and gives each range a caching policy.  Reads
+// of a cached register are answered from RAM without touching the bus.   Writes to a cached register
+// update the cache (write-through), and a failed write invalidates it.
+//
+// The cache is keyed by (device, register, length), so a cached read only satisfies a later read of
+// the same register with the same length.   Because most devices auto-increment their register
+// pointer, a write is assumed to touch 'length' consecutive registers, and any cached read that
+// overlaps those registers without matching the write exactly is invalidated.
+//
+// Devices on different I2C buses can have the same address, so the cache knows a device by a key that
+// combines the bus and the address.  Build one with CACHE_KEY()
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is the key the cache knows the device at an I2C address on a particular bus by
+#define CACHE_KEY(bus, address) (((bus) << 8) | (address))
+
+// This is how many register ranges can have a caching policy
+#define MAX_CACHE_RANGES    8
+
+// This is how many cached reads we can hold, and the longest read we'll cache
+#define MAX_CACHE_ENTRIES   32
+#define MAX_CACHE_DATA      16
+
+// These are the caching policies a range of registers can have
+enum cache_policy_t
+{
+    CACHE_NONE          = 0,    // Every read goes to the bus
+    CACHE_WRITE_THROUGH = 1,    // Reads are cached until a write or an invalidate
+    CACHE_TTL           = 2     // Like write-through, but cached data also expires after a while
+};
+
+
+//=========================================================================================================
+// These are the counters that describe how well the cache is working
+//=========================================================================================================
+struct reg_cache_stats_t
+{
+    uint32_t    hits;
+    uint32_t    misses;
+    uint32_t    invalidations;
+};
+//=========================================================================================================
+
+
+class CRegCache
+{
+public:
+
+    // Called once at startup
+    void    begin();
+
+    // Declares the caching policy of a range of registers.  CACHE_NONE frees the range
+    bool    set_range(int index, int address, uint32_t first_reg, uint32_t last_reg, int policy, uint32_t ttl_ms);
+
+    // If a read can be answered from the cache, fills in 'data' and returns 'true'
+    bool    lookup(int address, int reg, int length, uint8_t* data);
+
+    // Called after a bus read.  If the register is in a cached range, the data is cached
+    void    store(int address, int reg, int length, const uint8_t* data);
+
+    // Called after a bus write.  'data' is nullptr if the write failed
+    void    on_write(int address, int reg, int length, const uint8_t* data);
+
+    // Throws away cached data for one device, or for every device if address is -1
+    void    invalidate(int address = -1);
+
+    // Fetches and resets the counters
+    reg_cache_stats_t stats() {return m_stats;}
+    void    reset_stats() {memset(&m_stats, 0, sizeof m_stats);}
+
+    // Returns the number of cache entries that hold data
+    int     entries_in_use();
+
+protected:
+
+    struct range_t
+    {
+        int         policy;
+        int         address;
+        uint32_t    first_reg;
+        uint32_t    last_reg;
+        int64_t     ttl_us;
+    };
+
+    struct entry_t
+    {
+        bool        valid;
+        uint16_t    address;        // The CACHE_KEY() of the device
+        uint8_t     length;
+        uint32_t    reg;
+        int64_t     expires;        // Time (in microseconds) the data expires, or 0 for never
+        uint8_t     data[MAX_CACHE_DATA];
+    };
+
+    // Returns the range that a register belongs to, or nullptr if it's not in a cached range
+    range_t*    find_range(int address, uint32_t reg);
+
+    // Returns the entry that holds a cached read, or nullptr if there isn't one
+    entry_t*    find_entry(int address, uint32_t reg, int length);
+
+    // Fills in an entry with data and an expiration time
+    void        fill(entry_t* p_entry, range_t* p_range, const uint8_t* data);
+
+    // These are the register ranges that have a caching policy
+    range_t     m_range[MAX_CACHE_RANGES];
+
+    // These are the cached reads, and the index of the entry to re-use next
+    entry_t     m_entry[MAX_CACHE_ENTRIES];
+    int         m_next_entry;
+
+    // These are the counters that describe how well the cache is working
+    reg_cache_stats_t m_stats;
+
+    // Reads and writes can come from several tasks at once
+    SemaphoreHandle_t m_mutex;
+};
@@ -0,0 +1,71 @@
+//=========================================================================================================
+// spsc_ring.h - A lock-free ring buffer with a single producer task and a single consumer task
+//
+// The producer only ever writes m_head, and the consumer only ever writes m_tail, so neither side
+// needs a lock.   The producer publishes an item with a release-store of m_head, and the consumer
+// acquires it, so the consumer never sees a half-written item.   The same goes in the other direction
+// for m_tail, so the producer never overwrites an item the consumer is still looking at.
+//
+// The ring doesn't block.  Waking the consumer up (typically with a task notification) is up to the
+// caller.   CAPACITY must be a power of two.
+//=========================================================================================================
+#pragma once
+#include <atomic>
+#include "common.h"
+
+template <class T, int CAPACITY> class CSpscRing
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+
+    CSpscRing() {m_head = 0; m_tail = 0;}
+
+    // Called by the producer.  Returns 'false' if the ring is full
+    bool    push(const T& item)
+    {
+        uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == CAPACITY) return false;
+        m_item[head & (CAPACITY - 1)] = item;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer.  Returns a pointer to the oldest item, or nullptr if the ring is empty.
+    // The item stays in the ring (so the producer can't overwrite it) until pop() is called
+    T*      peek()
+    {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire)) return nullptr;
+        return &m_item[tail & (CAPACITY - 1)];
+    }
+
+    // Called by the consumer to throw away the item that peek() returned
+    void    pop() {m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);}
+
+    // Called by the consumer.  Copies out the oldest item and removes it.  Returns 'false' if empty
+    bool    pop(T* p_item)
+    {
+        T* p = peek();
+        if (p == nullptr) return false;
+        *p_item = *p;
+        pop();
+        return true;
+    }
+
+    // Returns the number of items in the ring.  Either side may call this
+    int     count() {return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);}
+
+    // Returns 'true' if the ring is empty
+    bool    empty() {return count() == 0;}
+
+protected:
+
+    // These are the items in the ring
+    T                       m_item[CAPACITY];
+
+    // The producer writes to m_head, the consumer writes to m_tail.  Both only ever count up
+    std::atomic<uint32_t>   m_head;
+    std::atomic<uint32_t>   m_tail;
+};
+//=========================================================================================================
@@ -0,0 +1,96 @@
+//=========================================================================================================
+// stats.cpp - Implements the performance counters of the command engine
+//=========================================================================================================
+#include "globals.h"
+
+
+//=========================================================================================================
+// record() - Records a command that the engine has handled
+//
+// Passed: command    = The command number
+//         error      = The error code that was sent in the reply
+//         bus_us     = Microseconds the command spent on the I2C bus
+//         bytes_in   = Length of the request packet
+//         bytes_out  = Length of the reply
+//         latency_us = Microseconds from the arrival of the request to the sending of the reply
+//=========================================================================================================
+void CStats::record(int command, int error, uint32_t bus_us, int bytes_in, int bytes_out, uint32_t latency_us)
+{
+    // If this command doesn't have counters, ignore it
+    if (command < 0 || command >= STATS_MAX_COMMANDS) return;
+
+    // Point to the counters for this command
+    cmd_stats_t& stats = m_command[command];
+
+    // Update the counters
+    ++stats.count;
+    if (error) ++stats.errors;
+    stats.bus_us    += bus_us;
+    stats.bytes_in  += bytes_in;
+    stats.bytes_out += bytes_out;
+
+    // The histogram bucket is the position of the highest set bit in the latency
+    int bucket = latency_us ? 31 - __builtin_clz(latency_us) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    ++stats.latency[bucket];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// command() - Returns the counters for a command, or nullptr if the command number is out of range
+//=========================================================================================================
+const cmd_stats_t* CStats::command(int command)
+{
+    if (command < 0 || command >= STATS_MAX_COMMANDS) return nullptr;
+    return &m_command[command];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// percentile() - Estimates a latency percentile from a command's histogram
+//
+// Passed: command = The command number
+//         percent = 1 thru 100
+//
+// Returns: The upper end (in microseconds) of the bucket that the percentile falls in, or 0 if the
+//          command has never been handled
+//=========================================================================================================
+uint32_t CStats::percentile(int command, int percent)
+{
+    // If there are no counters for this command, there's no percentile
+    const cmd_stats_t* p_stats = this->command(command);
+    if (p_stats == nullptr) return 0;
+
+    // Add up the samples in the histogram.  We don't use "count", since it may be mid-update
+    uint32_t total = 0;
+    for (int i=0; i<LATENCY_BUCKETS; ++i) total += p_stats->latency[i];
+    if (total == 0) return 0;
+
+    // This is how many samples have to be at or below the percentile
+    uint64_t needed = ((uint64_t)total * percent + 99) / 100;
+
+    // Find the bucket where we've seen that many samples
+    uint32_t seen = 0;
+    for (int i=0; i<LATENCY_BUCKETS - 1; ++i)
+    {
+        seen += p_stats->latency[i];
+        if (seen >= needed) return bucket_floor(i + 1) - 1;
+    }
+
+    // If we get here, the percentile is in the open-ended last bucket
+    return bucket_floor(LATENCY_BUCKETS - 1);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reset() - Resets every counter
+//=========================================================================================================
+void CStats::reset()
+{
+    memset(m_command, 0, sizeof m_command);
+    memset(&m_engine, 0, sizeof m_engine);
+}
+//=========================================================================================================
@@ -0,0 +1,88 @@
+//=========================================================================================================
+// stats.h - Defines the performance counters of the command engine
+//
+// Every command the engine handles is counted, along with its errors, the time it spent on the I2C bus,
+// the bytes it moved, and its end-to-end latency (from the moment the packet arrived to the moment its
+// reply was handed to the network).  Latencies are kept as a log2 histogram: bucket 'n' counts replies
+// that took between 2^n and 2^(n+1) - 1 microseconds, and the last bucket catches everything slower.
+//
+// The counters are only ever updated by the engine task, so they need no locking.  A reader in another
+// task might see one counter that's a single update behind the others, which is fine for statistics.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is how many command numbers have their own counters
+#define STATS_MAX_COMMANDS  32
+
+// This is how many buckets there are in a latency histogram.  The last one holds anything >= 2^19 us
+#define LATENCY_BUCKETS     20
+
+
+//=========================================================================================================
+// These are the counters for a single command
+//=========================================================================================================
+struct cmd_stats_t
+{
+    uint32_t    count;                      // Number of times this command was handled
+    uint32_t    errors;                     // Number of those that replied with an error
+    uint64_t    bus_us;                     // Microseconds spent on the I2C bus
+    uint32_t    bytes_in;                   // Bytes received in requests
+    uint32_t    bytes_out;                  // Bytes sent in replies
+    uint32_t    latency[LATENCY_BUCKETS];   // Log2 histogram of end-to-end latency in microseconds
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// These are the counters that aren't specific to a command
+//=========================================================================================================
+struct engine_stats_t
+{
+    uint32_t    duplicates;                 // Packets with a transaction ID we'd already handled
+    uint32_t    queue_high_water;           // The most packets there have ever been in the event queue
+};
+//=========================================================================================================
+
+
+class CStats
+{
+public:
+
+    // Called once at startup
+    void    begin() {reset();}
+
+    // Records a command that has been handled
+    void    record(int command, int error, uint32_t bus_us, int bytes_in, int bytes_out, uint32_t latency_us);
+
+    // Records a packet whose transaction ID we'd already seen
+    void    count_duplicate() {++m_engine.duplicates;}
+
+    // Records how many packets were in the event queue
+    void    note_queue_depth(uint32_t depth)
+            {if (depth > m_engine.queue_high_water) m_engine.queue_high_water = depth;}
+
+    // Returns the counters for a command, or nullptr if the command number is out of range
+    const cmd_stats_t* command(int command);
+
+    // Returns the counters that aren't specific to a command
+    const engine_stats_t& engine() {return m_engine;}
+
+    // Returns the latency (in microseconds) that 'percent' of the command's replies were faster than.
+    // The answer is the upper end of a histogram bucket, so it's only accurate to a factor of two
+    uint32_t percentile(int command, int percent);
+
+    // Returns the first latency (in microseconds) that lands in histogram bucket 'n'
+    static uint32_t bucket_floor(int n) {return n ? (1 << n) : 0;}
+
+    // Resets every counter
+    void    reset();
+
+protected:
+
+    // These are the counters for each command
+    cmd_stats_t     m_command[STATS_MAX_COMMANDS];
+
+    // These are the counters that aren't specific to a command
+    engine_stats_t  m_engine;
+};
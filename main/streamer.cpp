@@ -0,0 +1,482 @@
+//=========================================================================================================
+// streamer.cpp - Implements the engine that samples device registers periodically and streams the
+//                samples to the client
+//=========================================================================================================
+#include "globals.h"
+
+
+//=========================================================================================================
+// launch_task() - Calls the "task()" routine in the specified object
+//
+// Passed: *pvParameters points to the object that we want to use to run the task
+//=========================================================================================================
+static void launch_task(void *pvParameters)
+{
+    // Fetch a pointer to the object that is going to run out task
+    CStreamer* p_object = (CStreamer*) pvParameters;
+    
+    // And run the task for that object!
+    p_object->task();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// begin() - Creates a timer for each stream job and starts the streamer task
+//=========================================================================================================
+void CStreamer::begin()
+{
+    esp_timer_create_args_t timer_args;
+
+    // Create the queue that the timers post "sample is due" notifications to
+    m_sample_qh = xQueueCreate(MAX_STREAM_JOBS * 4, sizeof(int));
+
+    // Create the mutex that protects the job descriptors
+    m_mutex = xSemaphoreCreateMutex();
+
+    // Initialize each job and create its timer
+    for (int i = 0; i < MAX_STREAM_JOBS; ++i)
+    {
+        job_t& job = m_job[i];
+        memset(&job.cfg,    0, sizeof job.cfg);
+        memset(&job.status, 0, sizeof job.status);
+        job.owner = this;
+        job.index = i;
+        job.missed = 0;
+
+        memset(&timer_args, 0, sizeof timer_args);
+        timer_args.callback        = on_timer;
+        timer_args.arg             = &job;
+        timer_args.dispatch_method = ESP_TIMER_TASK;
+        timer_args.name            = "stream";
+        esp_timer_create(&timer_args, &job.timer);
+    }
+
+    // And start the task
+    xTaskCreatePinnedToCore(launch_task, "streamer", 4096, this, TASK_PRIO_STREAM, &m_task_handle, TASK_CPU);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_timer() - Called by esp_timer each time a sample is due.  Tells the streamer task to take it
+//=========================================================================================================
+void CStreamer::on_timer(void* p_job)
+{
+    job_t& job = *(job_t*)p_job;
+
+    // Tell the streamer task that this job needs a sample, and if it's too far behind, count an overrun.
+    // We don't own m_mutex here, so the streamer task adds the count to the job's status later
+    if (!xQueueSend(job.owner->m_sample_qh, &job.index, 0)) ++job.missed;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// sample_size() - Returns the size of a single sample (timestamp, status, and register data)
+//=========================================================================================================
+int CStreamer::sample_size(const stream_cfg_t& cfg)
+{
+    int size = SAMPLE_HDR_SIZE;
+    for (int i = 0; i < cfg.reg_count; ++i) size += cfg.regs[i].length;
+    return size;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start() - Starts a stream job.  If the job was already running, it is stopped first
+//
+// Passed: job = The job number
+//         cfg = Describes what to sample and how often
+//
+// Returns: 'false' if the configuration is invalid
+//=========================================================================================================
+bool CStreamer::start(int job_number, const stream_cfg_t& cfg)
+{
+    // Make sure the job number is valid
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS) return false;
+    
+    // The virtual device at address 0 belongs to the engine task, so a stream can't sample it
+    if (cfg.address == 0) return false;
+
+    // Make sure there's at least one register to sample, and that we're not sampling too fast
+    if (cfg.reg_count < 1 || cfg.reg_count > MAX_STREAM_REGS) return false;
+    if (cfg.period_us < MIN_STREAM_PERIOD_US) return false;
+
+    // Make sure at least one sample fits in a packet
+    int size = sample_size(cfg);
+    int capacity = (STREAM_PACKET_SIZE - STREAM_HDR_SIZE) / size;
+    if (capacity < 1) return false;
+
+    // Point to the job
+    job_t& job = m_job[job_number];
+
+    // We don't want the streamer task looking at this job while we're configuring it
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If this job is already running, stop it
+    stop_job(job);
+
+    // Save the configuration
+    job.cfg = cfg;
+    job.sample_size = size;
+
+    // The job is now running
+    activate(job, cfg.samples_per_packet, capacity);
+
+    // Start the timer that tells us when each sample is due
+    esp_timer_start_periodic(job.timer, cfg.period_us);
+
+    // We're done configuring the job
+    xSemaphoreGive(m_mutex);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start_external() - Starts a stream job with no timer.  Some other task pushes samples into it
+//
+// Passed: job                = The job number
+//         data_length        = The number of data bytes in each sample
+//         samples_per_packet = The maximum number of samples to pack into each packet
+//         session            = The UDP session the samples go to, or LATEST_SESSION
+//
+// Returns: 'false' if the job number is invalid or a sample won't fit in a packet
+//=========================================================================================================
+bool CStreamer::start_external(int job_number, int data_length, int samples_per_packet, int session)
+{
+    // Make sure the job number is valid
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS) return false;
+
+    // Make sure at least one sample fits in a packet
+    int size = SAMPLE_HDR_SIZE + data_length;
+    int capacity = (STREAM_PACKET_SIZE - STREAM_HDR_SIZE) / size;
+    if (data_length < 0 || capacity < 1) return false;
+
+    // Point to the job
+    job_t& job = m_job[job_number];
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If this job is already running, stop it
+    stop_job(job);
+
+    // An externally fed job has no registers and no sampling period
+    memset(&job.cfg, 0, sizeof job.cfg);
+    job.cfg.session = session;
+    job.sample_size = size;
+
+    // The job is now running
+    activate(job, samples_per_packet, capacity);
+
+    xSemaphoreGive(m_mutex);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// activate() - Resets a job's status and packet and marks it as running.  The caller must own m_mutex
+//
+// Passed: job                = The job to activate
+//         samples_per_packet = The number of samples the client would like in each packet
+//         capacity           = The number of samples that will fit in a packet
+//=========================================================================================================
+void CStreamer::activate(job_t& job, int samples_per_packet, int capacity)
+{
+    // Never put more samples in a packet than will fit, and always at least one
+    if (samples_per_packet > capacity) samples_per_packet = capacity;
+    if (samples_per_packet > 255     ) samples_per_packet = 255;
+    if (samples_per_packet < 1       ) samples_per_packet = 1;
+    job.cfg.samples_per_packet = samples_per_packet;
+
+    // Reset the status of the job
+    memset(&job.status, 0, sizeof job.status);
+    job.missed = 0;
+    job.status.period_us = job.cfg.period_us;
+    job.status.running   = true;
+
+    // The packet is empty
+    job.samples_in_packet = 0;
+    job.packet_length     = STREAM_HDR_SIZE;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// push() - Pushes a sample into an externally fed job.  This is safe to call from any task
+//
+// Passed: job       = The job number
+//         timestamp = Time the sample was taken, in microseconds
+//         status    = SAMPLE_OK or an error status
+//         data      = Pointer to the sample data.   It must be as long as the job's samples
+//=========================================================================================================
+void CStreamer::push(int job_number, uint32_t timestamp, int status, const uint8_t* data)
+{
+    // Make sure the job number is valid
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS) return;
+
+    // Point to the job
+    job_t& job = m_job[job_number];
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If the job is running (and isn't a timer-driven job), add the sample to it
+    if (job.status.running && job.status.period_us == 0)
+    {
+        ++job.status.samples;
+        if (status != SAMPLE_OK) ++job.status.errors;
+        push_sample(job, timestamp, status, data, job.sample_size - SAMPLE_HDR_SIZE);
+    }
+
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// count_overruns() - Adds to the count of samples that a job missed
+//=========================================================================================================
+void CStreamer::count_overruns(int job_number, uint32_t count)
+{
+    // Make sure the job number is valid
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS) return;
+
+    // Add to the count
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_job[job_number].status.overruns += count;
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stop() - Stops a stream job, sending any samples that haven't gone out yet
+//=========================================================================================================
+void CStreamer::stop(int job_number)
+{
+    // Make sure the job number is valid
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS) return;
+
+    // Stop the job
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    stop_job(m_job[job_number]);
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stop_all() - Stops every stream job
+//=========================================================================================================
+void CStreamer::stop_all()
+{
+    for (int i = 0; i < MAX_STREAM_JOBS; ++i) stop(i);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stop_session() - Stops every stream job whose samples go to the specified UDP session.  Jobs that
+//                  send to LATEST_SESSION keep running
+//=========================================================================================================
+void CStreamer::stop_session(int session)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    for (job_t& job : m_job) if (job.cfg.session == session) stop_job(job);
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stop_job() - Stops a stream job.  The caller must own m_mutex
+//=========================================================================================================
+void CStreamer::stop_job(job_t& job)
+{
+    // If the job isn't running, there's nothing to do
+    if (!job.status.running) return;
+
+    // Stop the timer
+    esp_timer_stop(job.timer);
+
+    // Send the samples that are waiting to go out
+    flush(job);
+
+    // And the job is no longer running
+    job.status.running = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_status() - Fetches the current status of a stream job
+//=========================================================================================================
+void CStreamer::get_status(int job_number, stream_status_t* p_status)
+{
+    // If the job number is invalid, it's not running
+    if (job_number < 0 || job_number >= MAX_STREAM_JOBS)
+    {
+        memset(p_status, 0, sizeof *p_status);
+        return;
+    }
+
+    // Otherwise, hand the caller a copy of the job's status, including overruns the timer just counted
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    job_t& job = m_job[job_number];
+    job.status.overruns += job.missed.exchange(0);
+    *p_status = job.status;
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// task() - Waits for samples to come due and takes them
+//=========================================================================================================
+void CStreamer::task()
+{
+    int job_number;
+
+    // Loop forever, waiting for samples to come due
+    while (xQueueReceive(m_sample_qh, &job_number, portMAX_DELAY))
+    {
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+        // If the job was stopped (or re-configured as externally fed) after this sample came due, ignore it
+        job_t& job = m_job[job_number];
+        job.status.overruns += job.missed.exchange(0);
+        if (job.status.running && job.status.period_us) take_sample(job);
+
+        xSemaphoreGive(m_mutex);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// take_sample() - Reads the registers for one sample of a job, and pushes the sample into its packet
+//=========================================================================================================
+void CStreamer::take_sample(job_t& job)
+{
+    // Only the streamer task takes samples, so this buffer doesn't need to live on its stack
+    static uint8_t data[STREAM_PACKET_SIZE];
+    int     status = SAMPLE_OK;
+
+    // The timestamp of the sample is the time we started reading it
+    uint32_t timestamp = (uint32_t)esp_timer_get_time();
+
+    // The whole sample is read in one turn on the bus, and it has to be done before the next one is due
+    CI2C& i2c = I2C[job.cfg.bus];
+    i2c.lock(BUS_CLASS_SAMPLING, esp_timer_get_time() + job.cfg.period_us);
+
+    // Read each register in the list
+    uint8_t* out = data;
+    for (int i = 0; i < job.cfg.reg_count; ++i)
+    {
+        const stream_reg_t& r = job.cfg.regs[i];
+        
+        // If this read fails, the sample gets an error status and zeros in place of the data.  A sample
+        // is always fresh from the device, never from the register cache
+        if (!Engine[job.cfg.bus].i2c_read(job.cfg.address, r.reg, job.cfg.reg_width, out, r.length, RWF_NO_CACHE))
+        {
+            memset(out, 0, r.length);
+            status = SAMPLE_I2C_ERROR;
+        }
+
+        // The next register's data goes after this one's
+        out += r.length;
+    }
+
+    // Other tasks can have the bus now
+    i2c.unlock();
+
+    // Keep track of how many samples we've taken, and how many failed
+    ++job.status.samples;
+    if (status != SAMPLE_OK) ++job.status.errors;
+
+    // Add this sample to the packet
+    push_sample(job, timestamp, status, data, out - data);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// push_sample() - Appends a sample to a job's packet, and sends the packet when it's full
+//
+// Passed: job       = The job the sample belongs to
+//         timestamp = Time the sample was taken, in microseconds
+//         status    = SAMPLE_OK or an error status
+//         data      = Pointer to the sample data
+//         length    = The length of the sample data
+//=========================================================================================================
+void CStreamer::push_sample(job_t& job, uint32_t timestamp, int status, const uint8_t* data, int length)
+{
+    // Point to where this sample goes in the packet
+    uint8_t* out = job.packet + job.packet_length;
+
+    // Output the timestamp and status
+    *out++ = timestamp >> 24;
+    *out++ = timestamp >> 16;
+    *out++ = timestamp >>  8;
+    *out++ = timestamp;
+    *out++ = status;
+
+    // Output the sample data
+    memcpy(out, data, length);
+    out += length;
+
+    // The packet now has one more sample in it
+    job.packet_length = out - job.packet;
+    ++job.samples_in_packet;
+
+    // If the packet is full, send it
+    if (job.samples_in_packet >= job.cfg.samples_per_packet) flush(job);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// flush() - If a job's packet has any samples in it, fills in the packet header and sends it
+//=========================================================================================================
+void CStreamer::flush(job_t& job)
+{
+    // If there are no samples in the packet, there's nothing to send
+    if (job.samples_in_packet == 0) return;
+
+    // Point to the packet header
+    uint8_t* out = job.packet;
+    uint32_t seq = job.status.seq;
+    uint32_t trans_id = STREAM_TRANS_ID;
+
+    // Fill in the transaction ID, command, and error code
+    *out++ = trans_id >> 24;
+    *out++ = trans_id >> 16;
+    *out++ = trans_id >>  8;
+    *out++ = trans_id;
+    *out++ = STREAM_DATA_CMD;
+    *out++ = 0;
+
+    // Fill in the job number and packet sequence number
+    *out++ = job.index;
+    *out++ = seq >> 24;
+    *out++ = seq >> 16;
+    *out++ = seq >>  8;
+    *out++ = seq;
+
+    // Fill in the sample count and sample size
+    *out++ = job.samples_in_packet;
+    *out++ = job.sample_size >> 8;
+    *out++ = job.sample_size;
+
+    // Send the packet to the client that started the job
+    UDPServer.reply(job.cfg.session, job.packet, job.packet_length);
+
+    // The next packet gets the next sequence number, and starts out empty
+    ++job.status.seq;
+    job.samples_in_packet = 0;
+    job.packet_length     = STREAM_HDR_SIZE;
+}
+//=========================================================================================================
@@ -0,0 +1,178 @@
+//=========================================================================================================
+// streamer.h - Defines the engine that samples device registers periodically and streams the samples
+//              to the client
+//
+// A stream job is a list of registers on one device and a sampling period.   An esp_timer tells the
+// streamer task when each sample is due.  The task reads the registers, timestamps the sample, and
+// packs it into that job's outgoing packet.   When the packet is full it's sent to the client.
+//
+// A job can also be "externally fed", in which case it has no timer and some other task (such as a
+// trigger input) pushes the samples into it.
+//
+// Format of a stream data packet:
+//   4 Bytes of transaction ID (always STREAM_TRANS_ID)
+//   1 Byte  of command        (always STREAM_DATA_CMD)
+//   1 Byte  of error code     (always 0)
+//   1 Byte  of job number
+//   4 Bytes of packet sequence number.  The first packet of a job is sequence number 0
+//   1 Byte  of sample count
+//   2 Bytes of sample size
+//   Samples.   Each is 4 bytes of timestamp in microseconds, 1 byte of status (0 = OK), then the data
+//              read from each register in the order the registers were listed
+//=========================================================================================================
+#pragma once
+#include <atomic>
+#include "common.h"
+#include "esp_timer.h"
+
+// This is how many stream jobs can exist at once, and how many registers each can sample
+#define MAX_STREAM_JOBS         4
+#define MAX_STREAM_REGS         8
+
+// Stream packets carry this transaction ID and command byte
+#define STREAM_TRANS_ID         0xFFFFFFFF
+#define STREAM_DATA_CMD         13
+
+// This is the maximum size of a stream packet, and the header at the front of it
+#define STREAM_PACKET_SIZE      1024
+#define STREAM_HDR_SIZE         14
+
+// Every sample starts with a 4-byte timestamp and a 1-byte status
+#define SAMPLE_HDR_SIZE         5
+
+// This is the fastest sampling rate we allow
+#define MIN_STREAM_PERIOD_US    500
+
+// These are the values of the status byte in a sample
+#define SAMPLE_OK               0
+#define SAMPLE_I2C_ERROR        1
+
+
+//=========================================================================================================
+// This is a register in a stream job's register list
+//=========================================================================================================
+struct stream_reg_t
+{
+    int     reg;
+    int     length;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes what a stream job samples, and how often
+//=========================================================================================================
+struct stream_cfg_t
+{
+    int             bus;
+    int             address;
+    int             reg_width;
+    uint32_t        period_us;
+    int             samples_per_packet;
+    int             reg_count;
+    stream_reg_t    regs[MAX_STREAM_REGS];
+    int             session;        // The UDP session the samples go to, or LATEST_SESSION
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This describes the current state of a stream job
+//=========================================================================================================
+struct stream_status_t
+{
+    bool        running;
+    uint32_t    period_us;      // 0 = an externally fed job
+    uint32_t    seq;            // The sequence number of the next packet
+    uint32_t    samples;        // Number of samples taken
+    uint32_t    overruns;       // Number of samples skipped because the previous one wasn't done
+    uint32_t    errors;         // Number of samples where an I2C read failed
+};
+//=========================================================================================================
+
+
+class CStreamer
+{
+public:
+
+    // Call this once at startup to create the streamer task
+    void    begin();
+
+    // Starts a stream job.  Returns 'false' if the configuration is invalid
+    bool    start(int job, const stream_cfg_t& cfg);
+
+    // Starts a job with no timer that other tasks push samples into
+    bool    start_external(int job, int data_length, int samples_per_packet, int session);
+
+    // Pushes a sample into an externally fed job
+    void    push(int job, uint32_t timestamp, int status, const uint8_t* data);
+
+    // Adds to the count of samples a job has missed
+    void    count_overruns(int job, uint32_t count);
+
+    // Stops a stream job, sending any samples that were waiting to go out
+    void    stop(int job);
+
+    // Stops every stream job
+    void    stop_all();
+
+    // Stops every stream job whose samples go to the specified UDP session
+    void    stop_session(int session);
+
+    // Fetches the status of a stream job
+    void    get_status(int job, stream_status_t* p_status);
+
+    // Returns the size of a single sample for the specified configuration
+    static int sample_size(const stream_cfg_t& cfg);
+
+public:
+
+    // This is the task that takes the samples
+    void    task();
+
+protected:
+
+    struct job_t
+    {
+        CStreamer*          owner;
+        int                 index;
+        stream_cfg_t        cfg;
+        stream_status_t     status;
+        esp_timer_handle_t  timer;
+        int                 sample_size;
+        int                 samples_in_packet;
+        int                 packet_length;
+        uint8_t             packet[STREAM_PACKET_SIZE];
+        std::atomic<uint32_t> missed;   // Overruns counted by the timer, not yet in status.overruns
+    };
+
+    // The esp_timer callback that tells the streamer task a sample is due
+    static void on_timer(void* p_job);
+
+    // Appends a sample to a job's packet, sending the packet when it's full
+    void    push_sample(job_t& job, uint32_t timestamp, int status, const uint8_t* data, int length);
+
+    // Reads the registers for one sample of a job and pushes the sample
+    void    take_sample(job_t& job);
+
+    // Sends a job's packet (if it has any samples in it)
+    void    flush(job_t& job);
+
+    // Stops a job.  The caller must own m_mutex
+    void    stop_job(job_t& job);
+
+    // Resets a job's status and packet and marks it as running.  The caller must own m_mutex
+    void    activate(job_t& job, int samples_per_packet, int capacity);
+
+    // These are the stream jobs
+    job_t   m_job[MAX_STREAM_JOBS];
+
+    // The timers post a job number to this queue when a sample is due
+    QueueHandle_t       m_sample_qh;
+
+    // This makes sure a job doesn't get re-configured while a sample is being taken
+    SemaphoreHandle_t   m_mutex;
+
+    // This is the handle of the streamer task
+    TaskHandle_t        m_task_handle;
+};
@@ -7,6 +7,10 @@
 // Compares a token to a string constant.  The string constant can be in RAM or Flash
 #define token_is(strcon) (strcmp(token,strcon) == 0)
 
+// These are the most bytes that "i2c read" and "i2c write" can handle in a single command
+#define I2C_TEXT_MAX_READ   256
+#define I2C_TEXT_MAX_WRITE   64
+
 
 //========================================================================================================= 
 // handle_fwrev() - Reports the firmware revision to the user
@@ -149,11 +153,27 @@ bool CTCPServer::handle_nvget()
     }
 
 
+    // Is the user asking for the default I2C bus clock?
+    if token_is("i2cclk")
+    {
+        return pass("%u", NVS.data.i2c_clock_hz);
+    }
+
+    // Is the user asking for the bus clock or pins of the second I2C bus?
+    if token_is("i2c1clk") return pass("%u", NVS.data.i2c1_clock_hz);
+    if token_is("i2c1sda") return pass("%i", NVS.data.i2c1_sda_pin);
+    if token_is("i2c1scl") return pass("%i", NVS.data.i2c1_scl_pin);
+
     // Is the user asking for a general dump of everything in nv-storage?
     if token_is("")
     {
         replyf(" ssid:       \"%s\"", NVS.data.network_ssid);
         replyf(" netuser:    \"%s\"", NVS.data.network_user);
+        replyf(" i2cclk:     %u",       NVS.data.i2c_clock_hz);
+        replyf(" i2c1clk:    %u",       NVS.data.i2c1_clock_hz);
+        replyf(" i2c1sda:    %i",       NVS.data.i2c1_sda_pin);
+        replyf(" i2c1scl:    %i",       NVS.data.i2c1_scl_pin);
+        replyf(" profile:    %s",       CPerfProfile::name(NVS.data.perf_profile));
         return pass();
     }
 
@@ -206,6 +226,49 @@ bool CTCPServer::handle_nvset()
         return pass();
     }
 
+    // Is the user setting the default I2C bus clock?
+    if token_is("i2cclk")
+    {
+        uint32_t clock_hz = strtoul(value, nullptr, 0);
+
+        // Ensure that this is a bus clock we support
+        if (!CI2C::is_valid_clock(clock_hz)) return fail_unsupp();
+
+        NVS.data.i2c_clock_hz = clock_hz;
+        NVS.write_to_flash();
+        return pass();
+    }
+
+    // Is the user setting the bus clock of the second I2C bus?
+    if token_is("i2c1clk")
+    {
+        uint32_t clock_hz = strtoul(value, nullptr, 0);
+
+        // Ensure that this is a bus clock we support
+        if (!CI2C::is_valid_clock(clock_hz)) return fail_unsupp();
+
+        NVS.data.i2c1_clock_hz = clock_hz;
+        NVS.write_to_flash();
+        return pass();
+    }
+
+    // Is the user setting one of the pins of the second I2C bus?  It takes effect at the next reboot
+    if (token_is("i2c1sda") || token_is("i2c1scl"))
+    {
+        int pin = atoi(value);
+
+        // A pin has to be able to drive the bus, and can't be a pin we're already using
+        if (pin != PIN_UNUSED)
+        {
+            if (!GPIO_IS_VALID_OUTPUT_GPIO(pin)) return fail_unsupp();
+            if (pin == PIN_I2C_SDA || pin == PIN_I2C_SCL || pin == PIN_PROV_BUTTON) return fail_unsupp();
+        }
+
+        if token_is("i2c1sda") NVS.data.i2c1_sda_pin = pin; else NVS.data.i2c1_scl_pin = pin;
+        NVS.write_to_flash();
+        return pass();
+    }
+
     // If we get here, there was a syntax error
     return fail_syntax();
 }
@@ -267,6 +330,477 @@ bool CTCPServer::handle_stack()
 
 
 
+//========================================================================================================= 
+// handle_i2c() - Handles I2C bus commands
+//
+// i2c [bus] clock                  - Reports the default bus clock
+// i2c [bus] clock <hz>             - Sets the default bus clock (until the next reboot)
+// i2c [bus] clock <hz> <address>   - Sets the bus clock for a single device.  0 Hz means "use the default"
+// i2c [bus] read <addr> <reg> [n]  - Reads n bytes (default 1) starting at a register
+// i2c [bus] write <addr> <reg> <byte> [<byte>...]   - Writes bytes starting at a register
+// i2c [bus] dump <addr> [reg] [n]  - Displays n registers (default 256) starting at a register
+// i2c [bus] scan                   - Reports the address of every device that answers
+//
+// If no bus number is given, the command applies to bus 0.  Register numbers are 1 byte wide, and
+// address 0 is the engine's virtual device
+//========================================================================================================= 
+bool CTCPServer::handle_i2c()
+{
+    const char *token, *value, *address;
+
+    // Fetch the sub-command
+    get_next_token(&token);
+
+    // If the sub-command is a bus number, the real sub-command comes after it
+    int bus = 0;
+    if (token[0] >= '0' && token[0] <= '9')
+    {
+        bus = atoi(token);
+        if (bus >= I2C_BUS_COUNT || !I2C[bus].is_installed()) return fail_unsupp();
+        get_next_token(&token);
+    }
+
+    // This is the bus we're working with
+    CI2C& i2c = I2C[bus];
+
+    // Is the user asking about the bus clock?
+    if token_is("clock")
+    {
+        // If there's no clock speed, report the current default clock
+        if (!get_next_token(&value)) return pass("%u", i2c.clock());
+
+        // Convert the clock to an integer
+        uint32_t clock_hz = strtoul(value, nullptr, 0);
+
+        // If there's no device address, this is the new default bus clock
+        if (!get_next_token(&address))
+        {
+            return i2c.set_clock(clock_hz) ? pass() : fail_unsupp();
+        }
+
+        // Otherwise, this is the bus clock for a single device
+        int i2c_address = strtoul(address, nullptr, 0);
+        return i2c.set_device_clock(i2c_address, clock_hz) ? pass() : fail_unsupp();
+    }
+
+    // Handle the sub-commands that talk to devices
+    if token_is("read")  return handle_i2c_read(bus);
+    if token_is("write") return handle_i2c_write(bus);
+    if token_is("dump")  return handle_i2c_dump(bus);
+    if token_is("scan")  return handle_i2c_scan(bus);
+
+    // If we get here, we didn't understand the sub-command
+    return fail_syntax();
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_i2c_read() - Reads registers and reports their values on a single line
+//
+// i2c [bus] read <address> <register> [count]
+//
+// Reports: OK <byte> <byte> ...    (in hex)
+//========================================================================================================= 
+bool CTCPServer::handle_i2c_read(int bus)
+{
+    const char *address, *reg, *count;
+    char    text[8];
+
+    // This is too big for our stack, and only the TCP server task ever uses it
+    static uint8_t data[I2C_TEXT_MAX_READ];
+
+    // Fetch the device address and register number, both of which are required
+    if (!get_next_token(&address)) return fail_syntax();
+    if (!get_next_token(&reg)) return fail_syntax();
+
+    // Fetch the number of bytes to read
+    int length = get_next_token(&count) ? strtoul(count, nullptr, 0) : 1;
+    if (length < 1 || length > I2C_TEXT_MAX_READ) return fail_syntax();
+
+    // I2C addresses are 7 bits.  Anything bigger would spill into the read/write bit
+    int i2c_address = strtoul(address, nullptr, 0);
+    if (i2c_address < 0 || i2c_address > 0x7F) return fail_syntax();
+
+    // Read the registers
+    if (!Engine[bus].i2c_read(i2c_address, strtoul(reg, nullptr, 0), 1, data, length)) return fail("I2C");
+
+    // And report them
+    send_text("OK", 2);
+    for (int i = 0; i < length; ++i)
+    {
+        sprintf(text, " %02X", data[i]);
+        send_text(text, 3);
+    }
+    send_text("\r\n", 2);
+    return true;
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_i2c_write() - Writes bytes to consecutive registers
+//
+// i2c [bus] write <address> <register> <byte> [<byte> ...]
+//========================================================================================================= 
+bool CTCPServer::handle_i2c_write(int bus)
+{
+    const char *address, *reg, *value;
+    uint8_t data[I2C_TEXT_MAX_WRITE];
+    int     length = 0;
+
+    // Fetch the device address and register number, both of which are required
+    if (!get_next_token(&address)) return fail_syntax();
+    if (!get_next_token(&reg)) return fail_syntax();
+
+    // Fetch the bytes to write.  There has to be at least one
+    while (get_next_token(&value))
+    {
+        if (length == I2C_TEXT_MAX_WRITE) return fail_syntax();
+        data[length++] = strtoul(value, nullptr, 0);
+    }
+    if (length == 0) return fail_syntax();
+
+    // I2C addresses are 7 bits.  Anything bigger would spill into the read/write bit
+    int i2c_address = strtoul(address, nullptr, 0);
+    if (i2c_address < 0 || i2c_address > 0x7F) return fail_syntax();
+
+    // And write them
+    if (!Engine[bus].i2c_write(i2c_address, strtoul(reg, nullptr, 0), 1, data, length)) return fail("I2C");
+    return pass();
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_i2c_dump() - Displays a range of registers, 16 to a line
+//
+// i2c [bus] dump <address> [first_register] [count]
+//========================================================================================================= 
+bool CTCPServer::handle_i2c_dump(int bus)
+{
+    const char *address, *token;
+    uint8_t data[16];
+    char    text[8];
+
+    // Fetch the device address, which is required.  I2C addresses are 7 bits
+    if (!get_next_token(&address)) return fail_syntax();
+    int i2c_address = strtoul(address, nullptr, 0);
+    if (i2c_address < 0 || i2c_address > 0x7F) return fail_syntax();
+
+    // Fetch the first register and the number of registers
+    int reg   = get_next_token(&token) ? strtoul(token, nullptr, 0) : 0;
+    int count = get_next_token(&token) ? strtoul(token, nullptr, 0) : 256;
+
+    // Register numbers are a single byte
+    if (reg < 0 || reg > 255 || count < 1) return fail_syntax();
+    if (reg + count > 256) count = 256 - reg;
+
+    // Read and display the registers 16 at a time
+    while (count)
+    {
+        int length = (count < 16) ? count : 16;
+        if (!Engine[bus].i2c_read(i2c_address, reg, 1, data, length)) return fail("I2C 0x%02X", reg);
+        sprintf(text, " %02X:", reg);
+        send_text(text, 4);
+        for (int i = 0; i < length; ++i)
+        {
+            sprintf(text, " %02X", data[i]);
+            send_text(text, 3);
+        }
+        send_text("\r\n", 2);
+        reg   += length;
+        count -= length;
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_i2c_scan() - Reports the address of every device on the bus that acknowledges its address
+//
+// i2c [bus] scan
+//
+// Reports: OK <address> <address> ...    (in hex)
+//========================================================================================================= 
+bool CTCPServer::handle_i2c_scan(int bus)
+{
+    char text[8];
+
+    send_text("OK", 2);
+
+    // Addresses below 0x08 and above 0x77 are reserved
+    for (int address = 0x08; address <= 0x77; ++address)
+    {
+        if (!I2C[bus].probe(address)) continue;
+        sprintf(text, " 0x%02X", address);
+        send_text(text, 5);
+    }
+
+    send_text("\r\n", 2);
+    return true;
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_pool() - Reports how well the pool of UDP packet buffers is keeping up with incoming traffic
+//
+// pool         - Displays the packet pool counters
+// pool reset   - Resets the packet pool counters
+//========================================================================================================= 
+bool CTCPServer::handle_pool()
+{
+    const char* token;
+
+    // If the user wants to reset the counters, make it so
+    if (get_next_token(&token))
+    {
+        if (!token_is("reset")) return fail_syntax();
+        PacketPool.reset_stats();
+        return pass();
+    }
+
+    // Fetch the counters
+    const packet_pool_stats_t& stats = PacketPool.stats();
+
+    // And display them
+    replyf(" buffers     %5i x %i bytes", PACKET_POOL_SIZE, PACKET_BUFFER_SIZE);
+    replyf(" free        %5i", PacketPool.free_count());
+    replyf(" low-water   %5u", stats.low_water);
+    replyf(" acquired    %5u", stats.acquired);
+    replyf(" waits       %5u", stats.waits);
+    replyf(" rx drops    %5u", stats.rx_drops);
+    replyf(" queue drops %5u", stats.queue_drops);
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_trace() - Displays or controls the ring of diagnostic trace events
+//
+// trace              - Displays every event in the trace ring, oldest first
+// trace dump [n]     - Displays the most recent 'n' events (or all of them)
+// trace echo on|off  - Turns echoing events to the console on or off
+// trace clear        - Throws away every event in the trace ring
+//========================================================================================================= 
+bool CTCPServer::handle_trace()
+{
+    const char *token, *value;
+    trace_entry_t entry;
+    char buffer[100];
+
+    // Fetch the sub-command
+    get_next_token(&token);
+
+    // Does the user want to turn console echo on or off?
+    if token_is("echo")
+    {
+        if (!get_next_token(&value)) return pass(Trace.echo() ? "on" : "off");
+        if (strcmp(value, "on" ) == 0) {Trace.set_echo(true ); return pass();}
+        if (strcmp(value, "off") == 0) {Trace.set_echo(false); return pass();}
+        return fail_syntax();
+    }
+
+    // Does the user want to throw away the events in the ring?
+    if token_is("clear")
+    {
+        Trace.clear();
+        return pass();
+    }
+
+    // If we get here, the only thing left is "dump"
+    if (!token_is("") && !token_is("dump")) return fail_syntax();
+
+    // By default, we display every event in the ring
+    int count = TRACE_RING_SIZE;
+
+    // If the user only wants the most recent 'n' events, that's all we'll display
+    if (get_next_token(&value)) count = atoi(value);
+
+    // Display each event that's still in the ring, oldest first
+    for (int i = count - 1; i >= 0; --i)
+    {
+        if (!Trace.get(i, &entry)) continue;
+        CTrace::format(entry, buffer, sizeof buffer);
+        replyf("%s", buffer);
+    }
+
+    // And we're done
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_stats() - Displays the engine's performance counters
+//
+// stats          - Displays the counters for every command that each engine has handled
+// stats reset    - Resets the engines' performance counters and the packet pool counters
+//========================================================================================================= 
+bool CTCPServer::handle_stats()
+{
+    const char* token;
+
+    // If the user wants to reset the counters, make it so
+    if (get_next_token(&token))
+    {
+        if (!token_is("reset")) return fail_syntax();
+        for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) Stats[bus].reset();
+        for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) I2C[bus].scheduler().reset_stats();
+        PacketPool.reset_stats();
+        return pass();
+    }
+
+    // Display the packet pool counters
+    const packet_pool_stats_t& pool = PacketPool.stats();
+    replyf(" rx drops    %5u", pool.rx_drops);
+    replyf(" queue drops %5u", pool.queue_drops);
+
+    // Display the counters for the engine of each I2C bus
+    for (int bus = 0; bus < I2C_BUS_COUNT; ++bus)
+    {
+        CStats& s = Stats[bus];
+        const engine_stats_t& stats = s.engine();
+
+        // A bus that isn't in use has nothing to report
+        if (!I2C[bus].is_installed()) continue;
+
+        // Display the counters that aren't specific to a command
+        replyf(" bus %i", bus);
+        replyf(" duplicates  %5u", stats.duplicates);
+        replyf(" queue hwm   %5u", stats.queue_high_water);
+        replyf(" timeouts    %5u", I2C[bus].timeouts());
+        replyf(" recoveries  %5u", I2C[bus].recoveries());
+
+        // Display the longest each class of work has waited for the bus
+        CBusScheduler& sched = I2C[bus].scheduler();
+        replyf(" max bus wait (us): realtime %u  sampling %u  interactive %u  bulk %u",
+               sched.max_wait_us(BUS_CLASS_REALTIME), sched.max_wait_us(BUS_CLASS_SAMPLING),
+               sched.max_wait_us(BUS_CLASS_INTERACTIVE), sched.max_wait_us(BUS_CLASS_BULK));
+        replyf(" cmd    count  errors   avg-bus-us   bytes-in  bytes-out   p50-us   p99-us");
+
+        // Display the counters for every command that has been handled
+        for (int cmd = 0; cmd < STATS_MAX_COMMANDS; ++cmd)
+        {
+            const cmd_stats_t& c = *s.command(cmd);
+            if (c.count == 0) continue;
+            replyf(" %3i %8u %7u %12u %10u %10u %8u %8u", cmd, c.count, c.errors, (uint32_t)(c.bus_us / c.count),
+                   c.bytes_in, c.bytes_out, s.percentile(cmd, 50), s.percentile(cmd, 99));
+        }
+    }
+
+    // And we're done
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_profile() - Displays or changes the performance profile
+//
+// profile              - Displays the profile that's in effect
+// profile <name>       - Switches to a profile (balanced, lowlatency or lowpower), and stores it in NVS
+//========================================================================================================= 
+bool CTCPServer::handle_profile()
+{
+    const char* token;
+
+    // If the user wants to switch profiles, make it so
+    if (get_next_token(&token))
+    {
+        int profile = CPerfProfile::from_name(token);
+        if (!PerfProfile.set(profile)) return fail_syntax();
+    }
+
+    // Tell the user which profile is in effect
+    return pass("%s", CPerfProfile::name(PerfProfile.current()));
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_perf() - Displays system-wide telemetry: the heap, the engine and flash queues, and the CPU
+//                 load and stack high-water mark of every task
+//========================================================================================================= 
+bool CTCPServer::handle_perf()
+{
+    heap_telemetry_t heap;
+
+    // This is too big for our stack, and only the TCP server task ever uses it
+    static task_telemetry_t task[TELEMETRY_MAX_TASKS];
+
+    // Fetch the state of the heap and the latest snapshot of the tasks
+    CTelemetry::heap(&heap);
+    int task_count = Telemetry.tasks(task, TELEMETRY_MAX_TASKS);
+
+    // Report the heap
+    replyf(" heap free %u, min %u, largest block %u", heap.free, heap.min_free, heap.largest_block);
+
+    // Report how many packets are waiting for each engine, and how many requests for the flash task
+    for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) replyf(" engine%i queue %i", bus, Engine[bus].queue_depth());
+    replyf(" flash queue %i", FlashIO.queue_depth());
+
+    // If there's no CPU load or task list in this build, say so
+    if (!CTelemetry::has_cpu_load()) replyf(" cpu load not available");
+
+    // Report every task
+    if (task_count) replyf(" %-16s core pri stack   cpu", "task");
+    for (int i = 0; i < task_count; ++i)
+    {
+        const task_telemetry_t& t = task[i];
+        char core[4];
+        if (t.core == TELEMETRY_ANY_CORE) strcpy(core, "-"); else sprintf(core, "%i", t.core);
+        replyf(" %-16s %4s %3i %5u %3i.%i%%", t.name, core, t.priority, t.stack_free,
+               t.cpu_permille / 10, t.cpu_permille % 10);
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+
+//========================================================================================================= 
+// handle_sessions() - Displays the UDP clients that have sessions with us
+//========================================================================================================= 
+bool CTCPServer::handle_sessions()
+{
+    udp_session_t session;
+    uint32_t      idle_ms;
+
+    for (int i = 0; i < MAX_UDP_SESSIONS; ++i)
+    {
+        // If this slot is free, there's nothing to show
+        if (!UDPServer.get_session(i, &session, &idle_ms)) continue;
+
+        // Show who the client is, where its replies go, and how long ago we heard from it
+        const uint8_t* ip = (const uint8_t*)&session.addr;
+        replyf(" %i  %i.%i.%i.%i:%i  replies to %i, idle %u ms", i, ip[0], ip[1], ip[2], ip[3],
+               session.port, session.reply_port, idle_ms);
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+
 //=========================================================================================================
 // on_command() - The top level dispatcher for commands
 // 
@@ -284,6 +818,13 @@ void CTCPServer::on_command(const char* token)
     else if token_is("rssi")     handle_rssi();
     else if token_is("wifi")     handle_wifi();
     else if token_is("stack")    handle_stack();
+    else if token_is("i2c")      handle_i2c();
+    else if token_is("pool")     handle_pool();
+    else if token_is("trace")    handle_trace();
+    else if token_is("stats")    handle_stats();
+    else if token_is("profile")  handle_profile();
+    else if token_is("perf")     handle_perf();
+    else if token_is("sessions") handle_sessions();
 
     else fail_syntax();
 }
@@ -27,6 +27,21 @@ protected:
     bool    handle_rssi();
     bool    handle_wifi();
     bool    handle_stack();
+    bool    handle_i2c();
+    bool    handle_pool();
+    bool    handle_trace();
+    bool    handle_stats();
+    bool    handle_profile();
+    bool    handle_perf();
+    bool    handle_sessions();
+    // ------------------------------------------------------------------
+
+
+    // ---------------  Sub-commands of the "i2c" command  --------------
+    bool    handle_i2c_read(int bus);
+    bool    handle_i2c_write(int bus);
+    bool    handle_i2c_dump(int bus);
+    bool    handle_i2c_scan(int bus);
     // ------------------------------------------------------------------
 
 
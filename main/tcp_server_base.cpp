@@ -15,12 +15,16 @@ static const char* TAG = "tcp_server";
 //=========================================================================================================
 // Constructor() 
 //=========================================================================================================
-CTCPServerBase::CTCPServerBase(int port)
+CTCPServerBase::CTCPServerBase(int port, const char* task_name, int priority, int cpu)
 {
     m_task_handle = nullptr;
     m_sock = CLOSED;
     m_has_client = false;
     m_server_port = port;
+    m_task_name = task_name;
+    m_task_priority = priority;
+    m_task_cpu = cpu;
+    m_tx_length = 0;
 }
 //=========================================================================================================
 
@@ -50,7 +54,7 @@ void CTCPServerBase::start()
     if (m_task_handle) return;
 
     // Create the task
-    xTaskCreatePinnedToCore(launch_task, "tcp_server", 3000, this, TASK_PRIO_TCP, &m_task_handle, TASK_CPU);
+    xTaskCreatePinnedToCore(launch_task, m_task_name, 3000, this, m_task_priority, &m_task_handle, m_task_cpu);
 }
 //=========================================================================================================
 
@@ -80,66 +84,70 @@ void CTCPServerBase::stop()
 
 
 //=========================================================================================================
-// execute() - State machine: Call this often, or with blocking set to true
-// 
-// If blocking is true:
-//     Virtual function read() should block until it has data to return
-//     If the input stream closes, read() should return -1
-//     If read() returns -1, this routine will return
+// execute() - Receives data from the client a block at a time, splits it into messages, and hands each
+//             message to handle_new_message().   Returns when the connection closes
 //=========================================================================================================
 void CTCPServerBase::execute()
 {
-    char c;
-
-again:
-
     // This is how many bytes we have remaining free in buffer that holds the incoming message
     int free_remaining = sizeof(m_message) - 1;
 
     // This is where the next incoming character will be stored
     char* p_input = m_message;
 
-     // For each character available
+    // Nothing is waiting to be sent to the client
+    m_tx_length = 0;
+
+    // Keep receiving until the connection closes
     while (true)
     {
-        // Fetch a single character from the socket;
-        if (recv(m_sock, &c, 1, 0) < 1) break;
+        // Fetch whatever data has arrived, up to a block's worth
+        int count = recv(m_sock, m_rx_block, sizeof m_rx_block, 0);
+        if (count < 1) break;
 
-        // Convert tabs to spaces
-        if (c == 9) c = 32;
-
-        // Handle backspace
-        if (c == 8)
+        // For each character we received
+        for (int i = 0; i < count; ++i)
         {
-            if (p_input > m_message)
+            char c = m_rx_block[i];
+
+            // Convert tabs to spaces
+            if (c == 9) c = 32;
+
+            // Handle backspace
+            if (c == 8)
             {
-                --p_input;
-                ++free_remaining;
+                if (p_input > m_message)
+                {
+                    --p_input;
+                    ++free_remaining;
+                }
+                continue;
             }
-            continue;
-        }
 
-        // Handle both carriage-return and linefeed
-        if (c == 13 || c == 10)
-        {
-            // If the message buffer is empty, ignore it
-            if (p_input == m_message) continue;
+            // Handle both carriage-return and linefeed
+            if (c == 13 || c == 10)
+            {
+                // If the message buffer is empty, ignore it
+                if (p_input == m_message) continue;
 
-            // Nul-terminate the message
-            *p_input = 0;
+                // Nul-terminate the message
+                *p_input = 0;
 
-            // Go see if the message needs to be handled
-            handle_new_message();
+                // Go see if the message needs to be handled
+                handle_new_message();
 
-            // Reset back to an empty message buffer
-            goto again;
-        }
+                // Reset back to an empty message buffer
+                free_remaining = sizeof(m_message) - 1;
+                p_input = m_message;
+                continue;
+            }
 
-        // If there's room to add this character to the input buffer, make it so
-        if (free_remaining)
-        {
-            *p_input++ = c;
-            --free_remaining;
+            // If there's room to add this character to the input buffer, make it so
+            if (free_remaining)
+            {
+                *p_input++ = c;
+                --free_remaining;
+            }
         }
     }
 }
@@ -194,6 +202,9 @@ void CTCPServerBase::handle_new_message()
     // Call the top level command handler
     on_command(first_token);
 
+    // And send the client everything the command handler had to say
+    flush_replies();
+
     // Keep track of the high-water mark on the stack for this thread
     StackMgr.record_hwm(TASK_IDX_TCP_SERVER);
 }
@@ -296,7 +307,7 @@ bool CTCPServerBase::get_next_token(const char** p_retval)
 //=========================================================================================================
 bool CTCPServerBase::pass()
 {
-    ::send(m_sock, "OK\r\n", 4, 0);
+    send_text("OK\r\n", 4);
     return true;
 }
 //=========================================================================================================
@@ -313,7 +324,7 @@ bool CTCPServerBase::pass(const char* fmt, ...)
     vsnprintf(buffer+3, sizeof(buffer)-3, fmt, args);
     va_end(args);
     strcat(buffer, "\r\n");    
-    ::send(m_sock, buffer, strlen(buffer), 0);
+    send_text(buffer, strlen(buffer));
     return true;
 }
 //=========================================================================================================
@@ -331,7 +342,7 @@ bool CTCPServerBase::fail(const char* fmt, ...)
     vsnprintf(buffer+5, sizeof(buffer)-5, fmt, args);
     va_end(args);
     strcat(buffer, "\r\n");    
-    ::send(m_sock, buffer, strlen(buffer), 0);
+    send_text(buffer, strlen(buffer));
     return true;
 }
 //=========================================================================================================
@@ -360,7 +371,42 @@ void CTCPServerBase::replyf(const char* fmt, ...)
     vsnprintf(buffer, sizeof(buffer)-2, fmt, args);
     va_end(args);
     strcat(buffer, "\r\n");    
-    ::send(m_sock, buffer, strlen(buffer), 0);
+    send_text(buffer, strlen(buffer));
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// send_text() - Adds text to the reply buffer.  If the buffer fills up, it's sent to the client
+//
+// Passed: text   = The text to send
+//         length = The length of the text
+//=========================================================================================================
+void CTCPServerBase::send_text(const char* text, int length)
+{
+    while (length)
+    {
+        // If the buffer is full, send it
+        if (m_tx_length == sizeof m_tx_buffer) flush_replies();
+
+        // Copy as much of the text as will fit into the buffer
+        int count = MIN(length, (int)sizeof(m_tx_buffer) - m_tx_length);
+        memcpy(m_tx_buffer + m_tx_length, text, count);
+        m_tx_length += count;
+        text        += count;
+        length      -= count;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// flush_replies() - Sends whatever is in the reply buffer to the client
+//=========================================================================================================
+void CTCPServerBase::flush_replies()
+{
+    if (m_tx_length) ::send(m_sock, m_tx_buffer, m_tx_length, 0);
+    m_tx_length = 0;
 }
 //=========================================================================================================
 
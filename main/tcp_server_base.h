@@ -2,6 +2,13 @@
 // tcp_server_base.h - The base class for a TCP command server
 //=========================================================================================================
 #pragma once
+#include "common.h"
+
+// Incoming data is received in blocks of up to this many bytes
+#define TCP_RX_BLOCK_SIZE   256
+
+// Replies are gathered in a buffer this big, and sent when the command is done (or the buffer is full)
+#define TCP_TX_BUFFER_SIZE  1460
 
 class CTCPServerBase
 {
@@ -11,8 +18,8 @@ class CTCPServerBase
     //--------------------------------------------------------------------------------
 public:
 
-    // Constructor
-    CTCPServerBase(int port);
+    // Constructor.  The server task is started with the specified name and priority, in the specified core
+    CTCPServerBase(int port, const char* task_name = "tcp_server", int priority = TASK_PRIO_TCP, int cpu = TASK_CPU);
 
     // Starts the thread that runs the server
     void    start();
@@ -26,6 +33,9 @@ public:
     // Call this to find out if there is a client connected to our server
     bool    has_client() {return m_has_client;}
 
+    // Returns the port number we listen on
+    int     port() {return m_server_port;}
+
     //--------------------------------------------------------------------------------
     // Public only so that launch_thread() has access to it
     //--------------------------------------------------------------------------------
@@ -41,7 +51,14 @@ public:
 protected:
 
     // This gets called whenever a new command is received. Over-ride this
-    virtual void  on_command(const char* command) = 0;
+    virtual void  on_command(const char* command) {}
+
+    // Once a connection is made, this fetches and handles incoming data until the connection closes.
+    // A server that doesn't speak the line-oriented text protocol over-rides this
+    virtual void  execute();
+
+    // Returns the socket descriptor of the connection to the client
+    int     client_socket() {return m_sock;}
 
 
     //--------------------------------------------------------------------------------
@@ -61,6 +78,12 @@ protected:
     // Lowest level methods for replying to a command
     void    replyf(const char* fmt, ...);
 
+    // Adds text to the buffered reply.  Long replies are sent in pieces as the buffer fills up
+    void    send_text(const char* text, int length);
+
+    // Sends whatever is in the reply buffer.  This is called after every command
+    void    flush_replies();
+
 
     //--------------------------------------------------------------------------------
     // Functions and data that are private to the base class
@@ -70,15 +93,19 @@ private:
     // Create a socket and listen for connections
     bool    wait_for_connection();
 
-    // Once a connection is made, this executes the command handler
-    void    execute();
-
     // This gets called when carriage-return or linefeed is received
     void    handle_new_message();
 
     // This is our incoming message
     char    m_message[128];
 
+    // Incoming data is received into here, and split into messages
+    char    m_rx_block[TCP_RX_BLOCK_SIZE];
+
+    // Replies to the current command are gathered here.  m_tx_length is how many bytes are waiting
+    char    m_tx_buffer[TCP_TX_BUFFER_SIZE];
+    int     m_tx_length;
+
     // When "get_next_token()" is called, this points to the 1st char of the next token
     char*   m_next_token;
 
@@ -102,5 +129,10 @@ private:  /* TCP and ESP specific stuff */
     // This is the server port we listen on
     int             m_server_port;
 
+    // These are the name, priority and core of the server task
+    const char*     m_task_name;
+    int             m_task_priority;
+    int             m_task_cpu;
+
 };
 
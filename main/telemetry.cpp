@@ -0,0 +1,126 @@
+//=========================================================================================================
+// telemetry.cpp - Implements the system-wide telemetry
+//=========================================================================================================
+#include "esp_heap_caps.h"
+#include "globals.h"
+
+// The snapshot that sample() takes.  It's too big for the stack of the task that calls us
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+static TaskStatus_t task_status[TELEMETRY_MAX_TASKS];
+#endif
+
+
+//=========================================================================================================
+// begin() - Called once at startup
+//=========================================================================================================
+void CTelemetry::begin()
+{
+    // We haven't taken a snapshot yet
+    m_task_count = m_prev_count = 0;
+    m_prev_total = 0;
+
+    // Create the mutex that protects the snapshot
+    m_mutex = xSemaphoreCreateMutex();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// sample() - Takes a snapshot of every task, and works out how much CPU each used since the last one
+//=========================================================================================================
+void CTelemetry::sample()
+{
+    #if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    uint32_t total = 0;
+    uint32_t run_time[TELEMETRY_MAX_TASKS], task_number[TELEMETRY_MAX_TASKS];
+
+    // Fetch the state of every task.  If there are more tasks than we have room for, this returns 0
+    int count = uxTaskGetSystemState(task_status, TELEMETRY_MAX_TASKS, &total);
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // The total run time is wall-clock time, and each task only runs on one core at a time, so a task
+    // that kept its core busy the whole period used 1000 permille
+    uint32_t period = total - m_prev_total;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const TaskStatus_t& status = task_status[i];
+        task_telemetry_t&   task   = m_task[i];
+
+        // Fill in what FreeRTOS tells us about the task
+        strncpy(task.name, status.pcTaskName, sizeof task.name);
+        task.name[sizeof task.name - 1] = 0;
+        BaseType_t core = xTaskGetAffinity(status.xHandle);
+        task.core       = (core == tskNO_AFFINITY) ? TELEMETRY_ANY_CORE : core;
+        task.priority   = status.uxCurrentPriority;
+        task.stack_free = status.usStackHighWaterMark;
+
+        // Find this task in the previous snapshot to see how much CPU it has used since then.  A task
+        // that's new since then has no CPU load yet
+        task.cpu_permille = 0;
+        for (int j = 0; j < m_prev_count; ++j)
+        {
+            if (m_prev_task_number[j] != status.xTaskNumber) continue;
+            if (period) task.cpu_permille = (uint64_t)(status.ulRunTimeCounter - m_prev_run_time[j]) * 1000 / period;
+            break;
+        }
+
+        // Remember where this task's counter was, for the next snapshot
+        task_number[i] = status.xTaskNumber;
+        run_time[i]    = status.ulRunTimeCounter;
+    }
+
+    // This is now the latest snapshot
+    m_task_count = count;
+    m_prev_count = count;
+    m_prev_total = total;
+    memcpy(m_prev_task_number, task_number, count * sizeof task_number[0]);
+    memcpy(m_prev_run_time,    run_time,    count * sizeof run_time[0]);
+
+    xSemaphoreGive(m_mutex);
+    #endif
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// tasks() - Copies the task telemetry from the latest snapshot
+//
+// Returns: The number of tasks copied into 'out'
+//=========================================================================================================
+int CTelemetry::tasks(task_telemetry_t* out, int max_tasks)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    int count = (m_task_count < max_tasks) ? m_task_count : max_tasks;
+    memcpy(out, m_task, count * sizeof m_task[0]);
+    xSemaphoreGive(m_mutex);
+    return count;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// has_cpu_load() - Returns 'true' if we're built with the run-time stats that CPU load comes from
+//=========================================================================================================
+bool CTelemetry::has_cpu_load()
+{
+    #if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    return true;
+    #else
+    return false;
+    #endif
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// heap() - Fills in the current state of the heap that ordinary allocations come from
+//=========================================================================================================
+void CTelemetry::heap(heap_telemetry_t* p_heap)
+{
+    p_heap->free          = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    p_heap->min_free      = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    p_heap->largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+//=========================================================================================================
@@ -0,0 +1,83 @@
+//=========================================================================================================
+// telemetry.h - Defines the system-wide telemetry: CPU load and stack high-water mark of every task, the
+//               state of the heap, and how deep the engine and flash queues are
+//
+// CPU load comes from the FreeRTOS run-time stats (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS), and the
+// list of tasks from CONFIG_FREERTOS_USE_TRACE_FACILITY.  Once a second, sample() takes a snapshot of
+// every task and works out how much of its core each one used since the last snapshot, so the IDLE
+// tasks tell us how busy each core is.  Without those options, only the heap and queue figures are kept
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is the most tasks we keep track of
+#define TELEMETRY_MAX_TASKS 32
+
+// This is how many bytes of a task's name we keep (the FreeRTOS default)
+#define TELEMETRY_NAME_LENGTH 16
+
+// In a task's telemetry, this core number means "not pinned to a core"
+#define TELEMETRY_ANY_CORE  0xFF
+
+
+//=========================================================================================================
+// This is the telemetry of a single task
+//=========================================================================================================
+struct task_telemetry_t
+{
+    char        name[TELEMETRY_NAME_LENGTH];
+    uint8_t     core;           // The core it's pinned to, or TELEMETRY_ANY_CORE
+    uint8_t     priority;       // Its current priority
+    uint32_t    stack_free;     // The fewest bytes there have ever been free on its stack
+    uint16_t    cpu_permille;   // How much of one core it used in the last period, in tenths of a percent
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This is the state of the heap
+//=========================================================================================================
+struct heap_telemetry_t
+{
+    uint32_t    free;           // Bytes free right now
+    uint32_t    min_free;       // The fewest bytes there have ever been free
+    uint32_t    largest_block;  // The largest block that could be allocated right now
+};
+//=========================================================================================================
+
+
+class CTelemetry
+{
+public:
+
+    // Called once at startup
+    void    begin();
+
+    // Called once a second to take a snapshot of every task
+    void    sample();
+
+    // Copies the task telemetry from the latest snapshot into 'out'.  Returns the number of tasks
+    int     tasks(task_telemetry_t* out, int max_tasks);
+
+    // Returns 'true' if we're built with the run-time stats that CPU load comes from
+    static bool has_cpu_load();
+
+    // Fills in the current state of the heap
+    static void heap(heap_telemetry_t* p_heap);
+
+protected:
+
+    // The telemetry of each task, as of the latest snapshot
+    task_telemetry_t    m_task[TELEMETRY_MAX_TASKS];
+    int                 m_task_count;
+
+    // The run-time counter of each task and the total run time at the previous snapshot, so we can
+    // tell how much CPU each task used in between.  Tasks are matched up by their task number
+    uint32_t            m_prev_task_number[TELEMETRY_MAX_TASKS];
+    uint32_t            m_prev_run_time[TELEMETRY_MAX_TASKS];
+    int                 m_prev_count;
+    uint32_t            m_prev_total;
+
+    // Keeps a reader from seeing a snapshot that's half written
+    SemaphoreHandle_t   m_mutex;
+};
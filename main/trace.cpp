@@ -0,0 +1,164 @@
+//=========================================================================================================
+// trace.cpp - Implements an in-RAM ring of binary trace events
+//=========================================================================================================
+#include <stdio.h>
+#include "esp_timer.h"
+#include "globals.h"
+
+
+//=========================================================================================================
+// log() - Records an event in the trace ring.   This never blocks, and is safe to call from any task
+//
+// Passed: event = The event being recorded
+//         arg0, arg1, arg2 = Event-specific arguments (see trace_event_t)
+//=========================================================================================================
+void CTrace::log(trace_event_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    // Claim the next slot in the ring
+    uint32_t seq = m_next.fetch_add(1, std::memory_order_relaxed);
+
+    // Point to that slot
+    trace_entry_t& entry = m_ring[seq & (TRACE_RING_SIZE - 1)];
+
+    // Mark it as "being written" so that a reader doesn't trust it
+    entry.seq = 0;
+
+    // Fill in the event
+    entry.time_us = (uint32_t)esp_timer_get_time();
+    entry.event   = event;
+    entry.arg[0]  = arg0;
+    entry.arg[1]  = arg1;
+    entry.arg[2]  = arg2;
+
+    // And now the entry is valid
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.seq = seq + 1;
+
+    // If the engineer wants to see events as they happen, print this one
+    if (m_echo)
+    {
+        char buffer[100];
+        format(entry, buffer, sizeof buffer);
+        printf("%s\n", buffer);
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// clear() - Throws away every event in the ring
+//=========================================================================================================
+void CTrace::clear()
+{
+    for (int i = 0; i < TRACE_RING_SIZE; ++i) m_ring[i].seq = 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// count() - Returns the number of events in the ring
+//=========================================================================================================
+int CTrace::count()
+{
+    int n = 0;
+    for (int i = 0; i < TRACE_RING_SIZE; ++i) if (m_ring[i].seq) ++n;
+    return n;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get() - Fetches one of the events in the ring
+//
+// Passed: n       = 0 for the newest event in the ring, 1 for the one before it, etc
+//         p_entry = Where to store a copy of the event
+//
+// Returns: 'false' if there is no such event, or it was overwritten while we were reading it
+//=========================================================================================================
+bool CTrace::get(int n, trace_entry_t* p_entry)
+{
+    // This is the sequence number of the next event to be recorded
+    uint32_t next = m_next.load(std::memory_order_relaxed);
+
+    // If that event was never recorded or has been overwritten, there's no such event
+    if (n < 0 || n >= TRACE_RING_SIZE || (uint32_t)n >= next) return false;
+
+    // This is the sequence number of the event the caller wants
+    uint32_t seq = next - 1 - n;
+
+    // Copy the entry, and make sure it wasn't being written or re-used while we copied it
+    const trace_entry_t& entry = m_ring[seq & (TRACE_RING_SIZE - 1)];
+    if (entry.seq != seq + 1) return false;
+    *p_entry = entry;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return entry.seq == seq + 1;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// format() - Formats an event into a human-readable string
+//=========================================================================================================
+void CTrace::format(const trace_entry_t& entry, char* buffer, int buffer_size)
+{
+    // Every line starts with the timestamp in microseconds
+    int n = snprintf(buffer, buffer_size, "%10u ", entry.time_us);
+    buffer      += n;
+    buffer_size -= n;
+
+    // For convenience
+    const uint32_t* arg = entry.arg;
+
+    switch (entry.event)
+    {
+        case TRC_UDP_RX:
+            snprintf(buffer, buffer_size, "rcvd %4u bytes from %u.%u.%u.%u", arg[0],
+                     arg[1] & 0xFF, (arg[1] >> 8) & 0xFF, (arg[1] >> 16) & 0xFF, arg[1] >> 24);
+            break;
+
+        case TRC_UDP_TX_FAIL:
+            snprintf(buffer, buffer_size, "sendto() failed with %i, errno %u", (int)arg[0], arg[1]);
+            break;
+
+        case TRC_RX_DROP:
+            snprintf(buffer, buffer_size, "packet dropped, no free buffer");
+            break;
+
+        case TRC_QUEUE_DROP:
+            snprintf(buffer, buffer_size, "packet of %u bytes dropped, engine queue full", arg[0]);
+            break;
+
+        case TRC_I2C_READ_FAIL:
+            snprintf(buffer, buffer_size, "I2C read failed on register 0x%02X for I2C device 0x%02X", arg[1], arg[0]);
+            break;
+
+        case TRC_I2C_WRITE_FAIL:
+            snprintf(buffer, buffer_size, "I2C write failed on register 0x%02X for I2C device 0x%02X", arg[1], arg[0]);
+            break;
+
+        case TRC_I2C_RAW_FAIL:
+            snprintf(buffer, buffer_size, "I2C read failed for I2C device 0x%02X", arg[0]);
+            break;
+
+        case TRC_NOT_ENUF_DATA:
+            snprintf(buffer, buffer_size, "register 0x%02X needs %u bytes, only %u available", arg[0], arg[1], arg[2]);
+            break;
+
+        case TRC_BIN_BAD_FRAME:
+            snprintf(buffer, buffer_size, "TCP frame of %u bytes is too long, connection closed", arg[0]);
+            break;
+
+        case TRC_BIN_TX_FAIL:
+            snprintf(buffer, buffer_size, "TCP reply of %u bytes failed, errno %u", arg[0], arg[1]);
+            break;
+
+        case TRC_I2C_RECOVERY:
+            snprintf(buffer, buffer_size, "I2C bus %u hung and was recovered, SDA=%u SCL=%u", arg[0], arg[1], arg[2]);
+            break;
+
+        default:
+            snprintf(buffer, buffer_size, "event %u (0x%X 0x%X 0x%X)", entry.event, arg[0], arg[1], arg[2]);
+            break;
+    }
+}
+//=========================================================================================================
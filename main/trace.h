@@ -0,0 +1,86 @@
+//=========================================================================================================
+// trace.h - Defines an in-RAM ring of binary trace events
+//
+// Any task can record an event without blocking: a slot in the ring is claimed with an atomic
+// increment and filled in place.   Events are only formatted into text when someone dumps the ring
+// (or when console echo is turned on).
+//=========================================================================================================
+#pragma once
+#include <atomic>
+#include "common.h"
+
+// This is how many events the ring holds.  It must be a power of two
+#define TRACE_RING_SIZE 256
+
+// This is the maximum number of arguments an event can carry
+#define TRACE_MAX_ARGS  3
+
+//=========================================================================================================
+// These are the events we know how to record
+//=========================================================================================================
+enum trace_event_t
+{
+    TRC_UDP_RX          = 1,    // length, sender IP address
+    TRC_UDP_TX_FAIL     = 2,    // sendto() return value, errno
+    TRC_RX_DROP         = 3,    // (none)
+    TRC_QUEUE_DROP      = 4,    // length
+    TRC_I2C_READ_FAIL   = 5,    // I2C address, register
+    TRC_I2C_WRITE_FAIL  = 6,    // I2C address, register
+    TRC_I2C_RAW_FAIL    = 7,    // I2C address
+    TRC_NOT_ENUF_DATA   = 8,    // register, bytes needed, bytes available
+    TRC_BIN_BAD_FRAME   = 9,    // frame length
+    TRC_BIN_TX_FAIL     = 10,   // reply length, errno
+    TRC_I2C_RECOVERY    = 11,   // I2C port, SDA level, SCL level
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// This is a single entry in the trace ring
+//=========================================================================================================
+struct trace_entry_t
+{
+    uint32_t    seq;                    // The event's sequence number + 1 (0 = never written)
+    uint32_t    time_us;                // Low 32 bits of esp_timer_get_time()
+    uint32_t    event;                  // A trace_event_t
+    uint32_t    arg[TRACE_MAX_ARGS];
+};
+//=========================================================================================================
+
+
+class CTrace
+{
+public:
+
+    CTrace() {m_next = 0; m_echo = false;}
+
+    // Records an event in the trace ring
+    void    log(trace_event_t event, uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0);
+
+    // Turns echoing events to the console on or off
+    void    set_echo(bool flag) {m_echo = flag;}
+    bool    echo() {return m_echo;}
+
+    // Throws away every event in the ring
+    void    clear();
+
+    // Fetches the event recorded 'n' events before the newest one.  Returns 'false' if there's no such event
+    bool    get(int n, trace_entry_t* p_entry);
+
+    // Returns the number of events in the ring
+    int     count();
+
+    // Formats an event into a human-readable string
+    static void format(const trace_entry_t& entry, char* buffer, int buffer_size);
+
+protected:
+
+    // This is the sequence number of the next event to be recorded
+    std::atomic<uint32_t>   m_next;
+
+    // If this is true, every event gets echoed to the console as it's recorded
+    volatile bool           m_echo;
+
+    // This is the ring of events
+    trace_entry_t           m_ring[TRACE_RING_SIZE];
+};
@@ -0,0 +1,180 @@
+//=========================================================================================================
+// trigger.cpp - Implements a trigger input that runs a stored op list when a GPIO edge occurs
+//=========================================================================================================
+#include "esp_timer.h"
+#include "globals.h"
+
+
+//=========================================================================================================
+// dispatch_task() - Calls the task-handler for a specific CTrigger object
+//=========================================================================================================
+void CTrigger::dispatch_task(void* p_object)
+{
+    ((CTrigger*)p_object)->trigger_task();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// isr() - This routine gets called by the ISR service any time an interrupt occurs on a pin that we
+//         have registered via gpio_isr_handler_add()
+//=========================================================================================================
+void IRAM_ATTR CTrigger::isr(void* p_object)
+{
+    // Create a pointer to the appropriate trigger object
+    CTrigger* p_trigger = (CTrigger*)p_object;
+
+    // The event we push into the queue is the time of the edge
+    uint32_t timestamp = (uint32_t)esp_timer_get_time();
+
+    // Stuff this event into the queue, and if the queue is full, count the missed edge
+    BaseType_t woken = pdFALSE;
+    if (!xQueueSendFromISR(p_trigger->m_event_queue, &timestamp, &woken)) ++p_trigger->m_missed;
+
+    // If that woke the trigger task, switch to it as soon as we return instead of at the next tick
+    if (woken) portYIELD_FROM_ISR();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// configure() - Configures the trigger and enables its interrupt
+//
+// Passed: cfg = Describes the pin, the edge, the op list to run, and where to send the data
+//
+// Returns: 'false' if the configuration is invalid
+//=========================================================================================================
+bool CTrigger::configure(const trigger_cfg_t& cfg)
+{
+    gpio_config_t io_conf;
+
+    // A trigger can't be on a pin we're already using for something else
+    if (!GPIO_IS_VALID_GPIO(cfg.pin)) return false;
+    if (cfg.pin == PIN_PROV_BUTTON) return false;
+    for (int i=0; i<I2C_BUS_COUNT; ++i) if (I2C[i].uses_pin(cfg.pin)) return false;
+
+    // Make sure the rest of the configuration is sensible
+    if (cfg.edge < TRIG_EDGE_RISING || cfg.edge > TRIG_EDGE_ANY) return false;
+    if (cfg.capture_length < 0 || cfg.capture_length > MAX_TRIGGER_CAPTURE) return false;
+    if (cfg.ops_length < 0 || cfg.ops_length > MAX_TRIGGER_OPS) return false;
+
+    // If this is the first time we've been configured, create our queue, mutex, and task
+    if (m_task_handle == nullptr)
+    {
+        m_event_queue = xQueueCreate(20, sizeof(uint32_t));
+        m_mutex = xSemaphoreCreateMutex();
+        xTaskCreatePinnedToCore(dispatch_task, "trigger", 4096, this, TASK_PRIO_TRIGGER, &m_task_handle, TASK_CPU);
+    }
+
+    // Stop responding to the old configuration
+    disable();
+
+    // Make sure the stream job is ready to receive our samples
+    if (!Streamer.start_external(cfg.job, cfg.capture_length, cfg.samples_per_packet, cfg.session)) return false;
+
+    // Save the new configuration
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_cfg = cfg;
+    m_fired = 0;
+    m_missed = 0;
+    xQueueReset(m_event_queue);
+    xSemaphoreGive(m_mutex);
+
+    // Set the GPIO configuration structure to known values
+    memset(&io_conf, 0, sizeof io_conf);
+
+    // Decide which edge(s) we want an interrupt on
+    if (cfg.edge == TRIG_EDGE_RISING ) io_conf.intr_type = GPIO_INTR_POSEDGE;
+    if (cfg.edge == TRIG_EDGE_FALLING) io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    if (cfg.edge == TRIG_EDGE_ANY    ) io_conf.intr_type = GPIO_INTR_ANYEDGE;
+
+    // This is a bitmap of which GPIO pins this configuration applies to
+    io_conf.pin_bit_mask = (1LL << cfg.pin);
+
+    // This pin is an input, driven by the device.  Data-ready lines are often open-drain
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+
+    // And configure this GPIO pin
+    gpio_config(&io_conf);
+
+    // When an interrupt occurs on this pin, call the interrupt-service routine
+    m_pin = cfg.pin;
+    m_enabled = true;
+    gpio_isr_handler_add((gpio_num_t)m_pin, CTrigger::isr, (void*) this);
+
+    // Tell the caller that all is well
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// disable() - Stops the trigger from responding to its GPIO pin
+//=========================================================================================================
+void CTrigger::disable()
+{
+    // If we never attached to a pin, there's nothing to do
+    if (m_pin < 0) return;
+
+    // Stop responding to interrupts on the pin
+    gpio_isr_handler_remove((gpio_num_t)m_pin);
+    gpio_set_intr_type((gpio_num_t)m_pin, GPIO_INTR_DISABLE);
+
+    // Wait for the trigger task to finish up anything it's working on
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_enabled = false;
+    m_pin = -1;
+    xSemaphoreGive(m_mutex);
+
+    // And send whatever samples the stream job has waiting to go out
+    Streamer.stop(m_cfg.job);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// trigger_task() - This runs as a separate task.  Each time the ISR reports an edge, this runs the op
+//                  list and hands the data that was read to the stream job
+//=========================================================================================================
+void CTrigger::trigger_task()
+{
+    uint32_t timestamp;
+    int      out_length, fail_index;
+
+    // Loop forever, waiting for event messages to arrive from the ISR
+    while (xQueueReceive(m_event_queue, &timestamp, portMAX_DELAY))
+    {
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        
+        // If we were disabled after this edge arrived, ignore it
+        if (!m_enabled)
+        {
+            xSemaphoreGive(m_mutex);
+            continue;
+        }
+
+        // If the ISR had to throw away any edges, the stream job missed those samples
+        uint32_t missed = m_missed.exchange(0);
+        if (missed) Streamer.count_overruns(m_cfg.job, missed);
+
+        // Run the op list with the bus locked, so that no other task's transactions get in between ours.
+        // A trigger is reacting to hardware, so it gets the bus ahead of everybody else
+        I2C[m_cfg.bus].lock(BUS_CLASS_REALTIME);
+        int error = Engine[m_cfg.bus].run_ops(m_cfg.address, m_cfg.ops, m_cfg.ops_length, m_capture, m_cfg.capture_length,
+                                   &out_length, &fail_index);
+        I2C[m_cfg.bus].unlock();
+
+        // If we read less than a full sample, fill the rest with zeros
+        if (out_length < m_cfg.capture_length) memset(m_capture + out_length, 0, m_cfg.capture_length - out_length);
+
+        // Hand the sample to the stream job
+        Streamer.push(m_cfg.job, timestamp, error ? SAMPLE_I2C_ERROR : SAMPLE_OK, m_capture);
+
+        // Keep track of how many times we've fired
+        ++m_fired;
+
+        xSemaphoreGive(m_mutex);
+    }
+}
+//=========================================================================================================
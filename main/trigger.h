@@ -0,0 +1,106 @@
+//=========================================================================================================
+// trigger.h - Defines a trigger input: a GPIO edge (such as a sensor's data-ready line) that runs a
+//             stored list of batch operations and pushes the data that was read into a stream job
+//
+// This follows the same pattern as CButton: an ISR posts to a per-object queue, and a per-object task
+// does the work.   The ISR timestamps the edge, so samples are stamped with the time of the edge
+// rather than the time the task got around to reading the device.
+//=========================================================================================================
+#pragma once
+#include <atomic>
+#include "common.h"
+#include "streamer.h"
+
+// This is how many trigger inputs there are
+#define MAX_TRIGGERS            2
+
+// This is the longest op list a trigger can store
+#define MAX_TRIGGER_OPS         256
+
+// This is the most data a trigger can capture each time it fires
+#define MAX_TRIGGER_CAPTURE     (STREAM_PACKET_SIZE - STREAM_HDR_SIZE - SAMPLE_HDR_SIZE)
+
+// These are the edges a trigger can fire on
+enum trigger_edge_t
+{
+    TRIG_EDGE_RISING  = 0,
+    TRIG_EDGE_FALLING = 1,
+    TRIG_EDGE_ANY     = 2
+};
+
+
+//=========================================================================================================
+// This describes what a trigger input does when it fires
+//=========================================================================================================
+struct trigger_cfg_t
+{
+    int             pin;                    // GPIO pin number
+    int             edge;                   // A trigger_edge_t
+    int             bus;                    // The I2C bus the op list runs on
+    int             address;                // The I2C address the op list starts with
+    int             job;                    // The stream job the captured data goes to
+    int             capture_length;         // The number of bytes the op list reads
+    int             samples_per_packet;
+    int             session;                // The UDP session the stream job goes to
+    int             ops_length;
+    uint8_t         ops[MAX_TRIGGER_OPS];   // The op list, in CMD_BATCH format
+};
+//=========================================================================================================
+
+
+class CTrigger
+{
+public:
+
+    CTrigger() {m_enabled = false; m_pin = -1; m_task_handle = nullptr; m_fired = 0; m_missed = 0;}
+
+    // Configures and enables the trigger.  Returns 'false' if the configuration is invalid
+    bool    configure(const trigger_cfg_t& cfg);
+
+    // Disables the trigger
+    void    disable();
+
+    // Returns the number of times the trigger has fired and been handled
+    uint32_t fired() {return m_fired;}
+
+    // Returns 'true' if the trigger is enabled and its samples go to the specified UDP session
+    bool    serves(int session) {return m_enabled && m_cfg.session == session;}
+
+protected:
+
+    // This is the global task handler that dispatches object-specific task handlers
+    static void dispatch_task(void* p_object);
+
+    // This is the global ISR that stuffs events into the trigger-specific event queues
+    static void isr(void* p_object);
+
+    // This is a task handler that is instantiated the first time the trigger is configured
+    void        trigger_task();
+
+    // This is the configuration of the trigger
+    trigger_cfg_t   m_cfg;
+
+    // The GPIO pin our ISR is attached to, or -1 if none
+    int             m_pin;
+
+    // This will be true while the trigger is enabled
+    volatile bool   m_enabled;
+
+    // This is the number of times the trigger has fired and been handled
+    uint32_t        m_fired;
+
+    // This is the number of edges the ISR had to throw away because the queue was full
+    std::atomic<uint32_t> m_missed;
+
+    // This is where the data read by the op list is stored
+    uint8_t         m_capture[MAX_TRIGGER_CAPTURE];
+
+    // This is the queue that the ISR will publish edge timestamps into
+    xQueueHandle    m_event_queue;
+
+    // This makes sure the trigger doesn't get re-configured while it's being handled
+    SemaphoreHandle_t m_mutex;
+
+    // This is the handle of the trigger task
+    TaskHandle_t    m_task_handle;
+};
@@ -28,20 +28,14 @@ const int SERVER_PORT = 1182;
 // This is contains the information about the server socket
 static struct sockaddr_in6 sock_desc;
 
-// When we receive a UDP message, this will contain the IP address of the sender
-static struct sockaddr_in6 source_addr; 
-
-// We're going to treat "sock_desc" as though it were a "sock_addr_in"
-static sockaddr_in& sockaddr_source = *(sockaddr_in*)&source_addr;
-
 // This contains the socket descriptor of the socket when it's open
 static int  sock = -1;
 
-// We expect an incoming message to be no larger than this
-#define MAX_PACKET_SIZE 1024
+// If the packet pool stays empty for this long, we throw away a packet that's already waiting for us
+#define POOL_WAIT_MS 100
 
-// This is a buffer of all incoming messages
-static unsigned char rolling_buffer[20000];
+// When there's no free packet buffer, the packet we throw away gets received into here
+static unsigned char discard_buffer[PACKET_BUFFER_SIZE];
 
 //========================================================================================================= 
 // hard_shutdown() - Ensures that the listening socket and the server socket are closed
@@ -65,13 +59,14 @@ static void hard_shutdown()
 //========================================================================================================= 
 void CUDPServer::task()
 {
-    char source_ip[20];
+    // This is the address of whoever sent the packet we just received
+    struct sockaddr_in6 from;
 
-    // By default, we'll send messages back to the client on the same port we're listening on
-    m_client_port = SERVER_PORT;
+    // We're going to treat "from" as though it were a "sockaddr_in"
+    sockaddr_in& sockaddr_from = *(sockaddr_in*)&from;
 
     // How long is the buffer that will hold the address of the sender?
-    socklen_t source_length = sizeof(source_addr);
+    socklen_t source_length = sizeof(from);
     
     // We're going to treat "sock_desc" as though it were a "sock_addr_in"
     sockaddr_in& sockaddr = *(sockaddr_in*)&sock_desc;
@@ -97,48 +92,52 @@ void CUDPServer::task()
         return;
     }
 
-    // The next incoming packet shold be placed at the start of the rolling buffer
-    unsigned char* next_in = rolling_buffer;
-
-    // This is how many bytes we have free in the buffer
-    uint32_t buffer_remaining = sizeof(rolling_buffer);
-
     // Tell the engineer that the socket is built and we're ready for incoming data
     printf(">>>> Waiting for incoming UDP messages <<<<\n");
     while (true)
     {
+        // Fetch a buffer to receive the next packet into.  While we wait, incoming packets queue
+        // up in the network stack, which is what holds the clients back
+        uint8_t* buffer;
+        while ((buffer = PacketPool.acquire(POOL_WAIT_MS)) == nullptr)
+        {
+            // The engine is far behind.  If a packet is already waiting, it's stale by now, so throw
+            // it away to keep the backlog short.  We never wait here for one to arrive
+            if (recvfrom(sock, discard_buffer, sizeof discard_buffer, MSG_DONTWAIT, (struct sockaddr *)&from, &source_length) >= 0)
+            {
+                PacketPool.count_rx_drop();
+                Trace.log(TRC_RX_DROP);
+            }
+        }
+
         // Wait for a message to arrive
-        int length = recvfrom(sock, next_in, buffer_remaining, 0, (struct sockaddr *)&source_addr, &source_length);
+        int length = recvfrom(sock, buffer, PACKET_BUFFER_SIZE, 0, (struct sockaddr *)&from, &source_length);
 
         // If that failed, tell the engineer
         if (length < 0)
         {
             ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+            PacketPool.release(buffer);
             continue;
         }
 
-        // Convert the sender's IP address into a string
-        inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, source_ip, sizeof(source_ip) - 1);
-        
-        // Tell the engineer pertinent details about the packet we just received
-        printf("Rcvd %4i bytes from %s\n", length, source_ip);
-
-        // Hand this packet to the I2C engine
-        Engine.handle_packet(next_in, length);
+        // A discovery request is answered right here, and doesn't give the requester a session
+        if (length >= 5 && (buffer[4] & ~CMD_BUS_FLAG) == DISCOVER_CMD)
+        {
+            answer_discovery(buffer, from);
+            PacketPool.release(buffer);
+            continue;
+        }
 
-        // Point to where the next incoming message gets stored
-        next_in += length;
+        // Find out which session this packet belongs to.  Its replies go back to that client
+        int session = find_session(from);
 
-        // We now have fewer free bytes in the buffer
-        buffer_remaining -= length;
+        // Record pertinent details about the packet we just received
+        Trace.log(TRC_UDP_RX, length, sockaddr_from.sin_addr.s_addr);
 
-        // If there's not enough room left in the buffer for an entire packet, wrap-around
-        // to the start of the buffer
-        if (buffer_remaining < MAX_PACKET_SIZE)
-        {
-            next_in = rolling_buffer;
-            buffer_remaining = sizeof rolling_buffer;
-        }
+        // Hand this packet to the engine for the I2C bus it's aimed at.  From here on, the engine
+        // owns the buffer
+        CEngine::dispatch(buffer, length, PKT_SRC_UDP, session);
     }
 }
 //========================================================================================================= 
@@ -162,12 +161,68 @@ static void launch_task(void *pvParameters)
 
 
 
+//=========================================================================================================
+// launch_sender() - Calls the "sender_task()" routine in the specified object
+//
+// Passed: *pvParameters points to the object that we want to use to run the task
+//=========================================================================================================
+static void launch_sender(void *pvParameters)
+{
+    ((CUDPServer*) pvParameters)->sender_task();
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// sender_task() - Sends the replies that the engines have queued up.  This runs in the network core so
+//                 that the engines never wait on lwIP
+//=========================================================================================================
+void CUDPServer::sender_task()
+{
+    // Every time an engine wakes us up, send every reply that every engine has waiting
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) Engine[bus].send_queued_replies();
+    }
+}
+//=========================================================================================================
+
+
+
 //=========================================================================================================
 // start() - Starts the UDP server task
 //=========================================================================================================
 void CUDPServer::begin()
 {
-    xTaskCreatePinnedToCore(launch_task, "udp_server", 4096, this, TASK_PRIO_UDP, &m_task_handle, TASK_CPU);
+    // The socket isn't tied to an IP address, so when Wi-Fi reconnects, the server we already have
+    // carries on, and so does the client's session
+    if (m_is_running) return;
+
+    // The first time we're called, pick up the session table from before a soft reboot (if there was
+    // one), and create the mutex that protects it
+    if (m_mutex == nullptr)
+    {
+        if (NVRAM.is_sealed(&NVRAM.client, sizeof NVRAM.client))
+            memcpy(m_session, NVRAM.client.session, sizeof m_session);
+        else
+            memset(m_session, 0, sizeof m_session);
+        memset(m_last_rx, 0, sizeof m_last_rx);
+        m_latest_session = LATEST_SESSION;
+        m_mutex = xSemaphoreCreateMutex();
+    }
+
+    // The reply sender is started the first time we're called, and runs from then on
+    if (m_sender_handle == nullptr)
+    {
+        xTaskCreatePinnedToCore(launch_sender, "udp_sender", 4096, this, PerfProfile.priority(TASK_PRIO_REPLY),
+                                &m_sender_handle, NET_CPU);
+    }
+
+    // Start the task that receives packets
+    xTaskCreatePinnedToCore(launch_task, "udp_server", 4096, this, PerfProfile.priority(TASK_PRIO_UDP), &m_task_handle,
+                            NET_CPU);
 
     // The server is running!
     m_is_running = true;
@@ -195,17 +250,251 @@ void CUDPServer::stop()
 
 
 //=========================================================================================================
-// reply() - Send a reply back to the last host that sent us a message
+// reply() - Sends a packet to the client that has a session
+//
+// Passed: session = The session slot of the client, or LATEST_SESSION for whoever we heard from last
+//         data    = The packet to send
+//         length  = The length of the packet
 //=========================================================================================================
-void CUDPServer::reply(void* data, int length)
+void CUDPServer::reply(int session, void* data, int length)
 {
-    // We want to send our reply back to the same port number we're listening on
-    sockaddr_source.sin_port = htons(m_client_port);
+    struct sockaddr_in6 dest;
+
+    // We're going to treat "dest" as though it were a "sockaddr_in"
+    sockaddr_in& sockaddr_dest = *(sockaddr_in*)&dest;
+    memset(&dest, 0, sizeof dest);
+
+    // If nobody has ever sent us a packet, there's nobody to reply to
+    if (m_mutex == nullptr) return;
+
+    // Find out where this client wants its replies to go
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    if (session == LATEST_SESSION) session = m_latest_session;
+    bool valid = (session >= 0 && session < MAX_UDP_SESSIONS && m_session[session].port != 0);
+    if (valid)
+    {
+        sockaddr_dest.sin_family      = AF_INET;
+        sockaddr_dest.sin_addr.s_addr = m_session[session].addr;
+        sockaddr_dest.sin_port        = htons(m_session[session].reply_port);
+    }
+    xSemaphoreGive(m_mutex);
+
+    // If that client's session is gone, so is the reply
+    if (!valid) return;
 
     // Send the message back
-    int err = sendto(sock, data, length, 0, (struct sockaddr *)&source_addr, sizeof source_addr);
+    int err = sendto(sock, data, length, 0, (struct sockaddr *)&dest, sizeof dest);
 
     // Say something if an error occurs
-    if (err < 0) printf("sendto() failed with %i\n", err);
+    if (err < 0) Trace.log(TRC_UDP_TX_FAIL, err, errno);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find_session() - Returns the session slot of the client that sent a packet.  A client we haven't heard
+//                  from before gets a free slot, or the slot of the client we've heard from least recently
+//
+// Passed: from = The address the packet came from
+//
+// Note: Only the UDP task may call this
+//=========================================================================================================
+int CUDPServer::find_session(const struct sockaddr_in6& from)
+{
+    const sockaddr_in& sockaddr_from = *(const sockaddr_in*)&from;
+    uint32_t addr    = sockaddr_from.sin_addr.s_addr;
+    uint16_t port    = ntohs(sockaddr_from.sin_port);
+    int64_t  now     = esp_timer_get_time();
+    int      slot, oldest = 0;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Look for this client's slot, keeping track of the best slot to take over if it doesn't have one.
+    // A free slot is better than any slot in use
+    for (slot = 0; slot < MAX_UDP_SESSIONS; ++slot)
+    {
+        const udp_session_t& entry = m_session[slot];
+        if (entry.port == port && entry.addr == addr) break;
+        if (m_session[oldest].port == 0) continue;
+        if (entry.port == 0 || m_last_rx[slot] < m_last_rx[oldest]) oldest = slot;
+    }
+
+    // If this new client is taking over another client's slot, the stream and trigger jobs that client
+    // started have to stop before the slot changes hands, or their samples would go to the new client.
+    // The slot is freed first, so anything they send while they stop goes nowhere.  Stopping them takes
+    // their own mutexes, and sending takes ours, so we can't hold ours while they stop
+    bool is_new = (slot == MAX_UDP_SESSIONS);
+    if (is_new && m_session[oldest].port != 0)
+    {
+        m_session[oldest].port = 0;
+        xSemaphoreGive(m_mutex);
+        for (int i = 0; i < MAX_TRIGGERS; ++i) if (Trigger[i].serves(oldest)) Trigger[i].disable();
+        Streamer.stop_session(oldest);
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+    }
+
+    // If this is a new client, give it a slot.  Its replies go to our own port until it says otherwise
+    if (is_new)
+    {
+        slot = oldest;
+        m_session[slot].addr       = addr;
+        m_session[slot].port       = port;
+        m_session[slot].reply_port = SERVER_PORT;
+        save_sessions();
+    }
+
+    // This is now the client we heard from most recently
+    m_last_rx[slot]  = now;
+    m_latest_session = slot;
+
+    xSemaphoreGive(m_mutex);
+
+    // A new client starts out with no transaction IDs and no cached replies in any engine.  This goes
+    // through the slot's packet ring, so the engines see it before the client's first packet
+    if (is_new) for (int bus = 0; bus < I2C_BUS_COUNT; ++bus) Engine[bus].post_message(ENGINE_MSG_RESET, slot);
+
+    // Tell the caller which slot this client has
+    return slot;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_client_port() - Tells us which port to send a client's replies to
+//
+// Passed: session = The session slot of the client
+//         port    = The port the client wants its replies on
+//=========================================================================================================
+void CUDPServer::set_client_port(int session, int port)
+{
+    if (m_mutex == nullptr || session < 0 || session >= MAX_UDP_SESSIONS) return;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    if (m_session[session].port)
+    {
+        m_session[session].reply_port = port;
+        save_sessions();
+    }
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_session() - Fetches a session slot
+//
+// Passed: session   = The session slot
+//         p_session = Filled in with the client's address, port and reply port
+//         p_idle_ms = Filled in with how many milliseconds ago we last heard from the client
+//
+// Returns: 'false' if the slot is free
+//=========================================================================================================
+bool CUDPServer::get_session(int session, udp_session_t* p_session, uint32_t* p_idle_ms)
+{
+    if (m_mutex == nullptr || session < 0 || session >= MAX_UDP_SESSIONS) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    *p_session = m_session[session];
+    *p_idle_ms = (esp_timer_get_time() - m_last_rx[session]) / 1000;
+    xSemaphoreGive(m_mutex);
+
+    return p_session->port != 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// save_sessions() - Copies the session table to NVRAM so that it survives a soft reboot
+//
+// Note: The caller must be holding m_mutex
+//=========================================================================================================
+void CUDPServer::save_sessions()
+{
+    memcpy(NVRAM.client.session, m_session, sizeof m_session);
+    NVRAM.seal(&NVRAM.client, sizeof NVRAM.client);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// port() - Returns the UDP port we listen on
+//=========================================================================================================
+int CUDPServer::port()
+{
+    return SERVER_PORT;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// answer_discovery() - Tells a client who we are, and where to find us
+//
+// Passed: request = The discovery request
+//         from    = Where the request came from.  That's where the answer goes
+//=========================================================================================================
+void CUDPServer::answer_discovery(const uint8_t* request, const struct sockaddr_in6& from)
+{
+    uint8_t reply[64], mac[6], *p = reply;
+
+    // Echo the transaction ID and the command, and report success
+    memcpy(p, request, 5);
+    p[4] = DISCOVER_CMD;
+    p[5] = 0;
+    p += 6;
+
+    // Our firmware version
+    int version = atoi(FW_VERSION);
+    *p++ = version >> 24;
+    *p++ = version >> 16;
+    *p++ = version >>  8;
+    *p++ = version;
+
+    // Our MAC address, which is how a client recognizes us if our IP address changes
+    memset(mac, 0, sizeof mac);
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    memcpy(p, mac, sizeof mac);
+    p += sizeof mac;
+
+    // If the requester has a session, find out where its replies go
+    const sockaddr_in& sockaddr_from = *(const sockaddr_in*)&from;
+    int reply_port = SERVER_PORT;
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    for (const udp_session_t& entry : m_session)
+    {
+        if (entry.port == ntohs(sockaddr_from.sin_port) && entry.addr == sockaddr_from.sin_addr.s_addr)
+            reply_port = entry.reply_port;
+    }
+    xSemaphoreGive(m_mutex);
+
+    // The ports we listen on, and the port the requester's replies go to
+    int ports[] = {SERVER_PORT, BinServer.port(), reply_port};
+    for (int port : ports)
+    {
+        *p++ = port >> 8;
+        *p++ = port;
+    }
+
+    // And our host name
+    int name_length = strlen(System.ssid) + 1;
+    if (name_length > (int)(reply + sizeof reply - p)) name_length = reply + sizeof reply - p;
+    memcpy(p, System.ssid, name_length);
+    p += name_length;
+    p[-1] = 0;
+
+    // Send the answer straight back to the port the request came from
+    int err = sendto(sock, reply, p - reply, 0, (struct sockaddr *)&from, sizeof from);
+    if (err < 0) Trace.log(TRC_UDP_TX_FAIL, err, errno);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_priority() - Changes the priorities of our tasks.  Tasks that aren't running yet pick up their
+//                  priority from PerfProfile when they're started
+//=========================================================================================================
+void CUDPServer::set_priority(int receive, int reply)
+{
+    if (m_is_running) vTaskPrioritySet(m_task_handle, receive);
+    if (m_sender_handle) vTaskPrioritySet(m_sender_handle, reply);
 }
 //=========================================================================================================
@@ -4,11 +4,57 @@
 #pragma once
 #include "common.h"
 
+/*
+A client finds servers on its network by broadcasting a discovery request to our port:
+    4 Bytes of transaction ID
+    1 Byte  of command (always DISCOVER_CMD)
+
+Every server answers straight back to the port the request came from, whether or not that client has
+a session with it:
+    4 Bytes of transaction ID (the one in the request)
+    1 Byte  of command (always DISCOVER_CMD)
+    1 Byte  of error code (always 0)
+    4 Bytes of firmware version
+    6 Bytes of MAC address
+    2 Bytes of UDP port
+    2 Bytes of binary TCP port
+    2 Bytes of the port replies to the requester are sent to (SERVER_PORT if it has no session)
+    n Bytes of host name, nul-terminated.  This is also our mDNS host name
+
+The same server is advertised over mDNS as _wifi-i2c._udp and _wifi-i2c._tcp
+
+Several clients can share the server at once.  Each client (an IP address and the port it sends from)
+gets a session slot of its own the first time we hear from it, and each session has its own reply port
+(see CMD_CLIENT_PORT), transaction-ID window, reply cache and coalescing setting in every engine.   When
+every slot is in use, a new client takes over the slot of the client we've heard from least recently
+*/
+#define DISCOVER_CMD 22
+
+// This is how many clients can have a session at once
+#define MAX_UDP_SESSIONS 4
+
+// Passing this as a session number means "whichever client sent us a packet most recently"
+#define LATEST_SESSION  -1
+
+struct sockaddr_in6;
+
+
+//=========================================================================================================
+// This identifies a client, and says where its replies go.  A slot with a port of 0 is free
+//=========================================================================================================
+struct udp_session_t
+{
+    uint32_t    addr;           // The client's IPv4 address, in network byte order
+    uint16_t    port;           // The port the client sends from
+    uint16_t    reply_port;     // The port the client wants its replies on
+};
+//=========================================================================================================
+
 class CUDPServer
 {
 public:
 
-    CUDPServer() {m_is_running = false;}
+    CUDPServer() {m_is_running = false; m_sender_handle = nullptr; m_mutex = nullptr;}
 
     // Call this to start the server task
     void    begin();
@@ -16,25 +62,61 @@ public:
     // Call this to stop the server task
     void    stop();
 
-    // Use this to reply back to the host that sent data
-    void    reply(void* data, int length);
+    // Sends a packet to the client that has the specified session (or LATEST_SESSION)
+    void    reply(int session, void* data, int length);
+
+    // Call this to determine what port to send a client's replies to
+    void    set_client_port(int session, int port);
+
+    // Fetches a session slot and how many milliseconds ago its client was last heard from.  Returns
+    // 'false' if the slot is free
+    bool    get_session(int session, udp_session_t* p_session, uint32_t* p_idle_ms);
 
-    // Call this to determine what client port to send replies to
-    void    set_client_port(int port) {m_client_port = port;}
+    // Returns the UDP port we listen on
+    int     port();
+
+    // Changes the priorities of the receiving task and the reply sender task, if they're running
+    void    set_priority(int receive, int reply);
+
+    // The engines call this to tell the reply sender task they've queued up replies
+    void    wake_sender() {if (m_sender_handle) xTaskNotifyGive(m_sender_handle);}
 
 public:
     
     // This is the task that serves as our UDP server.
     void    task();
 
+    // This is the task that sends the replies the engines have queued up
+    void    sender_task();
+
 protected:
 
+    // Answers a discovery request from a client
+    void    answer_discovery(const uint8_t* request, const struct sockaddr_in6& from);
+
+    // Returns the session slot of the client that sent a packet, giving it one if it doesn't have one
+    int     find_session(const struct sockaddr_in6& from);
+
+    // Copies the session table to NVRAM, so that a soft reboot doesn't end anyone's session.  The
+    // caller must be holding m_mutex
+    void    save_sessions();
+
     // This is the handle of the currently running server task
     TaskHandle_t m_task_handle;
 
+    // This is the handle of the reply sender task.  It keeps running when the server is stopped
+    TaskHandle_t m_sender_handle;
+
     // This will be 'true' when the server is running
     bool    m_is_running;
 
-    // This is the port number we'll send messages to the client on
-    int     m_client_port;
+    // These are the clients that have sessions with us, and when each was last heard from
+    udp_session_t   m_session[MAX_UDP_SESSIONS];
+    int64_t         m_last_rx[MAX_UDP_SESSIONS];
+
+    // This is the session of the client we heard from most recently
+    int     m_latest_session;
+
+    // The session table is changed by the UDP task and the engines, and read by the reply sender
+    SemaphoreHandle_t m_mutex;
 };
\ No newline at end of file
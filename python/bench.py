@@ -0,0 +1,244 @@
+import argparse, csv, sys, time
+from wifi_i2c import Wifi_I2C, Wifi_I2C_Ex
+
+#===========================================================================
+# bench.py - Measures the throughput and latency of a Wi-Fi I2C server
+#
+# Every test sends a stream of identical messages to the server with up to
+# "window" of them in flight at once, and reports:
+#
+#    ops/s     = I2C operations (or echoes) per second
+#    MB/s      = Payload bytes (written plus read) per second
+#    p50/p99/p999 = Round-trip latency of a single message, in microseconds
+#
+# The tests are:
+#
+#    echo      = CMD_ECHO.  Never touches the I2C bus, so this is the cost
+#                of the network and the engine by themselves
+#    read      = A single register read of "size" bytes
+#    write     = A single register write of "size" bytes of zeros.  This
+#                only runs against a real device if --writes is given
+#    batch     = A CMD_BATCH of "batch" 1-byte register reads
+#
+# Each bus test is run against the virtual device (address 0) and, if
+# --address is given, against a real device at that address.
+#
+# Typical use, as a regression gate for a firmware upgrade:
+#
+#    python3 bench.py --local 192.168.50.196 --server 192.168.50.229 \
+#                     --address 0x23 --csv before.csv
+#===========================================================================
+
+
+#===========================================================================
+# percentile() - Returns the value that 'pct' percent of the sorted list
+#                of samples are at or below
+#===========================================================================
+def percentile(samples, pct):
+
+    if not samples: return 0
+    index = int(len(samples) * pct / 100.0 + 0.5) - 1
+    return samples[max(0, min(index, len(samples) - 1))]
+
+
+#===========================================================================
+# run_messages() - Sends "count" copies of a message with up to "window"
+#                  in flight at once, and times each one
+#
+# Returns: A tuple of (elapsed seconds, sorted list of latencies in us)
+#
+# Lost messages are re-sent after a second, just like pipeline() does, and
+# the latency of a re-sent message is measured from its first transmission
+#===========================================================================
+def run_messages(device, command, data, count, window):
+
+    # Build every message ahead of time, so that building them isn't timed
+    messages = [device.build_message(command, data) for i in range(count)]
+
+    # These are the messages in flight. Key is trans ID, value is
+    # [index, attempts, first_sent_at, last_sent_at]
+    in_flight = {}
+    latency   = []
+    next_message = 0
+
+    # We're not yet expecting any replies
+    device.listener.expect_none()
+
+    start = time.perf_counter()
+
+    while next_message < count or in_flight:
+
+        # Fill the window with new messages
+        while next_message < count and len(in_flight) < window:
+            id, message = messages[next_message]
+            device.listener.expect_also(id)
+            now = time.perf_counter()
+            device.sock.sendto(message, device.server)
+            in_flight[id] = [next_message, 1, now, now]
+            next_message = next_message + 1
+
+        # Collect whatever replies have arrived
+        replies = device.listener.wait_for_replies(0.05)
+        now = time.perf_counter()
+        for id, reply in replies.items():
+            if id in in_flight:
+                entry = in_flight.pop(id)
+                device.parse_reply(reply)
+                latency.append((now - entry[2]) * 1e6)
+
+        # Re-send any message whose reply is overdue
+        for id, entry in in_flight.items():
+            if now - entry[3] >= 1:
+                if entry[1] == 5: raise Wifi_I2C_Ex(-1)
+                device.sock.sendto(messages[entry[0]][1], device.server)
+                entry[1] = entry[1] + 1
+                entry[3] = now
+
+    elapsed = time.perf_counter() - start
+
+    # Hand the caller the elapsed time and the sorted latencies
+    latency.sort()
+    return elapsed, latency
+
+
+#===========================================================================
+# build_test() - Returns the (command, data, ops per message, payload bytes
+#                per message) for a test
+#===========================================================================
+def build_test(device, test, address, size, batch):
+
+    # Every bus test is aimed at a specific device via a target byte
+    tflag = device.TARGET_FLAG
+    target = address.to_bytes(1, 'big')
+
+    if test == 'echo':
+        return device.ECHO_CMD, bytes(size), 1, 2 * size
+
+    if test == 'read':
+        data = (1 | tflag).to_bytes(1, 'big') + target + b'\x00' + size.to_bytes(2, 'big')
+        return device.READ_REG_CMD, data, 1, size
+
+    if test == 'write':
+        data = (1 | tflag).to_bytes(1, 'big') + target + b'\x00' + size.to_bytes(2, 'big') + bytes(size)
+        return device.WRITE_REG_CMD, data, 1, size
+
+    if test == 'batch':
+        ops = [('read_reg', n % 256, 1) for n in range(batch)]
+        data, _ = device.build_ops(ops, 1, address)
+        return device.BATCH_CMD, data, batch, batch
+
+    raise ValueError("unknown test " + test)
+
+
+#===========================================================================
+# bench() - Runs every test in the sweep
+#
+# Returns: A list of dictionaries, one per result
+#===========================================================================
+def bench(device, args):
+
+    # These are the devices we're going to run the bus tests against
+    targets = [0]
+    if args.address != None: targets.append(args.address)
+
+    # Build the list of (test, address, size, batch) combinations
+    sweep = []
+    for size in args.sizes:
+        sweep.append(('echo', None, size, 1))
+        for address in targets:
+            sweep.append(('read',  address, size, 1))
+            if address == 0 or args.writes: sweep.append(('write', address, size, 1))
+    for batch in args.batches:
+        for address in targets:
+            sweep.append(('batch', address, 1, batch))
+
+    results = []
+
+    for test, address, size, batch in sweep:
+        for window in args.windows:
+
+            # Reads and writes of the virtual device can't go past its 256 registers
+            if address == 0 and test in ('read', 'write') and size > 256: continue
+
+            command, data, ops, payload = build_test(device, test, address or 0, size, batch)
+
+            # Warm up, so that ARP and the like aren't part of the measurement
+            run_messages(device, command, data, min(args.count, 10), window)
+
+            elapsed, latency = run_messages(device, command, data, args.count, window)
+
+            # Figure out the statistics
+            result = {
+                'test'    : test,
+                'device'  : '-' if address == None else ('virtual' if address == 0 else hex(address)),
+                'size'    : size,
+                'batch'   : batch,
+                'window'  : window,
+                'count'   : args.count,
+                'ops_s'   : round(args.count * ops / elapsed, 1),
+                'mb_s'    : round(args.count * payload / elapsed / 1e6, 4),
+                'p50_us'  : round(percentile(latency, 50)),
+                'p99_us'  : round(percentile(latency, 99)),
+                'p999_us' : round(percentile(latency, 99.9)),
+            }
+
+            print("%-5s %-8s size %4i batch %3i window %2i : %9.1f ops/s %8.4f MB/s  p50 %6i  p99 %6i  p999 %6i us" %
+                  (result['test'], result['device'], size, batch, window, result['ops_s'], result['mb_s'],
+                   result['p50_us'], result['p99_us'], result['p999_us']))
+            results.append(result)
+
+    return results
+
+
+#===========================================================================
+# parse_list() - Parses a comma-separated list of integers
+#===========================================================================
+def parse_list(text):
+    return [int(x, 0) for x in text.split(',')]
+
+
+#===========================================================================
+# Execution starts here
+#===========================================================================
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(description = "Wi-Fi I2C throughput and latency benchmark")
+    parser.add_argument('--local',   default = None, help = "IP address of this computer (default: AP mode)")
+    parser.add_argument('--server',  default = None, help = "IP address of the server (default: AP mode)")
+    parser.add_argument('--address', default = None, type = lambda x: int(x, 0),
+                        help = "I2C address of a real device to test against")
+    parser.add_argument('--writes',  action = 'store_true',
+                        help = "also run the write test against the real device")
+    parser.add_argument('--count',   default = 1000, type = int, help = "messages per test")
+    parser.add_argument('--sizes',   default = [1, 16, 64, 256, 1000], type = parse_list,
+                        help = "payload sizes, comma separated")
+    parser.add_argument('--batches', default = [1, 8, 32, 128], type = parse_list,
+                        help = "ops per batch, comma separated")
+    parser.add_argument('--windows', default = [1, 4, 16], type = parse_list,
+                        help = "pipelining depths, comma separated")
+    parser.add_argument('--csv',     default = None, help = "file to write the results to")
+    args = parser.parse_args()
+
+    # Create the object that lets us control the I2C device via WiFi
+    device = Wifi_I2C(args.local)
+
+    # Start communicating
+    if not device.start(args.server):
+        print("Failed to connect to ESP32")
+        sys.exit(1)
+
+    print("Firmware revision is", device.get_firmware_rev())
+
+    # Run the benchmark and report any exceptions that occur
+    try:
+        results = bench(device, args)
+    except Wifi_I2C_Ex as e:
+        print(e.string)
+        sys.exit(1)
+
+    # If the user wants the results in a CSV file, write them out
+    if args.csv and results:
+        with open(args.csv, 'w', newline = '') as f:
+            writer = csv.DictWriter(f, fieldnames = list(results[0].keys()))
+            writer.writeheader()
+            writer.writerows(results)
@@ -0,0 +1,400 @@
+import argparse, csv, select, sys, time
+from wifi_i2c import Wifi_I2C, Wifi_I2C_Base, Wifi_I2C_Ex, Capture
+
+#===========================================================================
+# replay.py - Re-issues a recorded trace against a Wi-Fi I2C server, and
+#             compares the latencies with the ones that were recorded
+#
+# A trace is recorded by any program that uses Wifi_I2C:
+#
+#    device.start_capture('session.trc')
+#    ... init sequences, polling, bulk reads ...
+#    device.stop_capture()
+#
+# The replay sends the same requests, each with a new transaction ID, and
+# can either keep to the original timing (--timing original, the default,
+# optionally sped up with --speed) or send them as fast as possible
+# (--timing fast).  --window sets how many requests may be in flight at
+# once.  Over UDP, a request whose reply doesn't arrive within a second is
+# resent, and its latency is measured from its first transmission.
+#
+# The report shows, for each command and for the whole trace, the p50/p90/
+# p99/p999/max latency of the replay next to the recorded p50 and p99, a
+# log2 histogram of every latency, and how many replies differed from the
+# recorded ones (which is expected for registers that change on their own,
+# and worth a look when an error code differs).
+#
+# Typical use, as a regression gate for a firmware upgrade:
+#
+#    python3 replay.py session.trc --local 192.168.50.196 \
+#                      --server 192.168.50.229 --record baseline.trc
+#    ... upgrade the firmware ...
+#    python3 replay.py session.trc --local 192.168.50.196 \
+#                      --server 192.168.50.229 --baseline baseline.trc \
+#                      --fail-over 20
+#===========================================================================
+
+
+#===========================================================================
+# These are the names of the commands, keyed by command number
+#===========================================================================
+COMMAND_NAMES = {getattr(Wifi_I2C_Base, name) : name[:-4].lower()
+                 for name in dir(Wifi_I2C_Base) if name.endswith('_CMD')}
+
+
+#===========================================================================
+# percentile() - Returns the value that 'pct' percent of the sorted list
+#                of samples are at or below
+#===========================================================================
+def percentile(samples, pct):
+
+    if not samples: return 0
+    index = int(len(samples) * pct / 100.0 + 0.5) - 1
+    return samples[max(0, min(index, len(samples) - 1))]
+
+
+#===========================================================================
+# command_of() - Returns the name of the command in a message, with the bus
+#                it's aimed at if that isn't bus 0
+#===========================================================================
+def command_of(message):
+
+    command = message[4] & ~Wifi_I2C_Base.BUS_FLAG
+    name = COMMAND_NAMES.get(command, 'cmd%i' % command)
+    return name + '/1' if message[4] & Wifi_I2C_Base.BUS_FLAG else name
+
+
+#===========================================================================
+# replayable() - Returns False for a recorded request that can't be sent
+#                again as it was
+#
+# CLIENT_PORT names the port the recording client listened on (start()
+# sends our own), and a CHUNK_RESEND names the transaction ID of a read
+# that this replay never sent
+#===========================================================================
+def replayable(message):
+
+    command = message[4] & ~Wifi_I2C_Base.BUS_FLAG
+    if command == Wifi_I2C_Base.CLIENT_PORT_CMD: return False
+    if command == Wifi_I2C_Base.CHUNKED_CMD and len(message) > 5 and message[5] == Wifi_I2C_Base.CHUNK_RESEND:
+        return False
+    return True
+
+
+#===========================================================================
+# latencies() - Returns a dictionary of sorted lists of latencies in us,
+#               keyed by command name, from a list of transactions.  The
+#               key 'all' holds every latency
+#===========================================================================
+def latencies(transactions):
+
+    result = {'all' : []}
+    for t in transactions:
+        if t['reply'] == None or not replayable(t['request']): continue
+        latency = t['reply_us'] - t['sent_us']
+        result.setdefault(command_of(t['request']), []).append(latency)
+        result['all'].append(latency)
+    for samples in result.values(): samples.sort()
+    return result
+
+
+#===========================================================================
+# UDPLink - Sends messages to the server over UDP, and collects replies.
+#           Like TCPLink, it records into the client's trace (if it's
+#           recording one), since the replay doesn't send through Wifi_I2C
+#===========================================================================
+class UDPLink:
+
+    def __init__(self, device):
+        self.device = device
+        device.listener.expect_none()
+
+    def send(self, id, message):
+        self.device.listener.expect_also(id)
+        if self.device.capture: self.device.capture.record(Capture.REQUEST, message)
+        self.device.sock.sendto(message, self.device.server)
+
+    def resend(self, id, message):
+        self.device.sock.sendto(message, self.device.server)
+
+    def poll(self, seconds):
+        return self.device.listener.wait_for_replies(seconds).items()
+
+
+#===========================================================================
+# TCPLink - Sends messages to the server over its binary TCP port, and
+#           collects replies.  TCP takes care of lost messages
+#===========================================================================
+class TCPLink:
+
+    def __init__(self, device):
+        self.device = device
+
+    def send(self, id, message):
+        if self.device.capture: self.device.capture.record(Capture.REQUEST, message)
+        self.device.tcp.sendall(len(message).to_bytes(2, 'big') + message)
+
+    def resend(self, id, message):
+        pass
+
+    def poll(self, seconds):
+
+        replies = []
+        tcp = self.device.tcp
+        readable, _, _ = select.select([tcp], [], [], seconds)
+        if not readable: return replies
+
+        data = tcp.recv(65536)
+        if not data: raise Wifi_I2C_Ex(-1)
+
+        # Split whatever has arrived into frames.  Fragments of chunked reads
+        # aren't replies, and are thrown away
+        rx = self.device.tcp_rx
+        rx.extend(data)
+        while len(rx) >= 2:
+            length = int.from_bytes(rx[0:2], 'big')
+            if len(rx) < 2 + length: break
+            reply = bytes(rx[2:2 + length])
+            del rx[:2 + length]
+            if reply[0:4] == Wifi_I2C_Base.CHUNK_TRANS_ID: continue
+            if self.device.capture: self.device.capture.record(Capture.REPLY, reply)
+            replies.append((reply[0:4], reply))
+        return replies
+
+
+#===========================================================================
+# replay() - Re-issues every replayable request in a trace
+#
+# Returns: A tuple of (elapsed seconds, list of transactions in the same
+#          form that Capture.load() returns, worst lag behind the original
+#          timing in us)
+#===========================================================================
+def replay(device, link, recorded, args):
+
+    # Build every message ahead of time with a new transaction ID, and the
+    # time (relative to the first one) that it was originally sent at
+    plan = []
+    for t in recorded:
+        if not replayable(t['request']): continue
+        id = device.next_transaction_id()
+        plan.append((id, id + t['request'][4:], t['sent_us']))
+    if not plan: return 0, [], 0
+    first_us = plan[0][2]
+
+    # These are the messages in flight.  Key is trans ID, value is
+    # [transaction, attempts, last_sent_at]
+    in_flight = {}
+    results   = []
+    next_message = 0
+    worst_lag = 0
+
+    start = time.perf_counter()
+
+    while next_message < len(plan) or in_flight:
+
+        # Fill the window with any messages that are due
+        wait = 0.05
+        while next_message < len(plan) and len(in_flight) < args.window:
+            id, message, sent_us = plan[next_message]
+            now = time.perf_counter()
+
+            # Keep to the original timing, if we've been asked to
+            if args.timing == 'original':
+                due = start + (sent_us - first_us) / 1e6 / args.speed
+                if now < due:
+                    wait = min(wait, due - now)
+                    break
+                worst_lag = max(worst_lag, (now - due) * 1e6)
+
+            transaction = {'request' : message, 'sent_us' : int((now - start) * 1e6),
+                           'reply' : None, 'reply_us' : None}
+            results.append(transaction)
+            link.send(id, message)
+            in_flight[id] = [transaction, 1, now]
+            next_message = next_message + 1
+
+        # Collect whatever replies have arrived
+        for id, reply in link.poll(wait if in_flight or next_message < len(plan) else 0):
+            entry = in_flight.pop(id, None)
+            if entry:
+                entry[0]['reply']    = reply
+                entry[0]['reply_us'] = int((time.perf_counter() - start) * 1e6)
+
+        # Re-send any message whose reply is overdue
+        now = time.perf_counter()
+        for id, entry in in_flight.items():
+            if now - entry[2] >= 1:
+                if entry[1] == 5: raise Wifi_I2C_Ex(-1)
+                link.resend(id, entry[0]['request'])
+                entry[1] = entry[1] + 1
+                entry[2] = now
+
+    return time.perf_counter() - start, results, worst_lag
+
+
+#===========================================================================
+# compare_replies() - Counts the replies that differ from the recorded ones
+#
+# Returns: A tuple of (replies that differ, replies whose error code differs)
+#===========================================================================
+def compare_replies(recorded, replayed):
+
+    recorded = [t for t in recorded if replayable(t['request'])]
+    differ = errors = 0
+    for old, new in zip(recorded, replayed):
+        if old['reply'] == None or new['reply'] == None: continue
+        if old['reply'][4:] != new['reply'][4:]: differ = differ + 1
+        if old['reply'][5] != new['reply'][5]: errors = errors + 1
+    return differ, errors
+
+
+#===========================================================================
+# print_histogram() - Prints log2 histograms of two sets of latencies side
+#                     by side
+#===========================================================================
+def print_histogram(old, new, old_name, new_name):
+
+    def buckets(samples):
+        counts = {}
+        for us in samples:
+            bucket = max(0, int(us).bit_length() - 1)
+            counts[bucket] = counts.get(bucket, 0) + 1
+        return counts
+
+    old_counts, new_counts = buckets(old), buckets(new)
+    keys = sorted(set(old_counts) | set(new_counts))
+    if not keys: return
+
+    print("\n%18s %10s %10s" % ("latency (us)", old_name, new_name))
+    for bucket in range(keys[0], keys[-1] + 1):
+        low = 1 << bucket
+        print("%8i - %7i %10i %10i" % (low, 2 * low - 1, old_counts.get(bucket, 0), new_counts.get(bucket, 0)))
+
+
+#===========================================================================
+# report() - Prints the latency of each command, next to that of the run
+#            we're comparing against
+#
+# Returns: A list of dictionaries, one per command
+#===========================================================================
+def report(old, new, old_name):
+
+    results = []
+
+    print("\n%-16s %7s | %8s %8s | %8s %8s %8s %8s %8s | %7s %7s" %
+          ("command", "count", old_name + " p50", old_name + " p99",
+           "p50", "p90", "p99", "p999", "max", "p50 %", "p99 %"))
+
+    # The whole trace goes last
+    names = sorted(name for name in new if name != 'all') + ['all']
+    for name in names:
+        samples = new[name]
+        before  = old.get(name, [])
+        result = {
+            'command'     : name,
+            'count'       : len(samples),
+            'base_p50_us' : percentile(before, 50),
+            'base_p99_us' : percentile(before, 99),
+            'p50_us'      : percentile(samples, 50),
+            'p90_us'      : percentile(samples, 90),
+            'p99_us'      : percentile(samples, 99),
+            'p999_us'     : percentile(samples, 99.9),
+            'max_us'      : samples[-1] if samples else 0,
+        }
+
+        # This is how much slower (positive) or faster the replay was
+        def change(key):
+            base = result['base_' + key]
+            return round(100.0 * (result[key] - base) / base, 1) if base else 0
+        result['p50_change'] = change('p50_us')
+        result['p99_change'] = change('p99_us')
+
+        print("%-16s %7i | %8i %8i | %8i %8i %8i %8i %8i | %+6.1f%% %+6.1f%%" %
+              (name, result['count'], result['base_p50_us'], result['base_p99_us'], result['p50_us'],
+               result['p90_us'], result['p99_us'], result['p999_us'], result['max_us'],
+               result['p50_change'], result['p99_change']))
+        results.append(result)
+
+    return results
+
+
+#===========================================================================
+# Execution starts here
+#===========================================================================
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(description = "Wi-Fi I2C trace replay")
+    parser.add_argument('trace',         help = "trace file recorded with start_capture()")
+    parser.add_argument('--local',       default = None, help = "IP address of this computer (default: AP mode)")
+    parser.add_argument('--server',      default = None, help = "IP address of the server (default: discover)")
+    parser.add_argument('--tcp',         action = 'store_true', help = "replay over the binary TCP port")
+    parser.add_argument('--timing',      default = 'original', choices = ['original', 'fast'],
+                        help = "keep to the recorded timing, or send as fast as possible")
+    parser.add_argument('--speed',       default = 1.0, type = float,
+                        help = "with --timing original, replay this many times faster")
+    parser.add_argument('--window',      default = 1, type = int, help = "most requests in flight at once")
+    parser.add_argument('--baseline',    default = None,
+                        help = "compare against this trace (e.g. an earlier --record) instead of the recording")
+    parser.add_argument('--record',      default = None, help = "record the replay itself into this trace file")
+    parser.add_argument('--csv',         default = None, help = "file to write the per-command results to")
+    parser.add_argument('--fail-over',   default = None, type = float,
+                        help = "exit with status 2 if the overall p99 is this many percent over the baseline")
+    args = parser.parse_args()
+
+    # Load the trace, and whatever we're comparing against
+    trace = Capture.load(args.trace)
+    recorded = trace['transactions']
+    baseline = Capture.load(args.baseline)['transactions'] if args.baseline else recorded
+    base_name = 'base' if args.baseline else 'rec'
+
+    span = (recorded[-1]['sent_us'] - recorded[0]['sent_us']) / 1e6 if recorded else 0
+    print("%s: %i requests over %.2f s, recorded %s" %
+          (args.trace, len(recorded), span, time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(trace['start_time']))))
+
+    # Create the object that lets us control the I2C device via WiFi
+    device = Wifi_I2C(args.local)
+
+    # Start communicating
+    if not device.start(args.server):
+        print("Failed to connect to ESP32")
+        sys.exit(1)
+    if args.tcp and not device.start_tcp(device.server[0]):
+        print("Failed to connect to the binary TCP port")
+        sys.exit(1)
+
+    print("Firmware revision is", device.get_firmware_rev())
+
+    # Replay the trace and report any exceptions that occur
+    if args.record: device.start_capture(args.record)
+    link = TCPLink(device) if args.tcp else UDPLink(device)
+    try:
+        elapsed, replayed, worst_lag = replay(device, link, recorded, args)
+    except Wifi_I2C_Ex as e:
+        print(e.string)
+        sys.exit(1)
+    finally:
+        device.stop_capture()
+
+    print("Replayed %i requests in %.2f s (%.1f/s), timing %s, window %i" %
+          (len(replayed), elapsed, len(replayed) / elapsed if elapsed else 0, args.timing, args.window))
+    if args.timing == 'original': print("Worst lag behind the recorded timing: %i us" % worst_lag)
+
+    # Show how the latencies compare
+    old, new = latencies(baseline), latencies(replayed)
+    results = report(old, new, base_name)
+    print_histogram(old['all'], new['all'], base_name, 'replay')
+
+    differ, errors = compare_replies(recorded, replayed)
+    print("\n%i replies differ from the recording, %i of them in their error code" % (differ, errors))
+
+    # If the user wants the results in a CSV file, write them out
+    if args.csv and results:
+        with open(args.csv, 'w', newline = '') as f:
+            writer = csv.DictWriter(f, fieldnames = list(results[0].keys()))
+            writer.writeheader()
+            writer.writerows(results)
+
+    # If the replay is slower than the user will put up with, say so in the exit status
+    if args.fail_over != None and results[-1]['p99_change'] > args.fail_over:
+        print("p99 latency is %.1f%% over the baseline" % results[-1]['p99_change'])
+        sys.exit(2)
@@ -1,6 +1,6 @@
 """
 To use this class, do this at the top of your Python code:
-         from wifi_i2c import Wifi_I2C, Wifi_I2C_Ex
+         from wifi_i2c import Wifi_I2C, Wifi_I2C_Ex, MacroParam, Capture
 
 Public API:
 
@@ -9,6 +9,8 @@ Public API:
     write_reg() and read_reg() API functions
 
 
+    For an asyncio client that keeps many transactions in flight at once, see wifi_i2c_async.py
+
     ----------------------------------------------------------------------------------------------------------
     Constructor of Wifi_I2C(local_ip_address)
 
@@ -16,11 +18,43 @@ Public API:
     ---------------------------------------------------------------------------------------------------------
     start(server_ip, server_port)
 
-    Passed: server_ip   = The IP address of the server, or None if connecting in AP mode
+    Passed: server_ip   = The IP address of the server, or None to use the first server that discover()
+                          finds (or 192.168.4.1, the server in AP mode, if it finds none)
             server_port = The port number to connect to, or 0 to use the default (i.e., 1182)
 
+    If a message goes unanswered, the server may have rebooted or been given a new IP address, and
+    rediscover() is called to find it again.   The server remembers its client, its I2C address and its
+    device slots across a soft reboot, so a session carries on where it left off
+
     Returns: True if a connection was established, False if no communication established
     ---------------------------------------------------------------------------------------------------------
+    discover(timeout = 0.5, port = 0, address = None, sock = None)
+
+    Broadcasts a request that every server on the network answers (they're also advertised over mDNS as
+    _wifi-i2c._udp and _wifi-i2c._tcp).   Pass address= to ask only the server at that IP address.   A
+    server can have several clients at once, each with a session of its own; pass sock= to ask from the
+    socket a session sends its messages from
+
+    Returns: A list with a dictionary for each server of 'ip', 'udp_port', 'tcp_port', 'client_port'
+             (where it sends the replies of the session that asked, or its own UDP port if it has none),
+             'fw', 'mac' and 'name'
+    ---------------------------------------------------------------------------------------------------------
+    rediscover(timeout = 0.5)
+
+    Finds the server that start() connected to by its MAC address, and if it has a new IP address or has
+    forgotten where to send its replies, picks up the session with it
+
+    Returns: True if the server was found
+    ---------------------------------------------------------------------------------------------------------
+    start_tcp(server_ip, server_port)
+
+    Connects to the server's binary TCP port (by default, 1182) instead of using UDP.   Every command
+    from then on goes over that connection, and TCP takes care of lost packets instead of our retries.
+    Use it instead of start(), or after it.  Streaming (stream_start/stream/set_trigger) still uses UDP,
+    and needs start()
+
+    Returns: True if the connection was made, False if it wasn't
+    ---------------------------------------------------------------------------------------------------------
     set_i2c_address(address)
 
     Sets the 7-bit I2C address of the I2C device you want to talk to
@@ -44,6 +78,279 @@ Public API:
     read_reg(register_number)
 
     Returns: the integer value in the register
+
+    By default the register number is written and the data read back in a single I2C transaction with
+    a repeated START between them.   Pass split=True to use a STOP and a separate read transaction instead.
+    Pass no_cache=True to read from the device even if the register is in a cached range
+    ---------------------------------------------------------------------------------------------------------
+    modify_reg(register, mask, value, length = 1, verify = False)
+
+    Has the server read a register (length bytes, big-endian), replace the bits in mask with those bits
+    of value, and write it back, without any other traffic getting onto the bus in between.  With
+    verify=True the register is read back, and if it doesn't hold the new value, Wifi_I2C_Ex is raised
+    with ERR_VERIFY.   Also accepts reg_width=, split=, address= and slot=
+
+    Returns: A tuple of (old value, new value)
+    ---------------------------------------------------------------------------------------------------------
+    poll_until(register, mask, expected, timeout_us = 100000, interval_us = 100, length = 1, max_polls = 0)
+
+    Has the server read a register (length bytes, big-endian) every interval_us microseconds until
+    (value & mask) == expected, for at most timeout_us microseconds (no more than 3 seconds) and, if
+    max_polls isn't 0, at most max_polls reads.   Use it to wait for a "ready" or "done" bit without a
+    network round trip per read.   Also accepts reg_width=, split=, address= and slot=
+
+    Returns: A dictionary of 'met' (True if the condition was met), 'status' ('met', 'timeout' or
+             'max_polls'), 'polls' (how many reads it took), 'elapsed_us' and 'value' (the last value read)
+    ---------------------------------------------------------------------------------------------------------
+    read_bulk(register, length, chunk_size = 0)
+
+    Reads a block of any length (a whole EEPROM, for instance) starting at a register.  The server sends
+    it back in datagram-sized fragments, and any fragments that go missing are asked for again.  Every
+    fragment is a separate read that starts at (register + offset), so don't use this on a register
+    where reading has side effects.   Also accepts reg_width=, address= and slot=
+
+    Returns: A byte string of the data that was read
+    ---------------------------------------------------------------------------------------------------------
+    write_bulk(register, data, chunk_size = 256)
+
+    Writes a block of any length starting at a register, as a series of writes of chunk_size bytes each
+    to (register + offset).   This is write_block() with a smaller chunk size
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    write_block(register, data, window = 8, chunk_size = 0)
+
+    Writes a block of any length starting at a register, as a series of writes to (register + offset)
+    that are each as large as the server can receive (or chunk_size bytes, if that's smaller).   data can
+    be bytes, a bytearray, a memoryview, an array.array or a numpy array: it's copied exactly once, into
+    message buffers allocated up front, and nothing else is built per message.   Over TCP (see start_tcp)
+    the writes are streamed back-to-back and only failures are replied to, otherwise up to "window" of
+    them (no more than 8, the number of replies the server keeps for resending) are in flight at once.   Also accepts reg_width=, address= and slot=
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    batch([op, op, op, <etc>])
+
+    Performs an ordered list of I2C operations in a single packet.  Each op is a tuple:
+        ('write',    register, value)       Writes an int or byte string to a register
+        ('read',     length)                Reads without sending a register number first
+        ('read_reg', register, length)      Reads from a register
+        ('delay',    microseconds)          Waits for the specified number of microseconds (no more than
+                                            3 seconds, otherwise the batch fails with ERR_BAD_PARAM)
+        ('poll',     register, mask, expected, timeout_us, interval_us, length, max_polls)
+                                            Waits like poll_until() (the last four are optional).  If
+                                            the condition isn't met, the batch stops with
+                                            ERR_POLL_TIMEOUT
+        ('rmw',      register, mask, value, length, verify)
+                                            Changes bits like modify_reg() (the last two are optional)
+        ('addr',     address)               Sets the I2C address for the rest of the batch
+        ('slot',     slot)                  Sets the device slot for the rest of the batch
+
+    Returns: A list containing a byte string for each 'read' and 'read_reg' op, and a dictionary (just
+             like the one poll_until() returns) for each 'poll' op, and an (old value, new value) tuple
+             for each 'rmw' op
+    ---------------------------------------------------------------------------------------------------------
+    set_device(slot, address, reg_width = 1, clock_hz = 0, timeout_ms = 0, stretch_us = 0)
+
+    Configures one of the server's device slots (0 thru 15).   Once a slot is configured, read_reg(),
+    write_reg() and batch() accept slot=<n> to talk to that device without changing the I2C address.
+    They also accept address=<n> to talk to a device at a specific I2C address.
+
+    timeout_ms is the longest a transaction with the device may take (0 = the server's default of
+    20 ms), and stretch_us is the longest the device may stretch the clock (0 = the hardware default,
+    at most 13000).   A transaction that hangs fails with ERR_BUS_TIMEOUT, and the server frees the bus
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    free_device(slot)
+
+    Frees a device slot that was configured with set_device()
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    set_cache_range(index, first_reg, last_reg, policy = 'write-through', ttl_ms = 0)
+
+    Gives a range of registers (index 0 thru 7) a caching policy: 'none', 'write-through', or 'ttl'.
+    Reads of a cached register are answered from the server's RAM without touching the I2C bus, until
+    the register is written, the cache is invalidated, or (for 'ttl') ttl_ms milliseconds go by.
+    Also accepts address= and slot=
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    clear_cache_range(index)
+
+    Removes the caching policy from a range of registers
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    invalidate_cache(address = None, slot = None)
+
+    Throws away the cached register data for one device, or for every device if neither is given
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    cache_stats()
+
+    Returns: A dictionary with the 'hits', 'misses', 'invalidations' and 'entries' cache counters
+    ---------------------------------------------------------------------------------------------------------
+    scan(cached = False)
+
+    Has the server probe every I2C address (0x08 thru 0x77) on the bus in one go.  With cached=True,
+    the server reports its last scan instead (scanning first if it never has)
+
+    Returns: A tuple of (list of addresses that answered, age of the scan in milliseconds)
+    ---------------------------------------------------------------------------------------------------------
+    define_macro(number, op_list, persist = False)
+
+    Stores a batch op list on the server as macro 0 thru 15, so that it can be run later with a packet
+    that's only a few bytes long.   Any register number, write value, delay or 'addr' in the op list can
+    be a MacroParam(width = None) placeholder, which is filled in with a value each time the macro is
+    run.  With persist=True the macro is stored in flash and survives a reboot.   Also accepts reg_width=,
+    address= and slot=
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    run_macro(number, *args)
+
+    Runs a stored macro.  There must be one arg for each MacroParam, in order: an int or a byte string
+
+    Returns: A list containing a byte string for each 'read' and 'read_reg' op, just like batch()
+    ---------------------------------------------------------------------------------------------------------
+    delete_macro(number)
+
+    Deletes a stored macro, from flash too if it was persisted
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    query_macro(number)
+
+    Returns: A dictionary of 'ops_length', 'persist' and 'params' (the width of each parameter)
+    ---------------------------------------------------------------------------------------------------------
+    configure_scan(period_ms = 0, validate = False)
+
+    Has the server re-scan the bus every period_ms milliseconds (0 = never).  With validate=True, the
+    server checks the addresses in batch() 'addr' ops and in set_device() against its last scan, and
+    fails them with ERR_NO_DEVICE without touching the bus
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    set_bus_clock(clock_hz, address = None)
+
+    Sets the default I2C bus clock (i.e., 100000, 400000 or 1000000), or if an address is given, the bus
+    clock for just that one device.  A clock of 0 for a device means "use the default bus clock"
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    get_bus_clock()
+
+    Returns: The default I2C bus clock in Hz
+    ---------------------------------------------------------------------------------------------------------
+    pipeline([(command, data), (command, data), <etc>], window = 8)
+
+    Sends a list of raw messages to the server with up to "window" of them (no more than 8) in flight at once.  Lost
+    messages and replies are retried, and the server recognizes a retry and re-sends its original
+    reply rather than performing the I2C operation a second time.
+
+    Returns: A list containing the reply data (or None) for each message
+    ---------------------------------------------------------------------------------------------------------
+    bulk([(command, data), (command, data), <etc>])
+
+    Only over TCP (see start_tcp).  Streams a list of raw messages to the server back-to-back, and the
+    server only replies to the ones that fail (and to the last message to each bus, so we know when
+    they're all done).   Use this to keep the I2C bus busy with a long run of writes.
+
+    Returns: nothing.  Raises Wifi_I2C_Ex for the first message that failed, after all have been handled
+    ---------------------------------------------------------------------------------------------------------
+    stream_start(job, register_list, period_us, samples_per_packet = 16)
+
+    Starts a job (0 thru 3) on the server that reads a list of registers every "period_us" microseconds
+    and streams the timestamped samples back to us, up to "samples_per_packet" samples per packet.
+    Each entry of register_list is a register number (a 1-byte read) or a (register, length) tuple.
+    Also accepts reg_width=, address= and slot=
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    stream(job, timeout = None)
+
+    An iterator that yields (seq, timestamp_us, status, values) for each sample of a stream job, where
+    "values" is a list of byte strings, one per register.   Status is 0 if the sample was read OK.
+    The iteration ends if no samples arrive within "timeout" seconds.   The number of packets that
+    never arrived is kept in stream_lost[job]
+    ---------------------------------------------------------------------------------------------------------
+    set_trigger(trigger, pin, op_list, job, edge = 'falling')
+
+    Configures a trigger input (0 or 1) on the server.  Every time the GPIO pin sees the edge, the server
+    runs the op list (same format as batch()) and streams the data that was read to us as a sample of
+    stream job "job".   The sample's timestamp is the time of the edge.  Use stream(job) to read them.
+    The op list runs with the bus held ahead of every other client, so it can't contain 'delay' or 'poll'
+    ops, and can't talk to the virtual device at address 0 (the server answers ERR_BAD_OP or
+    ERR_BAD_PARAM).  Also accepts reg_width=, address=, slot= and samples_per_packet=
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    clear_trigger(trigger)
+
+    Disables a trigger input
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    stream_stop(job = None)
+
+    Stops a stream job, or every stream job if no job number is given
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    stream_query(job)
+
+    Returns: A dictionary with the 'running', 'period_us', 'seq', 'samples', 'overruns' and 'errors'
+             fields of a stream job
+    ---------------------------------------------------------------------------------------------------------
+    set_coalescing(enable = True, max_bytes = 1400, max_delay_us = 0)
+
+    Asks the server to pack several replies into each datagram.  Replies are held until the datagram would
+    exceed max_bytes, until max_delay_us microseconds go by, or (if max_delay_us is 0) until the server has
+    no more requests waiting.   Most useful with pipeline().   start() turns coalescing back off.
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    get_stats(command = None)
+
+    Returns: The server's performance counters.  With no command number, a dictionary of 'duplicates',
+             'rx_drops', 'queue_drops', 'queue_high_water', 'commands' (the command numbers that have
+             been handled), 'bus_timeouts' and 'bus_recoveries' (hung transactions since bootup), and
+             'profile' (the performance profile: 'balanced', 'lowlatency' or 'lowpower', set with the
+             TCP server's "profile" command).   With a command number, a dictionary of 'count', 'errors',
+             'bus_us', 'bytes_in', 'bytes_out' and 'latency' (a log2 histogram of latency in microseconds)
+    ---------------------------------------------------------------------------------------------------------
+    get_telemetry()
+
+    Returns: A dictionary of system-wide telemetry from the server: 'heap_free', 'heap_min' (the least
+             there has ever been free) and 'heap_largest' (the largest allocatable block), 'engine_queue'
+             (a list with the number of requests waiting for each bus), 'flash_queue', 'cpu_load' (False
+             if the firmware was built without run-time stats), and 'tasks': a list of dictionaries of
+             'name', 'core' (None if not pinned), 'priority', 'stack_free' (bytes) and 'cpu' (percent
+             of one core over the last second).  The TCP server's "perf" command shows the same
+    ---------------------------------------------------------------------------------------------------------
+    reset_stats()
+
+    Resets the server's performance counters
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    echo(data)
+
+    Sends a byte string to the server, which sends it straight back without touching the I2C bus
+
+    Returns: The byte string the server sent back
+    ---------------------------------------------------------------------------------------------------------
+    set_bus(bus)
+
+    Aims every command that follows at I2C bus 0 or bus 1.  Each bus has its own engine on the server with
+    its own I2C address, device slots, virtual device, coalescing mode and performance counters, and the
+    two buses work concurrently.   pipeline() also accepts (command, data, bus) tuples, so that messages
+    for both buses can be in flight at once.
+
+    Returns: nothing
     ---------------------------------------------------------------------------------------------------------
     get_firmware_rev()
 
@@ -53,6 +360,29 @@ Public API:
 
     Returns: The signal strength as measured by the server
     ---------------------------------------------------------------------------------------------------------
+    start_capture(filename)
+
+    Records every request we send and every reply we receive, with a timestamp of each, into a compact
+    binary trace file (see the Capture class for its format).  A message that's resent is only recorded
+    the first time, and the reply is timestamped when it arrives.   replay.py re-issues a trace against
+    a server and compares the latencies it sees with the ones that were recorded
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    stop_capture()
+
+    Stops recording, and closes the trace file
+
+    Returns: nothing
+    ---------------------------------------------------------------------------------------------------------
+    Capture.load(filename)
+
+    Reads a trace file
+
+    Returns: A dictionary of 'start_time' (the time.time() when the capture started) and 'transactions':
+             a list, in the order they were sent, of dictionaries of 'request', 'sent_us' (microseconds
+             since the capture started), 'reply' (None if no reply was recorded) and 'reply_us'
+    ---------------------------------------------------------------------------------------------------------
 
 """
 
@@ -62,11 +392,38 @@ Change History:
  Vers   When       Who  What
 ---------------------------------------------------------------------------------------------------------
   1000  15-Dec-21  DWW  Initial creation
+  1001  14-Oct-26       Added "split" option to read_reg()
+  1002  14-Oct-26       Added batch()
+  1003  14-Oct-26       Added set_bus_clock() and get_bus_clock()
+  1004  14-Oct-26       Added device slots and per-operation addressing
+  1005  14-Oct-26       Added pipeline(), Listener now tracks several transactions at once
+  1006  14-Oct-26       Added stream_start(), stream_stop(), stream_query() and stream()
+  1007  14-Oct-26       Added set_trigger() and clear_trigger()
+  1008  14-Oct-26       Added register cache control and the no_cache option to read_reg()
+  1009  14-Oct-26       Added set_coalescing(), Listener unpacks coalesced replies
+  1010  14-Oct-26       Added get_stats() and reset_stats()
+  1011  14-Oct-26       Added echo()
+  1012  14-Oct-26       Added set_bus(), pipeline() messages can be aimed at either I2C bus
+  1013  14-Oct-26       Added start_tcp() and bulk()
+  1014  14-Oct-26       Added read_bulk() and write_bulk()
+  1015  14-Oct-26       Added scan() and configure_scan()
+  1016  14-Oct-26       Added stretch_us to set_device(), and bus timeout counters to get_stats()
+  1017  14-Oct-26       Moved the constants and message builders into Wifi_I2C_Base (see wifi_i2c_async.py)
+  1018  14-Oct-26       Added write_block(), write_bulk() is built on it
+  1019  14-Oct-26       Added define_macro(), run_macro(), delete_macro() and query_macro()
+  1020  14-Oct-26       Added discover() and rediscover(), start() finds the server when no IP is given
+  1021  14-Oct-26       get_stats() reports the performance profile
+  1022  14-Oct-26       Added poll_until() and the 'poll' batch op
+  1023  14-Oct-26       Added modify_reg() and the 'rmw' batch op
+  1024  14-Oct-26       Added get_telemetry()
+  1025  14-Oct-26       discover() takes a socket, so rediscover() sees our own session on a shared server
+  1026  14-Oct-26       Added start_capture(), stop_capture() and the Capture trace file (see replay.py)
+  1027  14-Oct-26       Added ERR_REPLY_EXPIRED, windows are no bigger than the server's reply cache
 =========================================================================================================
 """
 
 
-import threading, time, socket
+import threading, time, socket, queue, select, struct
 
 # ==========================================================================================================
 # Exception class for error reporting
@@ -75,14 +432,27 @@ class Wifi_I2C_Ex(Exception):
 
     trans_id   = None
     command    = None
+    bus        = None
     error_code = None
     register   = None
+    op_index   = None
     string     = ""
 
     ERR_NONE          = 0
     ERR_NOT_ENUF_DATA = 1
     ERR_I2C_WRITE     = 2
     ERR_I2C_READ      = 3
+    ERR_BAD_OP        = 4
+    ERR_TOO_LONG      = 5
+    ERR_BAD_PARAM     = 6
+    ERR_BAD_SLOT      = 7
+    ERR_NO_BUS        = 8
+    ERR_NO_DEVICE     = 9
+    ERR_BUS_TIMEOUT   = 10
+    ERR_NO_MACRO      = 11
+    ERR_POLL_TIMEOUT  = 12
+    ERR_VERIFY        = 13
+    ERR_REPLY_EXPIRED = 14
     ERR_CONN_TIMEOUT  = 99
     ERR_UNSUPPORTED   = 255
 
@@ -95,7 +465,8 @@ class Wifi_I2C_Ex(Exception):
             return
 
         self.trans_id = message[0:3]
-        self.command = int(message[4])
+        self.command = int(message[4]) & ~Wifi_I2C.BUS_FLAG
+        self.bus = 1 if int(message[4]) & Wifi_I2C.BUS_FLAG else 0
         self.error_code = int(message[5])
 
         # If there are at least 7 bytes in the message, assume the 7th byte is a register
@@ -106,8 +477,17 @@ class Wifi_I2C_Ex(Exception):
             self.string = "No error"
             return
 
+        # Errors during a batch report the index of the op that failed instead of a register
+        if self.command == Wifi_I2C.BATCH_CMD and len(message) >= 8:
+            self.op_index = int.from_bytes(message[6:8], 'big')
+            self.string = ("Batch op %i failed with error %i" % (self.op_index, self.error_code))
+            return
+
         if self.error_code == self.ERR_NOT_ENUF_DATA:
-            self.string = ("On register %i, not enough data" % self.register)
+            if self.register == None:
+                self.string = "Not enough data"
+            else:
+                self.string = ("On register %i, not enough data" % self.register)
             return
 
         if self.error_code == self.ERR_I2C_WRITE:
@@ -118,146 +498,1931 @@ class Wifi_I2C_Ex(Exception):
             self.string = ("On register %i, I2C read error" % self.register)
             return
 
+        if self.error_code == self.ERR_BAD_OP:
+            self.string = "Bad operation"
+            return
+
+        if self.error_code == self.ERR_TOO_LONG:
+            self.string = "Too much data requested"
+            return
+
+        if self.error_code == self.ERR_BAD_PARAM:
+            self.string = "Bad parameter"
+            return
+
+        if self.error_code == self.ERR_BAD_SLOT:
+            self.string = "Device slot not in use"
+            return
+
+        if self.error_code == self.ERR_NO_BUS:
+            self.string = ("I2C bus %i is not configured on the server" % self.bus)
+            return
+
+        if self.error_code == self.ERR_NO_DEVICE:
+            self.string = "No device at that address in the last bus scan"
+            return
+
+        if self.error_code == self.ERR_BUS_TIMEOUT:
+            self.string = "I2C transaction timed out, the bus was recovered"
+            return
+
+        if self.error_code == self.ERR_NO_MACRO:
+            self.string = "No macro is stored under that number"
+            return
+
+        if self.error_code == self.ERR_POLL_TIMEOUT:
+            self.string = "The polled register never met its condition"
+            return
+
+        if self.error_code == self.ERR_VERIFY:
+            self.string = ("On register %i, the value read back isn't the value written" % self.register)
+            return
+
+        if self.error_code == self.ERR_REPLY_EXPIRED:
+            self.string = "The server no longer has the reply to a resent request, it may or may not have run"
+            return
+
         if self.error_code == self.ERR_UNSUPPORTED:
             self.string = ("Unsupported command %i" % self.command)
             return
 
-        self.string = "Unknown error: "+str(self.error_code)
-# ==========================================================================================================
+        self.string = "Unknown error: "+str(self.error_code)
+# ==========================================================================================================
+
+
+
+
+# ==========================================================================================================
+# MacroParam - A placeholder in the op list of a macro, filled in with a value each time the macro is run
+# ==========================================================================================================
+class MacroParam:
+
+    # width is how many bytes wide the value is.  None means "as wide as the field it's in"
+    def __init__(self, width = None):
+        self.width = width
+# ==========================================================================================================
+
+
+
+
+# ==========================================================================================================
+# Capture - A trace file of the requests a client sent and the replies it received
+#
+# The file starts with a header:
+#   4 Bytes of magic number (always b'WI2T')
+#   2 Bytes of format version
+#   2 Bytes of reserved (always 0)
+#   8 Bytes of the time.time() when the capture started, as a double
+#
+# Then comes a record for every request and every reply, in the order they happened:
+#   1 Byte  of record type (REQUEST or REPLY)
+#   4 Bytes of microseconds since the record before it (or since the capture started)
+#   2 Bytes of message length
+#   n Bytes of message, exactly as it was sent or received
+#
+# Every field is little-endian.  A reply belongs to the request with the same transaction ID
+# ==========================================================================================================
+class Capture:
+
+    MAGIC   = b'WI2T'
+    VERSION = 1
+
+    # These are the types of record
+    REQUEST = 1
+    REPLY   = 2
+
+    # This is the layout of the file header and of the header of each record
+    HEADER  = struct.Struct('<4sHHd')
+    RECORD  = struct.Struct('<BIH')
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # The constructor - Creates the trace file and writes its header
+    # ------------------------------------------------------------------------------------------------------
+    def __init__(self, filename):
+
+        self.file = open(filename, 'wb')
+        self.file.write(self.HEADER.pack(self.MAGIC, self.VERSION, 0, time.time()))
+
+        # Records are written by whichever thread sends or receives a message
+        self.lock = threading.Lock()
+
+        # Every timestamp is relative to when the capture started
+        self.start   = time.perf_counter()
+        self.last_us = 0
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # record() - Appends a message to the trace file
+    # ------------------------------------------------------------------------------------------------------
+    def record(self, kind, message):
+
+        with self.lock:
+            if self.file == None: return
+            now_us = int((time.perf_counter() - self.start) * 1e6)
+            delta  = min(now_us - self.last_us, 0xFFFFFFFF)
+            self.last_us = now_us
+            self.file.write(self.RECORD.pack(kind, delta, len(message)))
+            self.file.write(message)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # close() - Finishes the trace file
+    # ------------------------------------------------------------------------------------------------------
+    def close(self):
+
+        with self.lock:
+            if self.file: self.file.close()
+            self.file = None
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # load() - Reads a trace file, and pairs each request with its reply
+    #
+    # Returns: A dictionary of 'start_time' and 'transactions' (see the Public API)
+    # ------------------------------------------------------------------------------------------------------
+    @staticmethod
+    def load(filename):
+
+        with open(filename, 'rb') as f: data = f.read()
+
+        # Make sure this is a trace file we understand
+        if len(data) < Capture.HEADER.size: raise ValueError(filename + " is not a trace file")
+        magic, version, reserved, start_time = Capture.HEADER.unpack_from(data, 0)
+        if magic != Capture.MAGIC: raise ValueError(filename + " is not a trace file")
+        if version != Capture.VERSION: raise ValueError(filename + " is trace format version " + str(version))
+
+        # These are the transactions in the order they were sent, and the ones waiting for a reply
+        transactions = []
+        waiting = {}
+
+        index  = Capture.HEADER.size
+        now_us = 0
+        while index + Capture.RECORD.size <= len(data):
+            kind, delta, length = Capture.RECORD.unpack_from(data, index)
+            index   = index + Capture.RECORD.size
+            message = data[index : index + length]
+            index   = index + length
+            now_us  = now_us + delta
+
+            # A truncated record at the end means the capture wasn't closed
+            if len(message) < length or length < 5: break
+
+            if kind == Capture.REQUEST:
+                transaction = {'request' : message, 'sent_us' : now_us, 'reply' : None, 'reply_us' : None}
+                transactions.append(transaction)
+                waiting[message[0:4]] = transaction
+
+            elif kind == Capture.REPLY:
+                transaction = waiting.pop(message[0:4], None)
+                if transaction:
+                    transaction['reply']    = message
+                    transaction['reply_us'] = now_us
+
+        return {'start_time' : start_time, 'transactions' : transactions}
+    # ------------------------------------------------------------------------------------------------------
+
+# ==========================================================================================================
+
+
+
+
+# ==========================================================================================================
+# Wifi_I2C_Base - The constants and message builders that every client of the server shares, whatever
+#                 it uses to carry the messages
+# ==========================================================================================================
+class Wifi_I2C_Base:
+
+    # This is the transaction ID of the next message we will send
+    transaction_id = 0
+
+    # This is the I2C bus that our commands are aimed at
+    bus = 0
+
+    # This is the I2C address of the device the server talks to when we don't specify one
+    i2c_address = 0x62
+
+    # For each stream job we've started, this is the length of each register's data in a sample
+    stream_layout = {}
+
+    # For each stream job, this is the number of stream packets that never arrived
+    stream_lost = {}
+
+    # For each macro we know about, this is a tuple of (width of each parameter, length of each read)
+    macro_layout = {}
+
+    # These are all of the commands we can send to the server
+    INIT_SEQ_CMD     = 0
+    CLIENT_PORT_CMD  = 1
+    I2C_ADDR_CMD     = 2
+    WRITE_REG_CMD    = 3
+    READ_REG_CMD     = 4
+    GET_FWREV_CMD    = 5
+    GET_RSSI_CMD     = 6
+    BATCH_CMD        = 7
+    BUS_CLOCK_CMD    = 8
+    DEVICE_CTX_CMD   = 9
+    STREAM_START_CMD = 10
+    STREAM_STOP_CMD  = 11
+    STREAM_QUERY_CMD = 12
+    STREAM_DATA_CMD  = 13
+    TRIGGER_CMD      = 14
+    CACHE_CMD        = 15
+    COALESCE_CMD     = 16
+    GET_STATS_CMD    = 17
+    ECHO_CMD         = 18
+    CHUNKED_CMD      = 19
+    SCAN_CMD         = 20
+    MACRO_CMD        = 21
+    DISCOVER_CMD     = 22
+    POLL_UNTIL_CMD   = 23
+    RMW_CMD          = 24
+
+    # These are the sub-commands of CHUNKED_CMD
+    CHUNK_READ       = 0
+    CHUNK_RESEND     = 1
+
+    # These are the sub-commands of SCAN_CMD
+    SCAN_NOW         = 0
+    SCAN_CACHED      = 1
+    SCAN_CONFIGURE   = 2
+
+    # These are the sub-commands of MACRO_CMD
+    MACRO_DEFINE     = 0
+    MACRO_RUN        = 1
+    MACRO_DELETE     = 2
+    MACRO_QUERY      = 3
+
+    # This flag in a macro definition means "store the macro in flash"
+    MACRO_PERSIST    = 0x01
+
+    # This is how many missing fragments we'll ask for in a single CHUNK_RESEND
+    CHUNK_RESEND_MAX = 256
+
+    # These are the sub-commands of CACHE_CMD
+    CACHE_SET_RANGE  = 0
+    CACHE_INVALIDATE = 1
+    CACHE_QUERY      = 2
+
+    # These are the sub-commands of GET_STATS_CMD
+    STATS_SUMMARY    = 0
+    STATS_COMMAND    = 1
+    STATS_RESET      = 2
+    STATS_SYSTEM     = 3
+
+    # This is how many replies the server keeps for resending (REPLY_CACHE_SIZE in engine.h).  A window
+    # of messages in flight is never bigger than this, or a resent message could find its reply gone
+    REPLY_CACHE_SIZE = 8
+
+    # These are the server's performance profiles, as get_stats() reports them
+    PERF_PROFILES    = {0 : 'balanced', 1 : 'lowlatency', 2 : 'lowpower'}
+
+    # These are the caching policies a range of registers can have
+    CACHE_POLICY     = {'none' : 0, 'write-through' : 1, 'ttl' : 2}
+
+    # This bit in the command byte aims the command at I2C bus 1
+    BUS_FLAG         = 0x80
+
+    # This bit in the length of a TCP frame means "only reply if this message fails"
+    TCP_QUIET_FLAG   = 0x8000
+
+    # If we're waiting on the TCP connection and nothing happens for this many seconds, we give up
+    TCP_TIMEOUT      = 5
+
+    # This is the longest message the server can receive
+    MAX_MESSAGE      = 1024
+
+    # This is the UDP port every server listens on, and the address discovery requests are broadcast to
+    SERVER_PORT      = 1182
+    BROADCAST        = '255.255.255.255'
+
+    # Stream data packets arrive with this transaction ID
+    STREAM_TRANS_ID  = b'\xff\xff\xff\xff'
+
+    # Coalesced replies arrive with this transaction ID
+    COALESCE_TRANS_ID = b'\xff\xff\xff\xfe'
+
+    # The fragments of a chunked read arrive with this transaction ID
+    CHUNK_TRANS_ID   = b'\xff\xff\xff\xfd'
+
+    # These are the op codes of the operations in a batch
+    OP_WRITE         = 1
+    OP_READ          = 2
+    OP_WRITE_READ    = 3
+    OP_DELAY_US      = 4
+    OP_SET_ADDR      = 5
+    OP_POLL_UNTIL    = 6
+    OP_RMW           = 7
+
+    # This flag in a read-modify-write means "read the register back and make sure the write took"
+    RMW_VERIFY       = 0x01
+
+    # These are the outcomes of a poll, and the length of the outcome in front of the value
+    POLL_STATUS      = {0 : 'met', 1 : 'timeout', 2 : 'max_polls'}
+    POLL_RESULT_LEN  = 7
+
+    # This flag in the register-width byte of a read means "STOP between register write and read"
+    SPLIT_READ_FLAG  = 0x80
+
+    # This flag in the register-width byte of a read means "don't answer this read from the cache"
+    NO_CACHE_FLAG    = 0x20
+
+    # This flag in the register-width byte means "a target byte follows"
+    TARGET_FLAG      = 0x40
+
+    # In a target byte, this bit means "this is a device slot number" rather than an I2C address
+    TARGET_SLOT      = 0x80
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_ops() - Translates a list of batch ops into the bytes the server expects
+    #
+    # If "params" is a list, the op list may contain MacroParam placeholders, and the (offset, width) of
+    # each one is appended to "params"
+    #
+    # Returns: A tuple of (op list bytes, list of the length of each read)
+    # ------------------------------------------------------------------------------------------------------
+    def build_ops(self, op_list, reg_width, target, params = None):
+
+        data = bytearray()
+
+        # This is the length of each read, in the order they were performed
+        read_lengths = []
+
+        # This returns the bytes of a field, or of a placeholder for a macro parameter
+        def field(value, width):
+            if not isinstance(value, MacroParam): return value.to_bytes(width, 'big')
+            if params == None: raise TypeError("MacroParam can only be used in define_macro()")
+            if value.width: width = value.width
+            params.append((len(data), width))
+            return bytes(width)
+
+        # If the caller aimed the batch at a specific device, start with that device
+        if target != None:
+            data += self.OP_SET_ADDR.to_bytes(1, 'big') + target.to_bytes(1, 'big')
+
+        # Translate each op into the bytes the server expects
+        for op in op_list:
+
+            if op[0] == 'write' and isinstance(op[2], MacroParam):
+                data += self.OP_WRITE.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+                data += field(op[1], reg_width)
+                data += (op[2].width or reg_width).to_bytes(2, 'big')
+                data += field(op[2], reg_width)
+
+            elif op[0] == 'write' and isinstance(op[1], MacroParam):
+                value = self.build_one_register_string(0, op[2], reg_width)[1 + reg_width:]
+                data += self.OP_WRITE.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+                data += field(op[1], reg_width)
+                data += value
+
+            elif op[0] == 'write':
+                data += self.OP_WRITE.to_bytes(1, 'big')
+                data += self.build_one_register_string(op[1], op[2], reg_width)
+
+            elif op[0] == 'read':
+                data += self.OP_READ.to_bytes(1, 'big') + op[1].to_bytes(2, 'big')
+                read_lengths.append(op[1])
+
+            elif op[0] == 'read_reg':
+                data += self.OP_WRITE_READ.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+                data += field(op[1], reg_width)
+                data += op[2].to_bytes(2, 'big')
+                read_lengths.append(op[2])
+
+            elif op[0] == 'poll':
+                poll = self.build_poll_request(0, *op[2:], reg_width = reg_width, target = None)
+                data += self.OP_POLL_UNTIL.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+                data += field(op[1], reg_width)
+                data += poll[1 + reg_width:]
+                read_lengths.append(('poll', poll[1 + reg_width]))
+
+            elif op[0] == 'rmw':
+                rmw = self.build_rmw_request(0, *op[2:], reg_width = reg_width, target = None)
+                data += self.OP_RMW.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+                data += field(op[1], reg_width)
+                data += rmw[1 + reg_width:]
+                read_lengths.append(('rmw', rmw[1 + reg_width]))
+
+            elif op[0] == 'delay':
+                data += self.OP_DELAY_US.to_bytes(1, 'big')
+                data += field(op[1], 4)
+
+            elif op[0] == 'addr':
+                data += self.OP_SET_ADDR.to_bytes(1, 'big')
+                data += field(op[1], 1)
+
+            elif op[0] == 'slot':
+                data += self.OP_SET_ADDR.to_bytes(1, 'big') + (self.TARGET_SLOT | op[1]).to_bytes(1, 'big')
+
+            else:
+                raise ValueError("batch: unknown op "+ str(op[0]))
+
+        # Hand the caller the op list and the length of each read
+        return bytes(data), read_lengths
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # read_lengths_of() - Returns the length of each read in an op list that's already in the server's
+    #                     format (the op list of a macro that we didn't define ourselves, for instance)
+    # ------------------------------------------------------------------------------------------------------
+    def read_lengths_of(self, ops):
+
+        read_lengths = []
+        index = 0
+
+        while index < len(ops):
+            op = ops[index]
+            index = index + 1
+
+            # Writes, register reads and polls start with a register-width byte, an optional target and a
+            # register
+            if op in (self.OP_WRITE, self.OP_WRITE_READ, self.OP_POLL_UNTIL, self.OP_RMW):
+                width = ops[index]
+                index = index + 1 + (width & 0x0F) + (1 if width & self.TARGET_FLAG else 0)
+
+            # Writes, reads and register reads have a length
+            if op == self.OP_WRITE or op == self.OP_WRITE_READ or op == self.OP_READ:
+                length = int.from_bytes(ops[index : index + 2], 'big')
+                index = index + 2
+
+            # A write is followed by its data, and reads are what we're here to find
+            if op == self.OP_WRITE: index = index + length
+            elif op == self.OP_DELAY_US: index = index + 4
+            elif op == self.OP_SET_ADDR: index = index + 1
+            elif op == self.OP_READ or op == self.OP_WRITE_READ: read_lengths.append(length)
+            elif op == self.OP_POLL_UNTIL:
+                read_lengths.append(('poll', ops[index]))
+                index = index + 19
+            elif op == self.OP_RMW:
+                read_lengths.append(('rmw', ops[index]))
+                index = index + 10
+            else: break
+
+        # Hand the caller the length of each read
+        return read_lengths
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_macro_define() - Builds the data of a MACRO_CMD message that defines a macro, and remembers
+    #                        what we'll need to know to run it
+    # ------------------------------------------------------------------------------------------------------
+    def build_macro_define(self, number, op_list, persist, reg_width, target):
+
+        # Translate the op list, finding out where each parameter goes
+        params = []
+        ops, read_lengths = self.build_ops(op_list, reg_width, target, params)
+
+        # Describe the macro, and follow that with the op list
+        data = bytearray((self.MACRO_DEFINE, number, self.MACRO_PERSIST if persist else 0, len(params)))
+        for offset, width in params:
+            data += offset.to_bytes(2, 'big') + width.to_bytes(1, 'big')
+        data += ops
+
+        # Remember how wide each parameter is, and how long each read is
+        self.macro_layout[number] = ([width for offset, width in params], read_lengths)
+        return bytes(data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_macro_run() - Builds the data of a MACRO_CMD message that runs a macro
+    #
+    # Each arg is an int (which is sent as wide as its parameter) or a byte string
+    # ------------------------------------------------------------------------------------------------------
+    def build_macro_run(self, number, args):
+
+        widths = self.macro_layout[number][0]
+        if len(args) != len(widths): raise ValueError("run_macro: macro %i takes %i parameters" % (number, len(widths)))
+
+        data = bytearray((self.MACRO_RUN, number))
+        for arg, width in zip(args, widths):
+            data += arg.to_bytes(width, 'big') if type(arg) is int else bytes(arg)
+        return bytes(data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # parse_macro_query() - Remembers what we need to know to run a macro, from the reply to a MACRO_QUERY
+    #
+    # Returns: A dictionary that describes the macro
+    # ------------------------------------------------------------------------------------------------------
+    def parse_macro_query(self, number, rc):
+
+        ops_length  = int.from_bytes(rc[0:2], 'big')
+        param_count = rc[3]
+        widths      = [rc[4 + 3 * i + 2] for i in range(param_count)]
+        ops         = rc[4 + 3 * param_count:]
+
+        self.macro_layout[number] = (widths, self.read_lengths_of(ops))
+        return {'ops_length' : ops_length, 'persist' : bool(rc[2] & self.MACRO_PERSIST), 'params' : widths}
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_message() - Builds a message for the server, with a new transaction ID
+    #
+    # Returns: A tuple of (transaction ID bytes, message bytes)
+    # ------------------------------------------------------------------------------------------------------
+    def build_message(self, command, data = None, bus = None):
+
+        # Get a brand new transaction ID so the server knows this is a new msg
+        id = self.next_transaction_id()
+
+        # If the command is aimed at the second I2C bus, set the flag for that
+        if bus == None: bus = self.bus
+        if bus: command = command | self.BUS_FLAG
+
+        # If there is no data to go with the message, the message is just the header
+        if not data: return id, id + command.to_bytes(1, 'big')
+
+        # Otherwise, make sure the data is something we can send
+        if type(data) is bytearray:
+            data = bytes(data)
+        if not type(data) is bytes:
+            raise TypeError("send_message: data must be bytes, not "+ str(type(data)))
+
+        # Build the message in one go, and hand the caller the transaction ID and the message
+        return id, b''.join((id, command.to_bytes(1, 'big'), data))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # next_transaction_id() - Returns the 4 bytes of a transaction ID that hasn't been used yet
+    # ------------------------------------------------------------------------------------------------------
+    def next_transaction_id(self):
+
+        # Increment our outgoing transaction ID
+        self.transaction_id = self.transaction_id + 1
+
+        # Hand the caller the bytes for it
+        return self.transaction_id.to_bytes(4, 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # discover() - Finds the servers on our network.  Every server answers straight back to the port the
+    #              request came from, so unless the caller hands us a socket, this uses one of its own
+    #
+    # Passed: timeout = How many seconds to wait for answers
+    #         port    = The UDP port the servers listen on
+    #         address = Where to send the request: the broadcast address, or the IP address of one server
+    #         sock    = The socket to send the request from and hear the answers on, or None.  A server
+    #                   recognizes a session by the socket its messages come from
+    #
+    # Returns: A list of dictionaries, one per server, from parse_discovery()
+    # ------------------------------------------------------------------------------------------------------
+    def discover(self, timeout = 0.5, port = 0, address = None, sock = None):
+
+        # If the port number is 0 or there's no address, use the defaults
+        if port == 0: port = self.SERVER_PORT
+        if address == None: address = self.BROADCAST
+
+        id, message = self.build_message(self.DISCOVER_CMD, bus = 0)
+        found = {}
+
+        # If the caller didn't give us a socket, use a temporary one
+        own_sock = (sock == None)
+        if own_sock: sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+        try:
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+
+            # Ask every server to tell us who it is
+            try:
+                sock.sendto(message, (address, port))
+            except OSError:
+                return []
+
+            # And collect answers until nobody has answered for a while.  A server that hears the
+            # request on more than one interface only gets counted once
+            deadline = time.time() + timeout
+            while True:
+                remaining = deadline - time.time()
+                if remaining <= 0: break
+                sock.settimeout(remaining)
+                try:
+                    reply, sender = sock.recvfrom(2048)
+                except OSError:
+                    break
+                if reply[0:4] != id: continue
+                server = self.parse_discovery(reply, sender[0])
+                if server: found[server['mac']] = server
+
+                # A request to one server only has one answer
+                if found and address != self.BROADCAST: break
+
+        # A temporary socket gets closed, and the caller's socket goes back to blocking
+        finally:
+            if own_sock:
+                sock.close()
+            else:
+                sock.settimeout(None)
+
+        # Hand the caller what we found
+        return list(found.values())
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # parse_discovery() - Translates the server's answer to a DISCOVER_CMD request
+    #
+    # Returns: A dictionary of 'ip', 'udp_port', 'tcp_port', 'client_port' (where the server sends the
+    #          replies of the session that asked), 'fw', 'mac' and 'name', or None if the answer doesn't
+    #          make sense
+    # ------------------------------------------------------------------------------------------------------
+    def parse_discovery(self, reply, ip):
+
+        # The fixed part of the answer is 22 bytes long, and the server's name follows it
+        if len(reply) < 22 or (reply[4] & ~self.BUS_FLAG) != self.DISCOVER_CMD or reply[5] != 0: return None
+        fw, mac, udp_port, tcp_port, client_port = struct.unpack('>I6sHHH', reply[6:22])
+        name = reply[22:].split(b'\0')[0].decode(errors = 'replace')
+
+        return {'ip' : ip, 'udp_port' : udp_port, 'tcp_port' : tcp_port, 'client_port' : client_port,
+                'fw' : fw, 'mac' : mac.hex(':'), 'name' : name}
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # block_chunk_size() - Returns the most data a register write in a block write can carry
+    #
+    # A WRITE_REG_CMD message is: transaction ID(4), command(1), register width(1), optional target(1),
+    # register number(reg_width), data length(2), data
+    # ------------------------------------------------------------------------------------------------------
+    def block_chunk_size(self, reg_width, target, chunk_size = 0):
+
+        # This is the most data that fits in a message the server can receive
+        limit = self.MAX_MESSAGE - (8 + reg_width + (1 if target != None else 0))
+
+        # The caller may ask for smaller chunks than that, but not larger ones
+        if chunk_size <= 0 or chunk_size > limit: chunk_size = limit
+        return chunk_size
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # pack_write_message() - Packs a WRITE_REG_CMD message for one chunk of a block write into a buffer
+    #                        we already have, without building any intermediate byte strings
+    #
+    # Passed: frame    = The bytearray to pack the message into
+    #         start    = The offset in frame where the message begins
+    #         register = The register number the chunk is written to
+    #         chunk    = A memoryview of the data.  This is the only place the data is copied
+    #
+    # Returns: A tuple of (transaction ID bytes, length of the message)
+    # ------------------------------------------------------------------------------------------------------
+    def pack_write_message(self, frame, start, register, reg_width, target, chunk, bus = None):
+
+        # Get a brand new transaction ID
+        id = self.next_transaction_id()
+
+        # If the command is aimed at the second I2C bus, set the flag for that
+        if bus == None: bus = self.bus
+        command = self.WRITE_REG_CMD | (self.BUS_FLAG if bus else 0)
+
+        # The transaction ID, the command and the register width come first
+        frame[start : start + 4] = id
+        frame[start + 4] = command
+        frame[start + 5] = reg_width | (self.TARGET_FLAG if target != None else 0)
+        index = start + 6
+
+        # If we're aimed at a specific device, the target byte goes in front of the register number
+        if target != None:
+            frame[index] = target
+            index = index + 1
+
+        # Then the register number and the length of the data
+        struct.pack_into('>%isH' % reg_width, frame, index, register.to_bytes(reg_width, 'big'), len(chunk))
+        index = index + reg_width + 2
+
+        # And finally the data itself
+        frame[index : index + len(chunk)] = chunk
+
+        # Hand the caller the transaction ID and the length of the message
+        return id, index + len(chunk) - start
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # parse_reply() - Raises an exception if a reply contains an error, otherwise returns the reply data
+    # ------------------------------------------------------------------------------------------------------
+    def parse_reply(self, reply):
+
+        # If there's an error code in the reply raise an exception
+        if reply[5] != 0: raise Wifi_I2C_Ex(reply)
+
+
+        # Tell the caller what reply we got.  A message is:
+        #   4 bytes of transaction ID
+        #   1 byte of command
+        #   1 byte of error code
+        #   optional data
+
+        # If there's no reply data, return None
+        if len(reply) <= 6: return None
+
+        # Otherwise, return the reply data
+        return reply[6:]
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # make_target() - Returns the target byte for an I2C address or device slot, or None if neither
+    # ------------------------------------------------------------------------------------------------------
+    def make_target(self, address, slot):
+
+        if slot != None: return self.TARGET_SLOT | slot
+        return address
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_register_data() - Returns a string of bytes built from an input
+    #
+    # register_list is an int and value is an int or byte-string
+    #
+    # register_list can be:
+    #   [(register, value), (register, value), (register, value) (etc)]
+    # ------------------------------------------------------------------------------------------------------
+    def build_register_data(self, register_list, value = None, *, reg_width=1, target=None):
+
+        data = bytearray()
+
+        # If register is a list of values...
+        if type(register_list) is list:
+
+            # Loop through each tuple in the list of values
+            for register, value in register_list:
+                data += self.build_one_register_string(register, value, reg_width, target)
+
+            # We built a byte string from a list of tuples.  Return it
+            return bytes(data)
+
+        # Otherwise, build the string for the one single register number the caller provided
+        return self.build_one_register_string(register_list, value, reg_width, target)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_one_register_string() - Builds the register string for a single register number and value
+    # ------------------------------------------------------------------------------------------------------
+    def build_one_register_string(self, reg_number, value, reg_width, target = None):
+
+        # if value is an int, convert it to one or more bytes
+        if type(value) is int:
+            value = value.to_bytes(reg_width, 'big')
+
+        # If value is a bytearray, convert it to a bytes string
+        if type(value) is bytearray:
+            value = bytes(value)
+
+        # If value is a byte string, build our return value from it
+        if type(value) is bytes:
+            value_length = len(value).to_bytes(2, 'big')
+
+            # Convert the register number to one or more bytes
+            reg_number= reg_number.to_bytes(reg_width, 'big')
+
+            # If we're aimed at a specific device, the target byte goes in front of the register number
+            if target != None:
+                reg_width  = reg_width | self.TARGET_FLAG
+                reg_number = target.to_bytes(1, 'big') + reg_number
+
+            # Convert register width to one byte
+            reg_width = reg_width.to_bytes(1, 'big')
+
+            # Hand the caller the resulting byte string
+            return b''.join((reg_width, reg_number, value_length, value))
+
+        # We'll get here if 'value' wasn't an integer or byte string
+        raise TypeError("register values must be int or bytes")
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_read_request() - Builds the data of a READ_REG_CMD message
+    # ------------------------------------------------------------------------------------------------------
+    def build_read_request(self, register, length, reg_width, split, no_cache, target):
+
+        # Get register as one or more bytes
+        register = register.to_bytes(reg_width, 'big')
+
+        # If the caller wants a STOP between the register write and the read, set the flag for that
+        if split: reg_width = reg_width | self.SPLIT_READ_FLAG
+
+        # If the caller wants to bypass the register cache, set the flag for that
+        if no_cache: reg_width = reg_width | self.NO_CACHE_FLAG
+
+        # If we're aimed at a specific device, the target byte goes in front of the register number
+        if target != None:
+            reg_width = reg_width | self.TARGET_FLAG
+            register  = target.to_bytes(1, 'big') + register
+
+        # The request is the register-width byte, the register number, and a 2-byte length
+        return reg_width.to_bytes(1, 'big') + register + length.to_bytes(2, 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_poll_request() - Builds the data of a POLL_UNTIL_CMD message (which is also an OP_POLL_UNTIL,
+    #                        without the op code)
+    # ------------------------------------------------------------------------------------------------------
+    def build_poll_request(self, register, mask, expected, timeout_us = 100000, interval_us = 100, length = 1,
+                           max_polls = 0, *, reg_width = 1, split = False, target = None):
+
+        # The register-width byte, target and register number are just like those of a register read
+        data = self.build_read_request(register, 0, reg_width, split, False, target)[:-2]
+
+        # Followed by what we're waiting for, and how long to wait for it
+        return data + struct.pack('>BIIIIH', length, mask, expected, interval_us, timeout_us, max_polls)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # parse_poll_reply() - Translates the outcome of a poll
+    #
+    # Returns: A dictionary of 'met' (True if the condition was met), 'status' ('met', 'timeout' or
+    #          'max_polls'), 'polls' (how many times the register was read), 'elapsed_us' and 'value'
+    # ------------------------------------------------------------------------------------------------------
+    def parse_poll_reply(self, rc):
+
+        status, polls, elapsed_us = struct.unpack('>BHI', rc[0:self.POLL_RESULT_LEN])
+        return {'met'        : status == 0,
+                'status'     : self.POLL_STATUS.get(status, status),
+                'polls'      : polls,
+                'elapsed_us' : elapsed_us,
+                'value'      : int.from_bytes(rc[self.POLL_RESULT_LEN:], 'big')}
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_rmw_request() - Builds the data of a RMW_CMD message (which is also an OP_RMW, without the
+    #                       op code)
+    # ------------------------------------------------------------------------------------------------------
+    def build_rmw_request(self, register, mask, value, length = 1, verify = False, *, reg_width = 1,
+                          split = False, target = None):
+
+        # The register-width byte, target and register number are just like those of a register read
+        data = self.build_read_request(register, 0, reg_width, split, False, target)[:-2]
+
+        # Followed by the bits to change, and what to change them to
+        return data + struct.pack('>BIIB', length, mask, value, self.RMW_VERIFY if verify else 0)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # parse_rmw_reply() - Translates the reply to a read-modify-write
+    #
+    # Returns: A tuple of (old value, new value)
+    # ------------------------------------------------------------------------------------------------------
+    def parse_rmw_reply(self, rc):
+
+        length = len(rc) // 2
+        return int.from_bytes(rc[:length], 'big'), int.from_bytes(rc[length:], 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # split_batch_reply() - Splits the reply to a BATCH_CMD into one byte string per read
+    # ------------------------------------------------------------------------------------------------------
+    def split_batch_reply(self, rc, read_lengths):
+
+        # The first two bytes of the reply are the failing op index.  The rest is the data we read
+        rc = rc[2:]
+
+        # Split the reply data into one byte string per read, and the outcome of each poll
+        result = []
+        for length in read_lengths:
+            if type(length) is tuple and length[0] == 'rmw':
+                length = 2 * length[1]
+                result.append(self.parse_rmw_reply(rc[:length]))
+            elif type(length) is tuple:
+                length = self.POLL_RESULT_LEN + length[1]
+                result.append(self.parse_poll_reply(rc[:length]))
+            else:
+                result.append(rc[:length])
+            rc = rc[length:]
+
+        # Hand the caller the data from each read
+        return result
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # build_stream_job() - Builds the data of a STREAM_START_CMD message, and remembers the layout of the
+    #                      job's samples
+    # ------------------------------------------------------------------------------------------------------
+    def build_stream_job(self, job, register_list, period_us, reg_width, target, samples_per_packet):
+
+        # If the job isn't aimed at a specific device, it's aimed at the current one
+        if target == None: target = self.i2c_address
+
+        # Turn every register into a (register, length) tuple
+        register_list = [r if type(r) is tuple else (r, 1) for r in register_list]
+
+        # Build the job description
+        data = job.to_bytes(1, 'big') + target.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+        data = data + period_us.to_bytes(4, 'big') + samples_per_packet.to_bytes(1, 'big')
+        data = data + len(register_list).to_bytes(1, 'big')
+        for register, length in register_list:
+            data = data + register.to_bytes(reg_width, 'big') + length.to_bytes(1, 'big')
+
+        # Remember how to pick apart the samples
+        self.stream_layout[job] = [length for _, length in register_list]
+        self.stream_lost[job]   = 0
+        return data
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # unpack_stream_packet() - Picks apart the samples in a stream packet
+    #
+    # Passed: job          = The stream job the packet belongs to
+    #         packet       = The stream packet
+    #         expected_seq = The sequence number we expected this packet to have, or None
+    #
+    # Returns: A tuple of (list of samples, the sequence number we expect the next packet to have).  Each
+    #          sample is a (seq, timestamp_us, status, values) tuple, just like stream() yields
+    # ------------------------------------------------------------------------------------------------------
+    def unpack_stream_packet(self, job, packet, expected_seq):
+
+        # This is how long each register's data is
+        layout = self.stream_layout[job]
+
+        # Fetch the packet sequence number, the number of samples and the size of each one
+        seq         = int.from_bytes(packet[7:11], 'big')
+        count       = packet[11]
+        sample_size = int.from_bytes(packet[12:14], 'big')
+
+        # If we missed some packets, keep track of how many
+        if expected_seq != None and seq != expected_seq:
+            self.stream_lost[job] = self.stream_lost[job] + ((seq - expected_seq) & 0xFFFFFFFF)
+
+        # Pick apart each sample in the packet
+        samples = []
+        for i in range(0, count):
+            sample    = packet[14 + i * sample_size : 14 + (i + 1) * sample_size]
+            timestamp = int.from_bytes(sample[0:4], 'big')
+            status    = sample[4]
+            values    = []
+            offset    = 5
+            for length in layout:
+                values.append(sample[offset:offset + length])
+                offset = offset + length
+            samples.append((seq, timestamp, status, values))
+
+        # Hand the caller the samples, and the sequence number the next packet should have
+        return samples, (seq + 1) & 0xFFFFFFFF
+    # ------------------------------------------------------------------------------------------------------
+
+
+# ==========================================================================================================
+
+
+
+# ==========================================================================================================
+# wifi_i2c - Manages communications with ESP32 wifi-i2c server
+# ==========================================================================================================
+class Wifi_I2C(Wifi_I2C_Base):
+
+    # This is the server address and port
+    server = ('', 0)
+
+    # This will be a Listener object
+    listener = None
+
+    # This is the socket we'll be transmitting on
+    sock = None
+
+    # This is the MAC address of the server, which is how we find it again if its IP address changes
+    server_mac = None
+
+    # This is True while we're looking for the server again, so we don't start looking a second time
+    rediscovering = False
+
+    # When we're talking to the server over TCP, this is the socket, this holds the bytes we've
+    # received that aren't yet a whole frame, and this holds the fragments of chunked reads
+    tcp = None
+    tcp_rx = None
+    tcp_fragments = None
+
+    # When we're recording a trace (see start_capture), this is the Capture object
+    capture = None
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # The constructor - Sets up our listening socket
+    # ------------------------------------------------------------------------------------------------------
+    def __init__(self, local_ip):
+
+        # Create a listener object and start the listening thread
+        self.listener = Listener(local_ip)
+    # ------------------------------------------------------------------------------------------------------
+
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # start() - Create sockets and starts the thread that listens for incoming messages
+    #
+    # Returns:  True if communication was established
+    #           False if something goes awry
+    # ------------------------------------------------------------------------------------------------------
+    def start(self, server_ip = None, server_port = 0):
+
+        # If this listener was unable to bind to a socket, there's nothing we can do
+        if self.listener.port == None: return False;
+
+        # If either of the port numbers is 0, use defaults
+        if server_port == 0: server_port = self.SERVER_PORT
+
+        # If no IP address was provided, look for a server on our network.   If there isn't one, assume
+        # we're connecting in AP mode
+        if server_ip == None:
+            found = self.discover(port = server_port)
+            server_ip = found[0]['ip'] if found else '192.168.4.1'
+
+        # Save our server information
+        self.server = (server_ip, server_port)
+
+        # Create a socket for sending messages
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+        # Tell the server what local port to send responses to
+        reply = None
+        try:
+            reply = self.set_client_port(self.listener.port)
+        except Exception:
+            return False
+
+        # Find out the server's MAC address, so we can find it again if its IP address changes
+        found = self.discover(port = server_port, address = server_ip)
+        self.server_mac = found[0]['mac'] if found else None
+
+        # If we get here, we have communication with our Wi-Fi device!
+        return True
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # start_tcp() - Connects to the server's binary TCP port.  From then on, commands go over TCP
+    #
+    # Returns:  True if the connection was made
+    #           False if something goes awry
+    # ------------------------------------------------------------------------------------------------------
+    def start_tcp(self, server_ip = None, server_port = 0):
+
+        # If no IP address was provided, assume we're connecing in AP mode
+        if server_ip == None: server_ip = '192.168.4.1'
+
+        # If the port number is 0, use the default
+        if server_port == 0: server_port = 1182
+
+        # Connect to the server
+        try:
+            self.tcp = socket.create_connection((server_ip, server_port), self.TCP_TIMEOUT)
+        except OSError:
+            self.tcp = None
+            return False
+
+        # Our messages are already whole, so send each one without waiting for more to be written
+        self.tcp.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.tcp.setblocking(False)
+        self.tcp_rx = bytearray()
+        self.tcp_fragments = {}
+
+        # Make sure the server is really there
+        try:
+            self.get_firmware_rev()
+        except Exception:
+            self.tcp.close()
+            self.tcp = None
+            return False
+
+        # If we get here, we have communication with our Wi-Fi device!
+        return True
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # rediscover() - Finds our server again after it has rebooted or reconnected to Wi-Fi, possibly with
+    #                a new IP address, and makes sure its replies still come to us
+    #
+    # Returns:  True if the server was found
+    # ------------------------------------------------------------------------------------------------------
+    def rediscover(self, timeout = 0.5):
+
+        # If we don't know the server's MAC address, there's no way to recognize it
+        if self.server_mac == None or self.rediscovering: return False
+
+        # Look for a server with our server's MAC address.  We ask from the socket our messages come from,
+        # so that the server tells us where it sends our session's replies
+        server = None
+        for candidate in self.discover(timeout, self.server[1], sock = self.sock):
+            if candidate['mac'] == self.server_mac: server = candidate
+        if server == None: return False
+
+        # From now on, talk to it wherever it is now
+        self.server = (server['ip'], server['udp_port'])
+
+        # The server normally remembers where to send its replies across a soft reboot.  If it didn't
+        # (after a power cycle, for instance), tell it again
+        if server['client_port'] != self.listener.port:
+            self.rediscovering = True
+            try:
+                self.set_client_port(self.listener.port)
+            except Wifi_I2C_Ex:
+                return False
+            finally:
+                self.rediscovering = False
+
+        return True
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # start_capture() - Starts recording every request and reply into a trace file
+    # ------------------------------------------------------------------------------------------------------
+    def start_capture(self, filename):
+
+        # If we're already recording, that trace is finished
+        self.stop_capture()
+
+        # UDP replies are recorded by the listener the moment they arrive
+        self.capture = Capture(filename)
+        self.listener.capture = self.capture
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stop_capture() - Stops recording, and closes the trace file
+    # ------------------------------------------------------------------------------------------------------
+    def stop_capture(self):
+
+        capture = self.capture
+        self.capture = None
+        self.listener.capture = None
+        if capture: capture.close()
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # bulk() - Streams a list of messages to the server over TCP.  Only failures are replied to
+    # ------------------------------------------------------------------------------------------------------
+    def bulk(self, message_list):
+
+        if self.tcp == None: raise ValueError("bulk: requires a TCP connection (see start_tcp)")
+
+        # Build all of the messages and send them
+        messages = [self.build_message(*message) for message in message_list]
+        replies = self.tcp_exchange(messages, quiet = True)
+
+        # If any message failed, raise an exception for the first one that did
+        for id, message in messages:
+            if id in replies: self.parse_reply(replies[id])
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_bus() - Aims the commands that follow at I2C bus 0 or I2C bus 1
+    # ------------------------------------------------------------------------------------------------------
+    def set_bus(self, bus):
+
+        if bus not in (0, 1): raise ValueError("set_bus: bus must be 0 or 1")
+        self.bus = bus
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_i2c_address() - Tells the server the I2C address of the device to talk to
+    # ------------------------------------------------------------------------------------------------------
+    def set_i2c_address(self, address):
+
+        # Keep track of the address the server will be talking to
+        self.i2c_address = address
+
+        # Convert the address to a byte
+        address = address.to_bytes(1, 'big')
+
+        # Send the command to the server
+        return self.send_message(self.I2C_ADDR_CMD, address)
+    # ------------------------------------------------------------------------------------------------------
+
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_reg() - Writes values to a register on the I2C device
+    #
+    # register_list is an int and value is an int or byte-string
+    #
+    # register_list can be:
+    #   [(register, value), (register, value), (register, value) (etc)]
+    # ------------------------------------------------------------------------------------------------------
+    def write_reg(self, register_list, value = None, *, reg_width = 1, address = None, slot = None):
+
+        # Find out which device we're aimed at
+        target = self.make_target(address, slot)
+
+        # Get the register data as a stream of bytes
+        data = self.build_register_data(register_list, value, reg_width=reg_width, target=target)
+
+        # Send the command to the server
+        return self.send_message(self.WRITE_REG_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # read_reg() - Reads a value from a register
+    #
+    # Returns: The integer contents of the specified register
+    # ------------------------------------------------------------------------------------------------------
+    def read_reg(self, register, length = 1, *, reg_width = 1, split = False, no_cache = False, address = None,
+                 slot = None):
+
+        # Build the request
+        data = self.build_read_request(register, length, reg_width, split, no_cache, self.make_target(address, slot))
+
+        # Send the command to the server
+        rc = self.send_message(self.READ_REG_CMD, data)
+
+        # Convert the value to an integer and hand it to the caller
+        return int.from_bytes(rc, 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # modify_reg() - Has the server change the bits of a register that are in a mask, leaving the rest
+    #                as they were
+    # ------------------------------------------------------------------------------------------------------
+    def modify_reg(self, register, mask, value, *, length = 1, verify = False, reg_width = 1, split = False,
+                   address = None, slot = None):
+
+        # Build the request
+        data = self.build_rmw_request(register, mask, value, length, verify, reg_width = reg_width,
+                                      split = split, target = self.make_target(address, slot))
+
+        # Send the command to the server, and hand the caller the old and new values
+        return self.parse_rmw_reply(self.send_message(self.RMW_CMD, data))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # poll_until() - Has the server read a register until (value & mask) == expected
+    # ------------------------------------------------------------------------------------------------------
+    def poll_until(self, register, mask, expected, timeout_us = 100000, *, interval_us = 100, length = 1,
+                   max_polls = 0, reg_width = 1, split = False, address = None, slot = None):
+
+        # Build the request
+        data = self.build_poll_request(register, mask, expected, timeout_us, interval_us, length, max_polls,
+                                       reg_width = reg_width, split = split, target = self.make_target(address, slot))
+
+        # Send the command to the server, and hand the caller the outcome
+        return self.parse_poll_reply(self.send_message(self.POLL_UNTIL_CMD, data))
+    # ------------------------------------------------------------------------------------------------------
+
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # read_bulk() - Reads a block of data of any length, in fragments
+    #
+    # Returns: A byte string of the data that was read
+    # ------------------------------------------------------------------------------------------------------
+    def read_bulk(self, register, length, chunk_size = 0, *, reg_width = 1, address = None, slot = None):
+
+        # Find out which device we're aimed at
+        target = self.make_target(address, slot)
+
+        # Build the register spec, with the target byte in front of the register number if there is one
+        spec = register.to_bytes(reg_width, 'big')
+        if target != None:
+            reg_width = reg_width | self.TARGET_FLAG
+            spec = target.to_bytes(1, 'big') + spec
+        spec = reg_width.to_bytes(1, 'big') + spec + length.to_bytes(4, 'big') + chunk_size.to_bytes(2, 'big')
+
+        # This is where the fragments go as they arrive
+        result = bytearray(length)
+        missing = None
+
+        # Ask for the whole read, then for whatever fragments went missing, until we have them all
+        for attempt in range(0, 5):
+
+            if missing == None:
+                requests = [self.CHUNK_READ.to_bytes(1, 'big') + spec]
+            else:
+                wanted = sorted(missing)
+                requests = []
+                for i in range(0, len(wanted), self.CHUNK_RESEND_MAX):
+                    seqs = b''.join(seq.to_bytes(2, 'big') for seq in wanted[i:i + self.CHUNK_RESEND_MAX])
+                    requests.append(self.CHUNK_RESEND.to_bytes(1, 'big') + spec + seqs)
+
+            for request in requests:
+                reply, fragments = self.send_chunked(request)
+
+                # The reply tells us how many fragments there are in all
+                count = int.from_bytes(reply[0:2], 'big')
+                if missing == None: missing = set(range(count))
+
+                # Store each fragment where it belongs
+                for fragment in fragments:
+                    seq    = int.from_bytes(fragment[10:12], 'big')
+                    offset = int.from_bytes(fragment[12:16], 'big')
+                    data   = fragment[16:]
+                    result[offset : offset + len(data)] = data
+                    missing.discard(seq)
+
+            # If every fragment has arrived, we're done
+            if not missing: return bytes(result)
+
+        # If we get here, some fragments never arrived
+        raise Wifi_I2C_Ex(-1)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_bulk() - Writes a block of data of any length, in chunks
+    # ------------------------------------------------------------------------------------------------------
+    def write_bulk(self, register, data, chunk_size = 256, *, reg_width = 1, address = None, slot = None):
+
+        self.write_block(register, data, reg_width = reg_width, address = address, slot = slot,
+                         chunk_size = chunk_size)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_block() - Writes a block of data of any length, as register writes that are each as large as
+    #                 the server can receive.   The data can be anything that supports the buffer protocol
+    #                 (bytes, bytearray, memoryview, array.array, a numpy array) and is copied exactly
+    #                 once, straight into a message buffer we allocated up front
+    #
+    # Passed: register   = The register number the block starts at
+    #         data       = The data to write
+    #         window     = The maximum number of messages to have in flight at once (UDP only)
+    #         chunk_size = The most data to put in each message, or 0 for as much as will fit
+    # ------------------------------------------------------------------------------------------------------
+    def write_block(self, register, data, *, reg_width = 1, address = None, slot = None, window = 8,
+                    chunk_size = 0):
+
+        # Look at the caller's data as a flat run of bytes, without copying it
+        view = memoryview(data).cast('B')
+
+        # If there's nothing to write, we're done
+        if len(view) == 0: return
+
+        # Find out which device we're aimed at, and how much data goes in each message
+        target = self.make_target(address, slot)
+        chunk_size = self.block_chunk_size(reg_width, target, chunk_size)
+
+        # Over TCP, every message is packed back-to-back into a single buffer and streamed to the server
+        if self.tcp:
+            return self.tcp_write_block(register, view, reg_width, target, chunk_size)
+
+        # Over UDP, each message in flight needs a buffer of its own, since we may have to resend it
+        count  = (len(view) + chunk_size - 1) // chunk_size
+        frames = [bytearray(self.MAX_MESSAGE) for i in range(min(window, count))]
+
+        # These are the buffers holding the messages in flight, keyed by transaction ID
+        in_use = {}
+
+        # This packs each chunk into a free buffer just before it's sent for the first time
+        def messages():
+            for offset in range(0, len(view), chunk_size):
+                frame = frames.pop()
+                id, length = self.pack_write_message(frame, 0, register + offset, reg_width, target,
+                                                     view[offset : offset + chunk_size])
+                in_use[id] = frame
+                yield id, memoryview(frame)[:length]
+
+        # When a reply arrives, that message's buffer is free for the next chunk
+        def on_reply(id, reply):
+            frames.append(in_use.pop(id))
+            self.parse_reply(reply)
+
+        # Send them all
+        self.udp_window(messages(), len(frames), on_reply)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # tcp_write_block() - Streams a block write to the server over TCP.  Only failures are replied to,
+    #                     along with the last message
+    # ------------------------------------------------------------------------------------------------------
+    def tcp_write_block(self, register, view, reg_width, target, chunk_size):
+
+        # Allocate one buffer big enough for every message and its 2-byte frame length
+        count = (len(view) + chunk_size - 1) // chunk_size
+        out   = bytearray(len(view) + count * (10 + reg_width + (1 if target != None else 0)))
+
+        # Pack each message into the buffer, right behind the one before it
+        position = 0
+        for offset in range(0, len(view), chunk_size):
+            id, length = self.pack_write_message(out, position + 2, register + offset, reg_width, target,
+                                                 view[offset : offset + chunk_size])
+            last = offset + chunk_size >= len(view)
+            struct.pack_into('>H', out, position, length if last else length | self.TCP_QUIET_FLAG)
+            position = position + 2 + length
+
+        # Send them all, and wait for the reply to the last one
+        replies = self.tcp_transfer(out, {id})
+
+        # If any message failed, raise an exception for the first one that did
+        for reply in replies.values(): self.parse_reply(reply)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # batch() - Performs a list of operations in a single packet
+    #
+    # Returns: A list of byte strings, one for each read operation
+    # ------------------------------------------------------------------------------------------------------
+    def batch(self, op_list, *, reg_width = 1, address = None, slot = None):
+
+        # Translate the op list into the bytes the server expects
+        data, read_lengths = self.build_ops(op_list, reg_width, self.make_target(address, slot))
+
+        # Send the command to the server, and hand the caller the data from each read
+        return self.split_batch_reply(self.send_message(self.BATCH_CMD, data), read_lengths)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_trigger() - Configures a trigger input on the server.  Each time the GPIO pin sees the
+    #                 specified edge, the server runs the op list and streams the data it read to us
+    #                 as a sample of the specified stream job.  Use stream(job) to read the samples
+    #
+    # Passed: trigger = The trigger number (0 or 1)
+    #         pin     = The GPIO pin number
+    #         op_list = A list of ops, in the same format as batch()
+    #         job     = The stream job number the samples are sent to
+    #         edge    = 'rising', 'falling', or 'any'
+    # ------------------------------------------------------------------------------------------------------
+    def set_trigger(self, trigger, pin, op_list, job, edge = 'falling', *, reg_width = 1, address = None,
+                    slot = None, samples_per_packet = 1):
+
+        # Find out which device we're aimed at
+        target = self.make_target(address, slot)
+        if target == None: target = self.i2c_address
+
+        # Translate the edge into the value the server expects
+        edge = {'rising' : 0, 'falling' : 1, 'any' : 2}[edge]
+
+        # Translate the op list into the bytes the server expects
+        ops, read_lengths = self.build_ops(op_list, reg_width, None)
+
+        # Build the trigger description
+        data = trigger.to_bytes(1, 'big') + pin.to_bytes(1, 'big') + edge.to_bytes(1, 'big')
+        data = data + job.to_bytes(1, 'big') + target.to_bytes(1, 'big')
+        data = data + samples_per_packet.to_bytes(1, 'big') + sum(read_lengths).to_bytes(2, 'big') + ops
+
+        # Each sample holds the data from each read in the op list
+        self.stream_layout[job] = read_lengths
+        self.stream_lost[job]   = 0
+        self.listener.open_stream(job)
+
+        # Send the command to the server
+        return self.send_message(self.TRIGGER_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # clear_trigger() - Disables a trigger input on the server
+    # ------------------------------------------------------------------------------------------------------
+    def clear_trigger(self, trigger):
+
+        # A pin number of 0xFF means "disable this trigger"
+        data = trigger.to_bytes(1, 'big') + (0xFF).to_bytes(1, 'big')
+
+        # Send the command to the server
+        return self.send_message(self.TRIGGER_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_device() - Configures a device slot on the server
+    # ------------------------------------------------------------------------------------------------------
+    def set_device(self, slot, address, reg_width = 1, clock_hz = 0, timeout_ms = 0, stretch_us = 0):
+
+        # Build the slot description
+        data = slot.to_bytes(1, 'big') + address.to_bytes(1, 'big') + reg_width.to_bytes(1, 'big')
+        data = data + clock_hz.to_bytes(4, 'big') + timeout_ms.to_bytes(2, 'big') + stretch_us.to_bytes(2, 'big')
+
+        # Send the command to the server
+        return self.send_message(self.DEVICE_CTX_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # free_device() - Frees a device slot on the server
+    # ------------------------------------------------------------------------------------------------------
+    def free_device(self, slot):
+
+        # An address of 0xFF tells the server to free the slot
+        data = slot.to_bytes(1, 'big') + (0xFF).to_bytes(1, 'big')
+
+        # Send the command to the server
+        return self.send_message(self.DEVICE_CTX_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream_start() - Starts a job on the server that periodically samples a list of registers and
+    #                  streams the samples back to us
+    #
+    # Passed: job                = The job number (0 thru 3)
+    #         register_list      = A list of registers.  Each is either a register number (a 1-byte read)
+    #                              or a (register, length) tuple
+    #         period_us          = The sampling period in microseconds
+    #         samples_per_packet = The maximum number of samples the server packs into each packet
+    # ------------------------------------------------------------------------------------------------------
+    def stream_start(self, job, register_list, period_us, *, reg_width = 1, address = None, slot = None,
+                     samples_per_packet = 16):
+
+        # Build the job description, and remember how to pick apart the samples
+        data = self.build_stream_job(job, register_list, period_us, reg_width, self.make_target(address, slot),
+                                     samples_per_packet)
+
+        # Get ready to receive the samples
+        self.listener.open_stream(job)
+
+        # Send the command to the server
+        return self.send_message(self.STREAM_START_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream_stop() - Stops a stream job on the server.   Pass job=None to stop every job
+    # ------------------------------------------------------------------------------------------------------
+    def stream_stop(self, job = None):
+
+        # A job number of 0xFF means "every job"
+        if job == None: job = 0xFF
+
+        # Send the command to the server
+        return self.send_message(self.STREAM_STOP_CMD, job.to_bytes(1, 'big'))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream_query() - Fetches the status of a stream job on the server
+    #
+    # Returns: A dictionary describing the state of the job
+    # ------------------------------------------------------------------------------------------------------
+    def stream_query(self, job):
+
+        # Ask the server about this job
+        reply = self.send_message(self.STREAM_QUERY_CMD, job.to_bytes(1, 'big'))
+
+        # Pick apart the reply
+        fields = [int.from_bytes(reply[i:i+4], 'big') for i in range(1, 21, 4)]
+        return {
+            'running'   : reply[0] != 0,
+            'period_us' : fields[0],
+            'seq'       : fields[1],
+            'samples'   : fields[2],
+            'overruns'  : fields[3],
+            'errors'    : fields[4]
+        }
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream() - An iterator that yields the samples of a stream job as they arrive
+    #
+    # Passed: job     = The job number that was passed to stream_start()
+    #         timeout = If no packet arrives in this many seconds, the iteration ends.  None = wait forever
+    #
+    # Yields: (seq, timestamp_us, status, values) for each sample, where "seq" is the sequence number of
+    #         the packet the sample arrived in, and "values" is a list of byte strings, one per register
+    # ------------------------------------------------------------------------------------------------------
+    def stream(self, job, timeout = None):
+
+        # This is the sequence number we expect the next packet to have
+        expected_seq = None
+
+        # Loop until we time out waiting for a packet
+        while True:
+
+            # Wait for the next packet for this job
+            packet = self.listener.get_stream_packet(job, timeout)
+            if packet == None: return
+
+            # Yield each sample in the packet
+            samples, expected_seq = self.unpack_stream_packet(job, packet, expected_seq)
+            for sample in samples: yield sample
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_cache_range() - Gives a range of registers on a device a caching policy
+    #
+    # Passed: index     = Which range (0 thru 7)
+    #         first_reg = The first register in the range
+    #         last_reg  = The last register in the range
+    #         policy    = 'none', 'write-through', or 'ttl'
+    #         ttl_ms    = For the 'ttl' policy, how long cached data stays valid
+    # ------------------------------------------------------------------------------------------------------
+    def set_cache_range(self, index, first_reg, last_reg, policy = 'write-through', ttl_ms = 0, *,
+                        address = None, slot = None):
+
+        # Find out which device we're aimed at
+        target = self.make_target(address, slot)
+        if target == None: target = self.i2c_address
+
+        # Build the range description
+        data = self.CACHE_SET_RANGE.to_bytes(1, 'big') + index.to_bytes(1, 'big') + target.to_bytes(1, 'big')
+        data = data + first_reg.to_bytes(4, 'big') + last_reg.to_bytes(4, 'big')
+        data = data + self.CACHE_POLICY[policy].to_bytes(1, 'big') + ttl_ms.to_bytes(4, 'big')
+
+        # Send the command to the server
+        return self.send_message(self.CACHE_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # clear_cache_range() - Removes the caching policy from a range of registers
+    # ------------------------------------------------------------------------------------------------------
+    def clear_cache_range(self, index):
+        return self.set_cache_range(index, 0, 0, 'none', address = 0)
+    # ------------------------------------------------------------------------------------------------------
+
 
+    # ------------------------------------------------------------------------------------------------------
+    # invalidate_cache() - Throws away cached register data for one device, or for every device
+    # ------------------------------------------------------------------------------------------------------
+    def invalidate_cache(self, *, address = None, slot = None):
 
+        # Find out which device we're aimed at.  0xFF means "every device"
+        target = self.make_target(address, slot)
+        if target == None: target = 0xFF
 
+        # Send the command to the server
+        data = self.CACHE_INVALIDATE.to_bytes(1, 'big') + target.to_bytes(1, 'big')
+        return self.send_message(self.CACHE_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
 
-# ==========================================================================================================
-# wifi_i2c - Manages communications with ESP32 wifi-i2c server
-# ==========================================================================================================
-class Wifi_I2C:
 
-    # This is the transaction ID of the next message we will send
-    transaction_id = 0
+    # ------------------------------------------------------------------------------------------------------
+    # cache_stats() - Fetches the register cache counters
+    #
+    # Returns: A dictionary with 'hits', 'misses', 'invalidations' and 'entries' fields
+    # ------------------------------------------------------------------------------------------------------
+    def cache_stats(self):
+
+        # Ask the server for the counters
+        reply = self.send_message(self.CACHE_CMD, self.CACHE_QUERY.to_bytes(1, 'big'))
+
+        # Pick apart the reply
+        return {
+            'hits'          : int.from_bytes(reply[0:4],  'big'),
+            'misses'        : int.from_bytes(reply[4:8],  'big'),
+            'invalidations' : int.from_bytes(reply[8:12], 'big'),
+            'entries'       : reply[12]
+        }
+    # ------------------------------------------------------------------------------------------------------
 
-    # This is the server address and port
-    server = ('', 0)
 
-    # This will be a Listener object
-    listener = None
+    # ------------------------------------------------------------------------------------------------------
+    # set_coalescing() - Asks the server to pack several replies into each datagram
+    #
+    # Passed: enable       = True to coalesce replies, False for one reply per datagram
+    #         max_bytes    = The largest datagram the server should send
+    #         max_delay_us = The longest the server may hold a reply.  0 means "until the server has
+    #                        no more requests waiting"
+    #
+    # Coalescing is most useful along with pipeline().  The server turns it off again whenever
+    # init_sequence() or set_client_port() is called
+    # ------------------------------------------------------------------------------------------------------
+    def set_coalescing(self, enable = True, max_bytes = 1400, max_delay_us = 0):
 
-    # This is the socket we'll be transmitting on
-    sock = None
+        # Build the command
+        data = (1 if enable else 0).to_bytes(1, 'big')
+        if enable: data = data + max_bytes.to_bytes(2, 'big') + max_delay_us.to_bytes(4, 'big')
 
-    # These are all of the commands we can send to the server
-    INIT_SEQ_CMD     = 0
-    CLIENT_PORT_CMD  = 1
-    I2C_ADDR_CMD     = 2
-    WRITE_REG_CMD    = 3
-    READ_REG_CMD     = 4
-    GET_FWREV_CMD    = 5
-    GET_RSSI_CMD     = 6
+        # And send it to the server
+        return self.send_message(self.COALESCE_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # The constructor - Sets up our listening socket
+    # get_stats() - Fetches the server's performance counters
+    #
+    # Passed: command = None for the counters that aren't specific to a command, or a command number
+    #
+    # Returns: For the summary, a dictionary with 'duplicates', 'rx_drops', 'queue_drops',
+    #          'queue_high_water', 'commands' (a list of the command numbers that have been handled),
+    #          'bus_timeouts' and 'bus_recoveries'.
+    #
+    #          For a command, a dictionary with 'count', 'errors', 'bus_us', 'bytes_in', 'bytes_out' and
+    #          'latency'.  'latency' is a list where entry 'n' counts replies that took between 2**n and
+    #          2**(n+1) - 1 microseconds (entry 0 includes 0 us).  The last entry has no upper limit
+    # ------------------------------------------------------------------------------------------------------
+    def get_stats(self, command = None):
+
+        # If the caller wants the summary...
+        if command == None:
+            reply = self.send_message(self.GET_STATS_CMD, self.STATS_SUMMARY.to_bytes(1, 'big'))
+            bitmap = int.from_bytes(reply[16:20], 'big')
+            return {
+                'duplicates'       : int.from_bytes(reply[0:4],   'big'),
+                'rx_drops'         : int.from_bytes(reply[4:8],   'big'),
+                'queue_drops'      : int.from_bytes(reply[8:12],  'big'),
+                'queue_high_water' : int.from_bytes(reply[12:16], 'big'),
+                'commands'         : [n for n in range(32) if bitmap & (1 << n)],
+                'bus_timeouts'     : int.from_bytes(reply[20:24], 'big'),
+                'bus_recoveries'   : int.from_bytes(reply[24:28], 'big'),
+                'profile'          : self.PERF_PROFILES.get(reply[28], reply[28]) if len(reply) > 28 else None
+            }
+
+        # Otherwise, ask for the counters of a single command
+        data = self.STATS_COMMAND.to_bytes(1, 'big') + command.to_bytes(1, 'big')
+        reply = self.send_message(self.GET_STATS_CMD, data)
+        buckets = reply[24]
+        return {
+            'count'     : int.from_bytes(reply[0:4],   'big'),
+            'errors'    : int.from_bytes(reply[4:8],   'big'),
+            'bus_us'    : int.from_bytes(reply[8:16],  'big'),
+            'bytes_in'  : int.from_bytes(reply[16:20], 'big'),
+            'bytes_out' : int.from_bytes(reply[20:24], 'big'),
+            'latency'   : [int.from_bytes(reply[25+4*n : 29+4*n], 'big') for n in range(buckets)]
+        }
     # ------------------------------------------------------------------------------------------------------
-    def __init__(self, local_ip):
 
-        # Create a listener object and start the listening thread
-        self.listener = Listener(local_ip)
+
+    # ------------------------------------------------------------------------------------------------------
+    # get_telemetry() - Fetches the server's system-wide telemetry: heap, queue depths, and the CPU load
+    #                   and stack high-water mark of every task
+    #
+    # Returns: A dictionary with 'heap_free', 'heap_min', 'heap_largest', 'engine_queue' (a list, one
+    #          entry per bus), 'flash_queue', 'cpu_load' and 'tasks'.  Each entry in 'tasks' is a
+    #          dictionary with 'name', 'core', 'priority', 'stack_free' and 'cpu' (in percent)
+    # ------------------------------------------------------------------------------------------------------
+    def get_telemetry(self):
+
+        reply = self.send_message(self.GET_STATS_CMD, self.STATS_SYSTEM.to_bytes(1, 'big'))
+
+        # Fetch the heap figures and the queue depth of each engine
+        heap_free, heap_min, heap_largest, engines = struct.unpack('>IIIB', reply[0:13])
+        offset = 13
+        engine_queue = [int.from_bytes(reply[offset+2*n : offset+2*n+2], 'big') for n in range(engines)]
+        offset += 2 * engines
+
+        # Then the flash queue depth, whether there's CPU load, and how many tasks follow
+        flash_queue, cpu_load, task_count = struct.unpack('>HBB', reply[offset:offset+4])
+        offset += 4
+
+        # Each task is 16 bytes of name, then core, priority, stack high-water mark and CPU load
+        tasks = []
+        for n in range(task_count):
+            name, core, priority, stack_free, permille = struct.unpack('>16sBBIH', reply[offset:offset+24])
+            offset += 24
+            tasks.append({
+                'name'       : name.split(b'\0', 1)[0].decode(errors = 'replace'),
+                'core'       : None if core == 0xFF else core,
+                'priority'   : priority,
+                'stack_free' : stack_free,
+                'cpu'        : permille / 10
+            })
+
+        return {
+            'heap_free'    : heap_free,
+            'heap_min'     : heap_min,
+            'heap_largest' : heap_largest,
+            'engine_queue' : engine_queue,
+            'flash_queue'  : flash_queue,
+            'cpu_load'     : bool(cpu_load),
+            'tasks'        : tasks
+        }
     # ------------------------------------------------------------------------------------------------------
 
 
+    # ------------------------------------------------------------------------------------------------------
+    # reset_stats() - Resets the server's performance counters
+    # ------------------------------------------------------------------------------------------------------
+    def reset_stats(self):
+        return self.send_message(self.GET_STATS_CMD, self.STATS_RESET.to_bytes(1, 'big'))
+    # ------------------------------------------------------------------------------------------------------
+
 
     # ------------------------------------------------------------------------------------------------------
-    # start() - Create sockets and starts the thread that listens for incoming messages
+    # echo() - Sends data to the server, which sends it straight back without touching the I2C bus
     #
-    # Returns:  True if communication was established
-    #           False if something goes awry
+    # Returns: The byte string the server sent back
     # ------------------------------------------------------------------------------------------------------
-    def start(self, server_ip = None, server_port = 0):
-
-        # If no IP address was provided, assume we're connecing in AP mode
-        if server_ip == None: server_ip = '192.168.4.1'
+    def echo(self, data):
 
-        # If this listener was unable to bind to a socket, there's nothing we can do
-        if self.listener.port == None: return False;
+        # Send the data to the server
+        rc = self.send_message(self.ECHO_CMD, data)
 
-        # If either of the port numbers is 0, use defaults
-        if server_port == 0: server_port = 1182
+        # An empty reply comes back as None
+        return rc if rc else b''
+    # ------------------------------------------------------------------------------------------------------
 
-        # Save our server information
-        self.server = (server_ip, server_port)
 
-        # Create a socket for sending messages
-        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    # ------------------------------------------------------------------------------------------------------
+    # scan() - Finds out which I2C addresses have a device at them
+    #
+    # Returns: A tuple of (list of addresses, age of the scan in milliseconds)
+    # ------------------------------------------------------------------------------------------------------
+    def scan(self, cached = False):
 
-        # Tell the server what local port to send responses to
-        reply = None
-        try:
-            reply = self.set_client_port(self.listener.port)
-        except Exception:
-            return False
+        sub_command = self.SCAN_CACHED if cached else self.SCAN_NOW
+        rc = self.send_message(self.SCAN_CMD, sub_command.to_bytes(1, 'big'))
 
-        # If we get here, we have communication with our Wi-Fi device!
-        return True
+        # Bit (address & 7) of byte (address >> 3) is set if there's a device at that address
+        addresses = [address for address in range(128) if rc[address >> 3] & (1 << (address & 7))]
+        return addresses, int.from_bytes(rc[16:20], 'big')
     # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # set_i2c_address() - Tells the server the I2C address of the device to talk to
+    # configure_scan() - Sets how often the server re-scans the bus, and whether it checks addresses
     # ------------------------------------------------------------------------------------------------------
-    def set_i2c_address(self, address):
+    def configure_scan(self, period_ms = 0, validate = False):
 
-        # Convert the address to a byte
-        address = address.to_bytes(1, 'big')
+        data = self.SCAN_CONFIGURE.to_bytes(1, 'big') + period_ms.to_bytes(4, 'big') + (1 if validate else 0).to_bytes(1, 'big')
+        self.send_message(self.SCAN_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
 
-        # Send the command to the server
-        return self.send_message(self.I2C_ADDR_CMD, address)
+
+    # ------------------------------------------------------------------------------------------------------
+    # define_macro() - Stores an op list on the server, to be run later by number with run_macro()
     # ------------------------------------------------------------------------------------------------------
+    def define_macro(self, number, op_list, persist = False, *, reg_width = 1, address = None, slot = None):
 
+        data = self.build_macro_define(number, op_list, persist, reg_width, self.make_target(address, slot))
+        self.send_message(self.MACRO_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # write_reg() - Writes values to a register on the I2C device
+    # run_macro() - Runs a stored macro, with a value for each of its parameters
     #
-    # register_list is an int and value is an int or byte-string
-    #
-    # register_list can be:
-    #   [(register, value), (register, value), (register, value) (etc)]
+    # Returns: A list of byte strings, one for each read operation
     # ------------------------------------------------------------------------------------------------------
-    def write_reg(self, register_list, value = None, *, reg_width = 1):
+    def run_macro(self, number, *args):
 
-        # Get the register data as a stream of bytes
-        data = self.build_register_data(register_list, value, reg_width=reg_width)
+        # If we didn't define this macro, find out what it looks like
+        if number not in self.macro_layout: self.query_macro(number)
 
-        # Send the command to the server
-        return self.send_message(self.WRITE_REG_CMD, data)
+        rc = self.send_message(self.MACRO_CMD, self.build_macro_run(number, args))
+        return self.split_batch_reply(rc, self.macro_layout[number][1])
     # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # read_reg() - Reads a value from a register
+    # delete_macro() - Deletes a stored macro
+    # ------------------------------------------------------------------------------------------------------
+    def delete_macro(self, number):
+
+        self.macro_layout.pop(number, None)
+        self.send_message(self.MACRO_CMD, bytes((self.MACRO_DELETE, number)))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # query_macro() - Asks the server about a stored macro
     #
-    # Returns: The integer contents of the specified register
+    # Returns: A dictionary of 'ops_length', 'persist', and 'params' (the width of each parameter)
     # ------------------------------------------------------------------------------------------------------
-    def read_reg(self, register, length = 1, *, reg_width = 1):
+    def query_macro(self, number):
 
-        # Get register as one or more bytes
-        register = register.to_bytes(reg_width, 'big')
+        rc = self.send_message(self.MACRO_CMD, bytes((self.MACRO_QUERY, number)))
+        return self.parse_macro_query(number, rc)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_bus_clock() - Sets the default I2C bus clock, or the clock for a single device
+    # ------------------------------------------------------------------------------------------------------
+    def set_bus_clock(self, clock_hz, address = None):
 
-        # Convert register-width to a byte
-        reg_width = reg_width.to_bytes(1, 'big')
+        # Convert the clock speed to bytes
+        data = clock_hz.to_bytes(4, 'big')
 
-        # Get length as a pair of bytes
-        length = length.to_bytes(2, 'big')
+        # If this is the clock for a single device, append the device address
+        if address != None: data = data + address.to_bytes(1, 'big')
 
         # Send the command to the server
-        rc = self.send_message(self.READ_REG_CMD, reg_width + register + length)
+        return self.send_message(self.BUS_CLOCK_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # get_bus_clock() - Fetches the default I2C bus clock
+    # ------------------------------------------------------------------------------------------------------
+    def get_bus_clock(self):
+
+        # Send the request to the server
+        rc = self.send_message(self.BUS_CLOCK_CMD)
 
         # Convert the value to an integer and hand it to the caller
         return int.from_bytes(rc, 'big')
     # ------------------------------------------------------------------------------------------------------
 
 
-
     # ------------------------------------------------------------------------------------------------------
     # get_firmware_rev() - Fetches and returns the server firmware revision
     # ------------------------------------------------------------------------------------------------------
@@ -315,23 +2480,25 @@ class Wifi_I2C:
     # ------------------------------------------------------------------------------------------------------
     def send_message(self, command, data = None):
 
-        # Increment our outgoing transaction ID so the server knows this is a new msg
-        self.transaction_id = self.transaction_id + 1
+        # Build the message, with a brand new transaction ID
+        id, message = self.build_message(command, data)
+
+        # And send it
+        return self.send_message_built(id, message)
+    # ------------------------------------------------------------------------------------------------------
 
-        # Get the bytes for the transaction ID
-        id = self.transaction_id.to_bytes(4, 'big')
 
-        # Build the message we're about to send'
-        message = id
-        message = message + command.to_bytes(1, 'big')
+    # ------------------------------------------------------------------------------------------------------
+    # send_message_built() - Sends a message from build_message(), making multiple attempts to get a reply
+    #
+    # Returns: response bytes
+    #   or None = Transaction was good, but no response data
+    # ------------------------------------------------------------------------------------------------------
+    def send_message_built(self, id, message):
 
-        # If there is data to go with the message, append it
-        if data:
-            if type(data) is bytearray:
-                data = bytes(data)
-            if not type(data) is bytes:
-                raise TypeError("send_message: data must be bytes, not "+ str(type(data)))
-            message = message + data
+        # If we're talking over TCP, there's no need to retry
+        if self.tcp:
+            return self.parse_reply(self.tcp_exchange([(id, message)])[id])
 
         # So far we don't have a reply message
         reply = None
@@ -342,6 +2509,9 @@ class Wifi_I2C:
             # Tell the listener to expect this message ID
             self.listener.expect(id)
 
+            # If we're recording a trace, a message goes into it the first time it's sent
+            if self.capture and attempt == 0: self.capture.record(Capture.REQUEST, message)
+
             # Send the message to the server
             self.sock.sendto(message, self.server)
 
@@ -351,85 +2521,227 @@ class Wifi_I2C:
             # If we have a reply, we don't have to retry
             if reply: break
 
+            # After two unanswered attempts, the server may have rebooted or changed its IP address.
+            # The server recognizes a retry, so if the message got through, it won't be executed twice
+            if attempt == 1: self.rediscover(0.2)
+
         # If we didn't receive a reply, that's an error
         if not reply: raise Wifi_I2C_Ex(-1)
 
-
-        # If there's an error code in the reply raise an exception
-        if reply[5] != 0: raise Wifi_I2C_Ex(reply)
-
-
-        # Tell the caller what reply we got.  A message is:
-        #   4 bytes of transaction ID
-        #   1 byte of command
-        #   1 byte of error code
-        #   optional data
-
-        # If there's no reply data, return None
-        if len(reply) <= 6: return None
-
-        # Otherwise, return the reply data
-        return reply[6:]
+        # Check the reply for errors and hand the caller the reply data
+        return self.parse_reply(reply)
     # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # build_register_data() - Returns a string of bytes built from an input
+    # pipeline() - Sends a list of messages to the server, keeping up to "window" of them in flight at
+    #              once, and resending any whose reply doesn't arrive within a second.  The server keeps
+    #              the most recent replies, so a resent message gets its original reply back rather than
+    #              being executed a second time.
     #
-    # register_list is an int and value is an int or byte-string
+    # Passed: message_list = A list of (command, data) or (command, data, bus) tuples
+    #         window       = The maximum number of messages to have in flight at once
     #
-    # register_list can be:
-    #   [(register, value), (register, value), (register, value) (etc)]
+    # Returns: A list containing the reply data for each message, in order
     # ------------------------------------------------------------------------------------------------------
-    def build_register_data(self, register_list, value = None, *, reg_width=1):
+    def pipeline(self, message_list, window = 8):
 
-        data = bytearray()
+        # Build all of the messages, each with its own transaction ID
+        messages = [self.build_message(*message) for message in message_list]
 
-        # If register is a list of values...
-        if type(register_list) is list:
+        # If we're talking over TCP, the kernel takes care of the window and the retries
+        if self.tcp:
+            replies = self.tcp_exchange(messages)
+            return [self.parse_reply(replies[id]) for id, message in messages]
 
-            # Loop through each tuple in the list of values
-            for register, value in register_list:
-                data = data + self.build_one_register_string(register, value, reg_width)
+        # Send them all, and collect the replies
+        replies = {}
+        self.udp_window(messages, window, replies.__setitem__)
 
-            # We built a byte string from a list of tuples.  Return it
-            return bytes(data)
+        # Check each reply for errors and hand the caller the reply data, in order
+        return [self.parse_reply(replies[id]) for id, message in messages]
+    # ------------------------------------------------------------------------------------------------------
 
-        # Otherwise, build the string for the one single register number the caller provided
-        return self.build_one_register_string(register_list, value, reg_width)
+
+    # ------------------------------------------------------------------------------------------------------
+    # udp_window() - Sends messages to the server, keeping up to "window" of them in flight at once, and
+    #                resending any whose reply doesn't arrive within a second
+    #
+    # Passed: messages = An iterable of (transaction ID, message) tuples.  A message can be any bytes-like
+    #                    object, and isn't asked for until there's room in the window for it
+    #         window   = The maximum number of messages to have in flight at once.  It's never more
+    #                    than REPLY_CACHE_SIZE
+    #         on_reply = Called with (transaction ID, reply) as each reply arrives
+    # ------------------------------------------------------------------------------------------------------
+    def udp_window(self, messages, window, on_reply):
+
+        # A resent message is only answered if the server still has its reply
+        window = max(1, min(window, self.REPLY_CACHE_SIZE))
+
+        # These are the messages in flight.  Key is the transaction ID, value is [message, attempts, sent_at]
+        in_flight = {}
+
+        # This is where the messages we haven't sent yet come from
+        messages = iter(messages)
+        more = True
+
+        # We only look for a server that has gone quiet once per call
+        looked = False
+
+        # We're not yet expecting any replies
+        self.listener.expect_none()
+
+        # Keep going until every message has been sent and answered
+        while more or in_flight:
+
+            # Fill the window with new messages
+            while more and len(in_flight) < window:
+                message = next(messages, None)
+                if message == None:
+                    more = False
+                    break
+                in_flight[message[0]] = [message[1], 0, 0]
+                self.listener.expect_also(message[0])
+
+            # If a message has gone unanswered twice, the server may have rebooted or changed its IP
+            # address.  Look for it before anything is resent to the address it used to have
+            now = time.time()
+            if not looked and any(entry[1] == 2 and now - entry[2] >= 1 for entry in in_flight.values()):
+                looked = True
+                self.rediscover(0.2)
+
+            # Send any message that hasn't been sent yet or whose reply is overdue
+            now = time.time()
+            for id, entry in in_flight.items():
+                if now - entry[2] >= 1:
+                    if entry[1] == 5: raise Wifi_I2C_Ex(-1)
+                    if self.capture and entry[1] == 0: self.capture.record(Capture.REQUEST, entry[0])
+                    self.sock.sendto(entry[0], self.server)
+                    entry[1] = entry[1] + 1
+                    entry[2] = now
+
+            # Collect whatever replies have arrived
+            for id, reply in self.listener.wait_for_replies(0.05).items():
+                if id in in_flight:
+                    del in_flight[id]
+                    on_reply(id, reply)
     # ------------------------------------------------------------------------------------------------------
 
 
     # ------------------------------------------------------------------------------------------------------
-    # build_one_register_string() - Builds the register string for a single register number and value
+    # send_chunked() - Sends a CHUNKED_CMD request and collects the fragments that come back
+    #
+    # Returns: A tuple of (reply data, list of fragments)
     # ------------------------------------------------------------------------------------------------------
-    def build_one_register_string(self, reg_number, value, reg_width):
+    def send_chunked(self, request):
 
-        # if value is an int, convert it to one or more bytes
-        if type(value) is int:
-            value = value.to_bytes(reg_width, 'big')
+        id, message = self.build_message(self.CHUNKED_CMD, request)
 
-        # If value is a bytearray, convert it to a bytes string
-        if type(value) is bytearray:
-            value = bytes(value)
+        # Over TCP, the fragments all arrive before the reply
+        if self.tcp:
+            reply = self.parse_reply(self.tcp_exchange([(id, message)])[id])
+            return reply, self.tcp_fragments.pop(id, [])
 
-        # If value is a byte string, build our return value from it
-        if type(value) is bytes:
-            value_length = len(value).to_bytes(2, 'big')
+        # Over UDP, tell the listener to hold on to the fragments, and send the request
+        self.listener.open_fragments(id)
+        try:
+            reply = self.send_message_built(id, message)
 
-            # Convert the register number to one or more bytes
-            reg_number= reg_number.to_bytes(reg_width, 'big')
+            # The fragments are sent before the reply, but a datagram or two might still be on its way
+            time.sleep(0.01)
+        finally:
+            fragments = self.listener.close_fragments(id)
 
-            # Convert register width to one byte
-            reg_width = reg_width.to_bytes(1, 'big')
+        return reply, fragments
+    # ------------------------------------------------------------------------------------------------------
 
-            # Hand the caller the resulting byte string
-            return reg_width + reg_number + value_length + value
 
-        # We'll get here if 'value' wasn't an integer or byte string
-        raise TypeError("register values must be int or bytes")
     # ------------------------------------------------------------------------------------------------------
+    # tcp_exchange() - Sends a list of messages to the server over TCP, and collects the replies
+    #
+    # Passed: messages = A list of (transaction ID, message) tuples from build_message()
+    #         quiet    = If True, the server is asked to reply only to messages that fail, and to the last
+    #                    message to each bus
+    #
+    # Returns: A dictionary of replies, keyed by transaction ID
+    # ------------------------------------------------------------------------------------------------------
+    def tcp_exchange(self, messages, quiet = False):
+
+        # Find the last message to each bus.  In quiet mode, those are the ones we wait for the replies to
+        last = {}
+        for index, (id, message) in enumerate(messages):
+            last[message[4] & self.BUS_FLAG] = index
+
+        # Frame every message, and keep track of which replies we're waiting for
+        out = bytearray()
+        expected = set()
+        for index, (id, message) in enumerate(messages):
+            length = len(message)
+            if quiet and last[message[4] & self.BUS_FLAG] != index:
+                length = length | self.TCP_QUIET_FLAG
+            else:
+                expected.add(id)
+            out += length.to_bytes(2, 'big')
+            out += message
+
+        # Send them, and collect the replies
+        return self.tcp_transfer(out, expected)
+    # ------------------------------------------------------------------------------------------------------
+
 
+    # ------------------------------------------------------------------------------------------------------
+    # tcp_transfer() - Sends a buffer of framed messages to the server over TCP, and collects the replies
+    #
+    # Passed: out      = The framed messages
+    #         expected = The set of transaction IDs whose replies we have to wait for
+    #
+    # Returns: A dictionary of replies, keyed by transaction ID
+    # ------------------------------------------------------------------------------------------------------
+    def tcp_transfer(self, out, expected):
+
+        # We send straight out of the caller's buffer
+        out = memoryview(out)
+        replies = {}
+        sent = 0
+
+        # If we're recording a trace, every framed message goes into it
+        if self.capture:
+            index = 0
+            while index + 2 <= len(out):
+                length = int.from_bytes(out[index:index+2], 'big') & ~self.TCP_QUIET_FLAG
+                self.capture.record(Capture.REQUEST, out[index+2 : index+2+length])
+                index = index + 2 + length
+
+        # Keep sending and receiving until every message is sent and every reply we expect is here.  We
+        # receive while we send, so that neither end's window fills up with replies nobody's reading
+        while sent < len(out) or expected:
+            writers = [self.tcp] if sent < len(out) else []
+            readable, writable, error = select.select([self.tcp], writers, [], self.TCP_TIMEOUT)
+            if not readable and not writable: raise Wifi_I2C_Ex(-1)
+
+            # Send as much as the socket will take
+            if writable: sent = sent + self.tcp.send(out[sent:])
+
+            # Split whatever has arrived into frames
+            if readable:
+                data = self.tcp.recv(65536)
+                if not data: raise Wifi_I2C_Ex(-1)
+                self.tcp_rx.extend(data)
+                while len(self.tcp_rx) >= 2:
+                    length = int.from_bytes(self.tcp_rx[0:2], 'big')
+                    if len(self.tcp_rx) < 2 + length: break
+                    reply = bytes(self.tcp_rx[2:2 + length])
+                    del self.tcp_rx[:2 + length]
+                    if reply[0:4] == self.CHUNK_TRANS_ID:
+                        self.tcp_fragments.setdefault(reply[6:10], []).append(reply)
+                        continue
+                    if self.capture: self.capture.record(Capture.REPLY, reply)
+                    replies[reply[0:4]] = reply
+                    expected.discard(reply[0:4])
+
+        # Hand the caller every reply we received
+        return replies
+    # ------------------------------------------------------------------------------------------------------
 
 
 # ==========================================================================================================
@@ -445,9 +2757,14 @@ class Listener(threading.Thread):
 
     sock        = None
     port        = None
-    expected_id = None
+    expected    = None
+    replies     = None
+    streams     = None
+    fragments   = None
+    lock        = None
     event       = None
     incoming    = None
+    capture     = None      # The client's Capture object, while it's recording a trace
 
     def __init__(self, local_ip=None):
 
@@ -491,6 +2808,19 @@ class Listener(threading.Thread):
         # Create an event that other threads can wait on
         self.event = threading.Event()
 
+        # This guards the set of expected transaction IDs and the replies that have arrived
+        self.lock = threading.Lock()
+
+        # We're not yet expecting any messages
+        self.expected = set()
+        self.replies  = {}
+
+        # This is a queue of incoming stream packets for each stream job
+        self.streams  = {}
+
+        # This is the list of fragments that have arrived for each chunked read in progress
+        self.fragments = {}
+
         # Start the thread
         self.start()
     # ---------------------------------------------------------------------------
@@ -501,11 +2831,55 @@ class Listener(threading.Thread):
     # ---------------------------------------------------------------------------
     def expect(self, transaction_id):
 
-        # Clear the event.  It will be set if a message arrives
-        self.event.clear()
+        # Forget about any messages we were expecting
+        self.expect_none()
 
         # Save the message ID that we are expecting
-        self.expected_id = transaction_id
+        self.expect_also(transaction_id)
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # expect_none() - Forgets about every message we were expecting
+    # ---------------------------------------------------------------------------
+    def expect_none(self):
+
+        with self.lock:
+
+            # Clear the event.  It will be set if a message arrives
+            self.event.clear()
+
+            # We're not expecting anything, and we have no replies
+            self.expected = set()
+            self.replies  = {}
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # expect_also() - Adds a message ID to the set of messages we're expecting
+    # ---------------------------------------------------------------------------
+    def expect_also(self, transaction_id):
+
+        with self.lock:
+            self.expected.add(transaction_id)
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # wait_for_replies() - Waits for one or more expected replies to arrive
+    #
+    # Returns a dictionary of replies, keyed by transaction ID (it may be empty)
+    # ---------------------------------------------------------------------------
+    def wait_for_replies(self, seconds):
+
+        # If nothing arrived, tell the caller
+        if not self.event.wait(seconds): return {}
+
+        # Hand the caller all of the replies that have arrived so far
+        with self.lock:
+            self.event.clear()
+            replies, self.replies = self.replies, {}
+            return replies
     # ---------------------------------------------------------------------------
 
 
@@ -525,6 +2899,52 @@ class Listener(threading.Thread):
 
 
 
+    # ---------------------------------------------------------------------------
+    # open_stream() - Starts collecting the incoming packets for a stream job
+    # ---------------------------------------------------------------------------
+    def open_stream(self, job):
+
+        with self.lock:
+            self.streams[job] = queue.Queue()
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # get_stream_packet() - Waits for the next packet for a stream job
+    #
+    # Returns either None or a byte-string
+    # ---------------------------------------------------------------------------
+    def get_stream_packet(self, job, seconds):
+
+        try:
+            return self.streams[job].get(timeout=seconds)
+        except queue.Empty:
+            return None
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # open_fragments() - Starts collecting the fragments of a chunked read
+    # ---------------------------------------------------------------------------
+    def open_fragments(self, transaction_id):
+
+        with self.lock:
+            self.fragments[transaction_id] = []
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # close_fragments() - Stops collecting the fragments of a chunked read
+    #
+    # Returns the list of fragments that arrived
+    # ---------------------------------------------------------------------------
+    def close_fragments(self, transaction_id):
+
+        with self.lock:
+            return self.fragments.pop(transaction_id, [])
+    # ---------------------------------------------------------------------------
+
+
     # ---------------------------------------------------------------------------
     # run() - A blocking thread that permanently waits for incoming messages
     # ---------------------------------------------------------------------------
@@ -534,19 +2954,58 @@ class Listener(threading.Thread):
         while True:
 
             # Wait for an incoming message
-            message, _ = self.sock.recvfrom(1024)
+            message, _ = self.sock.recvfrom(2048)
+
+            # If this isn't a coalesced datagram, it's a single message
+            if message[0:4] != Wifi_I2C.COALESCE_TRANS_ID:
+                self.handle_message(message)
+                continue
+
+            # Otherwise, it's a series of replies, each preceded by a 2-byte length
+            index = 6
+            while index + 2 <= len(message):
+                length = int.from_bytes(message[index:index+2], 'big')
+                self.handle_message(message[index+2 : index+2+length])
+                index = index + 2 + length
+    # ---------------------------------------------------------------------------
+
+
+    # ---------------------------------------------------------------------------
+    # handle_message() - Hands a single incoming message to whoever is waiting for it
+    # ---------------------------------------------------------------------------
+    def handle_message(self, message):
+
+        # What's the message ID of this message?
+        trans_id = message[0:4]
+
+        # If this is a stream packet, hand it to whoever is reading that stream
+        if trans_id == Wifi_I2C.STREAM_TRANS_ID and len(message) >= 14:
+            with self.lock:
+                stream = self.streams.get(message[6])
+            if stream != None: stream.put(message)
+            return
+
+        # If this is a fragment of a chunked read, hand it to whoever is collecting them
+        if trans_id == Wifi_I2C.CHUNK_TRANS_ID and len(message) >= 16:
+            with self.lock:
+                fragments = self.fragments.get(message[6:10])
+                if fragments != None: fragments.append(message)
+            return
 
-            # What's the message ID of this message?
-            trans_id = message[0:4]
+        with self.lock:
 
             # If this was an unexpected transaction ID, ignore it
-            if trans_id != self.expected_id: continue
+            if not trans_id in self.expected: return
 
-            # We are no longer expecting a message
-            self.expected_id = None
+            # We are no longer expecting this message
+            self.expected.discard(trans_id)
 
             # Save the incoming message so the other thread can retrieve it
             self.incoming = message
+            self.replies[trans_id] = message
+
+            # If the client is recording a trace, this is when the reply arrived
+            if self.capture: self.capture.record(Capture.REPLY, message)
 
             # Tell the other thread that his reply arrived
             self.event.set()
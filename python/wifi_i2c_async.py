@@ -0,0 +1,798 @@
+"""
+To use this module, do this at the top of your Python code:
+         from wifi_i2c_async import Wifi_I2C_Async, Wifi_I2C_Pipelined
+         from wifi_i2c import Wifi_I2C_Ex
+
+Wifi_I2C_Async is an asyncio client for the server.  Any number of transactions can be in flight at once
+(up to the window), each with its own future.  A reply is matched to its request by transaction ID, so
+replies may arrive in any order, and so may coalesced replies.   Lost requests are resent after a timeout
+that follows the round-trip time we measure, the way TCP does it (RFC 6298).
+
+Wifi_I2C_Pipelined has exactly the same API as Wifi_I2C, but carries its messages with a Wifi_I2C_Async
+running in a background thread.   Several threads can share one Wifi_I2C_Pipelined, and their
+transactions are in flight at the same time.
+
+Public API of Wifi_I2C_Async (every method but the constructor, close() and stats() is a coroutine):
+
+    ----------------------------------------------------------------------------------------------------------
+    Constructor of Wifi_I2C_Async(local_ip_address = None, window = 8)
+
+    window is the most transactions that may be waiting for a reply at once.  It's never more than
+    REPLY_CACHE_SIZE (8), the number of replies the server keeps for resending
+    ---------------------------------------------------------------------------------------------------------
+    start(server_ip = None, server_port = 0)
+
+    With no server_ip, the first server that discover() finds is used
+
+    Returns: True if a connection was established, False if no communication established
+    ---------------------------------------------------------------------------------------------------------
+    discover(timeout = 0.5, port = 0, address = None)
+
+    Not a coroutine.  Works just like Wifi_I2C.discover()
+    ---------------------------------------------------------------------------------------------------------
+    close()
+
+    Closes the socket.  Transactions still waiting for a reply fail
+    ---------------------------------------------------------------------------------------------------------
+    send_message(command, data = None, bus = None)
+
+    Sends any command to the server and waits for the reply
+
+    Returns: The reply data, or None if there wasn't any.  Raises Wifi_I2C_Ex if the server reports an error
+    ---------------------------------------------------------------------------------------------------------
+    pipeline(message_list)
+
+    Sends a list of (command, data) or (command, data, bus) tuples, all in flight at once (up to the window)
+
+    Returns: A list containing the reply data for each message, in order
+    ---------------------------------------------------------------------------------------------------------
+    set_i2c_address(address)
+    write_reg(register_list, value = None, *, reg_width = 1, address = None, slot = None)
+    write_block(register, data, *, reg_width = 1, address = None, slot = None, chunk_size = 0)
+    read_reg(register, length = 1, *, reg_width = 1, split = False, no_cache = False, address = None, slot = None)
+    modify_reg(register, mask, value, *, length = 1, verify = False, reg_width = 1, address = None, slot = None)
+    poll_until(register, mask, expected, timeout_us = 100000, *, interval_us = 100, length = 1, max_polls = 0, ...)
+    batch(op_list, *, reg_width = 1, address = None, slot = None)
+    define_macro(number, op_list, persist = False, *, reg_width = 1, address = None, slot = None)
+    run_macro(number, *args)
+    set_coalescing(enable = True, max_bytes = 1400, max_delay_us = 0)
+    stream_start(job, register_list, period_us, *, reg_width = 1, address = None, slot = None, samples_per_packet = 16)
+    stream_stop(job = None)
+    echo(data)
+    get_firmware_rev()
+
+    These work just like their namesakes in Wifi_I2C
+    ---------------------------------------------------------------------------------------------------------
+    stream(job, timeout = None)
+
+    An async iterator that yields the samples of a stream job, just like Wifi_I2C.stream()
+    ---------------------------------------------------------------------------------------------------------
+    stats()
+
+    Returns: A dictionary of 'srtt' and 'rto' (the smoothed round-trip time and the retransmit timeout, in
+             seconds), 'in_flight' and 'retransmits'
+    ---------------------------------------------------------------------------------------------------------
+"""
+
+"""
+Change History:
+==========================================================================================================
+ Vers   When       Who  What
+---------------------------------------------------------------------------------------------------------
+  1000  14-Oct-26       Initial creation
+  1001  14-Oct-26       Added write_block()
+  1002  14-Oct-26       Added define_macro() and run_macro()
+  1003  14-Oct-26       start() uses discover() when no IP address is given
+  1004  14-Oct-26       Added poll_until()
+  1005  14-Oct-26       Added modify_reg()
+  1006  14-Oct-26       The window defaults to, and is never more than, the server's reply cache
+=========================================================================================================
+"""
+
+
+import asyncio, threading, queue
+from wifi_i2c import Wifi_I2C, Wifi_I2C_Base, Wifi_I2C_Ex
+
+# ==========================================================================================================
+# Wifi_I2C_Async - An asyncio client that keeps many transactions in flight at once
+# ==========================================================================================================
+class Wifi_I2C_Async(Wifi_I2C_Base):
+
+    # Before we've measured the round-trip time, this is the retransmit timeout, in seconds
+    INITIAL_RTO  = 0.25
+
+    # The retransmit timeout is never shorter or longer than these
+    MIN_RTO      = 0.01
+    MAX_RTO      = 1.0
+
+    # This is how many times we send a message before giving up on it
+    MAX_ATTEMPTS = 5
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # The constructor
+    # ------------------------------------------------------------------------------------------------------
+    def __init__(self, local_ip = None, window = 8):
+
+        # If no IP address was provided, assume we're connecing in AP mode
+        if local_ip == None: local_ip = '192.168.4.2'
+
+        # This is the address we listen on, the server's address, and our socket (once we've started)
+        self.local_ip  = local_ip
+        self.server    = ('', 0)
+        self.transport = None
+
+        # This is the most messages we'll have in flight at once, and the semaphore that enforces it.  A
+        # resent message is only answered if the server still has its reply
+        self.window    = max(1, min(window, self.REPLY_CACHE_SIZE))
+        self.slots     = None
+
+        # These are the messages in flight.  Key is the transaction ID, value is an _InFlight
+        self.pending   = {}
+
+        # This is a queue of incoming packets for each stream job, and the fragments that have arrived
+        # for each chunked read
+        self.streams   = {}
+        self.fragments = {}
+
+        # These describe the samples of each stream job, and count the stream packets that were lost
+        self.stream_layout = {}
+        self.stream_lost   = {}
+
+        # This is our estimate of the round-trip time, and the retransmit timeout that comes from it
+        self.srtt      = None
+        self.rttvar    = None
+        self.rto       = self.INITIAL_RTO
+
+        # This is how many messages we've had to resend
+        self.retransmits = 0
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # start() - Creates our socket and tells the server where to send its replies
+    #
+    # Returns:  True if communication was established
+    #           False if something goes awry
+    # ------------------------------------------------------------------------------------------------------
+    async def start(self, server_ip = None, server_port = 0):
+
+        # If the port number is 0, use the default
+        if server_port == 0: server_port = self.SERVER_PORT
+
+        # If no IP address was provided, look for a server on our network.   If there isn't one, assume
+        # we're connecting in AP mode
+        loop = asyncio.get_running_loop()
+        if server_ip == None:
+            found = await loop.run_in_executor(None, self.discover, 0.5, server_port)
+            server_ip = found[0]['ip'] if found else '192.168.4.1'
+
+        # Save our server information
+        self.server = (server_ip, server_port)
+
+        # Create the socket we send and receive on
+        try:
+            self.transport, _ = await loop.create_datagram_endpoint(lambda: _Protocol(self),
+                                                                    local_addr = (self.local_ip, 0))
+        except OSError:
+            return False
+
+        # This keeps the number of messages in flight within the window
+        self.slots = asyncio.Semaphore(self.window)
+
+        # Tell the server what local port to send responses to
+        try:
+            port = self.transport.get_extra_info('sockname')[1]
+            await self.send_message(self.CLIENT_PORT_CMD, port.to_bytes(2, 'big'))
+        except Exception:
+            self.close()
+            return False
+
+        # If we get here, we have communication with our Wi-Fi device!
+        return True
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # close() - Closes our socket.  Anything still waiting for a reply fails
+    # ------------------------------------------------------------------------------------------------------
+    def close(self):
+
+        for entry in self.pending.values():
+            if not entry.future.done(): entry.future.set_exception(Wifi_I2C_Ex(-1))
+
+        if self.transport: self.transport.close()
+        self.transport = None
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stats() - Reports how the transport is doing
+    # ------------------------------------------------------------------------------------------------------
+    def stats(self):
+
+        return {
+            'srtt'        : self.srtt,
+            'rto'         : self.rto,
+            'in_flight'   : len(self.pending),
+            'retransmits' : self.retransmits
+        }
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # send_message() - Sends a message to the server and waits for the reply
+    #
+    # Returns: response bytes
+    #   or None = Transaction was good, but no response data
+    # ------------------------------------------------------------------------------------------------------
+    async def send_message(self, command, data = None, bus = None):
+
+        # Build the message, with a brand new transaction ID
+        id, message = self.build_message(command, data, bus)
+
+        # Send it, and check the reply for errors
+        return self.parse_reply(await self.send_built(id, message))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # pipeline() - Sends a list of messages to the server, all in flight at once
+    #
+    # Passed: message_list = A list of (command, data) or (command, data, bus) tuples
+    #
+    # Returns: A list containing the reply data for each message, in order
+    # ------------------------------------------------------------------------------------------------------
+    async def pipeline(self, message_list):
+
+        messages = [self.build_message(*message) for message in message_list]
+        return [self.parse_reply(reply) for reply in await self.send_many(messages)]
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_i2c_address() - Tells the server the I2C address of the device to talk to
+    # ------------------------------------------------------------------------------------------------------
+    async def set_i2c_address(self, address):
+
+        self.i2c_address = address
+        return await self.send_message(self.I2C_ADDR_CMD, address.to_bytes(1, 'big'))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_reg() - Writes values to a register on the I2C device
+    # ------------------------------------------------------------------------------------------------------
+    async def write_reg(self, register_list, value = None, *, reg_width = 1, address = None, slot = None):
+
+        data = self.build_register_data(register_list, value, reg_width=reg_width, target=self.make_target(address, slot))
+        return await self.send_message(self.WRITE_REG_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_block() - Writes a block of data of any length, as register writes that are each as large as
+    #                 the server can receive.   The data can be anything that supports the buffer protocol,
+    #                 and is copied exactly once, straight into a message buffer we allocated up front
+    #
+    # 'builder' is the object whose transaction IDs the messages use.  Wifi_I2C_Pipelined passes itself
+    # ------------------------------------------------------------------------------------------------------
+    async def write_block(self, register, data, *, reg_width = 1, address = None, slot = None, chunk_size = 0,
+                          builder = None):
+
+        if builder == None: builder = self
+
+        # Look at the caller's data as a flat run of bytes, without copying it
+        view = memoryview(data).cast('B')
+        if len(view) == 0: return
+
+        # Find out which device we're aimed at, and how much data goes in each message
+        target = self.make_target(address, slot)
+        chunk_size = self.block_chunk_size(reg_width, target, chunk_size)
+
+        # Each message in flight needs a buffer of its own, since we may have to resend it
+        count  = (len(view) + chunk_size - 1) // chunk_size
+        frames = asyncio.Queue()
+        for i in range(min(self.window, count)): frames.put_nowait(bytearray(self.MAX_MESSAGE))
+
+        # This packs one chunk into a free buffer, sends it, and frees the buffer when the reply arrives
+        async def write_chunk(offset):
+            frame = await frames.get()
+            try:
+                id, length = builder.pack_write_message(frame, 0, register + offset, reg_width, target,
+                                                        view[offset : offset + chunk_size])
+                self.parse_reply(await self.send_built(id, memoryview(frame)[:length]))
+            finally:
+                frames.put_nowait(frame)
+
+        # Send every chunk
+        await asyncio.gather(*[write_chunk(offset) for offset in range(0, len(view), chunk_size)])
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # read_reg() - Reads a value from a register
+    #
+    # Returns: The integer contents of the specified register
+    # ------------------------------------------------------------------------------------------------------
+    async def read_reg(self, register, length = 1, *, reg_width = 1, split = False, no_cache = False,
+                       address = None, slot = None):
+
+        data = self.build_read_request(register, length, reg_width, split, no_cache, self.make_target(address, slot))
+        return int.from_bytes(await self.send_message(self.READ_REG_CMD, data), 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # modify_reg() - Has the server change the bits of a register that are in a mask
+    # ------------------------------------------------------------------------------------------------------
+    async def modify_reg(self, register, mask, value, *, length = 1, verify = False, reg_width = 1, split = False,
+                         address = None, slot = None):
+
+        data = self.build_rmw_request(register, mask, value, length, verify, reg_width = reg_width,
+                                      split = split, target = self.make_target(address, slot))
+        return self.parse_rmw_reply(await self.send_message(self.RMW_CMD, data))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # poll_until() - Has the server read a register until (value & mask) == expected
+    # ------------------------------------------------------------------------------------------------------
+    async def poll_until(self, register, mask, expected, timeout_us = 100000, *, interval_us = 100, length = 1,
+                         max_polls = 0, reg_width = 1, split = False, address = None, slot = None):
+
+        data = self.build_poll_request(register, mask, expected, timeout_us, interval_us, length, max_polls,
+                                       reg_width = reg_width, split = split, target = self.make_target(address, slot))
+        return self.parse_poll_reply(await self.send_message(self.POLL_UNTIL_CMD, data))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # batch() - Performs a list of operations in a single packet
+    #
+    # Returns: A list of byte strings, one for each read operation
+    # ------------------------------------------------------------------------------------------------------
+    async def batch(self, op_list, *, reg_width = 1, address = None, slot = None):
+
+        data, read_lengths = self.build_ops(op_list, reg_width, self.make_target(address, slot))
+        return self.split_batch_reply(await self.send_message(self.BATCH_CMD, data), read_lengths)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # define_macro() - Stores an op list on the server, to be run later by number with run_macro()
+    # ------------------------------------------------------------------------------------------------------
+    async def define_macro(self, number, op_list, persist = False, *, reg_width = 1, address = None, slot = None):
+
+        data = self.build_macro_define(number, op_list, persist, reg_width, self.make_target(address, slot))
+        return await self.send_message(self.MACRO_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # run_macro() - Runs a stored macro, with a value for each of its parameters
+    #
+    # Returns: A list of byte strings, one for each read operation
+    # ------------------------------------------------------------------------------------------------------
+    async def run_macro(self, number, *args):
+
+        # If we didn't define this macro, find out what it looks like
+        if number not in self.macro_layout:
+            rc = await self.send_message(self.MACRO_CMD, bytes((self.MACRO_QUERY, number)))
+            self.parse_macro_query(number, rc)
+
+        rc = await self.send_message(self.MACRO_CMD, self.build_macro_run(number, args))
+        return self.split_batch_reply(rc, self.macro_layout[number][1])
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # set_coalescing() - Turns reply coalescing on the server on or off
+    # ------------------------------------------------------------------------------------------------------
+    async def set_coalescing(self, enable = True, max_bytes = 1400, max_delay_us = 0):
+
+        data = (1 if enable else 0).to_bytes(1, 'big')
+        if enable: data = data + max_bytes.to_bytes(2, 'big') + max_delay_us.to_bytes(4, 'big')
+        return await self.send_message(self.COALESCE_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream_start() - Starts a job on the server that samples registers and streams them to us
+    # ------------------------------------------------------------------------------------------------------
+    async def stream_start(self, job, register_list, period_us, *, reg_width = 1, address = None, slot = None,
+                           samples_per_packet = 16):
+
+        # Build the job description, and get ready to receive the samples
+        data = self.build_stream_job(job, register_list, period_us, reg_width, self.make_target(address, slot),
+                                     samples_per_packet)
+        self.streams[job] = asyncio.Queue()
+
+        # Send the command to the server
+        return await self.send_message(self.STREAM_START_CMD, data)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream_stop() - Stops a stream job on the server.   Pass job=None to stop every job
+    # ------------------------------------------------------------------------------------------------------
+    async def stream_stop(self, job = None):
+
+        if job == None: job = 0xFF
+        return await self.send_message(self.STREAM_STOP_CMD, job.to_bytes(1, 'big'))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # stream() - An async iterator that yields the samples of a stream job as they arrive
+    #
+    # Passed: job     = The job number that was passed to stream_start()
+    #         timeout = If no packet arrives in this many seconds, the iteration ends.  None = wait forever
+    # ------------------------------------------------------------------------------------------------------
+    async def stream(self, job, timeout = None):
+
+        expected_seq = None
+
+        while True:
+
+            # Wait for the next packet for this job
+            try:
+                packet = await asyncio.wait_for(self.streams[job].get(), timeout)
+            except asyncio.TimeoutError:
+                return
+
+            # Yield each sample in the packet
+            samples, expected_seq = self.unpack_stream_packet(job, packet, expected_seq)
+            for sample in samples: yield sample
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # echo() - Sends a byte string to the server, and returns what it sends back
+    # ------------------------------------------------------------------------------------------------------
+    async def echo(self, data):
+
+        rc = await self.send_message(self.ECHO_CMD, data)
+        return rc if rc else b''
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # get_firmware_rev() - Fetches and returns the server firmware revision
+    # ------------------------------------------------------------------------------------------------------
+    async def get_firmware_rev(self):
+
+        return int.from_bytes(await self.send_message(self.GET_FWREV_CMD), 'big')
+    # ------------------------------------------------------------------------------------------------------
+
+
+
+    # <><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
+    # <><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
+    # From here on down are methods that are private to this class
+    # <><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
+    # <><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
+
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # send_built() - Sends a message from build_message() and waits for its reply, resending it if the
+    #                reply doesn't arrive in time
+    #
+    # Returns: The raw reply message
+    # ------------------------------------------------------------------------------------------------------
+    async def send_built(self, id, message):
+
+        # Wait for room in the window
+        async with self.slots:
+
+            # We can't send anything once the socket is closed
+            if self.transport == None: raise Wifi_I2C_Ex(-1)
+
+            # Keep track of this message, and send it
+            entry = _InFlight(message, asyncio.get_running_loop().create_future())
+            self.pending[id] = entry
+            self.transmit(id, entry)
+
+            # Wait for the reply (or for transmit() to give up)
+            try:
+                return await entry.future
+            finally:
+                if entry.timer: entry.timer.cancel()
+                self.pending.pop(id, None)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # send_many() - Sends a list of messages from build_message(), all in flight at once (up to the window)
+    #
+    # Returns: A list of the raw reply messages, in order
+    # ------------------------------------------------------------------------------------------------------
+    async def send_many(self, messages):
+
+        return await asyncio.gather(*[self.send_built(id, message) for id, message in messages])
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # transmit() - Sends (or resends) a message, and arranges to resend it if no reply arrives in time
+    # ------------------------------------------------------------------------------------------------------
+    def transmit(self, id, entry):
+
+        loop = asyncio.get_running_loop()
+
+        # Each time we have to resend a message, we wait twice as long for the reply
+        timeout = min(self.rto * (2 ** entry.attempts), self.MAX_RTO)
+
+        # Send the message
+        entry.attempts = entry.attempts + 1
+        entry.sent_at  = loop.time()
+        self.transport.sendto(entry.message, self.server)
+
+        # And wait for the reply
+        entry.timer = loop.call_later(timeout, self.on_timeout, id)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # on_timeout() - Called when a reply is late.  Resends the message, or gives up on it
+    # ------------------------------------------------------------------------------------------------------
+    def on_timeout(self, id):
+
+        # If the reply arrived in the meantime, there's nothing to do
+        entry = self.pending.get(id)
+        if entry == None or entry.future.done() or self.transport == None: return
+
+        # If we've sent this message as often as we're going to, it failed
+        if entry.attempts == self.MAX_ATTEMPTS:
+            entry.future.set_exception(Wifi_I2C_Ex(-1))
+            return
+
+        # Otherwise, send it again.  The server keeps its most recent replies, so if it was the reply
+        # that got lost, the server sends it again rather than executing the message a second time
+        self.retransmits = self.retransmits + 1
+        self.transmit(id, entry)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # note_rtt() - Updates our estimate of the round-trip time with a new measurement (RFC 6298)
+    # ------------------------------------------------------------------------------------------------------
+    def note_rtt(self, rtt):
+
+        if self.srtt == None:
+            self.srtt   = rtt
+            self.rttvar = rtt / 2
+        else:
+            self.rttvar = 0.75 * self.rttvar + 0.25 * abs(self.srtt - rtt)
+            self.srtt   = 0.875 * self.srtt + 0.125 * rtt
+
+        self.rto = min(max(self.srtt + 4 * self.rttvar, self.MIN_RTO), self.MAX_RTO)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # datagram_received() - Splits an incoming datagram into messages and handles each one
+    # ------------------------------------------------------------------------------------------------------
+    def datagram_received(self, datagram):
+
+        # If this isn't a coalesced datagram, it's a single message
+        if datagram[0:4] != self.COALESCE_TRANS_ID:
+            self.handle_message(datagram)
+            return
+
+        # Otherwise, it's a series of replies, each preceded by a 2-byte length
+        index = 6
+        while index + 2 <= len(datagram):
+            length = int.from_bytes(datagram[index:index+2], 'big')
+            self.handle_message(datagram[index+2 : index+2+length])
+            index = index + 2 + length
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # handle_message() - Hands a single incoming message to whoever is waiting for it
+    # ------------------------------------------------------------------------------------------------------
+    def handle_message(self, message):
+
+        trans_id = message[0:4]
+
+        # If this is a stream packet, hand it to whoever is reading that stream
+        if trans_id == self.STREAM_TRANS_ID and len(message) >= 14:
+            stream = self.streams.get(message[6])
+            if stream != None: stream.put_nowait(message)
+            return
+
+        # If this is a fragment of a chunked read, hand it to whoever is collecting them
+        if trans_id == self.CHUNK_TRANS_ID and len(message) >= 16:
+            fragments = self.fragments.get(message[6:10])
+            if fragments != None: fragments.append(message)
+            return
+
+        # If nobody is waiting for this reply (perhaps it's the reply to a resent message that we'd
+        # already received), ignore it
+        entry = self.pending.get(trans_id)
+        if entry == None or entry.future.done(): return
+
+        # Only a message that was sent once tells us the round-trip time.  If it was resent, we can't
+        # tell which copy this is the reply to
+        if entry.attempts == 1: self.note_rtt(asyncio.get_running_loop().time() - entry.sent_at)
+
+        # Hand the reply to whoever is waiting for it
+        entry.future.set_result(message)
+    # ------------------------------------------------------------------------------------------------------
+
+# ==========================================================================================================
+
+
+
+# ==========================================================================================================
+# _InFlight - A message that's waiting for its reply
+# ==========================================================================================================
+class _InFlight:
+
+    def __init__(self, message, future):
+        self.message  = message
+        self.future   = future
+        self.attempts = 0
+        self.sent_at  = 0
+        self.timer    = None
+# ==========================================================================================================
+
+
+
+# ==========================================================================================================
+# _Protocol - Hands the datagrams that arrive on the socket to the client
+# ==========================================================================================================
+class _Protocol(asyncio.DatagramProtocol):
+
+    def __init__(self, client):
+        self.client = client
+
+    def datagram_received(self, datagram, address):
+        self.client.datagram_received(datagram)
+
+    def error_received(self, exc):
+        pass
+# ==========================================================================================================
+
+
+
+# ==========================================================================================================
+# Wifi_I2C_Pipelined - The synchronous Wifi_I2C API, carried by a Wifi_I2C_Async in a background thread
+# ==========================================================================================================
+class Wifi_I2C_Pipelined(Wifi_I2C):
+
+    # ------------------------------------------------------------------------------------------------------
+    # The constructor - Starts the thread that runs the asyncio client
+    # ------------------------------------------------------------------------------------------------------
+    def __init__(self, local_ip = None, window = 8):
+
+        # The asyncio client runs in an event loop of its own, in a thread of its own
+        self.client = Wifi_I2C_Async(local_ip, window)
+        self.loop   = asyncio.new_event_loop()
+        threading.Thread(target = self.loop.run_forever, daemon = True).start()
+
+        # Several threads may build messages at once, so handing out transaction IDs needs a lock
+        self.id_lock = threading.Lock()
+
+        # stream_start(), set_trigger() and stream() talk to the listener about streams
+        self.listener = _ListenerShim(self)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # start() - Starts the asyncio client
+    #
+    # Returns:  True if communication was established
+    #           False if something goes awry
+    # ------------------------------------------------------------------------------------------------------
+    def start(self, server_ip = None, server_port = 0):
+
+        if not self.run(self.client.start(server_ip, server_port)): return False
+
+        # Our transaction IDs pick up where the client's left off, so the server never sees one twice
+        self.transaction_id = self.client.transaction_id
+        return True
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # run() - Runs a coroutine on the client's event loop and waits for it to finish
+    # ------------------------------------------------------------------------------------------------------
+    def run(self, coroutine):
+
+        return asyncio.run_coroutine_threadsafe(coroutine, self.loop).result()
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # next_transaction_id() - Returns the 4 bytes of a transaction ID that hasn't been used yet
+    # ------------------------------------------------------------------------------------------------------
+    def next_transaction_id(self):
+
+        with self.id_lock:
+            return Wifi_I2C.next_transaction_id(self)
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # send_message_built() - Sends a message from build_message() and waits for the reply
+    # ------------------------------------------------------------------------------------------------------
+    def send_message_built(self, id, message):
+
+        # Over TCP, things work just like they do in Wifi_I2C
+        if self.tcp: return Wifi_I2C.send_message_built(self, id, message)
+
+        return self.parse_reply(self.run(self.client.send_built(id, message)))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # write_block() - Writes a block of data of any length, as register writes that are each as large as
+    #                 the server can receive
+    #
+    # The "window" argument is accepted for compatibility with Wifi_I2C, but the client's window is used
+    # ------------------------------------------------------------------------------------------------------
+    def write_block(self, register, data, *, reg_width = 1, address = None, slot = None, window = None,
+                    chunk_size = 0):
+
+        # Over TCP, things work just like they do in Wifi_I2C
+        if self.tcp:
+            return Wifi_I2C.write_block(self, register, data, reg_width = reg_width, address = address,
+                                        slot = slot, chunk_size = chunk_size)
+
+        self.run(self.client.write_block(register, data, reg_width = reg_width, address = address, slot = slot,
+                                         chunk_size = chunk_size, builder = self))
+    # ------------------------------------------------------------------------------------------------------
+
+
+    # ------------------------------------------------------------------------------------------------------
+    # pipeline() - Sends a list of messages to the server, all in flight at once (up to the window)
+    #
+    # The "window" argument is accepted for compatibility with Wifi_I2C, but the client's window is used
+    # ------------------------------------------------------------------------------------------------------
+    def pipeline(self, message_list, window = None):
+
+        # Over TCP, things work just like they do in Wifi_I2C
+        if self.tcp: return Wifi_I2C.pipeline(self, message_list)
+
+        messages = [self.build_message(*message) for message in message_list]
+        return [self.parse_reply(reply) for reply in self.run(self.client.send_many(messages))]
+    # ------------------------------------------------------------------------------------------------------
+
+# ==========================================================================================================
+
+
+
+# ==========================================================================================================
+# _ListenerShim - Gives Wifi_I2C_Pipelined the parts of the Listener interface that Wifi_I2C relies on
+# ==========================================================================================================
+class _ListenerShim:
+
+    def __init__(self, owner):
+        self.owner = owner
+
+    # This is the port the server sends its replies to
+    @property
+    def port(self):
+        transport = self.owner.client.transport
+        return transport.get_extra_info('sockname')[1] if transport else None
+
+    # The event loop puts stream packets into a thread-safe queue that stream() can wait on
+    def open_stream(self, job):
+        self.owner.client.streams[job] = queue.Queue()
+
+    def get_stream_packet(self, job, seconds):
+        try:
+            return self.owner.client.streams[job].get(timeout=seconds)
+        except queue.Empty:
+            return None
+
+    # The event loop appends the fragments of a chunked read to a list that's ours once it's closed
+    def open_fragments(self, transaction_id):
+        self.owner.client.fragments[transaction_id] = []
+
+    def close_fragments(self, transaction_id):
+        return self.owner.client.fragments.pop(transaction_id, [])
+# ==========================================================================================================